@@ -48,10 +48,14 @@
 #include <sys/shm.h>
 #include <sched.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pmc_user.h> /*For the data type */
-#include <sys/time.h> /* For setitimer */
+#include <sys/time.h> /* For gettimeofday */
 #include <pmctrack_internal.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 #ifndef  _GNU_SOURCE
 #define _GNU_SOURCE
@@ -86,15 +90,20 @@ struct options {
 	/* Global switches */
 	int timeout_secs;
 	int msecs;
+	int usecs;	/* Sampling period (msecs may be rounded) */
 	int max_samples;
 	int kernel_buffer_size;
+	char* overflow_policy;
+	char* mux_policy;	/* Policy to multiplex event sets */
 	unsigned long cpumask;
+	char* syswide_cpus;	/* CPUs to monitor in system-wide mode */
+	char* cgroup;		/* cgroup to monitor (cgroup mode) */
 	int optind;
 	char** argv;
 	unsigned long flags;
 	pid_t target_pid;
 	/* Information on PMCs  */
-	char* user_cfg_str[MAX_COUNTER_CONFIGS];
+	char* user_cfg_str[MAX_COUNTER_CONFIGS+1]; /* NULL-terminated */
 	char* strcfg[MAX_RAW_COUNTER_CONFIGS_SAFE];
 	int user_nr_configs;
 	unsigned int pmu_id;
@@ -104,6 +113,10 @@ struct options {
 	char* virtcfg;
 	unsigned int  nr_virtual_counters;
 	unsigned int  virtual_mask;
+	/* Derived metrics (NULL if none) */
+	pmct_metric_set_t* metrics;
+	/* How to aggregate the counts of threads in the -A mode */
+	pmct_rollup_t rollup;
 };
 
 
@@ -126,20 +139,10 @@ struct timeval start_time, end_time;
 sem_t* sem_config_ready;
 #endif
 
-#define MAX_THREADS_APP 256
+/* Buffer for the output stream */
+#define OUTPUT_BUFFER_SIZE	(1<<20)
+static char output_buffer[OUTPUT_BUFFER_SIZE];
 
-/* To implement cummulative mode */
-struct pid_ctrl {
-	/* PID of the particular thread we're tracking
-		or CPU in the system-wide monitoring mode  */
-	pid_t pid;
-	/* Experiment mask */
-	unsigned long exp_mask;
-	/* To keep track of the number of samples accumulated */
-	unsigned int nr_samples_accum[MAX_COUNTER_CONFIGS];
-};
-
-inline void sigalarm_handler(int signo) {};
 void sigchld_handler(int signo);
 void sigint_handler(int signo);
 static void usage(const char* program_name,int status);
@@ -149,9 +152,8 @@ struct pid_set;
 typedef struct pid_set pid_set_t;
 
 static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned int pmcmask,
-                               unsigned int virtual_mask,struct pid_ctrl* pid_ctrl_vector,
-                               pmc_sample_t** acum_samples, monitoring_mode_t mode,
-                               pid_set_t* set);
+                               unsigned int virtual_mask,pmct_thread_table_t* acum,
+                               monitoring_mode_t mode, pid_set_t* set);
 #ifndef USE_VFORK
 static void init_posix_semaphore(sem_t** sem, int value)
 {
@@ -221,24 +223,152 @@ static inline void pmctrack_exit(int status)
 #endif
 }
 
-/* Sets up a timer that fires after a certain number of msecs */
-static unsigned int alarm_ms(unsigned int mseconds)
+/*
+ * The monitor waits for samples, for the sampling period to expire
+ * and for signals in a single poll() call on these file descriptors
+ */
+enum {
+	LOOP_MONITOR_FD=0,	/* /proc/pmc/monitor */
+	LOOP_TIMER_FD,		/* Fires once every sampling period */
+	LOOP_SIGNAL_FD,		/* SIGINT, SIGTERM and SIGCHLD */
+	LOOP_NR_FDS
+};
+
+typedef struct {
+	struct pollfd fds[LOOP_NR_FDS];
+	sigset_t sigmask;	/* Signals retrieved via the signalfd */
+	monitoring_mode_t mode;
+} event_loop_t;
+
+/*
+ * Set up the timer and the signalfd of the event loop. The signals
+ * are blocked from now on, so the handlers installed with
+ * install_signal_handlers() only cover the startup.
+ */
+static int init_event_loop(event_loop_t* loop, int usecs, monitoring_mode_t mode)
 {
-	struct itimerval new;
+	struct itimerspec period;
+	int i;
+
+	for (i=0; i<LOOP_NR_FDS; i++) {
+		loop->fds[i].fd=-1;
+		loop->fds[i].events=POLLIN;
+	}
+
+	loop->mode=mode;
+	sigemptyset(&loop->sigmask);
+	sigaddset(&loop->sigmask,SIGINT);
+	sigaddset(&loop->sigmask,SIGTERM);
+	if (mode!=PMCTRACK_MODE_ATTACH)
+		sigaddset(&loop->sigmask,SIGCHLD);
+
+	if (sigprocmask(SIG_BLOCK,&loop->sigmask,NULL)<0) {
+		warn("Can't block signals");
+		return 1;
+	}
+
+	if ((loop->fds[LOOP_SIGNAL_FD].fd=signalfd(-1,&loop->sigmask,SFD_NONBLOCK))<0) {
+		warn("Can't create signalfd");
+		return 1;
+	}
+
+	if ((loop->fds[LOOP_TIMER_FD].fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK))<0) {
+		warn("Can't create timerfd");
+		return 1;
+	}
 
-	new.it_value.tv_usec = (mseconds*1000) % 1000000;
-	new.it_value.tv_sec = mseconds/1000;
-	new.it_interval=new.it_value;
+	period.it_value.tv_sec=usecs/1000000;
+	period.it_value.tv_nsec=(usecs%1000000)*1000;
+	period.it_interval=period.it_value;
 
-	/* Set interval to zero so that it is a one-shot timer */
-	new.it_interval.tv_usec=0;
-	new.it_interval.tv_sec=0;
+	if (timerfd_settime(loop->fds[LOOP_TIMER_FD].fd,0,&period,NULL)<0) {
+		warn("Can't set up the sampling timer");
+		return 1;
+	}
 
-	if (setitimer (ITIMER_REAL, &new, NULL) < 0) {}
-	return 1;
 	return 0;
 }
 
+/* The monitor exits right after this, so signals are left blocked */
+static void destroy_event_loop(event_loop_t* loop)
+{
+	if (loop->fds[LOOP_TIMER_FD].fd>=0)
+		close(loop->fds[LOOP_TIMER_FD].fd);
+	if (loop->fds[LOOP_SIGNAL_FD].fd>=0)
+		close(loop->fds[LOOP_SIGNAL_FD].fd);
+	loop->fds[LOOP_TIMER_FD].fd=loop->fds[LOOP_SIGNAL_FD].fd=-1;
+}
+
+/* Same as sigchld_handler() and sigint_handler(), but outside signal context */
+static void handle_signals(event_loop_t* loop)
+{
+	struct signalfd_siginfo info;
+
+	while (read(loop->fds[LOOP_SIGNAL_FD].fd,&info,sizeof(info))==sizeof(info)) {
+		if (info.ssi_signo==SIGCHLD) {
+			if (wait4(pid,&child_status,WNOHANG,&child_rusage)>0) {
+				gettimeofday(&end_time, NULL);
+				child_finished=1;
+			}
+		} else {
+			if (loop->mode!=PMCTRACK_MODE_ATTACH && !child_finished)
+				kill(pid,SIGTERM);
+			/* Finish inmediately */
+			stop_profiling=1;
+			printf("Received signal %d\n", info.ssi_signo);
+		}
+	}
+}
+
+/*
+ * Wait until samples are available, the sampling period expires
+ * or a signal arrives. The function returns 1 if there are samples
+ * to retrieve, 0 if there are not, and -1 upon failure.
+ */
+static int wait_for_samples(event_loop_t* loop, pmct_sample_rings_t* rings)
+{
+	uint64_t expirations;
+	int ready=0;
+
+	if (poll(loop->fds,LOOP_NR_FDS,-1)<0) {
+		if (errno==EINTR)
+			return 0;
+		warn("Can't wait for samples");
+		return -1;
+	}
+
+	if (loop->fds[LOOP_SIGNAL_FD].revents & POLLIN)
+		handle_signals(loop);
+
+	if (loop->fds[LOOP_TIMER_FD].revents & POLLIN) {
+		if (read(loop->fds[LOOP_TIMER_FD].fd,&expirations,sizeof(expirations))<0) {}
+		/* The output is written in large blocks: show what we have so far */
+		fflush(fo);
+		/* The rings may hold records even if the wakeup conditions are not met yet */
+		if (rings && pmct_ring_has_samples(rings))
+			ready=1;
+	}
+
+	/* POLLHUP: all the monitored threads finished (read() returns EOF) */
+	if (loop->fds[LOOP_MONITOR_FD].revents & (POLLIN|POLLHUP|POLLERR))
+		ready=1;
+
+	return ready;
+}
+
+/* Returns a non-zero value if samples can be retrieved right away */
+static int monitor_has_samples(int fd, pmct_sample_rings_t* rings)
+{
+	struct pollfd pfd;
+
+	if (rings)
+		return pmct_ring_has_samples(rings);
+
+	pfd.fd=fd;
+	pfd.events=POLLIN;
+	return poll(&pfd,1,0)>0 && (pfd.revents & POLLIN);
+}
+
 /*
  * This function takes care of printing event-to-counter mappings
  * in the event the user did not specified PMC and virtual-counter
@@ -267,6 +397,17 @@ static void print_counter_mappings(FILE* fout,
 
 }
 
+/* Show the name of each group of threads (-U comm) */
+static void print_thread_names(FILE* fout, pmct_thread_table_t* groups)
+{
+	int i;
+
+	fprintf(fout,"[Thread names]\n");
+	for (i=0; i<groups->nr_entries; i++)
+		fprintf(fout,"%6d %s (%u threads)\n",groups->entries[i].pid,
+		        groups->entries[i].comm,groups->entries[i].nr_threads);
+}
+
 
 /*
  *  Returns non-zero if the child process has been running longer
@@ -324,16 +465,6 @@ static int install_signal_handlers(int install_sigchild)
 {
 	struct sigaction sact;
 
-	/* processing SIGALRM signal */
-	sact.sa_handler = sigalarm_handler;
-	sact.sa_flags = 0;
-	sigemptyset(&sact.sa_mask);
-	sigaddset(&sact.sa_mask, SIGALRM);
-	if(sigaction(SIGALRM, &sact, NULL) < 0) {
-		perror("Can't assign signal handler for SIGALRM");
-		return 1;
-	}
-
 	/* processing SIGINT signal */
 	sact.sa_handler = sigint_handler;
 	sact.sa_flags = 0;
@@ -375,8 +506,8 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 	unsigned int pmcmask=0;
 	unsigned int npmcs = 0;
 	struct timespec;
-	pmc_sample_t** acum_samples=NULL;
-	struct pid_ctrl* pid_ctrl_vector=NULL;
+	pmct_thread_table_t acum_table;
+	pmct_thread_table_t* acum=NULL;
 	unsigned int nr_experiments;
 
 	child_status = 0;
@@ -400,13 +531,9 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 	}
 
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
-		acum_samples=malloc(sizeof(pmc_sample_t*)*MAX_THREADS_APP);
-		pid_ctrl_vector=malloc(sizeof(struct pid_ctrl)*MAX_THREADS_APP); /* As much as 256 threads */
-		if (!acum_samples || ! pid_ctrl_vector) {
-			fprintf(stderr, "%s\n", "Couldn't reserve memory for cummulative counters");
+		if (pmct_thread_table_init(&acum_table,nr_experiments,PMCT_ROLLUP_NONE))
 			exit(1);
-		}
-		memset(acum_samples,0,sizeof(pmc_sample_t*)*MAX_THREADS_APP);/* Set NULL POINTERS*/
+		acum=&acum_table;
 	}
 
 
@@ -438,6 +565,14 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 		if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size))
 			pmctrack_exit(1);
 
+		/* Set up what to do when the kernel buffer fills up */
+		if (opts->overflow_policy && pmct_set_overflow_policy(opts->overflow_policy))
+			pmctrack_exit(1);
+
+		/* Set up how to multiplex event sets */
+		if (opts->mux_policy && pmct_config_mux_policy(opts->mux_policy))
+			pmctrack_exit(1);
+
 		/* Configure counters if there is something to configure */
 		if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,0))
 			pmctrack_exit(1);
@@ -445,7 +580,7 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 		/* Set up sampling period
 			(check whether the kernel control the counters or not)
 		*/
-		if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0)))
+		if (pmct_config_timeout_us(opts->usecs,(!(opts->strcfg)[0] && npmcs!=0)))
 			pmctrack_exit(1);
 
 		if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,0))
@@ -479,13 +614,11 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 		sem_wait(sem_config_ready);
 #endif
 		process_pmc_counts(opts,nr_experiments,pmcmask,virtual_mask,
-		                   pid_ctrl_vector,acum_samples,PMCTRACK_MODE_PROCESS,NULL);
+		                   acum,PMCTRACK_MODE_PROCESS,NULL);
 	}//end parent code
 }
 
 
-#define MAX_CPUS 256
-
 /* Config & Monitoring function for system-wide mode */
 void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 {
@@ -493,8 +626,8 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	unsigned int pmcmask=0;
 	unsigned int npmcs = 0;
 	struct timespec;
-	pmc_sample_t** acum_samples=NULL;
-	struct pid_ctrl* pid_ctrl_vector=NULL;
+	pmct_thread_table_t acum_table;
+	pmct_thread_table_t* acum=NULL;
 	unsigned int nr_experiments;
 
 	child_status = 0;
@@ -517,13 +650,9 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	}
 
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
-		acum_samples=malloc(sizeof(pmc_sample_t*)*MAX_CPUS);
-		pid_ctrl_vector=malloc(sizeof(struct pid_ctrl)*MAX_CPUS); /* As much as 256 CPUs */
-		if (!acum_samples || ! pid_ctrl_vector) {
-			fprintf(stderr, "%s\n", "Couldn't reserve memory for cummulative counters");
+		if (pmct_thread_table_init(&acum_table,nr_experiments,PMCT_ROLLUP_NONE))
 			exit(1);
-		}
-		memset(acum_samples,0,sizeof(pmc_sample_t*)*MAX_CPUS);/* Set NULL POINTERS*/
+		acum=&acum_table;
 	}
 
 	/* In system-wide mode, the monitor program "owns" the counter configuration
@@ -534,6 +663,14 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size))
 		pmctrack_exit(1);
 
+	/* Set up what to do when the kernel buffer fills up */
+	if (opts->overflow_policy && pmct_set_overflow_policy(opts->overflow_policy))
+		pmctrack_exit(1);
+
+	/* Set up how to multiplex event sets */
+	if (opts->mux_policy && pmct_config_mux_policy(opts->mux_policy))
+		pmctrack_exit(1);
+
 	/* Configure counters if there is something to configure */
 	if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,PMCT_CONFIG_SYSWIDE))
 		pmctrack_exit(1);
@@ -541,12 +678,20 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	/* Set up sampling period
 		(check whether the kernel control the counters or not)
 	*/
-	if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0)))
+	if (pmct_config_timeout_us(opts->usecs,(!(opts->strcfg)[0] && npmcs!=0)))
 		pmctrack_exit(1);
 
 	if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,PMCT_CONFIG_SYSWIDE))
 		pmctrack_exit(1);
 
+	/* Restrict monitoring to a subset of the CPUs */
+	if (opts->syswide_cpus && pmct_syswide_config_cpus(opts->syswide_cpus))
+		pmctrack_exit(1);
+
+	/* Count only while the tasks of a cgroup run */
+	if (opts->cgroup && pmct_syswide_config_cgroup(opts->cgroup))
+		pmctrack_exit(1);
+
 #ifndef USE_VFORK
 	/* init semaphore to signal the parent that the child proccess has successfuly configured the counters */
 	init_posix_semaphore(&sem_config_ready,0);
@@ -590,7 +735,7 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 		sem_wait(sem_config_ready);
 #endif
 		process_pmc_counts(opts,nr_experiments,pmcmask,virtual_mask,
-		                   pid_ctrl_vector,acum_samples,PMCTRACK_MODE_SYSWIDE,NULL);
+		                   acum,PMCTRACK_MODE_SYSWIDE,NULL);
 	}//end parent code
 }
 
@@ -689,57 +834,36 @@ return_free_pidlist:
 }
 
 /*
- * Returns the number of pids that could not be attached
- * The PID of the master thread must be attached for this to succeed
+ * Attach all threads of the application in a single operation
+ * (threads created afterwards are attached by the kernel as well).
+ * Returns the number of pids in the set, or -1 upon failure.
  */
 static int attach_pid_set(pid_set_t* set,int pid, unsigned long cpumask)
 {
 	int i=0;
-	int nr_attached=0;
 
-	if (pmct_attach_process(pid,1) < 0) {
+	if (pmct_attach_thread_group(pid) < 0) {
 		warnx("Can't attach to process with PID %d\n",pid);
 		return -1;
 	}
 
-	try_to_bind_process_cpumask(pid,cpumask);
-
-	nr_attached=1;
-
 	for (i = 0; i < set->nr_pids; i++) {
-		pid_t cur_pid=set->pid_status[i].pid;
-
-		/* Do not attempt to re-attach to master thread */
-		if (cur_pid==pid) {
-			set->pid_status[i].attached=1;
-			continue;
-		}
-
-		if (pmct_attach_process(cur_pid,1) < 0) {
-			warnx("Can't attach to process with PID %d\n",cur_pid);
-		} else {
-			set->pid_status[i].attached=1;
-			nr_attached++;
-			try_to_bind_process_cpumask(cur_pid,cpumask);
-		}
+		set->pid_status[i].attached=1;
+		try_to_bind_process_cpumask(set->pid_status[i].pid,cpumask);
 	}
 
-	return nr_attached;
+	return set->nr_pids;
 }
 
 static void detach_pid_set(pid_set_t* set,int pid)
 {
 	int i=0;
-	int ret=0;
 
-	for (i = 0; i < set->nr_pids; i++) {
-		if (set->pid_status[i].attached) {
-			ret=pmct_detach_process(set->pid_status[i].pid);
-			set->pid_status[i].attached=0;
-			if (ret==0)
-				printf("PID=%d detached successfuly\n",set->pid_status[i].pid);
-		}
-	}
+	for (i = 0; i < set->nr_pids; i++)
+		set->pid_status[i].attached=0;
+
+	if (pmct_detach_thread_group(pid)==0)
+		printf("PID=%d detached successfuly\n",pid);
 }
 
 /* Config & Monitoring function for per-thread monitoring mode (attach variant) */
@@ -749,8 +873,8 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	unsigned int pmcmask=0;
 	unsigned int npmcs = 0;
 	struct timespec;
-	pmc_sample_t** acum_samples=NULL;
-	struct pid_ctrl* pid_ctrl_vector=NULL;
+	pmct_thread_table_t acum_table;
+	pmct_thread_table_t* acum=NULL;
 	unsigned int nr_experiments;
 	pid_set_t* set=alloc_pid_set();
 	int exit_val=0;
@@ -787,14 +911,11 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	}
 
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
-		acum_samples=malloc(sizeof(pmc_sample_t*)*MAX_THREADS_APP);
-		pid_ctrl_vector=malloc(sizeof(struct pid_ctrl)*MAX_THREADS_APP); /* As much as 256 threads */
-		if (!acum_samples || ! pid_ctrl_vector) {
-			fprintf(stderr, "%s\n", "Couldn't reserve memory for cummulative counters");
+		if (pmct_thread_table_init(&acum_table,nr_experiments,PMCT_ROLLUP_NONE)) {
 			exit_val=1;
 			goto free_up_pid_set;
 		}
-		memset(acum_samples,0,sizeof(pmc_sample_t*)*MAX_THREADS_APP);/* Set NULL POINTERS*/
+		acum=&acum_table;
 	}
 
 	/* Flag this stuff */
@@ -808,6 +929,18 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 		goto free_up_pid_set;
 	}
 
+	/* Set up what to do when the kernel buffer fills up */
+	if (opts->overflow_policy && pmct_set_overflow_policy(opts->overflow_policy)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	/* Set up how to multiplex event sets */
+	if (opts->mux_policy && pmct_config_mux_policy(opts->mux_policy)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
 	/* Configure counters if there is something to configure */
 	if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,0)) {
 		exit_val=1;
@@ -817,7 +950,7 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	/* Set up sampling period
 		(check whether the kernel control the counters or not)
 	*/
-	if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0))) {
+	if (pmct_config_timeout_us(opts->usecs,(!(opts->strcfg)[0] && npmcs!=0))) {
 		exit_val=1;
 		goto free_up_pid_set;
 	}
@@ -836,7 +969,7 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	}
 
 	process_pmc_counts(opts,nr_experiments,pmcmask,virtual_mask,
-	                   pid_ctrl_vector,acum_samples,PMCTRACK_MODE_ATTACH,set);
+	                   acum,PMCTRACK_MODE_ATTACH,set);
 	return;
 
 free_up_pid_set:
@@ -846,54 +979,96 @@ free_up_pid_set:
 }
 
 static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned int pmcmask,
-                               unsigned int virtual_mask,struct pid_ctrl* pid_ctrl_vector,
-                               pmc_sample_t** acum_samples, monitoring_mode_t mode, pid_set_t* set)
+                               unsigned int virtual_mask,pmct_thread_table_t* acum,
+                               monitoring_mode_t mode, pid_set_t* set)
 {
 	int i=0,cont=1;
 	int fd=-1;
-	pmc_sample_t* samples=NULL;
-	int nr_pids=0;
+	pmc_sample_v2_t* samples=NULL;
+	pmc_sample_t* legacy_samples=NULL;
 	int nr_samples;
 	unsigned int max_buffer_samples;
 	int detached=1;
+	pmct_sample_rings_t* rings=NULL;
+	event_loop_t loop;
+	int ready,hangup,eof=0;
 
 	if (mode==PMCTRACK_MODE_ATTACH)
 		detached=0;
 
 	profile_started=1;
 
+	if (init_event_loop(&loop,opts->usecs,mode))
+		goto error_path;
+
 	if ( (fd = pmct_open_monitor_entry())<0 )
 		goto error_path;
 
-	if (opts->kernel_buffer_size<4096) {
-		/* Request shared memory region */
-		if ((samples=pmct_request_shared_memory_region(fd,&max_buffer_samples))==NULL)
+	loop.fds[LOOP_MONITOR_FD].fd=fd;
+
+	/* Retrieve samples straight from the kernel's rings if possible */
+	rings=pmct_map_sample_rings(fd);
+
+	if (rings) {
+		/* Room for the records that fit in a ring */
+		max_buffer_samples=rings->control->data_size/pmc_sample_record_size(0,0);
+		if ((samples=malloc(max_buffer_samples*sizeof(pmc_sample_v2_t)))==NULL)
 			goto error_path;
 	} else {
-		/* Reserve a big buffer from the heap directly */
-		max_buffer_samples=opts->kernel_buffer_size/sizeof(pmc_sample_t);
-		if ((samples=malloc(max_buffer_samples*sizeof(pmc_sample_t)))==NULL)
+		if (opts->kernel_buffer_size<4096) {
+			/* Request shared memory region */
+			if ((legacy_samples=pmct_request_shared_memory_region(fd,&max_buffer_samples))==NULL)
+				goto error_path;
+		} else {
+			/* Reserve a big buffer from the heap directly */
+			max_buffer_samples=opts->kernel_buffer_size/sizeof(pmc_sample_t);
+			if ((legacy_samples=malloc(max_buffer_samples*sizeof(pmc_sample_t)))==NULL)
+				goto error_path;
+		}
+
+		/* read() returns samples in the legacy format (with no timing information) */
+		if ((samples=malloc(max_buffer_samples*sizeof(pmc_sample_v2_t)))==NULL)
 			goto error_path;
 	}
 	/* Print header if necessary */
 	if (!(opts->flags & CMD_FLAG_ACUM_SAMPLES)) {
 		print_counter_mappings(fo,opts,nr_experiments);
-		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output,mode==PMCTRACK_MODE_SYSWIDE);
+		pmct_print_header_with_metrics(fo,nr_experiments,pmcmask,virtual_mask,extended_output,
+		                               mode==PMCTRACK_MODE_SYSWIDE,opts->metrics);
 	}
 	/* Print child counters */
-	while(!stop_profiling) {
+	while(!stop_profiling && !eof) {
 		/*
-		 * Do this while !child_finished
-		 * Note that in the ATTACH mode, child_finished is always false
+		 * Wait for samples, also after the child finished: signals
+		 * are only delivered via the signalfd, and the monitored
+		 * threads may not be gone yet.
 		 */
-		if (!child_finished) {
-			alarm_ms(opts->msecs);
-			pause();
-		}
-
+		if ((ready=wait_for_samples(&loop,rings))<0)
+			goto error_path;
 		/* Check if Ctrl+C was pressed */
-		if(!stop_profiling) {
-			nr_samples=pmct_read_samples(fd,samples,max_buffer_samples);
+		if (!ready || stop_profiling)
+			continue;
+
+		/*
+		 * POLLHUP: all the monitored threads finished. Retrieve
+		 * what is left without blocking, and then stop (EOF).
+		 */
+		hangup=(loop.fds[LOOP_MONITOR_FD].revents & POLLHUP);
+
+		/* Retrieve all the samples available, in batches */
+		do {
+			if (hangup && !monitor_has_samples(fd,rings)) {
+				eof=1;
+				break;
+			}
+
+			if (rings)
+				nr_samples=pmct_ring_read_samples(fd,rings,samples,max_buffer_samples);
+			else {
+				nr_samples=pmct_read_samples(fd,legacy_samples,max_buffer_samples);
+				for (i=0; i<nr_samples; i++)
+					pmc_sample_from_legacy(&legacy_samples[i],&samples[i]);
+			}
 
 			if (nr_samples < 0)
 				goto error_path;
@@ -903,49 +1078,36 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 			 *  then exit loop.
 			 *  Note that in the ATTACH mode, child_finished is always false.
 			 */
-			if (nr_samples==0 && (mode==PMCTRACK_MODE_ATTACH || child_finished) )
+			if (nr_samples==0 && (mode==PMCTRACK_MODE_ATTACH || child_finished) ) {
+				eof=1;
 				break;
+			}
 
 			/* Make sure not to exceed the maximum number of samples requested */
 			if (opts->max_samples!=-1 && (cont+nr_samples>opts->max_samples))
 				nr_samples=opts->max_samples-(cont-1);
 
 			for (i=0; i<nr_samples; i++) {
-				pmc_sample_t* cur=&samples[i];
+				pmc_sample_v2_t* cur=&samples[i];
 
 				if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
-					int j=0;
-					unsigned char copy_metadata=0;
-
-					/* Search PID in set */
-					while (j<nr_pids && pid_ctrl_vector[j].pid!=cur->pid)
-						j++;
-
-					/* PID not found */
-					if (j==nr_pids) {
-						/* Add new item to set */
-						pid_ctrl_vector[j].pid=cur->pid;
-						pid_ctrl_vector[j].exp_mask=0;
-						nr_pids++;
-						acum_samples[j]=malloc(sizeof(pmc_sample_t)*nr_experiments);
-
-						if (!acum_samples[j]) {
-							fprintf(stderr,"Couldn't reserve memory for cummulative counters");
-							goto error_path;
-						}
-					}
+					pmct_thread_acum_t* entry;
+
+					/* CPU online/offline notifications carry no counts */
+					if (cur->type==PMC_CPU_ONLINE_SAMPLE || cur->type==PMC_CPU_OFFLINE_SAMPLE)
+						continue;
 
-					if (! (pid_ctrl_vector[j].exp_mask & (1<<cur->exp_idx))) {
-						/* Time to copy metadata ... */
-						copy_metadata=1;
-						pid_ctrl_vector[j].exp_mask|=1<<cur->exp_idx;
-						pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]=1;
-					} else
-						pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]++;
+					if ((entry=pmct_thread_table_accumulate(acum,pmcmask,virtual_mask,cur))==NULL)
+						goto error_path;
 
-					pmct_accumulate_sample (nr_experiments,pmcmask,virtual_mask,copy_metadata,cur,&acum_samples[j][cur->exp_idx]);
+					/* Get the name of new threads while they (or their process) are still around */
+					if (opts->rollup==PMCT_ROLLUP_COMM && !entry->comm[0])
+						pmct_get_thread_comm(entry->pid,entry->tgid,entry->comm);
 				} else {
-					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, cont, cur);
+					if (opts->metrics)
+						pmct_metrics_eval(opts->metrics,cur,1,0);
+					pmct_print_sample_with_metrics (fo,nr_experiments, pmcmask, virtual_mask,
+					                                extended_output, cont, cur, opts->metrics);
 				}
 
 				cont++;
@@ -966,40 +1128,91 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 					}
 				}
 			}
-		}
+		} while (!stop_profiling && nr_samples>0 && monitor_has_samples(fd,rings));
 	}//end while
 
 	/* Generate output from accumulated values */
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
+		pmct_thread_table_t groups;
+		pmct_thread_table_t* table=acum;
+		pmct_thread_acum_t* entry;
+
+		/* Extrapolate multiplexed counts based on the time each event set was counting */
+		pmct_thread_table_scale(acum);
+
+		/* Aggregate the counts of the threads of each process or with the same name */
+		if (opts->rollup!=PMCT_ROLLUP_NONE) {
+			if (pmct_thread_table_init(&groups,nr_experiments,opts->rollup))
+				goto error_path;
+			table=&groups;
+			if (pmct_thread_table_rollup(acum,table,pmcmask,virtual_mask))
+				goto error_path;
+		}
+
+		if (opts->rollup==PMCT_ROLLUP_COMM)
+			print_thread_names(fo,table);
 
 		print_counter_mappings(fo,opts,nr_experiments);
-		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output,mode==PMCTRACK_MODE_SYSWIDE);
+		pmct_print_header_with_metrics(fo,nr_experiments,pmcmask,virtual_mask,extended_output,
+		                               mode==PMCTRACK_MODE_SYSWIDE,opts->metrics);
 
-		/* Generate samples for the various threads */
-		for (i=0; i<nr_pids; i++) {
+		/* Generate samples for the various threads (or groups) */
+		for (i=0; i<table->nr_entries; i++) {
 			int j=0;
+
+			entry=&table->entries[i];
+
 			for (j=0; j<nr_experiments; j++) {
-				if ( pid_ctrl_vector[i].exp_mask & (1<<j))
-					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask,
-					                   extended_output, pid_ctrl_vector[i].nr_samples_accum[j], &acum_samples[i][j]);
+				if (!(entry->exp_mask & (1UL<<j)))
+					continue;
+
+				/* Metrics may combine the events of all the sets (scaled to the same time) */
+				if (opts->metrics)
+					pmct_metrics_eval(opts->metrics,entry->samples,nr_experiments,j);
+
+				pmct_print_sample_with_metrics (fo,nr_experiments, pmcmask, virtual_mask,
+				                                extended_output, entry->nr_samples_accum[j],
+				                                &entry->samples[j], opts->metrics);
 			}
 		}
+
+		if (table!=acum)
+			pmct_thread_table_free(table);
 	}
 
 error_path:
 	if (!detached)
 		detach_pid_set(set,opts->target_pid);
 
+	destroy_event_loop(&loop);
+
 	if (mode!=PMCTRACK_MODE_ATTACH && !child_finished) {
 		wait4(pid,&child_status,0,&child_rusage);
 		gettimeofday(&end_time, NULL);
 	}
 	if (opts->flags & CMD_FLAG_SHOW_CHILD_TIMES)
 		print_process_statistics(fo,&child_rusage,&start_time,&end_time);
+	if (rings) {
+		unsigned long nr_lost,nr_throttled;
+
+		/* Report overflows of the kernel buffer */
+		pmct_ring_get_losses(rings,&nr_lost,&nr_throttled);
+
+		if (nr_lost)
+			fprintf(stderr, "%lu samples were lost because the kernel buffer was full. "
+			        "Consider increasing its size with -k\n",nr_lost);
+		if (nr_throttled)
+			fprintf(stderr, "%lu samples were deferred because the kernel buffer was full "
+			        "(their counts were included in later samples)\n",nr_throttled);
+
+		pmct_unmap_sample_rings(rings);
+	}
 	if (fd>0)
 		close(fd);
 	if (set)
 		destroy_pid_set(set);
+	if (acum)
+		pmct_thread_table_free(acum);
 	exit(child_status);
 }
 
@@ -1017,7 +1230,8 @@ void sigchld_handler(int signo)
 
 void sigint_handler(int signo)
 {
-	kill(SIGTERM, pid);
+	if (pid>0 && !child_finished)
+		kill(pid,SIGTERM);
 	/* Finish inmediately */
 	stop_profiling=1;
 	printf("Received signal %d\n", signo);
@@ -1030,25 +1244,32 @@ void init_options( struct options* opts)
 	unsigned int i;
 
 	opts->msecs = 1000;
+	opts->usecs = 1000000;
 	opts->virtcfg = NULL;
 	opts->nr_virtual_counters=opts->virtual_mask=0;
 
 	for (i = 0; i<MAX_RAW_COUNTER_CONFIGS_SAFE; ++i)
 		opts->strcfg[i] = NULL;
 
-	for (i = 0; i<MAX_COUNTER_CONFIGS; ++i)
+	for (i = 0; i<=MAX_COUNTER_CONFIGS; ++i)
 		opts->user_cfg_str[i]=NULL;
 
 	opts->cpumask = NO_CPU_BINDING;
+	opts->syswide_cpus = NULL;
+	opts->cgroup = NULL;
 	opts->max_samples = -1;
 	opts->flags=0;
 	opts->target_pid=-1;
 	opts->kernel_buffer_size = -1;
+	opts->overflow_policy = NULL;
+	opts->mux_policy = NULL;
 	opts->user_nr_configs=0;
 	opts->pmu_id=0;
 	memset(opts->event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
 	opts->global_pmcmask=0;
 	opts->timeout_secs=-1; /* Disabled for now */
+	opts->metrics=NULL;
+	opts->rollup=PMCT_ROLLUP_NONE;
 }
 
 
@@ -1072,6 +1293,26 @@ int add_cfg_string_to_options(char* usercfg, struct options* opts)
 	return 0;
 }
 
+/*
+ * Add metric definitions (or the definitions found in a file
+ * if from_file!=0) to the set of derived metrics
+ */
+int add_metrics_to_options(char* str, int from_file, struct options* opts)
+{
+	if (!opts->metrics) {
+		if ((opts->metrics=malloc(sizeof(pmct_metric_set_t)))==NULL) {
+			warnx("Can't allocate memory for the derived metrics");
+			return 1;
+		}
+		pmct_metrics_init(opts->metrics);
+	}
+
+	if (from_file)
+		return pmct_metrics_load_file(opts->metrics,str);
+	else
+		return pmct_metrics_add(opts->metrics,str);
+}
+
 /* Wrapper for pmct_parse_pmc_configuration() */
 int parse_pmc_configuration(struct options* opts)
 {
@@ -1123,6 +1364,11 @@ void free_options (struct options* opts)
 
 	if (opts->virtcfg)
 		free(opts->virtcfg);
+
+	if (opts->metrics) {
+		pmct_metrics_free(opts->metrics);
+		free(opts->metrics);
+	}
 }
 
 int check_options(struct options* opts,char *argv[],int optind)
@@ -1139,6 +1385,18 @@ int check_options(struct options* opts,char *argv[],int optind)
 	} else if ( (opts->flags & CMD_FLAG_SHOW_CHILD_TIMES) && opts->target_pid!=-1 ) {
 		warnx("Attach mode (-p) not compatible with -t option\n");
 		return 4;
+	} else if ( opts->syswide_cpus && !(opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) ) {
+		warnx("The -C option requires system-wide mode (-S)\n");
+		return 5;
+	} else if ( (extended_output & PMCT_OUTPUT_METRICS_ONLY) && !opts->metrics ) {
+		warnx("The -x option requires derived metrics (-m or -f)\n");
+		return 6;
+	} else if ( opts->rollup!=PMCT_ROLLUP_NONE && !(opts->flags & CMD_FLAG_ACUM_SAMPLES) ) {
+		warnx("The -U option requires the aggregate count mode (-A)\n");
+		return 7;
+	} else if ( opts->rollup!=PMCT_ROLLUP_NONE && (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) ) {
+		warnx("The -U option is not available in system-wide mode\n");
+		return 8;
 	}
 	return 0;
 }
@@ -1150,17 +1408,26 @@ static void usage(const char* program_name,int status)
 	case 0:
 		printf ("Usage: %s [OPTION [OP. ARGS]] [PROG [ARGS]]\n", program_name);
 		printf ("Available oprions:");
-		printf ("\n\t-c\t<config-string>\n\t\tset up a performance monitoring experiment using either raw or mnemonic-based PMC string");
+		printf ("\n\t-c\t<config-string>\n\t\tset up a performance monitoring experiment using either raw or mnemonic-based PMC string. Mnemonic-based events are packed into as few event sets as possible (the <event>:ref flag includes an event in all of them)");
 		printf ("\n\t-o\t<output>\n\t\toutput: set output file for the results. (default = stdout.)");
-		printf ("\n\t-T\t<Time>\n\t\tTime: elapsed time in seconds between two consecutive counter samplings. (default = 1 sec.)");
+		printf ("\n\t-T\t<Time>\n\t\tTime: elapsed time in seconds between two consecutive counter samplings. Sub-millisecond values are accepted in TBS mode. (default = 1 sec.)");
 		printf ("\n\t-b\t<cpu or mask>\n\t\tbind launched program to the specified cpu o cpumask.");
 		printf ("\n\t-n\t<max-samples>\n\t\tRun command until a given number of samples are collected");
 		printf ("\n\t-N\t<secs>\n\t\tRun command for secs seconds only");
 		printf ("\n\t-e\n\t\tEnable extended output");
 		printf ("\n\t-A\n\t\tEnable aggregate count mode");
+		printf ("\n\t-U\t<tgid|comm>\n\t\tIn aggregate count mode, show the counts of the threads of each process (tgid) or of the threads with the same name (comm) together");
+		printf ("\n\t-R\n\t\tShow event rates (counts per second) rather than raw counts");
+		printf ("\n\t-m\t<name=expr[;name=expr...]>\n\t\tShow derived metrics (e.g., IPC=instr_retired/unhalted_core_cycles). Expressions may use event names, pmcN, virtN, secs, previously defined metrics, + - * / and min/max/sum(...)");
+		printf ("\n\t-f\t<file>\n\t\tRead derived-metric definitions from a file (one per line)");
+		printf ("\n\t-x\n\t\tShow derived metrics only (hide raw counts)");
 		printf ("\n\t-k\t<kernel_buffer_size>\n\t\tSpecify the size of the kernel buffer used for the PMC samples");
+		printf ("\n\t-O\t<drop|overwrite|throttle>\n\t\tSpecify what to do when the kernel buffer fills up (default = drop)");
+		printf ("\n\t-M\t<rr|weighted|adaptive>\n\t\tSpecify how to multiplex event sets. Use the weight=N flag in a -c string to give its sets more time (default = weighted)");
 		printf ("\n\t-b\t<cpu or mask>\n\t\tbind monitor program to the specified cpu o cpumask.");
 		printf ("\n\t-S\n\t\tEnable system-wide monitoring mode (per-CPU)");
+		printf ("\n\t-C\t<cpu-list>\n\t\tMonitor only the specified CPUs in system-wide mode (e.g., 0-3,8)");
+		printf ("\n\t-G\t<cgroup>\n\t\tcgroup mode: count events per CPU only while tasks of the cgroup run (path in the perf_event hierarchy). Implies -S");
 		printf ("\n\t-r\t\n\t\tAccept pmc configuration strings in the RAW format");
 		printf ("\n\t-P\t<pmu>\n\t\tSpecify the PMU id to use for the event configuration");
 		printf ("\n\t-L\n\t\tLegacy-mode: do not show counter-to-event mapping");
@@ -1188,6 +1455,7 @@ int main(int argc, char *argv[])
 	fo = stdout;
 	char optc;
 	static struct options opts;
+	double period;
 
 	init_options(&opts);
 
@@ -1195,7 +1463,7 @@ int main(int argc, char *argv[])
 		usage(argv[0],0);
 
 	/* Process command-line options ... */
-	while ((optc = getopt(argc, argv, "+hc:T:o:b:n:V:B:eAk:SrP:LtN:p:")) != (char)-1) {
+	while ((optc = getopt(argc, argv, "+hc:T:o:b:n:V:B:eARU:m:f:xk:O:M:SC:G:rP:LtN:p:")) != (char)-1) {
 		switch (optc) {
 		case 'o':
 			if((fo = fopen(optarg, "w")) == NULL)
@@ -1205,7 +1473,7 @@ int main(int argc, char *argv[])
 			usage(argv[0],0);
 			break;
 		case 'c':
-			if (add_cfg_string_to_options(optarg,&opts)<0)
+			if (add_cfg_string_to_options(optarg,&opts))
 				exit(1);
 			break;
 		case 'V':
@@ -1213,7 +1481,17 @@ int main(int argc, char *argv[])
 				exit(1);
 			break;
 		case 'T':
-			opts.msecs = (int)1000.0*atof(optarg);
+			period=atof(optarg);
+			/*
+			 * The period is handled in microseconds (int), and a zero
+			 * period would disarm the sampling timer
+			 */
+			if (!(period>0) || period>INT_MAX/1000000.0 || (int)(1000000.0*period)==0) {
+				warnx("The sampling period must be at least 1 microsecond and at most %d seconds",INT_MAX/1000000);
+				exit(1);
+			}
+			opts.usecs = (int)(1000000.0*period);
+			opts.msecs = opts.usecs>=1000?opts.usecs/1000:1;
 			break;
 		case 'b':
 			opts.cpumask=str_to_cpumask(optarg);
@@ -1225,18 +1503,55 @@ int main(int argc, char *argv[])
 			opts.max_samples=atoi(optarg);
 			break;
 		case 'e':
-			extended_output=1;
+			extended_output|=PMCT_OUTPUT_EXTENDED;
 			opts.flags|=CMD_FLAG_EXTENDED_OUTPUT;
 			break;
 		case 'A':
 			opts.flags|=CMD_FLAG_ACUM_SAMPLES;
 			break;
+		case 'R':
+			extended_output|=PMCT_OUTPUT_RATES;
+			break;
+		case 'm':
+			if (add_metrics_to_options(optarg,0,&opts))
+				exit(1);
+			break;
+		case 'f':
+			if (add_metrics_to_options(optarg,1,&opts))
+				exit(1);
+			break;
+		case 'x':
+			extended_output|=PMCT_OUTPUT_METRICS_ONLY;
+			break;
+		case 'U':
+			if (!strcmp(optarg,"tgid"))
+				opts.rollup=PMCT_ROLLUP_TGID;
+			else if (!strcmp(optarg,"comm"))
+				opts.rollup=PMCT_ROLLUP_COMM;
+			else {
+				warnx("Unknown aggregation criterion: %s (use tgid or comm)",optarg);
+				exit(1);
+			}
+			break;
 		case 'k':
 			opts.kernel_buffer_size=atoi(optarg);
 			break;
+		case 'O':
+			opts.overflow_policy=optarg;
+			break;
+		case 'M':
+			opts.mux_policy=optarg;
+			break;
 		case 'S':
 			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
 			break;
+		case 'C':
+			opts.syswide_cpus=optarg;
+			break;
+		case 'G':
+			opts.cgroup=optarg;
+			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
+			break;
 		case 'r':
 			opts.flags|=CMD_FLAG_RAW_PMC_FORMAT;
 			break;
@@ -1271,9 +1586,16 @@ int main(int argc, char *argv[])
 	if (parse_pmc_configuration(&opts))
 		exit(1);
 
+	/* Event names can be resolved now */
+	if (opts.metrics && pmct_metrics_compile(opts.metrics,opts.event_mapping))
+		exit(1);
+
 
-	/* Get rid of stdio buffer */
-	setbuf(fo,NULL);
+	/*
+	 * Write the output in large blocks (it is flushed
+	 * once every sampling period)
+	 */
+	setvbuf(fo,output_buffer,_IOFBF,OUTPUT_BUFFER_SIZE);
 
 	/* Invoke main monitoring function for the selected mode */
 	if (opts.flags & CMD_FLAG_SYSTEM_WIDE_MODE)
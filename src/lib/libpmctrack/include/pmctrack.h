@@ -33,7 +33,12 @@
 #define _GNU_SOURCE
 #endif
 
-#define MAX_COUNTER_CONFIGS 5  /* Max number of event multiplexing experiments */
+/*
+ * Max number of event multiplexing experiments (bits in experiment_mask).
+ * It sets the size of counter_mapping_t, so changing it changes the ABI
+ * of the library (see LIB_MAJOR in src/Makefile).
+ */
+#define MAX_COUNTER_CONFIGS 32
 
 /* Forward-declare opaque descriptor */
 struct pmctrack_desc;
@@ -32,6 +32,8 @@
 #ifndef PMCTRACK_INTERNAL_H
 #define PMCTRACK_INTERNAL_H
 #include <pmctrack.h>
+#include <pmc_ioctl.h> /* Note: This file is found in PMCTrack's kernel module source code */
+#include <pmc_expr.h> /* Expression compiler shared with the kernel module */
 
 
 /* Max length for user-provided PMC configuration strings */
@@ -129,6 +131,23 @@ int pmct_config_virtual_counters(const char* virtcfg, unsigned long flags);
  */
 int pmct_config_timeout(int msecs, int kernel_control);
 
+/*
+ * Same as pmct_config_timeout(), but the timeout is specified in us
+ * (sub-millisecond timeouts are supported in the TBS mode only).
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_timeout_us(int usecs, int kernel_control);
+
+/*
+ * Select the policy used by the kernel to multiplex event sets:
+ * "rr" (round robin), "weighted" (honors the weight=N flag of each set)
+ * or "adaptive" (sets whose event rates fluctuate get more intervals).
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_mux_policy(const char* policy);
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session in per-thread mode
  *
@@ -136,6 +155,11 @@ int pmct_config_timeout(int msecs, int kernel_control);
  */
 int pmct_start_counting( void );
 
+/* Flags for the "extended_output" parameter of pmct_print_header() and pmct_print_sample() */
+#define PMCT_OUTPUT_EXTENDED	0x1	/* Show coretype and expid columns */
+#define PMCT_OUTPUT_RATES	0x2	/* Show counts per second (based on the sample's time_enabled) */
+#define PMCT_OUTPUT_METRICS_ONLY	0x4	/* Hide raw counts (derived metrics only) */
+
 /*
  * Print a header in the "normalized" format for a table of
  * PMC and virtual-counter samples
@@ -144,9 +168,10 @@ int pmct_start_counting( void );
  * nr_experiments: Number of event-multiplexing experiments in use
  * pmcmask: bitmask indicating which PMCs are in use
  * virtual_mask: bitmask indicating which virtual counters are in use
- * extended_output: Use a non-zero value if nr_experiments>1 or different
+ * extended_output: Use PMCT_OUTPUT_EXTENDED if nr_experiments>1 or different
  *                  events sets are monitored in the various cores of
- *                  an asymmetric multicore system
+ *                  an asymmetric multicore system. PMCT_OUTPUT_RATES may
+ *                  be ORed in to print rates per second instead of counts
  * syswide: Use a non-zero value if the system-wide mode is enabled.
  *
  */
@@ -164,9 +189,10 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
  * nr_experiments: Number of event-multiplexing experiments in use
  * pmcmask: bitmask indicating which PMCs are in use
  * virtual_mask: bitmask indicating which virtual counters are in use
- * extended_output: Use a non-zero value if nr_experiments>1 or different
+ * extended_output: Use PMCT_OUTPUT_EXTENDED if nr_experiments>1 or different
  *                  events sets are monitored in the various cores of
- *                  an asymmetric multicore system
+ *                  an asymmetric multicore system. PMCT_OUTPUT_RATES may
+ *                  be ORed in to print rates per second instead of counts
  * nsample: Number of sample to be included in the row
  * sample: Actual sample with PMC and virtual-counter data
  *
@@ -176,11 +202,40 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
                         unsigned int virtual_mask,
                         unsigned int extended_output,
                         int nsample,
-                        pmc_sample_t* sample);
+                        pmc_sample_v2_t* sample);
+
+/* Data type predeclaration (see derived metrics below) */
+struct pmct_metric_set;
+
+/*
+ * Same as pmct_print_header(), but a column is added
+ * for each derived metric in "metrics" (which may be NULL)
+ */
+void pmct_print_header_with_metrics (FILE* fo, unsigned int nr_experiments,
+                                     unsigned int pmcmask,
+                                     unsigned int virtual_mask,
+                                     int extended_output,
+                                     int syswide,
+                                     struct pmct_metric_set* metrics);
+
+/*
+ * Same as pmct_print_sample(), but the values of the derived metrics
+ * in "metrics" (which may be NULL) are printed after the counts.
+ * The metrics must be evaluated with pmct_metrics_eval() beforehand.
+ */
+void pmct_print_sample_with_metrics (FILE* fo, unsigned int nr_experiments,
+                                     unsigned int pmcmask,
+                                     unsigned int virtual_mask,
+                                     unsigned int extended_output,
+                                     int nsample,
+                                     pmc_sample_v2_t* sample,
+                                     struct pmct_metric_set* metrics);
 
 /*
  * Accumulate PMC and virtual-counter values from one sample into
- * another sample.
+ * another sample. Counts are accumulated as is, along with the
+ * time the event set was enabled and running; use
+ * pmct_scale_accumulated_samples() to extrapolate multiplexed counts.
  * (This function is used to implement the "-A" option
  * of the pmctrack command-line tool)
  *
@@ -197,8 +252,30 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
                              unsigned int pmcmask,
                              unsigned int virtual_mask,
                              unsigned char copy_metainfo,
-                             pmc_sample_t* sample,
-                             pmc_sample_t* accum);
+                             pmc_sample_v2_t* sample,
+                             pmc_sample_v2_t* accum);
+
+/*
+ * Scale the PMC counts accumulated for the various event sets
+ * of a thread (or CPU) when event multiplexing is in use.
+ * The counts of each event set are extrapolated to the
+ * whole time the thread was monitored (the sum of time_enabled
+ * across event sets) based on the time the set was actually
+ * counting (time_running). If the kernel does not provide
+ * timing information, the counts are just multiplied by
+ * the number of experiments. Both time_enabled and time_running
+ * (unless the set never got to count) are set to the whole
+ * monitoring time afterwards.
+ *
+ * ==Parameters==
+ * nr_experiments: Number of event-multiplexing experiments in use
+ * exp_mask: bitmask indicating which entries of "accum" are valid
+ * accum: Array of nr_experiments samples (one per event set)
+ *        with accumulated data
+ */
+void pmct_scale_accumulated_samples (unsigned int nr_experiments,
+                                     unsigned int exp_mask,
+                                     pmc_sample_v2_t* accum);
 
 /*
  * Become the monitor process of another process with PID=pid.
@@ -219,6 +296,22 @@ int pmct_attach_process (pid_t pid, int config_pmcs);
  */
 int pmct_detach_process (pid_t pid);
 
+/*
+ * Become the monitor process of all the threads of the process that
+ * the thread with PID=pid belongs to. The kernel attaches every thread
+ * of the thread group in a single operation; threads created afterwards
+ * are monitored automatically. The threads inherit the PMC and virtual
+ * counter configuration from the parent process.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_attach_thread_group (pid_t pid);
+
+/*
+ * Detach all threads of a process from monitor
+ */
+int pmct_detach_thread_group (pid_t pid);
+
 
 /*
  * Obtain a file descriptor of the special file exported by
@@ -257,6 +350,65 @@ int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples);
  */
 pmc_sample_t* pmct_request_shared_memory_region(int monitor_fd, unsigned int* max_samples);
 
+/*
+ * Per-CPU sample rings of the kernel buffer mapped into the
+ * address space of the monitor process. Records are decoded straight
+ * from the mapping, with no copies between kernel and user space.
+ */
+typedef struct {
+	pmc_ring_control_t* control;  /* Control area (header + per-CPU ring indices) */
+	size_t mmap_size;             /* Size of the mapping (in bytes) */
+	unsigned int cur_ring;        /* Next ring to visit (round robin) */
+	pmc_schema_table_t* schemas;  /* Schemas found so far in each ring */
+	unsigned long nr_lost_reported; /* Samples lost according to the PMC_RECORD_LOST records found */
+	unsigned long nr_discarded;   /* Samples discarded because their schema was overwritten */
+} pmct_sample_rings_t;
+
+/*
+ * Map the per-CPU sample rings associated with the monitor process.
+ * Note that the kernel allocates the rings when the monitoring session
+ * starts (or when the monitor attaches to a process).
+ *
+ * ==Parameters==
+ * monitor_fd: File descriptor obtained with pmct_open_monitor_entry()
+ *
+ * The function returns a non-NULL pointer on success, and NULL upon failure
+ * (e.g., if the kernel module does not support this feature).
+ */
+pmct_sample_rings_t* pmct_map_sample_rings(int monitor_fd);
+
+/* Unmap sample rings obtained with pmct_map_sample_rings() */
+void pmct_unmap_sample_rings(pmct_sample_rings_t* rings);
+
+/*
+ * Retrieve samples from the per-CPU rings. Variable-length records
+ * are converted into the pmc_sample_v2_t format and handed back to the
+ * kernel right away. The samples returned by each call are sorted by
+ * timestamp (but not across calls). The function blocks if no samples
+ * are available.
+ *
+ * ==Parameters==
+ * fd: File descriptor obtained with pmct_open_monitor_entry()
+ * rings: Rings obtained with pmct_map_sample_rings()
+ * samples (out): Array where samples will be stored
+ * max_samples: Capacity of the array
+ *
+ * The function returns the number of samples retrieved, 0 if all
+ * monitored threads finished, and a negative value upon failure.
+ */
+int pmct_ring_read_samples(int fd, pmct_sample_rings_t* rings, pmc_sample_v2_t* samples, unsigned int max_samples);
+
+/* Returns a non-zero value if the rings hold unread records */
+int pmct_ring_has_samples(pmct_sample_rings_t* rings);
+
+/*
+ * Retrieve the number of samples lost so far because the rings
+ * filled up (nr_lost), and the number of samples deferred by the kernel
+ * with the "throttle" overflow policy (nr_throttled). Deferred samples
+ * are not lost: their counts are included in the next sample.
+ */
+void pmct_ring_get_losses(pmct_sample_rings_t* rings, unsigned long* nr_lost, unsigned long* nr_throttled);
+
 /*
  * Set up the size of the kernel buffer used to store PMC and virtual
  * counter values
@@ -265,6 +417,34 @@ pmc_sample_t* pmct_request_shared_memory_region(int monitor_fd, unsigned int* ma
  */
 int pmct_set_kernel_buffer_size(unsigned int nr_bytes);
 
+/*
+ * Select what the kernel does when the buffer that stores PMC samples fills up:
+ *  - "drop": new samples are dropped (default)
+ *  - "overwrite": the oldest samples are overwritten
+ *  - "throttle": new samples are deferred and their counts go into the next
+ *     sample that fits (scheduler-driven and TBS modes; samples are dropped
+ *     in the other modes)
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_overflow_policy(const char* policy);
+
+/*
+ * Set up when the kernel wakes up the monitor process (blocked in read()
+ * or poll() on the monitor entry) as samples become available. The monitor
+ * is woken up as soon as any of the enabled conditions is met in one of
+ * the per-CPU rings. Zero disables a condition; if all of them are disabled,
+ * the monitor is woken up on every sample.
+ *
+ * ==Parameters==
+ * nr_samples: Number of unread samples
+ * fill_percent: Ring occupancy (in %)
+ * latency_ms: Age of the oldest unread sample (in ms)
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_wakeup_watermarks(unsigned int nr_samples, unsigned int fill_percent, unsigned int latency_ms);
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session in system-wide mode
  *
@@ -272,6 +452,95 @@ int pmct_set_kernel_buffer_size(unsigned int nr_bytes);
  */
 int pmct_syswide_start_counting( void );
 
+/*
+ * Restrict the next system-wide monitoring session to the CPUs
+ * in "cpulist" (e.g., "0-3,8"). The rest of the CPUs are not
+ * sampled and their PMCs remain available for per-thread monitoring.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_syswide_config_cpus(const char* cpulist);
+
+/*
+ * Restrict the next system-wide monitoring session to the tasks of
+ * a cgroup (cgroup mode): events are counted on each CPU only while
+ * tasks of the cgroup run on it. "cgroup" is either a directory in the
+ * perf_event cgroup hierarchy or a path relative to its mount point
+ * (e.g., "docker/<id>"). The cgroup must contain at least one process.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_syswide_config_cgroup(const char* cgroup);
+
+/*
+ * Binary control interface (/dev/pmctrack).
+ *
+ * PMC configurations are validated and translated by the kernel
+ * just once (pmct_ioctl_compile_config()). The resulting handle is
+ * then used to attach processes or to start monitoring sessions,
+ * which spares the kernel from parsing text on each operation.
+ */
+
+/*
+ * Open the control device and check that the kernel speaks
+ * the same ABI version as the library.
+ *
+ * The function returns a file descriptor on success, and -1 upon failure.
+ */
+int pmct_ioctl_open(void);
+
+/*
+ * Compile a NULL-terminated array of raw PMC configuration strings
+ * (one per event set) into a kernel handle.
+ *
+ * The function returns the handle (>=0) on success, and -1 upon failure.
+ */
+int pmct_ioctl_compile_config(int fd, const char* strcfg[]);
+
+/* Release a handle. Threads using the configuration are not affected */
+int pmct_ioctl_destroy_config(int fd, int handle);
+
+/*
+ * Become the monitor process of the process with PID=pid,
+ * which will be monitored with the configuration of "handle".
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_ioctl_attach(int fd, int handle, pid_t pid);
+
+/* Detach process from monitor */
+int pmct_ioctl_detach(int fd, pid_t pid);
+
+/*
+ * Same as pmct_ioctl_attach() but for all the threads of the process
+ * that "pid" belongs to (see pmct_attach_thread_group()).
+ *
+ * The function returns the number of threads attached, and -1 upon failure.
+ */
+int pmct_ioctl_attach_tgid(int fd, int handle, pid_t pid);
+
+/* Detach all the threads of a process from monitor */
+int pmct_ioctl_detach_tgid(int fd, pid_t pid);
+
+/*
+ * Attach the "nr_pids" processes in "pids" with a single request.
+ *
+ * The function returns the number of processes attached, and -1 upon failure.
+ */
+int pmct_ioctl_attach_list(int fd, int handle, pid_t* pids, unsigned int nr_pids);
+
+/*
+ * Start a per-thread monitoring session for the calling thread
+ * (or a system-wide session if PMCT_IOC_SYSWIDE is set in "flags")
+ * using the configuration of "handle".
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_ioctl_start_counting(int fd, int handle, unsigned int flags);
+
+/* Stop the session started with pmct_ioctl_start_counting() */
+int pmct_ioctl_stop_counting(int fd, unsigned int flags);
+
 /* PMCTrack PMU_INFO structures plus event mnemonic translation engine */
 
 #define MAX_CORE_TYPES 2
@@ -299,6 +568,8 @@ typedef struct {
 	char name[NAME_HW_EVENT_SIZE];
 	pmc_property_t *properties[MAX_NR_PROPERTIES];
 	unsigned int nr_properties;
+	unsigned int pmc_mask;     /* Counters the subevent can be counted on (0=any). The "pmcs" flag
+	                            * in the CSV file gives a mask of general-purpose counters */
 } hw_subevent_t;
 
 /* Structure that represents a HW event */
@@ -370,6 +641,13 @@ void pmct_print_event_list(pmu_info_t *pmu_info, int verbose);
  * allocated. As such, the function returns an array of
  * raw-formatted (feasible) configuration strings.
  *
+ * Events are packed into as few experiments as possible, taking
+ * into account the counters each event can be counted on (fixed-function
+ * counters, "pmcs" flag in the PMU's CSV file, or the "pmc=N" flag in
+ * the string). Events with the "ref" flag (e.g., "instr:ref,...")
+ * are included in every experiment, so that the counts of the various
+ * experiments can be normalized to each other.
+ *
  * ==Parameters==
  * strcfg (in):  mnemonic-based PMC configuration string.
  *               Event mnemonics or hex-codes may be used to specify events.
@@ -475,4 +753,182 @@ int pmct_parse_vcounter_config(const char* virtcfg,
                                unsigned int* nr_virtual_counters,
                                int* mnemonics_used,
                                char** raw_virtcfg);
+
+/*** Derived metrics ***/
+
+#define PMCT_MAX_METRICS	16	/* Max number of derived metrics */
+#define PMCT_MAX_METRIC_NAME	32	/* Max length of a metric name */
+#define PMCT_METRIC_MAX_SLOTS	64	/* Max number of distinct event values a set of metrics reads */
+
+/*
+ * A derived metric, such as "IPC=instr_retired/unhalted_core_cycles".
+ * The expression is compiled once (see pmc_expr.h) and evaluated
+ * for each sample.
+ */
+typedef struct {
+	char name[PMCT_MAX_METRIC_NAME];
+	char* definition;            /* Expression as specified by the user */
+	pmc_expr_t* prog;            /* Compiled expression */
+	uint64_t slot_mask;          /* Event slots read by the expression */
+	unsigned int value_mask;     /* Entries of "values" read by the expression */
+} pmct_metric_t;
+
+/*
+ * Set of derived metrics along with the state to evaluate them.
+ * The events referenced in the expressions are assigned "slots":
+ * pmcN takes slot N, virtN takes slot MAX_PERFORMANCE_COUNTERS+N and
+ * each distinct event name found in the event-to-counter mapping
+ * gets a slot of its own.
+ */
+typedef struct pmct_metric_set {
+	pmct_metric_t metrics[PMCT_MAX_METRICS];
+	unsigned int nr_metrics;
+	char* slot_names[PMCT_METRIC_MAX_SLOTS];   /* Event names (point to the mapping) */
+	unsigned int nr_slots;
+	signed char event_slot[MAX_PERFORMANCE_COUNTERS][MAX_COUNTER_CONFIGS]; /* Slot of the event of each PMC and set (-1 if none) */
+	/* Evaluation state */
+	uint64_t hw_events[PMCT_METRIC_MAX_SLOTS];  /* Counts of the current evaluation */
+	uint64_t present;                           /* Slots with a count in hw_events */
+	int64_t values[PMCT_MAX_METRICS+1];          /* Elapsed time ("secs") followed by the metrics (fixed point) */
+	unsigned int valid;                         /* Entries of "values" that could be computed */
+} pmct_metric_set_t;
+
+/* Initialize an empty set of metrics */
+void pmct_metrics_init(pmct_metric_set_t* set);
+
+/* Free up the resources associated with a set of metrics */
+void pmct_metrics_free(pmct_metric_set_t* set);
+
+/*
+ * Add one or more metric definitions to the set. Definitions
+ * have the form <name>=<expression> and are separated by ';'.
+ * Besides the operators and functions supported by pmc_expr.h,
+ * expressions may reference:
+ *  - Event names of mnemonic-based configurations (e.g., instr_retired)
+ *  - pmcN and virtN (raw counts of a counter or virtual counter)
+ *  - Virtual counter names
+ *  - "secs" (time the sample covers, in seconds)
+ *  - Metrics defined earlier
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_metrics_add(pmct_metric_set_t* set, const char* definitions);
+
+/*
+ * Add the metric definitions found in a file (one per line).
+ * Blank lines and lines starting with '#' are ignored.
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_metrics_load_file(pmct_metric_set_t* set, const char* path);
+
+/*
+ * Compile the metrics of the set. Event names are resolved using the
+ * event-to-counter mapping returned by pmct_parse_pmc_configuration()
+ * (the mapping is empty for raw configurations).
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_metrics_compile(pmct_metric_set_t* set, counter_mapping_t* mapping);
+
+/*
+ * Evaluate the metrics of the set for the sample samples[cur].
+ * Counts are scaled up when the event set was multiplexed (time_running
+ * smaller than time_enabled). The counts of events not included in
+ * samples[cur] are taken from the other samples in the array, which must
+ * cover the same time span (e.g., the per-event-set samples accumulated
+ * for a thread and scaled with pmct_scale_accumulated_samples()).
+ * Metrics whose events are missing are left undefined.
+ */
+void pmct_metrics_eval(pmct_metric_set_t* set, pmc_sample_v2_t* samples,
+                       unsigned int nr_samples, unsigned int cur);
+
+/*** Per-thread accumulated samples ***/
+
+#define PMCT_COMM_LEN	16	/* Max length of a thread name (TASK_COMM_LEN) */
+
+/* Criteria to aggregate the counts of several threads */
+typedef enum {
+	PMCT_ROLLUP_NONE=0,	/* One entry per thread (or CPU) */
+	PMCT_ROLLUP_TGID,	/* One entry per process */
+	PMCT_ROLLUP_COMM	/* One entry per thread name */
+} pmct_rollup_t;
+
+/* Counts accumulated for a thread, or for a group of threads */
+typedef struct {
+	pid_t pid;                  /* Thread ID, CPU (system-wide mode) or group ID */
+	pid_t tgid;                 /* Process the thread belongs to (-1 if unknown) */
+	char comm[PMCT_COMM_LEN];   /* Thread name (empty if not retrieved) */
+	unsigned long exp_mask;     /* Event sets with accumulated samples */
+	unsigned int nr_threads;    /* Number of threads aggregated in the entry */
+	unsigned int nr_samples_accum[MAX_COUNTER_CONFIGS];
+	pmc_sample_v2_t* samples;      /* Accumulated sample of each event set */
+} pmct_thread_acum_t;
+
+/*
+ * Table of accumulated samples. Entries are stored in order of arrival
+ * and located by means of an open-addressing hash index, which grows
+ * (along with the entries) as new threads show up.
+ */
+typedef struct {
+	pmct_thread_acum_t* entries;
+	unsigned int nr_entries;
+	unsigned int max_entries;
+	int* index;                 /* Position in entries, or -1 if the bucket is empty */
+	unsigned int index_size;    /* Power of two */
+	unsigned int nr_experiments;
+	pmct_rollup_t key;          /* Entries are keyed by pid (NONE/TGID) or thread name (COMM) */
+} pmct_thread_table_t;
+
+/*
+ * Initialize an empty table for samples of "nr_experiments" event sets.
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_thread_table_init(pmct_thread_table_t* table,
+                           unsigned int nr_experiments,
+                           pmct_rollup_t key);
+
+/* Free up the resources associated with a table */
+void pmct_thread_table_free(pmct_thread_table_t* table);
+
+/*
+ * Retrieve the entry of a thread (or group) ID, or the entry of a thread
+ * name if the table is keyed by name. A new entry is created if
+ * it does not exist yet. Returns NULL if no memory is available.
+ * Note that the pointer is only valid until the next entry is created.
+ */
+pmct_thread_acum_t* pmct_thread_table_get(pmct_thread_table_t* table, pid_t pid);
+pmct_thread_acum_t* pmct_thread_table_get_comm(pmct_thread_table_t* table, const char* comm);
+
+/*
+ * Accumulate a sample in the entry of the thread (or CPU) it belongs to.
+ * Returns the entry, or NULL upon failure.
+ */
+pmct_thread_acum_t* pmct_thread_table_accumulate(pmct_thread_table_t* table,
+        unsigned int pmcmask,
+        unsigned int virtual_mask,
+        pmc_sample_v2_t* sample);
+
+/*
+ * Extrapolate the multiplexed counts of every entry
+ * (see pmct_scale_accumulated_samples())
+ */
+void pmct_thread_table_scale(pmct_thread_table_t* table);
+
+/*
+ * Aggregate the (already scaled) entries of a per-thread table into
+ * "groups", which must be initialized with the PMCT_ROLLUP_TGID or
+ * PMCT_ROLLUP_COMM key. Groups by thread name are numbered from 1
+ * in order of arrival. Threads whose process is unknown (samples
+ * retrieved with read() carry no tgid) form a group of their own.
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_thread_table_rollup(pmct_thread_table_t* threads,
+                             pmct_thread_table_t* groups,
+                             unsigned int pmcmask,
+                             unsigned int virtual_mask);
+
+/*
+ * Retrieve the name of a thread from /proc. The name of the process
+ * is used if the thread already exited. If neither can be retrieved,
+ * comm is set to "?" and the function returns -1.
+ */
+int pmct_get_thread_comm(pid_t tid, pid_t tgid, char* comm);
 #endif
@@ -48,6 +48,9 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sched.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/ioctl.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
@@ -64,7 +67,7 @@ const char* pmc_monitor_entry="/proc/pmc/monitor";
 const char* pmc_config_entry="/proc/pmc/config";
 const char* pmc_props_entry="/proc/pmc/properties";
 
-static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration","self"};
+static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration","self","online","offline"};
 
 /*
  * Tell PMCTrack's kernel module which virtual counters
@@ -314,6 +317,66 @@ int pmct_config_timeout(int msecs, int kernel_control)
 	return 0;
 }
 
+/*
+ * Same as pmct_config_timeout(), but the timeout is specified in us.
+ * Sub-millisecond periods are only honored in the TBS mode;
+ * the scheduler-driven mode works with ms.
+ */
+int pmct_config_timeout_us(int usecs, int kernel_control)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	/* Whole milliseconds are understood by older kernel modules as well */
+	if (kernel_control || usecs%1000==0)
+		return pmct_config_timeout(usecs>=1000?usecs/1000:1,kernel_control);
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"timeout_us %d\n",usecs);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Select the multiplexing policy for the event sets */
+int pmct_config_mux_policy(const char* policy)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,MAX_CONFIG_STRING_SIZE,"mux_policy %s\n",policy);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
 /*
  * Tell PMCTrack's kernel module which PMC events
  * must be monitored.
@@ -401,6 +464,249 @@ int pmct_syswide_start_counting( void )
 	return 0;
 }
 
+/*
+ * Restrict the next system-wide monitoring session
+ * to a list of CPUs (e.g., "0-3,8")
+ */
+int pmct_syswide_config_cpus(const char* cpulist)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	if (strlen(cpulist)>=MAX_CONFIG_STRING_SIZE-14) {
+		warnx("CPU list too long\n");
+		return -1;
+	}
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"syswide_cpus %s\n",cpulist);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Mount point of the perf_event cgroup hierarchy */
+#define PERF_EVENT_CGROUP_ROOT "/sys/fs/cgroup/perf_event"
+
+/*
+ * Count events only while the tasks of a cgroup run (cgroup mode)
+ * in the next system-wide monitoring session. "cgroup" may be
+ * either a directory or a path relative to the perf_event hierarchy.
+ * The kernel identifies the cgroup through one of its processes.
+ */
+int pmct_syswide_config_cgroup(const char* cgroup)
+{
+	char path[PATH_MAX];
+	char buf[MAX_CONFIG_STRING_SIZE];
+	struct stat st;
+	FILE* procs;
+	int pid=-1;
+	int fd;
+	int len;
+
+	if (stat(cgroup,&st)==0 && S_ISDIR(st.st_mode))
+		snprintf(path,sizeof(path),"%s/cgroup.procs",cgroup);
+	else
+		snprintf(path,sizeof(path),"%s/%s/cgroup.procs",PERF_EVENT_CGROUP_ROOT,cgroup);
+
+	if ((procs=fopen(path,"r"))==NULL) {
+		warnx("Can't open %s\n",path);
+		return -1;
+	}
+
+	if (fscanf(procs,"%d",&pid)!=1)
+		pid=-1;
+	fclose(procs);
+
+	if (pid<=0) {
+		warnx("No processes found in cgroup %s\n",cgroup);
+		return -1;
+	}
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"syswide_cgroup %d\n",pid);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Open PMCTrack's control device and make sure that
+ * the kernel module implements the same binary ABI
+ */
+int pmct_ioctl_open(void)
+{
+	struct pmct_ioc_version version;
+	int fd=open(PMCT_IOC_DEVICE_PATH, O_RDWR);
+
+	if(fd == -1) {
+		warnx("Can't open %s\n",PMCT_IOC_DEVICE_PATH);
+		return -1;
+	}
+
+	if (ioctl(fd,PMCT_IOC_GET_VERSION,&version)) {
+		warnx("Can't retrieve ABI version from %s\n",PMCT_IOC_DEVICE_PATH);
+		close(fd);
+		return -1;
+	}
+
+	if (version.abi_version!=PMCT_IOC_ABI_VERSION) {
+		warnx("ABI version mismatch (kernel=%u, library=%u)\n",
+		      version.abi_version,PMCT_IOC_ABI_VERSION);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Ask PMCTrack's kernel module to validate a PMC
+ * configuration and keep it for later use
+ */
+int pmct_ioctl_compile_config(int fd, const char* strcfg[])
+{
+	struct pmct_ioc_config cfg;
+	int i=0;
+
+	memset(&cfg,0,sizeof(cfg));
+
+	while (strcfg[i]!=NULL) {
+		if (i==PMCT_IOC_MAX_EVENT_SETS) {
+			warnx("Too many event sets (max %d)\n",PMCT_IOC_MAX_EVENT_SETS);
+			return -1;
+		}
+		if (strlen(strcfg[i])>=PMCT_IOC_MAX_CFG_LEN) {
+			warnx("Configuration string too long: %s\n",strcfg[i]);
+			return -1;
+		}
+		strcpy(cfg.strcfg[i],strcfg[i]);
+		i++;
+	}
+
+	cfg.nr_sets=i;
+
+	if (ioctl(fd,PMCT_IOC_COMPILE,&cfg)) {
+		warnx("Can't configure counters");
+		return -1;
+	}
+
+	return cfg.handle;
+}
+
+/* Release a precompiled PMC configuration */
+int pmct_ioctl_destroy_config(int fd, int handle)
+{
+	int32_t val=handle;
+
+	return ioctl(fd,PMCT_IOC_DESTROY,&val);
+}
+
+/*
+ * Become the monitor process of another process with PID=pid
+ * (using a precompiled PMC configuration)
+ */
+int pmct_ioctl_attach(int fd, int handle, pid_t pid)
+{
+	struct pmct_ioc_attach arg;
+
+	arg.handle=handle;
+	arg.pid=pid;
+
+	return ioctl(fd,PMCT_IOC_ATTACH,&arg);
+}
+
+/* Detach process from monitor */
+int pmct_ioctl_detach(int fd, pid_t pid)
+{
+	int32_t val=pid;
+
+	return ioctl(fd,PMCT_IOC_DETACH,&val);
+}
+
+/* Attach all the threads of a process with a precompiled PMC configuration */
+int pmct_ioctl_attach_tgid(int fd, int handle, pid_t pid)
+{
+	struct pmct_ioc_attach arg;
+
+	arg.handle=handle;
+	arg.pid=pid;
+
+	return ioctl(fd,PMCT_IOC_ATTACH_TGID,&arg);
+}
+
+/* Detach all the threads of a process from monitor */
+int pmct_ioctl_detach_tgid(int fd, pid_t pid)
+{
+	int32_t val=pid;
+
+	return ioctl(fd,PMCT_IOC_DETACH_TGID,&val);
+}
+
+/* Attach a list of processes with a precompiled PMC configuration */
+int pmct_ioctl_attach_list(int fd, int handle, pid_t* pids, unsigned int nr_pids)
+{
+	struct pmct_ioc_attach_list arg;
+
+	/* The kernel expects an array of int32_t */
+	if (sizeof(pid_t)!=sizeof(int32_t))
+		return -1;
+
+	arg.handle=handle;
+	arg.nr_pids=nr_pids;
+	arg.pids=(uint64_t)(unsigned long)pids;
+
+	return ioctl(fd,PMCT_IOC_ATTACH_LIST,&arg);
+}
+
+/*
+ * Start a per-thread or system-wide monitoring session
+ * with a precompiled PMC configuration
+ */
+int pmct_ioctl_start_counting(int fd, int handle, unsigned int flags)
+{
+	struct pmct_ioc_start arg;
+
+	arg.handle=handle;
+	arg.flags=flags;
+
+	return ioctl(fd,PMCT_IOC_START,&arg);
+}
+
+/* Stop a monitoring session started via the control device */
+int pmct_ioctl_stop_counting(int fd, unsigned int flags)
+{
+	uint32_t val=flags;
+
+	return ioctl(fd,PMCT_IOC_STOP,&val);
+}
 
 /*
  * Print a header in the "normalized" format for a table of
@@ -411,12 +717,24 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
                         unsigned int virtual_mask,
                         int extended_output,
                         int syswide)
+{
+	pmct_print_header_with_metrics(fo,nr_experiments,pmcmask,virtual_mask,
+	                               extended_output,syswide,NULL);
+}
+
+/* Same as pmct_print_header(), with a column for each derived metric */
+void pmct_print_header_with_metrics (FILE* fo, unsigned int nr_experiments,
+                                     unsigned int pmcmask,
+                                     unsigned int virtual_mask,
+                                     int extended_output,
+                                     int syswide,
+                                     pmct_metric_set_t* metrics)
 {
 	int i;
 	char* str[2]= {"pid","cpu"};
 	int index=syswide?1:0; /* To make sure it is in the allowed range */
 
-	if (!extended_output && nr_experiments<2) {
+	if (!(extended_output & PMCT_OUTPUT_EXTENDED) && nr_experiments<2) {
 		/* Legacy mode */
 		fprintf(fo, "%7s %6s %10s", "nsample", str[index], "event");
 	} else {
@@ -424,22 +742,57 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
 		fprintf(fo, "%7s %6s %8s %5s %10s", "nsample", str[index], "coretype","expid","event");
 	}
 
-	for(i=0; i<MAX_PERFORMANCE_COUNTERS; i++) {
-		if(pmcmask & (0x1<<i)) {
-			fprintf(fo, " %12s%i","pmc",i);
+	if (!(metrics && (extended_output & PMCT_OUTPUT_METRICS_ONLY))) {
+		for(i=0; i<MAX_PERFORMANCE_COUNTERS; i++) {
+			if(pmcmask & (0x1<<i)) {
+				fprintf(fo, " %12s%i","pmc",i);
+			}
 		}
-	}
 
-	for(i=0; (virtual_mask) && (i<MAX_VIRTUAL_COUNTERS); i++) {
-		if(virtual_mask & (0x1<<i)) {
-			fprintf(fo, " %12s%i","virt",i);
+		for(i=0; (virtual_mask) && (i<MAX_VIRTUAL_COUNTERS); i++) {
+			if(virtual_mask & (0x1<<i)) {
+				fprintf(fo, " %12s%i","virt",i);
+			}
 		}
 	}
 
+	for(i=0; metrics && i<metrics->nr_metrics; i++)
+		fprintf(fo, " %13s",metrics->metrics[i].name);
+
 	fprintf(fo, "\n");
 
 }
 
+/* Columns of a sample row are 14 characters wide unless a value does not fit */
+#define SAMPLE_COLUMN_SIZE	32
+
+/*
+ * Print a column of a sample row into a buffer of "size" bytes (size>0).
+ * Returns the number of characters actually written, so that the
+ * output is truncated rather than overflowing the buffer.
+ */
+static int print_column(char* dst, size_t size, const char* fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap,fmt);
+	n=vsnprintf(dst,size,fmt,ap);
+	va_end(ap);
+
+	if (n<0)
+		return 0;
+	return (size_t)n<size?n:size-1;
+}
+
+/* Print a count as a rate per second (or a dash if the time is unknown) */
+static int print_rate(char* dst, size_t size, uint64_t count, uint64_t time_ns)
+{
+	if (time_ns==0)
+		return print_column(dst,size,"%13s ","-");
+	return print_column(dst,size,"%13.0f ",(double)count*1e9/time_ns);
+}
+
 /*
  * Print a sample row in the "normalized" format for a table of
  * PMC and virtual-counter samples
@@ -449,27 +802,50 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
                         unsigned int virtual_mask,
                         unsigned int extended_output,
                         int nsample,
-                        pmc_sample_t* sample)
+                        pmc_sample_v2_t* sample)
 {
+	pmct_print_sample_with_metrics(fo,nr_experiments,pmcmask,virtual_mask,
+	                               extended_output,nsample,sample,NULL);
+}
 
-	char line_out[256]; /* Allocating memory for output */
+/* Same as pmct_print_sample(), followed by the values of the derived metrics */
+void pmct_print_sample_with_metrics (FILE* fo, unsigned int nr_experiments,
+                                     unsigned int pmcmask,
+                                     unsigned int virtual_mask,
+                                     unsigned int extended_output,
+                                     int nsample,
+                                     pmc_sample_v2_t* sample,
+                                     pmct_metric_set_t* metrics)
+{
+
+	char line_out[(MAX_PERFORMANCE_COUNTERS+MAX_VIRTUAL_COUNTERS+PMCT_MAX_METRICS)*SAMPLE_COLUMN_SIZE];
 	char* dst=line_out;
+	char* end=line_out+sizeof(line_out);
 	int j,cnt=0;
 	unsigned int remaining_pmcmask=pmcmask;
 
+	/* Only the metrics are shown */
+	if (metrics && (extended_output & PMCT_OUTPUT_METRICS_ONLY))
+		remaining_pmcmask=virtual_mask=0;
+
+	line_out[0]='\0';
+
 	/* Max supported counters... */
 	for(j=0; (j<MAX_PERFORMANCE_COUNTERS) && (remaining_pmcmask); j++) {
 		if(sample->pmc_mask & (0x1<<j)) {
+			if (extended_output & PMCT_OUTPUT_RATES)
+				dst+=print_rate(dst,end-dst,sample->pmc_counts[cnt++],sample->time_enabled);
+			else
 #if defined(__i386__) || defined(__arm__)
-			dst+=sprintf(dst,"%13llu ",sample->pmc_counts[cnt++]);
+				dst+=print_column(dst,end-dst,"%13llu ",sample->pmc_counts[cnt++]);
 #else
-			dst+=sprintf(dst,"%13lu ",sample->pmc_counts[cnt++]);
+				dst+=print_column(dst,end-dst,"%13lu ",sample->pmc_counts[cnt++]);
 #endif
 			remaining_pmcmask&=~(0x1<<j);
 		}
 		/* Print dash only if the particular pmcmask contains the pmc*/
 		else if (remaining_pmcmask & (0x1<<j)) {
-			dst+=sprintf(dst,"%13s ","-");
+			dst+=print_column(dst,end-dst,"%13s ","-");
 		}
 	}
 
@@ -477,18 +853,28 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
 	cnt=0;
 	for(j=0; (j<MAX_VIRTUAL_COUNTERS) && (remaining_pmcmask) ; j++) {
 		if(sample->virt_mask & (0x1<<j)) {
+			if (extended_output & PMCT_OUTPUT_RATES)
+				dst+=print_rate(dst,end-dst,sample->virtual_counts[cnt++],sample->time_enabled);
+			else
 #if defined(__i386__) || defined(__arm__)
-			dst+=sprintf(dst,"%13llu ",sample->virtual_counts[cnt++]);
+				dst+=print_column(dst,end-dst,"%13llu ",sample->virtual_counts[cnt++]);
 #else
-			dst+=sprintf(dst,"%13lu ",sample->virtual_counts[cnt++]);
+				dst+=print_column(dst,end-dst,"%13lu ",sample->virtual_counts[cnt++]);
 #endif
 			remaining_pmcmask&=~(0x1<<j);
 		} else if (remaining_pmcmask & (0x1<<j)) {
-			dst+=sprintf(dst,"%13s ","-");
+			dst+=print_column(dst,end-dst,"%13s ","-");
 		}
 	}
 
-	if (!extended_output && nr_experiments<2) {
+	for(j=0; metrics && j<metrics->nr_metrics; j++) {
+		if (metrics->valid & (0x1<<(j+1)))
+			dst+=print_column(dst,end-dst,"%13.3f ",(double)metrics->values[j+1]/PMC_EXPR_ONE);
+		else
+			dst+=print_column(dst,end-dst,"%13s ","-");
+	}
+
+	if (!(extended_output & PMCT_OUTPUT_EXTENDED) && nr_experiments<2) {
 		/* Legacy mode */
 		fprintf(fo, "%7d %6d %10s %s\n", nsample, sample->pid, sample_type_to_str[sample->type], line_out);
 	} else {
@@ -506,8 +892,8 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
                              unsigned int pmcmask,
                              unsigned int virtual_mask,
                              unsigned char copy_metainfo,
-                             pmc_sample_t* sample,
-                             pmc_sample_t* accum)
+                             pmc_sample_v2_t* sample,
+                             pmc_sample_v2_t* accum)
 {
 	int j,cnt=0;
 	unsigned int remaining_pmcmask=pmcmask;
@@ -517,16 +903,23 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
 		accum->coretype=sample->coretype;
 		accum->exp_idx=sample->exp_idx;
 		accum->pid=sample->pid;
+		accum->tgid=sample->tgid;
 		accum->pmc_mask=sample->pmc_mask;
 		accum->nr_counts=sample->nr_counts;
 		accum->virt_mask=sample->virt_mask;
 		accum->nr_virt_counts=sample->nr_virt_counts;
 	}
 
+	/* The accumulated sample spans up to the most recent one */
+	if (sample->timestamp>accum->timestamp)
+		accum->timestamp=sample->timestamp;
+	accum->time_enabled+=sample->time_enabled;
+	accum->time_running+=sample->time_running;
+
 	/* Max supported counters... */
 	for(j=0; (j<MAX_PERFORMANCE_COUNTERS) && (remaining_pmcmask); j++) {
 		if(sample->pmc_mask & (0x1<<j)) {
-			accum->pmc_counts[cnt]+=sample->pmc_counts[cnt]*nr_experiments; /* Multiplex info */
+			accum->pmc_counts[cnt]+=sample->pmc_counts[cnt]; /* Scaled afterwards */
 			remaining_pmcmask&=~(0x1<<j);
 			cnt++;
 		}
@@ -544,6 +937,48 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
 
 }
 
+/*
+ * Extrapolate the PMC counts accumulated for the various
+ * event sets of a thread (or CPU) to the whole monitoring time
+ */
+void pmct_scale_accumulated_samples (unsigned int nr_experiments,
+                                     unsigned int exp_mask,
+                                     pmc_sample_v2_t* accum)
+{
+	uint64_t total_enabled=0;
+	pmc_sample_v2_t* cur;
+	double factor;
+	int i,j;
+
+	for (i=0; i<nr_experiments; i++)
+		if (exp_mask & (1U<<i))
+			total_enabled+=accum[i].time_enabled;
+
+	for (i=0; i<nr_experiments; i++) {
+		if (!(exp_mask & (1U<<i)))
+			continue;
+
+		cur=&accum[i];
+
+		if (total_enabled==0)
+			/* No timing information: assume all sets ran for the same time */
+			factor=nr_experiments;
+		else if (cur->time_running==0)
+			/* The event set never got to count */
+			factor=0;
+		else
+			factor=(double)total_enabled/cur->time_running;
+
+		for (j=0; j<cur->nr_counts && j<MAX_PERFORMANCE_COUNTERS; j++)
+			cur->pmc_counts[j]=(uint64_t)(cur->pmc_counts[j]*factor+0.5);
+
+		/* The counts now cover the time the thread was monitored */
+		cur->time_enabled=total_enabled;
+		if (cur->time_running)
+			cur->time_running=total_enabled;
+	}
+}
+
 /*
  * Obtain a file descriptor of the special file exported by
  * PMCTrack's kernel module file to retrieve performance samples
@@ -610,6 +1045,52 @@ int pmct_detach_process (pid_t pid)
 	return 0;
 }
 
+/*
+ * Attach all the threads of a process to the monitor in one go
+ */
+int pmct_attach_thread_group (pid_t pid)
+{
+	char str[30];
+	int siz;
+	int ret=0;
+
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+	siz=sprintf(str, "tgid_attach %d", pid);
+
+	if(write(fd, str, siz+1) < 0)
+		ret=-1;
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Detach all the threads of a process from monitor
+ */
+int pmct_detach_thread_group (pid_t pid)
+{
+	char str[30];
+	int siz;
+	int ret=0;
+
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+	siz=sprintf(str, "tgid_detach %d", pid);
+
+	if(write(fd, str, siz+1) < 0)
+		ret=-1;
+
+	close(fd);
+	return ret;
+}
+
 /*
  * Retrieve performance samples from the special file exported by
  * PMCTrack's kernel module
@@ -626,9 +1107,7 @@ int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples)
 		return -1;
 	}
 
-	/* Reset read counter */
-	lseek(fd, 0, SEEK_SET);
-
+	/* No need to rewind: the kernel module ignores the file offset */
 	nr_samples=nbytes/sizeof(pmc_sample_t);
 	return nr_samples;
 }
@@ -986,7 +1465,7 @@ void pmctrack_print_counts(pmctrack_desc_t* desc, FILE* fo, int extended_output)
 {
 
 	int i=0;
-	pmc_sample_t* cur;
+	pmc_sample_v2_t cur;
 	int syswide=desc->flags & PMCT_FLAG_SYSWIDE;
 
 	// print event-to-counter mappings
@@ -1007,9 +1486,9 @@ void pmctrack_print_counts(pmctrack_desc_t* desc, FILE* fo, int extended_output)
 
 	// printing samples
 	for (i=0; i<desc->nr_samples; i++) {
-		cur = &desc->samples[i];
+		pmc_sample_from_legacy(&desc->samples[i],&cur);
 
-		pmct_print_sample (fo,desc->nr_experiments, desc->pmcmask, desc->virtual_mask, extended_output, i+1, cur);
+		pmct_print_sample (fo,desc->nr_experiments, desc->pmcmask, desc->virtual_mask, extended_output, i+1, &cur);
 	}
 }
 
@@ -1050,6 +1529,69 @@ int pmct_set_kernel_buffer_size(unsigned int nr_bytes)
 	return 0;
 }
 
+/*
+ * Select what the kernel does when the buffer that stores
+ * PMC and virtual counter values fills up
+ */
+int pmct_set_overflow_policy(const char* policy)
+{
+	int len=0;
+	char buf[128];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=snprintf(buf,sizeof(buf),"buffer_overflow_t %s\n",policy);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Unsupported buffer overflow policy: %s\n",policy);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Set up when the kernel wakes up the monitor process
+ * as samples become available
+ */
+int pmct_set_wakeup_watermarks(unsigned int nr_samples, unsigned int fill_percent, unsigned int latency_ms)
+{
+	int i=0;
+	int len=0;
+	char buf[3][64];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	sprintf(buf[0],"wakeup_samples %u\n",nr_samples);
+	sprintf(buf[1],"wakeup_fill %u\n",fill_percent);
+	sprintf(buf[2],"wakeup_latency %u\n",latency_ms);
+
+	/* One setting per write */
+	for (i=0; i<3; i++) {
+		len=write(fd,buf[i],strlen(buf[i]));
+
+		if(len <= 0) {
+			warnx("Write error in %s\n",pmc_config_entry);
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
 /*
  * Request a memory region shared between kernel and user space to
  * enable efficient communication between the monitor process and
@@ -1089,3 +1631,261 @@ int pmctrack_get_event_mapping( pmctrack_desc_t* desc,
 
 	return 0;
 }
+
+/* Return the data area of a per-CPU ring */
+static inline char* pmct_ring_data(pmct_sample_rings_t* rings, unsigned int ring)
+{
+	pmc_ring_control_t* control=rings->control;
+
+	return (char*)control+control->data_offset+ring*control->ring_stride;
+}
+
+/*
+ * Map the per-CPU sample rings associated with the monitor process.
+ * The size of the mapping is obtained from the header found in the
+ * first page of the control area.
+ */
+pmct_sample_rings_t* pmct_map_sample_rings(int monitor_fd)
+{
+	long page_size=sysconf(_SC_PAGESIZE);
+	off_t offset=(off_t)page_size*PMC_RING_MMAP_PGOFF;
+	pmc_ring_control_t* control;
+	pmct_sample_rings_t* rings;
+	size_t mmap_size;
+
+	/* Peek at the header */
+	control=mmap(NULL,page_size,PROT_READ,MAP_SHARED,monitor_fd,offset);
+
+	if (control==MAP_FAILED)
+		return NULL;
+
+	if (control->version!=PMC_RING_VERSION || control->max_record_size>PMC_MAX_RECORD_SIZE) {
+		warnx("Unsupported layout of the sample rings\n");
+		munmap(control,page_size);
+		return NULL;
+	}
+
+	mmap_size=control->mmap_size;
+	munmap(control,page_size);
+
+	/* Map the whole thing */
+	control=mmap(NULL,mmap_size,PROT_READ|PROT_WRITE,MAP_SHARED,monitor_fd,offset);
+
+	if (control==MAP_FAILED)
+		return NULL;
+
+	if ((rings=malloc(sizeof(pmct_sample_rings_t)))==NULL) {
+		munmap(control,mmap_size);
+		return NULL;
+	}
+
+	if ((rings->schemas=calloc(control->nr_rings,sizeof(pmc_schema_table_t)))==NULL) {
+		munmap(control,mmap_size);
+		free(rings);
+		return NULL;
+	}
+
+	rings->control=control;
+	rings->mmap_size=mmap_size;
+	rings->cur_ring=0;
+	rings->nr_lost_reported=0;
+	rings->nr_discarded=0;
+	return rings;
+}
+
+/* Unmap sample rings obtained with pmct_map_sample_rings() */
+void pmct_unmap_sample_rings(pmct_sample_rings_t* rings)
+{
+	munmap(rings->control,rings->mmap_size);
+	free(rings->schemas);
+	free(rings);
+}
+
+/*
+ * Decode records from a ring into 'samples' (up to 'max_samples')
+ * and hand the space back to the kernel.
+ *
+ * If the kernel overwrites old records when the ring fills up, it may
+ * discard the record being read, so each record is copied first and
+ * then claimed by advancing the tail with a compare-and-swap.
+ *
+ * Returns the number of samples retrieved.
+ */
+static int pmct_ring_decode(pmct_sample_rings_t* rings, unsigned int ring,
+                            pmc_sample_v2_t* samples, unsigned int max_samples)
+{
+	pmc_ring_control_t* control=rings->control;
+	pmc_ring_index_t* idx=&control->index[ring];
+	pmc_schema_table_t* schemas=&rings->schemas[ring];
+	char* data=pmct_ring_data(rings,ring);
+	unsigned int mask=control->data_size-1;
+	int overwrite=(control->overflow_policy==PMC_OVERFLOW_OVERWRITE);
+	pmc_record_header_t* header;
+	unsigned int nr_samples=0;
+	uint32_t head,tail,size;
+	union {
+		pmc_record_header_t header;
+		char raw[PMC_MAX_RECORD_SIZE];
+	} rec;
+
+	head=idx->head;
+	/* Read the head before the records it covers */
+	__sync_synchronize();
+	tail=idx->tail;
+
+	while (nr_samples<max_samples) {
+		/* The kernel may have overwritten everything up to 'head' */
+		if (tail==head || (overwrite && (int32_t)(head-tail)<0))
+			break;
+
+		header=(pmc_record_header_t*)(data+(tail & mask));
+		size=0;
+
+		if (head-tail<=control->data_size && !(tail & (PMC_RECORD_ALIGN-1)))
+			size=header->size;
+
+		if (size<sizeof(pmc_record_header_t) || size>head-tail ||
+		    size>control->data_size-(tail & mask) || (size & (PMC_RECORD_ALIGN-1))) {
+			/* Overwritten while we were reading it? */
+			if (overwrite && tail!=idx->tail) {
+				tail=idx->tail;
+				continue;
+			}
+			warnx("Corrupted record found in sample ring %u\n",ring);
+			if (overwrite)
+				__sync_bool_compare_and_swap(&idx->tail,tail,head);
+			tail=head;
+			break;
+		}
+
+		/* Only the header is needed for padding (or oversized) records */
+		memcpy(&rec,header,size>sizeof(rec)?sizeof(pmc_record_header_t):size);
+
+		if (overwrite && !__sync_bool_compare_and_swap(&idx->tail,tail,tail+size)) {
+			tail=idx->tail;
+			continue;
+		}
+
+		tail+=size;
+
+		if (size>sizeof(rec))
+			continue;
+
+		switch (rec.header.type) {
+		case PMC_RECORD_SCHEMA:
+			pmc_schema_table_update(schemas,(pmc_schema_record_t*)&rec);
+			break;
+		case PMC_RECORD_SAMPLE:
+			if (!pmc_sample_record_decode((pmc_sample_record_t*)&rec,schemas,&samples[nr_samples]))
+				nr_samples++;
+			else
+				rings->nr_discarded++;
+			break;
+		case PMC_RECORD_LOST:
+			rings->nr_lost_reported+=((pmc_lost_record_t*)&rec)->nr_lost;
+			break;
+		case PMC_RECORD_CPU_STATE:
+			pmc_cpu_state_record_decode((pmc_cpu_state_record_t*)&rec,&samples[nr_samples++]);
+			break;
+		default:
+			/* Padding or unknown record: skip it */
+			break;
+		}
+	}
+
+	if (!overwrite) {
+		/* Make sure we are done with the records before releasing them */
+		__sync_synchronize();
+		idx->tail=tail;
+	}
+
+	return nr_samples;
+}
+
+/*
+ * Order samples by timestamp, breaking ties by the pid field
+ * (thread ID, or CPU in system-wide mode)
+ */
+static int compare_samples_by_timestamp(const void* a, const void* b)
+{
+	const pmc_sample_v2_t* sa=(const pmc_sample_v2_t*)a;
+	const pmc_sample_v2_t* sb=(const pmc_sample_v2_t*)b;
+
+	if (sa->timestamp!=sb->timestamp)
+		return sa->timestamp<sb->timestamp?-1:1;
+	return sa->pid-sb->pid;
+}
+
+/*
+ * Retrieve samples from the per-CPU rings
+ * (Round-robin traversal of the per-CPU rings).
+ * Samples gathered from different rings are merged by timestamp.
+ * Note that the order only holds within the samples returned by a
+ * single invocation: a later batch may contain older samples.
+ */
+int pmct_ring_read_samples(int fd, pmct_sample_rings_t* rings, pmc_sample_v2_t* samples, unsigned int max_samples)
+{
+	pmc_ring_control_t* control=rings->control;
+	pmc_sample_t dummy;
+	unsigned int nr_samples=0;
+	unsigned int nr_rings_read=0;
+	int nr_decoded;
+	int i;
+	int nbytes;
+
+	while (1) {
+		for (i=0; i<control->nr_rings && nr_samples<max_samples; i++) {
+			nr_decoded=pmct_ring_decode(rings,rings->cur_ring,&samples[nr_samples],max_samples-nr_samples);
+			if (nr_decoded>0)
+				nr_rings_read++;
+			nr_samples+=nr_decoded;
+			rings->cur_ring=(rings->cur_ring+1)%control->nr_rings;
+		}
+
+		if (nr_samples>0) {
+			/* Each ring is already sorted */
+			if (nr_rings_read>1)
+				qsort(samples,nr_samples,sizeof(pmc_sample_v2_t),compare_samples_by_timestamp);
+			return nr_samples;
+		}
+
+		/* No samples: block in the kernel until they are available */
+		if((nbytes = read(fd, &dummy, sizeof(pmc_sample_t))) < 0) {
+			if (errno!=EINTR)
+				warnx("Can't read from %s\n",pmc_monitor_entry);
+			return -1;
+		}
+
+		/* EOF */
+		if (nbytes==0)
+			return 0;
+	}
+}
+
+/* Retrieve the number of samples lost or deferred so far because the rings filled up */
+void pmct_ring_get_losses(pmct_sample_rings_t* rings, unsigned long* nr_lost, unsigned long* nr_throttled)
+{
+	pmc_ring_control_t* control=rings->control;
+	int i;
+
+	(*nr_lost)=rings->nr_discarded;
+	(*nr_throttled)=0;
+
+	for (i=0; i<control->nr_rings; i++) {
+		(*nr_lost)+=control->index[i].nr_lost;
+		(*nr_throttled)+=control->index[i].nr_throttled;
+	}
+}
+
+/* Returns a non-zero value if the rings hold unread records */
+int pmct_ring_has_samples(pmct_sample_rings_t* rings)
+{
+	pmc_ring_control_t* control=rings->control;
+	int i;
+
+	for (i=0; i<control->nr_rings; i++)
+		if (control->index[i].head!=control->index[i].tail)
+			return 1;
+
+	return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * metrics.c
+ *
+ * Derived metrics (e.g., IPC or bandwidth) computed from the PMC and
+ * virtual-counter samples. Metric definitions are compiled once
+ * with the expression compiler of PMCTrack's kernel module (pmc_expr.c)
+ * and evaluated in fixed point for every sample.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include "pmctrack_internal.h"
+
+#define MAX_METRIC_LINE	(PMCT_MAX_METRIC_NAME+PMC_EXPR_MAX_LENGTH)
+
+/* Index of "secs" in the values array (metric i is stored at i+1) */
+#define SECS_VALUE	0
+
+/* Slots of the named events follow those of pmcN and virtN */
+#define FIRST_NAMED_SLOT	(MAX_PERFORMANCE_COUNTERS+MAX_VIRTUAL_COUNTERS)
+
+/* Context for the name-resolution callback */
+typedef struct {
+	pmct_metric_set_t* set;
+	unsigned int cur_metric;	/* Only previous metrics can be referenced */
+} lookup_ctx_t;
+
+void pmct_metrics_init(pmct_metric_set_t* set)
+{
+	memset(set,0,sizeof(pmct_metric_set_t));
+	memset(set->event_slot,-1,sizeof(set->event_slot));
+}
+
+void pmct_metrics_free(pmct_metric_set_t* set)
+{
+	int i;
+
+	for (i=0; i<set->nr_metrics; i++) {
+		if (set->metrics[i].prog)
+			pmc_expr_free(set->metrics[i].prog);
+		free(set->metrics[i].definition);
+	}
+	set->nr_metrics=0;
+}
+
+static int is_valid_name(const char* name)
+{
+	const char* p=name;
+
+	if (!((*p>='a' && *p<='z') || (*p>='A' && *p<='Z') || *p=='_'))
+		return 0;
+
+	for (p++; *p; p++)
+		if (!((*p>='a' && *p<='z') || (*p>='A' && *p<='Z') || *p=='_' || (*p>='0' && *p<='9')))
+			return 0;
+	return 1;
+}
+
+/* Remove leading and trailing blanks (in place) */
+static char* strip_blanks(char* str)
+{
+	char* end;
+
+	while (*str==' ' || *str=='\t')
+		str++;
+
+	end=str+strlen(str);
+	while (end>str && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\n' || end[-1]=='\r'))
+		end--;
+	*end='\0';
+	return str;
+}
+
+/* Add a single definition (<name>=<expression>) */
+static int add_metric(pmct_metric_set_t* set, char* definition)
+{
+	pmct_metric_t* metric;
+	char* name;
+	char* expr;
+	char* eq;
+	int i;
+
+	if ((eq=strchr(definition,'='))==NULL) {
+		warnx("Wrong format for metric definition: %s (expected <name>=<expression>)",definition);
+		return 1;
+	}
+
+	*eq='\0';
+	name=strip_blanks(definition);
+	expr=strip_blanks(eq+1);
+
+	if (!is_valid_name(name) || strlen(name)>=PMCT_MAX_METRIC_NAME || strcmp(name,"secs")==0) {
+		warnx("Invalid metric name: %s",name);
+		return 1;
+	}
+
+	if (expr[0]=='\0') {
+		warnx("Empty expression for metric %s",name);
+		return 1;
+	}
+
+	for (i=0; i<set->nr_metrics; i++) {
+		if (strcmp(set->metrics[i].name,name)==0) {
+			warnx("Metric %s defined twice",name);
+			return 1;
+		}
+	}
+
+	if (set->nr_metrics>=PMCT_MAX_METRICS) {
+		warnx("Too many metrics (max %d)",PMCT_MAX_METRICS);
+		return 1;
+	}
+
+	metric=&set->metrics[set->nr_metrics];
+	strcpy(metric->name,name);
+
+	if ((metric->definition=strdup(expr))==NULL) {
+		warnx("Can't allocate memory for metric %s",name);
+		return 1;
+	}
+
+	metric->prog=NULL;
+	set->nr_metrics++;
+	return 0;
+}
+
+int pmct_metrics_add(pmct_metric_set_t* set, const char* definitions)
+{
+	char* copy=strdup(definitions);
+	char* str;
+	char* def;
+	int ret=0;
+
+	if (!copy)
+		return 1;
+
+	str=copy;
+
+	while ((def=strsep(&str,";"))!=NULL && !ret) {
+		def=strip_blanks(def);
+
+		if (def[0]!='\0')
+			ret=add_metric(set,def);
+	}
+
+	free(copy);
+	return ret;
+}
+
+int pmct_metrics_load_file(pmct_metric_set_t* set, const char* path)
+{
+	FILE* fin=fopen(path,"r");
+	char line[MAX_METRIC_LINE];
+	char* def;
+	int ret=0;
+
+	if (!fin) {
+		warnx("Can't open metrics file %s",path);
+		return 1;
+	}
+
+	while (!ret && fgets(line,MAX_METRIC_LINE,fin)) {
+		def=strip_blanks(line);
+
+		if (def[0]!='\0' && def[0]!='#')
+			ret=pmct_metrics_add(set,def);
+	}
+
+	fclose(fin);
+	return ret;
+}
+
+/* Resolve the names found in a metric expression */
+static int lookup_name(const char* name, void* data, pmc_expr_opcode_t* opcode)
+{
+	lookup_ctx_t* ctx=data;
+	pmct_metric_set_t* set=ctx->set;
+	virtual_counter_info_t* vci;
+	int i;
+
+	if (strcmp(name,"secs")==0)
+		return SECS_VALUE;
+
+	/* Previous metrics */
+	for (i=0; i<ctx->cur_metric; i++)
+		if (strcmp(name,set->metrics[i].name)==0)
+			return i+1;
+
+	*opcode=PMC_EXPR_PUSH_EVENT;
+
+	/* Raw counters */
+	if (strncmp(name,"pmc",3)==0 && name[3]>='0' && name[3]<='9') {
+		i=atoi(name+3);
+		return i<MAX_PERFORMANCE_COUNTERS?i:-1;
+	}
+
+	if (strncmp(name,"virt",4)==0 && name[4]>='0' && name[4]<='9') {
+		i=atoi(name+4);
+		return i<MAX_VIRTUAL_COUNTERS?MAX_PERFORMANCE_COUNTERS+i:-1;
+	}
+
+	/* Events of the mnemonic-based configuration */
+	for (i=FIRST_NAMED_SLOT; i<set->nr_slots; i++)
+		if (strcmp(name,set->slot_names[i])==0)
+			return i;
+
+	/* Virtual counter mnemonics */
+	if ((vci=pmct_get_virtual_counter_info())) {
+		for (i=0; i<vci->nr_virtual_counters && i<MAX_VIRTUAL_COUNTERS; i++)
+			if (vci->name[i] && strcmp(name,vci->name[i])==0)
+				return MAX_PERFORMANCE_COUNTERS+i;
+	}
+
+	return -1;
+}
+
+/* Assign a slot to each distinct event name found in the mapping */
+static int assign_event_slots(pmct_metric_set_t* set, counter_mapping_t* mapping)
+{
+	int i,j,k;
+	char* name;
+
+	set->nr_slots=FIRST_NAMED_SLOT;
+	memset(set->event_slot,-1,sizeof(set->event_slot));
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS; i++) {
+		for (j=0; j<MAX_COUNTER_CONFIGS; j++) {
+			if (!(mapping[i].experiment_mask & (1U<<j)) || !(name=mapping[i].events[j]))
+				continue;
+
+			for (k=FIRST_NAMED_SLOT; k<set->nr_slots; k++)
+				if (strcmp(name,set->slot_names[k])==0)
+					break;
+
+			if (k==set->nr_slots) {
+				if (set->nr_slots==PMCT_METRIC_MAX_SLOTS) {
+					warnx("Too many distinct events for derived metrics (max %d)",
+					      PMCT_METRIC_MAX_SLOTS-FIRST_NAMED_SLOT);
+					return 1;
+				}
+				set->slot_names[set->nr_slots++]=name;
+			}
+
+			set->event_slot[i][j]=k;
+		}
+	}
+
+	return 0;
+}
+
+int pmct_metrics_compile(pmct_metric_set_t* set, counter_mapping_t* mapping)
+{
+	pmct_metric_t* metric;
+	lookup_ctx_t ctx;
+	int i,j,ret;
+
+	if (assign_event_slots(set,mapping))
+		return 1;
+
+	ctx.set=set;
+
+	for (i=0; i<set->nr_metrics; i++) {
+		metric=&set->metrics[i];
+		ctx.cur_metric=i;
+
+		if ((ret=pmc_expr_compile(metric->definition,lookup_name,&ctx,&metric->prog))) {
+			if (ret==-EINVAL)
+				warnx("Syntax error or unknown event in metric %s: %s",metric->name,metric->definition);
+			else
+				warnx("Can't compile metric %s: %s",metric->name,strerror(-ret));
+			metric->prog=NULL;
+			return 1;
+		}
+
+		/* Find out what has to be available to evaluate the metric */
+		metric->slot_mask=0;
+		metric->value_mask=0;
+
+		for (j=0; j<metric->prog->nr_insns; j++) {
+			pmc_expr_insn_t* insn=&metric->prog->code[j];
+
+			if (insn->opcode==PMC_EXPR_PUSH_EVENT) {
+				/* "evN" references must fall within the slots in use */
+				if (insn->operand>=set->nr_slots) {
+					warnx("Unknown event in metric %s: %s",metric->name,metric->definition);
+					return 1;
+				}
+				metric->slot_mask|=1ULL<<insn->operand;
+			} else if (insn->opcode==PMC_EXPR_PUSH_METRIC) {
+				metric->value_mask|=1U<<insn->operand;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Make the counts of a sample available to the metrics */
+static void load_sample(pmct_metric_set_t* set, pmc_sample_v2_t* sample)
+{
+	double factor=0;
+	uint64_t count;
+	int i,slot,cnt=0;
+	int exp_idx=sample->exp_idx;
+
+	/* The event set never got to count */
+	if (sample->time_running==0 && sample->time_enabled!=0)
+		return;
+
+	/* Multiplexed event set: extrapolate to the whole interval */
+	if (sample->time_running && sample->time_running<sample->time_enabled)
+		factor=(double)sample->time_enabled/sample->time_running;
+
+	if (exp_idx<0 || exp_idx>=MAX_COUNTER_CONFIGS)
+		exp_idx=-1;
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS && cnt<sample->nr_counts; i++) {
+		if (!(sample->pmc_mask & (0x1<<i)))
+			continue;
+
+		count=sample->pmc_counts[cnt++];
+		if (factor)
+			count=(uint64_t)(count*factor+0.5);
+
+		set->hw_events[i]=count;
+		set->present|=1ULL<<i;
+
+		if (exp_idx>=0 && (slot=set->event_slot[i][exp_idx])>=0) {
+			set->hw_events[slot]=count;
+			set->present|=1ULL<<slot;
+		}
+	}
+
+	cnt=0;
+	for (i=0; i<MAX_VIRTUAL_COUNTERS && cnt<sample->nr_virt_counts; i++) {
+		if (sample->virt_mask & (0x1<<i)) {
+			set->hw_events[MAX_PERFORMANCE_COUNTERS+i]=sample->virtual_counts[cnt++];
+			set->present|=1ULL<<(MAX_PERFORMANCE_COUNTERS+i);
+		}
+	}
+}
+
+void pmct_metrics_eval(pmct_metric_set_t* set, pmc_sample_v2_t* samples,
+                       unsigned int nr_samples, unsigned int cur)
+{
+	pmct_metric_t* metric;
+	uint64_t time_enabled=samples[cur].time_enabled;
+	int i;
+
+	set->present=0;
+	set->valid=0;
+
+	/* The current sample goes last, so that pmcN refers to its counters */
+	for (i=0; i<nr_samples; i++)
+		if (i!=cur)
+			load_sample(set,&samples[i]);
+	load_sample(set,&samples[cur]);
+
+	if (time_enabled) {
+		set->values[SECS_VALUE]=(int64_t)(time_enabled*((double)PMC_EXPR_ONE/1e9));
+		set->valid|=1U<<SECS_VALUE;
+	}
+
+	for (i=0; i<set->nr_metrics; i++) {
+		metric=&set->metrics[i];
+
+		if (!metric->prog || (metric->slot_mask & ~set->present) ||
+		    (metric->value_mask & ~set->valid))
+			continue;
+
+		set->values[i+1]=pmc_expr_eval(metric->prog,set->hw_events,set->values,sizeof(int64_t));
+		set->valid|=1U<<(i+1);
+	}
+}
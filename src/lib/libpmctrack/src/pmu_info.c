@@ -39,6 +39,9 @@
 
 #define COMPLETE_EVENT_CFG_SIZE 100
 
+/* Reference events (":ref" flag) get cloned into every experiment */
+#define MAX_NR_EVENTS_CFG_EXPANDED (MAX_NR_EVENTS_CFG+MAX_COUNTER_CONFIGS)
+
 typedef struct {
 	int nr_counter;
 	int nr_exp;
@@ -46,6 +49,8 @@ typedef struct {
 	char code[CODE_HW_EVENT_SIZE];
 	pmc_property_t *properties[MAX_NR_PROPERTIES];
 	unsigned int nr_properties;
+	unsigned int pmc_mask;	/* Counters the event can be assigned to */
+	int reference;		/* The event must be included in every experiment */
 } event_cfg_t;
 
 
@@ -174,12 +179,19 @@ static int parse_csv_file(pmu_info_t *pmu_info)
 		hw_subevent_t *hw_subevt = (hw_subevent_t *)malloc(sizeof(hw_subevent_t));
 		strcpy(hw_subevt->name, subevt_name);
 		hw_subevt->nr_properties = 0;
+		hw_subevt->pmc_mask = 0;
 
 		while((flag = strsep(&flags, ";")) != NULL) {
 			key = strsep(&flag, "=");
 			value = strsep(&flag, "=");
 			if(strcmp(key, "pmc") == 0) {
 				pmu_info->events[ind]->pmcn = atoi(value);
+			} else if(strcmp(key, "pmcs") == 0 && value) {
+				/*
+				 * The event can only be counted on some counters
+				 * (bit 0 is the first general-purpose counter)
+				 */
+				hw_subevt->pmc_mask = strtoul(value, NULL, 16) << pmu_info->nr_fixed_pmcs;
 			} else if(strncmp(key, "-", 1) != 0 && strcmp(key, "type") != 0) {
 				pmc_property_t *property = (pmc_property_t *)malloc(sizeof(pmc_property_t));
 				strncpy(property->key, key, NAME_KEY_PMC_PROPERTY_SIZE);
@@ -331,6 +343,213 @@ virtual_counter_info_t* pmct_get_virtual_counter_info(void)
 	return virtual_counter_info_gbl;
 }
 
+/*
+ * Event-to-counter assignment for pmct_parse_counter_string().
+ *
+ * Each (experiment, counter) pair is a slot, and an event can only take
+ * the slots of the counters in its pmc_mask. Given a number of experiments,
+ * a feasible assignment exists iff there is a matching that covers all
+ * the events in the bipartite graph events-slots. The number of experiments
+ * is increased until such a matching is found, so the result has the
+ * minimum number of experiments. Reference events are represented by one
+ * item per experiment, each of them restricted to the slots of that experiment.
+ *
+ * Items are matched in order (reference events first) and slots are tried
+ * in increasing (experiment, counter) order, so when all the events fit
+ * in a single experiment the result is the same as that of a first-fit
+ * assignment.
+ */
+typedef struct {
+	int event;	/* Index in the events_cfg array */
+	int exp;	/* Experiment the item is restricted to (-1 if none) */
+} pack_item_t;
+
+typedef struct {
+	pack_item_t* items;
+	int* slot_owner;	/* Item that holds each slot (-1 if free) */
+	char* visited;
+	event_cfg_t** events_cfg;
+	unsigned int nr_counters;
+	unsigned int nr_exps;
+} pack_state_t;
+
+/* Check whether an item can be assigned to a given slot */
+static inline int pack_slot_allowed(pack_state_t* st, pack_item_t* it, int slot)
+{
+	unsigned int exp=slot/st->nr_counters;
+	unsigned int counter=slot%st->nr_counters;
+
+	return (it->exp==-1 || it->exp==exp) &&
+	       (st->events_cfg[it->event]->pmc_mask & (0x1 << counter));
+}
+
+/*
+ * Augmenting path search (Kuhn's algorithm). Free slots are tried first,
+ * so that items already assigned are moved only if necessary.
+ */
+static int pack_try_item(pack_state_t* st, int item)
+{
+	pack_item_t* it=&st->items[item];
+	int nr_slots=st->nr_exps*st->nr_counters;
+	int slot;
+
+	for (slot=0; slot<nr_slots; slot++)
+		if (st->slot_owner[slot]==-1 && pack_slot_allowed(st,it,slot)) {
+			st->slot_owner[slot]=item;
+			return 1;
+		}
+
+	for (slot=0; slot<nr_slots; slot++) {
+		if (st->visited[slot] || !pack_slot_allowed(st,it,slot))
+			continue;
+
+		st->visited[slot]=1;
+
+		if (pack_try_item(st,st->slot_owner[slot])) {
+			st->slot_owner[slot]=item;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Clone an event configuration (reference events) */
+static event_cfg_t* clone_event_cfg(event_cfg_t* evt_cfg)
+{
+	event_cfg_t* clone=malloc(sizeof(event_cfg_t));
+	int i;
+
+	memcpy(clone,evt_cfg,sizeof(event_cfg_t));
+
+	for (i=0; i<evt_cfg->nr_properties; i++) {
+		clone->properties[i]=malloc(sizeof(pmc_property_t));
+		memcpy(clone->properties[i],evt_cfg->properties[i],sizeof(pmc_property_t));
+	}
+	return clone;
+}
+
+/*
+ * Set the nr_counter and nr_exp fields of the events in events_cfg
+ * (using as few experiments as possible). Reference events are cloned,
+ * so *nr_events_cfg may increase.
+ *
+ * Returns 0 on success, and a non-zero value if the events cannot be
+ * assigned to counters.
+ */
+static int pack_events(event_cfg_t* events_cfg[],
+                       unsigned int* nr_events_cfg,
+                       unsigned int nr_counters,
+                       unsigned int* nr_experiments)
+{
+	pack_state_t st;
+	unsigned int nr_refs=0,nr_items,nr_slots;
+	unsigned int i,j,exp;
+	int item,slot,ret=1;
+
+	for (i=0; i<*nr_events_cfg; i++) {
+		if (!events_cfg[i]->pmc_mask) {
+			warnx("No counter available for event %s", events_cfg[i]->name);
+			return 1;
+		}
+		if (events_cfg[i]->reference)
+			nr_refs++;
+	}
+
+	nr_items=*nr_events_cfg+nr_refs*(MAX_COUNTER_CONFIGS-1);
+	nr_slots=MAX_COUNTER_CONFIGS*nr_counters;
+	st.items=malloc(sizeof(pack_item_t)*nr_items);
+	st.slot_owner=malloc(sizeof(int)*nr_slots);
+	st.visited=malloc(nr_slots);
+	st.events_cfg=events_cfg;
+	st.nr_counters=nr_counters;
+
+	if (!st.items || !st.slot_owner || !st.visited) {
+		warnx("Can't allocate memory for the event assignment");
+		goto free_resources;
+	}
+
+	for (st.nr_exps=1; st.nr_exps<=MAX_COUNTER_CONFIGS; st.nr_exps++) {
+		/* Items: one per experiment for reference events, then the rest */
+		nr_items=0;
+		for (i=0; i<*nr_events_cfg; i++)
+			if (events_cfg[i]->reference)
+				for (exp=0; exp<st.nr_exps; exp++) {
+					st.items[nr_items].event=i;
+					st.items[nr_items++].exp=exp;
+				}
+
+		/* Not enough room for the clones of reference events */
+		if (*nr_events_cfg-nr_refs+nr_items>MAX_NR_EVENTS_CFG_EXPANDED)
+			break;
+
+		for (i=0; i<*nr_events_cfg; i++)
+			if (!events_cfg[i]->reference) {
+				st.items[nr_items].event=i;
+				st.items[nr_items++].exp=-1;
+			}
+
+		for (slot=0; slot<st.nr_exps*nr_counters; slot++)
+			st.slot_owner[slot]=-1;
+
+		for (item=0; item<nr_items; item++) {
+			memset(st.visited,0,st.nr_exps*nr_counters);
+			if (!pack_try_item(&st,item))
+				break;
+		}
+
+		if (item==nr_items) {
+			ret=0;
+			break;
+		}
+	}
+
+	if (ret) {
+		warnx("Can't find a feasible assignment of events to counters");
+		goto free_resources;
+	}
+
+	/* Apply the assignment */
+	j=*nr_events_cfg;
+	for (slot=0; slot<st.nr_exps*nr_counters; slot++) {
+		event_cfg_t* evt_cfg;
+
+		if (st.slot_owner[slot]==-1)
+			continue;
+
+		item=st.slot_owner[slot];
+		evt_cfg=events_cfg[st.items[item].event];
+
+		/* The original reference event goes to the first experiment */
+		if (evt_cfg->reference && st.items[item].exp!=0) {
+			evt_cfg=clone_event_cfg(evt_cfg);
+			events_cfg[j++]=evt_cfg;
+		}
+
+		evt_cfg->nr_exp=slot/nr_counters;
+		evt_cfg->nr_counter=slot%nr_counters;
+	}
+
+	*nr_events_cfg=j;
+	*nr_experiments=st.nr_exps;
+free_resources:
+	free(st.items);
+	free(st.slot_owner);
+	free(st.visited);
+	return ret;
+}
+
+/* Free up the event configurations built by pmct_parse_counter_string() */
+static void free_events_cfg(event_cfg_t* events_cfg[], unsigned int nr_events_cfg)
+{
+	int i,j;
+
+	for (i=0; i<nr_events_cfg; i++) {
+		for (j=0; j<events_cfg[i]->nr_properties; j++)
+			free(events_cfg[i]->properties[j]);
+		free(events_cfg[i]);
+	}
+}
+
 /*
  * This function takes care of translating a mnemonic-based
  * PMC configuration string into the raw format.
@@ -347,48 +566,72 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
                               counter_mapping_t *mapping)
 {
 
-	event_cfg_t *events_cfg[MAX_NR_EVENTS_CFG];
+	event_cfg_t *events_cfg[MAX_NR_EVENTS_CFG_EXPANDED];
 	unsigned int nr_events_cfg = 0;
-	event_cfg_t *evt_cfg;
+	event_cfg_t *evt_cfg = NULL;
 	pmc_property_t *property_evt;
 	char row_cfg[ROW_CFG_SIZE];
 	char *row_ptr, *evt_row, *field_evt, *key_field_evt, *value_field_evt;
-	unsigned int nr_exps, actual_exp, highest_exp = 0;
+	unsigned int nr_exps;
 	unsigned int pmc_mask = 0;
 	int found, subfound, ind, subind, x;
 	pmu_info_t *pmu_info = pmct_get_pmu_info(nr_coretype,processor_model);
 	hw_subevent_t* cur_subevent;
 	int max_core_types=pmct_get_nr_pmus_model(processor_model);
 	int coretype=-1; /* In the event the coretype was forced in the high-level string */
-	char* orig_evt_row=NULL;
+	int weight=0; /* Multiplexing weight of the event sets (0 = default) */
+	unsigned int gp_mask;
+	int ret;
 
 	if(!pmu_info)
 		return -1; /* Error getting PMU information */
 
+	gp_mask=((1U<<pmu_info->nr_gp_pmcs)-1) << pmu_info->nr_fixed_pmcs;
+
 	strncpy(row_cfg, strcfg, ROW_CFG_SIZE);
 	row_ptr = row_cfg;
 
 	while((evt_row = strsep(&row_ptr, ","))) {
-		orig_evt_row=evt_row;
+		/* Flags that apply to the whole string */
+		if (sscanf(evt_row,"coretype=%d",&ind)==1) {
+			if (ind <0 || ind>=max_core_types) {
+				warnx("No such core type ID (%i)", ind);
+				ret = -2;
+				goto free_events;
+			}
+
+			coretype=ind;
+			continue;
+		} else if (sscanf(evt_row,"weight=%d",&ind)==1) {
+			if (ind <=0) {
+				warnx("Invalid multiplexing weight (%i)", ind);
+				ret = -2;
+				goto free_events;
+			}
+
+			weight=ind;
+			continue;
+		}
+
+		if (nr_events_cfg==MAX_NR_EVENTS_CFG) {
+			warnx("Too many events in a single string (max %d)", MAX_NR_EVENTS_CFG);
+			ret = -2;
+			goto free_events;
+		}
+
 		field_evt = strsep(&evt_row, ":");
 		evt_cfg = (event_cfg_t *)malloc(sizeof(event_cfg_t));
 		evt_cfg->nr_counter = -1;
 		evt_cfg->nr_exp = 0;
 		strncpy(evt_cfg->name, field_evt, COMPLETE_EVENT_CFG_SIZE);
 		evt_cfg->nr_properties = 0;
+		evt_cfg->pmc_mask = gp_mask;
+		evt_cfg->reference = 0;
 		key_field_evt = strsep(&field_evt, ".");
 		value_field_evt = strsep(&field_evt, ".");
 
-		/* Differences depending on whether the user specifies the "coretype" flag, an event code or mnemonic. */
-		if (sscanf(orig_evt_row,"coretype=%d",&ind)==1) {
-			if (ind <0 || ind>=max_core_types) {
-				warnx("No such core type ID (%i)", ind);
-				return -2;
-			}
-
-			coretype=ind;
-			continue; /* Skip parsing flags */
-		} else if(strncmp(key_field_evt, "0x", strlen("0x")) == 0) {
+		/* Differences depending on whether the user specifies an event code or mnemonic. */
+		if(strncmp(key_field_evt, "0x", strlen("0x")) == 0) {
 			strncpy(evt_cfg->code, key_field_evt, CODE_HW_EVENT_SIZE);
 		} else {
 			ind = subind = found = 0;
@@ -410,7 +653,8 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
 				}
 			if(!found || !subfound) {
 				warnx("Event '%s' or their subevent not found.", key_field_evt);
-				return -2;
+				ret = -2;
+				goto free_events;
 			}
 
 			/* Point to event and subevent ... */
@@ -428,21 +672,11 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
 				(evt_cfg->nr_properties)++;
 			}
 
-			if(pmu_info->events[ind]->pmcn > -1) {
-				/*
-				 * It is possible that in the experiment 0 is already used this fixed counter, should seek
-				 * appropriate experiment.
-				 */
-				x = 0;
-				for(ind = 0; ind < nr_events_cfg; ind++)
-					if(events_cfg[ind]->nr_counter == evt_cfg->nr_counter)
-						x++;
-				evt_cfg->nr_exp = x;
-				if(x > highest_exp)
-					highest_exp = x;
-				if(x == 0)
-					pmc_mask |= (0x1 << evt_cfg->nr_counter);
-			}
+			/* Counter constraints */
+			if(pmu_info->events[ind]->pmcn > -1)
+				evt_cfg->pmc_mask = 0x1 << pmu_info->events[ind]->pmcn;
+			else if(cur_subevent->pmc_mask)
+				evt_cfg->pmc_mask = cur_subevent->pmc_mask & gp_mask;
 		}
 
 		/* Process the specified flags on the user string for this event. */
@@ -450,25 +684,16 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
 			key_field_evt = strsep(&field_evt, "=");
 			value_field_evt = strsep(&field_evt, "=");
 			if(strcmp(key_field_evt, "pmc") == 0 && evt_cfg->nr_counter == -1) {
-				evt_cfg->nr_counter = atoi(value_field_evt);
-				if(evt_cfg->nr_counter < pmu_info->nr_fixed_pmcs || evt_cfg->nr_counter >= pmu_info->nr_gp_pmcs) {
-					warnx("Counter no.%i is not in the range of gp counters.", evt_cfg->nr_counter);
-					return -3;
+				x = value_field_evt ? atoi(value_field_evt) : -1;
+				if(x < 0 || x >= MAX_PERFORMANCE_COUNTERS || !(gp_mask & (0x1 << x))) {
+					warnx("Counter no.%i is not in the range of gp counters.", x);
+					ret = -3;
+					goto free_events;
 				}
-
-				/*
-				 * It is possible that in the experiment 0 is already used this gp counter, should seek
-				 * appropriate experiment.
-				 */
-				x = 0;
-				for(ind = 0; ind < nr_events_cfg; ind++)
-					if(events_cfg[ind]->nr_counter == evt_cfg->nr_counter)
-						x++;
-				evt_cfg->nr_exp = x;
-				if(x > highest_exp)
-					highest_exp = x;
-				if(x == 0)
-					pmc_mask |= (0x1 << evt_cfg->nr_counter);
+				/* The user pinned the event to this counter */
+				evt_cfg->pmc_mask = 0x1 << x;
+			} else if(strcmp(key_field_evt, "ref") == 0) {
+				evt_cfg->reference = 1;
 			} else if(strcmp(key_field_evt, "pmc") != 0) {
 				x = 0;
 				found = 0;
@@ -496,45 +721,18 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
 
 		events_cfg[nr_events_cfg] = evt_cfg;
 		nr_events_cfg++;
+		evt_cfg = NULL;
 	}
 
-	/* Assign a counter to those events which have none assigned. */
-	x = pmu_info->nr_fixed_pmcs;
-	found = 1;
-	ind = 0;
-	actual_exp = 0;
-	while(ind < nr_events_cfg) {
-		if(events_cfg[ind]->nr_counter == -1) {
-			while(x < (pmu_info->nr_fixed_pmcs + pmu_info->nr_gp_pmcs) && found) {
-				subind = found = 0;
-				while(subind < nr_events_cfg && !found) {
-					if(events_cfg[subind]->nr_exp == actual_exp && events_cfg[subind]->nr_counter == x)
-						found = 1;
-					subind++;
-				}
-				if(found) x++;
-			}
-			if(found) {
-				actual_exp++;
-				x = pmu_info->nr_fixed_pmcs;
-			} else {
-				events_cfg[ind]->nr_counter = x;
-				events_cfg[ind]->nr_exp = actual_exp;
-				if(actual_exp == 0)
-					pmc_mask |= (0x1 << x);
-				ind++;
-				found = 1;
-			}
-		} else {
-			ind++;
-		}
+	/* Assign a counter and an experiment to every event. */
+	if(pack_events(events_cfg, &nr_events_cfg,
+	               pmu_info->nr_fixed_pmcs + pmu_info->nr_gp_pmcs, &nr_exps)) {
+		ret = -4;
+		goto free_events;
 	}
 
-	if(highest_exp > actual_exp) {
-		nr_exps = highest_exp + 1;
-	} else {
-		nr_exps = actual_exp + 1;
-	}
+	for(ind = 0; ind < nr_events_cfg; ind++)
+		pmc_mask |= (0x1 << events_cfg[ind]->nr_counter);
 
 	/* Reserve into memory and generate the raw kernel strings. */
 	for(ind = 0; ind < nr_exps; ind++) {
@@ -553,7 +751,7 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
 		}
 		mapping[events_cfg[ind]->nr_counter].events[events_cfg[ind]->nr_exp] = (char *)malloc(COMPLETE_EVENT_CFG_SIZE*sizeof(char));
 		strncpy(mapping[events_cfg[ind]->nr_counter].events[events_cfg[ind]->nr_exp], events_cfg[ind]->name, COMPLETE_EVENT_CFG_SIZE);
-		mapping[events_cfg[ind]->nr_counter].experiment_mask |= (0x1 << events_cfg[ind]->nr_exp);
+		mapping[events_cfg[ind]->nr_counter].experiment_mask |= (0x1U << events_cfg[ind]->nr_exp);
 
 		/* Generate corresponding kernel string. */
 		if(raw_cfgs[events_cfg[ind]->nr_exp][0] != '\0')
@@ -583,17 +781,23 @@ int pmct_parse_counter_string(const char *strcfg, int nr_coretype,
 			strcat(raw_cfgs[ind],row_cfg);
 		}
 
-	/* Free the reserved memory on the execution of this function. */
-	for(ind = 0; ind < nr_events_cfg; ind++) {
-		for(subind = 0; subind < events_cfg[ind]->nr_properties; subind++)
-			free(events_cfg[ind]->properties[subind]);
-		free(events_cfg[ind]);
-	}
+	/* Same goes for the weight (it applies to all the sets derived from this string) */
+	if (weight)
+		for(ind = 0; ind < nr_exps; ind++) {
+			sprintf(row_cfg,",weight=%i",weight);
+			strcat(raw_cfgs[ind],row_cfg);
+		}
 
 	*nr_experiments = nr_exps;
 	*used_counter_mask = pmc_mask;
+	ret = 0;
 
-	return 0;
+free_events:
+	/* Free the reserved memory on the execution of this function. */
+	if (evt_cfg)
+		free_events_cfg(&evt_cfg, 1);
+	free_events_cfg(events_cfg, nr_events_cfg);
+	return ret;
 }
 
 /* Print a listing of the events supported by a given PMU */
@@ -651,13 +855,13 @@ void pmct_print_counter_mappings(FILE* fout,
 
 	for (i=0; i<MAX_PERFORMANCE_COUNTERS && pmask; i++) {
 		/* Counter used for this experiment */
-		if (pmask & 1<<i) {
+		if (pmask & 1U<<i) {
 			emask=mappings[i].experiment_mask;
 			fprintf(fout,"pmc%d=",i);
 			k=0;
 			/* Iterate through used experiments for the counter ... */
 			for (j=0; j<MAX_COUNTER_CONFIGS && emask; j++) {
-				if (emask & 1<<j) {
+				if (emask & 1U<<j) {
 					if (k>0)
 						fprintf(fout,","); //Separator
 					if (nr_experiments==1)
@@ -665,12 +869,12 @@ void pmct_print_counter_mappings(FILE* fout,
 					else
 						fprintf(fout,"%s(%d)",mappings[i].events[j],j);
 
-					emask &= ~(1<<j);
+					emask &= ~(1U<<j);
 					k++;
 				}
 			}//for_j
 			fprintf(fout,"\n");
-			pmask &= ~(1<<i);
+			pmask &= ~(1U<<i);
 		}//endif
 	}//for_i
 }
@@ -692,7 +896,7 @@ static int merge_counter_mappings(counter_mapping_t* mapping_dst,
 
 	while(pmask) {
 		/* Counter used for this experiment */
-		if (pmask & 1<<i) {
+		if (pmask & 1U<<i) {
 			cur_src=&mapping_src[i];
 			cur_dst=&mapping_dst[i];
 			emask=cur_src->experiment_mask;
@@ -700,21 +904,21 @@ static int merge_counter_mappings(counter_mapping_t* mapping_dst,
 
 			/* Iterate through used experiments for the counter ... */
 			for (j=0; j<MAX_COUNTER_CONFIGS && emask; j++) {
-				if (emask & 1<<j) {
-					if (cur_dst->experiment_mask & (1<<(j+base_exp_idx))) {
+				if (emask & 1U<<j) {
+					if (cur_dst->experiment_mask & (1U<<(j+base_exp_idx))) {
 						warnx("An existing experiment with the same ID was using the counter!!");
 						return 1;
 					}
-					cur_dst->experiment_mask|=(1<<(j+base_exp_idx));
+					cur_dst->experiment_mask|=(1U<<(j+base_exp_idx));
 					cur_dst->events[j+base_exp_idx]=cur_src->events[j];
 					/* Clean positions */
-					emask &= ~(1<<j);
+					emask &= ~(1U<<j);
 				}
 			}
 		}
 
 		/* Clean positions */
-		pmask &= ~(1<<i);
+		pmask &= ~(1U<<i);
 		i++;
 	}
 
@@ -760,14 +964,17 @@ int pmct_parse_pmc_configuration(const char* user_cfg_str[],
 		}
 		return 0;
 	} else {
-		/* Since it is not too big, reserve it in the stack for now*/
-		struct {
+		/*
+		 * Too big for the stack with dynamically-sized event sets,
+		 * so reserve it in the heap
+		 */
+		struct aux_cfg_data {
 			counter_mapping_t mappings[MAX_PERFORMANCE_COUNTERS];
 			unsigned int pmcmask;
 			unsigned int nr_exps; /* To know the experiments
 																contained on each
 																cfg string  */
-		} aux_data[MAX_COUNTER_CONFIGS];
+		} *aux_data;
 		int nr_actual_cfgs=0;
 		char* tmp_raw_cfgs[MAX_COUNTER_CONFIGS];
 		unsigned int base_exp_idx=0;
@@ -779,7 +986,12 @@ int pmct_parse_pmc_configuration(const char* user_cfg_str[],
 		}
 
 		/* Default initialization */
-		memset(aux_data,0,sizeof(aux_data));
+		aux_data=calloc(MAX_COUNTER_CONFIGS,sizeof(struct aux_cfg_data));
+
+		if (!aux_data) {
+			warnx("Can't allocate memory for the parser");
+			return 1;
+		}
 
 		succesful_cfgs=0;
 
@@ -809,6 +1021,13 @@ int pmct_parse_pmc_configuration(const char* user_cfg_str[],
 				raw_cfgs[nr_actual_cfgs+j]=tmp_raw_cfgs[j];
 
 			nr_actual_cfgs+=aux_data[i].nr_exps;
+
+			if (user_cfg_str[i+1]!=NULL && i+1>=MAX_COUNTER_CONFIGS) {
+				warnx("Maximum number of experiments exceeded\n");
+				ret=2;
+				succesful_cfgs++;
+				goto free_resources;
+			}
 		}
 
 		/*  Merge counter mappings */
@@ -833,6 +1052,7 @@ int pmct_parse_pmc_configuration(const char* user_cfg_str[],
 		/* Prepare remaining return values */
 		(*used_counter_mask)=global_pmcmask;
 		(*nr_experiments)=base_exp_idx;
+		free(aux_data);
 		return 0;
 free_resources:
 		/* Free up resources */
@@ -840,19 +1060,20 @@ free_resources:
 			pmask=aux_data[i].pmcmask;
 			for (j=0; j<MAX_PERFORMANCE_COUNTERS && pmask; j++) {
 				/* Counter used for this experiment */
-				if (pmask & 1<<j) {
+				if (pmask & 1U<<j) {
 					emask=aux_data[i].mappings[j].experiment_mask;
 					/* Iterate through used experiments for the counter ... */
 					for (k=0; k<MAX_COUNTER_CONFIGS && emask; k++) {
-						if (emask & 1<<k) {
+						if (emask & 1U<<k) {
 							free(aux_data[i].mappings[j].events[k]);
-							emask &= ~(1<<k);
+							emask &= ~(1U<<k);
 						}
 					}//for_k
-					pmask &= ~(1<<j);
+					pmask &= ~(1U<<j);
 				}//endif
 			}//for_j
 		}//for_i
+		free(aux_data);
 		return ret;
 	}
 }
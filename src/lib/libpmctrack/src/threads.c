@@ -0,0 +1,369 @@
+/*
+ * threads.c
+ *
+ * Table to accumulate the samples of each thread (or CPU) in the
+ * cumulative mode of pmctrack (-A), and to aggregate the counts
+ * of threads belonging to the same process or sharing a name.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <err.h>
+#include "pmctrack_internal.h"
+
+/* Initial capacity of the table (it doubles when it fills up) */
+#define INITIAL_ENTRIES	64
+
+/* Keep the load factor of the hash index at or below 1/2 */
+#define INDEX_SIZE(max_entries)	(2*(max_entries))
+
+static inline unsigned int hash_pid(pid_t pid)
+{
+	uint32_t h=(uint32_t)pid*2654435761U;
+
+	return h^(h>>16);
+}
+
+/* FNV-1a */
+static inline unsigned int hash_comm(const char* comm)
+{
+	uint32_t h=2166136261U;
+	int i;
+
+	for (i=0; i<PMCT_COMM_LEN && comm[i]; i++) {
+		h^=(unsigned char)comm[i];
+		h*=16777619U;
+	}
+
+	return h;
+}
+
+static inline unsigned int hash_entry(pmct_thread_table_t* table, pmct_thread_acum_t* entry)
+{
+	if (table->key==PMCT_ROLLUP_COMM)
+		return hash_comm(entry->comm);
+	else
+		return hash_pid(entry->pid);
+}
+
+/* Allocate a new hash index and insert all the entries into it */
+static int rebuild_index(pmct_thread_table_t* table, unsigned int index_size)
+{
+	int* index;
+	unsigned int mask=index_size-1;
+	unsigned int i,bucket;
+
+	if ((index=malloc(index_size*sizeof(int)))==NULL)
+		return -ENOMEM;
+
+	memset(index,-1,index_size*sizeof(int));
+
+	for (i=0; i<table->nr_entries; i++) {
+		bucket=hash_entry(table,&table->entries[i]) & mask;
+		while (index[bucket]!=-1)
+			bucket=(bucket+1) & mask;
+		index[bucket]=i;
+	}
+
+	free(table->index);
+	table->index=index;
+	table->index_size=index_size;
+	return 0;
+}
+
+int pmct_thread_table_init(pmct_thread_table_t* table,
+                           unsigned int nr_experiments,
+                           pmct_rollup_t key)
+{
+	memset(table,0,sizeof(pmct_thread_table_t));
+	table->nr_experiments=nr_experiments;
+	table->key=key;
+
+	if ((table->entries=malloc(INITIAL_ENTRIES*sizeof(pmct_thread_acum_t)))==NULL) {
+		warnx("Couldn't reserve memory for cummulative counters");
+		return -ENOMEM;
+	}
+
+	table->max_entries=INITIAL_ENTRIES;
+
+	if (rebuild_index(table,INDEX_SIZE(INITIAL_ENTRIES))) {
+		warnx("Couldn't reserve memory for cummulative counters");
+		free(table->entries);
+		table->entries=NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void pmct_thread_table_free(pmct_thread_table_t* table)
+{
+	int i;
+
+	for (i=0; i<table->nr_entries; i++)
+		free(table->entries[i].samples);
+
+	free(table->entries);
+	free(table->index);
+	memset(table,0,sizeof(pmct_thread_table_t));
+}
+
+/*
+ * Append an empty entry to the table, making room for it if necessary.
+ * The caller must set the key and then insert it into the index.
+ */
+static pmct_thread_acum_t* add_entry(pmct_thread_table_t* table)
+{
+	pmct_thread_acum_t* entry;
+	pmc_sample_v2_t* samples;
+
+	if (table->nr_entries==table->max_entries) {
+		unsigned int max_entries=2*table->max_entries;
+
+		entry=realloc(table->entries,max_entries*sizeof(pmct_thread_acum_t));
+		if (!entry)
+			return NULL;
+		table->entries=entry;
+		table->max_entries=max_entries;
+
+		if (rebuild_index(table,INDEX_SIZE(max_entries)))
+			return NULL;
+	}
+
+	if ((samples=calloc(table->nr_experiments,sizeof(pmc_sample_v2_t)))==NULL)
+		return NULL;
+
+	entry=&table->entries[table->nr_entries];
+	memset(entry,0,sizeof(pmct_thread_acum_t));
+	entry->tgid=-1;
+	entry->samples=samples;
+	table->nr_entries++;
+
+	return entry;
+}
+
+/* Insert the last entry added into the index */
+static void index_last_entry(pmct_thread_table_t* table)
+{
+	unsigned int mask=table->index_size-1;
+	unsigned int bucket=hash_entry(table,&table->entries[table->nr_entries-1]) & mask;
+
+	while (table->index[bucket]!=-1)
+		bucket=(bucket+1) & mask;
+	table->index[bucket]=table->nr_entries-1;
+}
+
+pmct_thread_acum_t* pmct_thread_table_get(pmct_thread_table_t* table, pid_t pid)
+{
+	unsigned int mask=table->index_size-1;
+	unsigned int bucket=hash_pid(pid) & mask;
+	pmct_thread_acum_t* entry;
+	int pos;
+
+	while ((pos=table->index[bucket])!=-1) {
+		if (table->entries[pos].pid==pid)
+			return &table->entries[pos];
+		bucket=(bucket+1) & mask;
+	}
+
+	if ((entry=add_entry(table))==NULL) {
+		warnx("Couldn't reserve memory for cummulative counters");
+		return NULL;
+	}
+
+	entry->pid=pid;
+	index_last_entry(table);
+	return entry;
+}
+
+pmct_thread_acum_t* pmct_thread_table_get_comm(pmct_thread_table_t* table, const char* comm)
+{
+	unsigned int mask=table->index_size-1;
+	unsigned int bucket=hash_comm(comm) & mask;
+	pmct_thread_acum_t* entry;
+	int pos;
+
+	while ((pos=table->index[bucket])!=-1) {
+		if (strncmp(table->entries[pos].comm,comm,PMCT_COMM_LEN)==0)
+			return &table->entries[pos];
+		bucket=(bucket+1) & mask;
+	}
+
+	if ((entry=add_entry(table))==NULL) {
+		warnx("Couldn't reserve memory for cummulative counters");
+		return NULL;
+	}
+
+	/* Groups are numbered in order of arrival */
+	entry->pid=table->nr_entries;
+	strncpy(entry->comm,comm,PMCT_COMM_LEN-1);
+	index_last_entry(table);
+	return entry;
+}
+
+pmct_thread_acum_t* pmct_thread_table_accumulate(pmct_thread_table_t* table,
+        unsigned int pmcmask,
+        unsigned int virtual_mask,
+        pmc_sample_v2_t* sample)
+{
+	pmct_thread_acum_t* entry;
+	unsigned char copy_metadata=0;
+	int exp_idx=sample->exp_idx;
+
+	if (exp_idx<0 || exp_idx>=table->nr_experiments) {
+		warnx("Sample with invalid event set index (%d) found",exp_idx);
+		return NULL;
+	}
+
+	if ((entry=pmct_thread_table_get(table,sample->pid))==NULL)
+		return NULL;
+
+	if (entry->tgid==-1)
+		entry->tgid=sample->tgid;
+
+	if (!(entry->exp_mask & (1UL<<exp_idx))) {
+		/* Time to copy metadata ... */
+		copy_metadata=1;
+		entry->exp_mask|=1UL<<exp_idx;
+		entry->nr_samples_accum[exp_idx]=1;
+	} else
+		entry->nr_samples_accum[exp_idx]++;
+
+	entry->nr_threads=1;
+
+	pmct_accumulate_sample(table->nr_experiments,pmcmask,virtual_mask,copy_metadata,
+	                       sample,&entry->samples[exp_idx]);
+	return entry;
+}
+
+void pmct_thread_table_scale(pmct_thread_table_t* table)
+{
+	int i;
+
+	for (i=0; i<table->nr_entries; i++)
+		pmct_scale_accumulated_samples(table->nr_experiments,
+		                               table->entries[i].exp_mask,
+		                               table->entries[i].samples);
+}
+
+int pmct_thread_table_rollup(pmct_thread_table_t* threads,
+                             pmct_thread_table_t* groups,
+                             unsigned int pmcmask,
+                             unsigned int virtual_mask)
+{
+	pmct_thread_acum_t* thread;
+	pmct_thread_acum_t* group;
+	pmc_sample_v2_t* sample;
+	unsigned char copy_metadata;
+	int i,j;
+
+	for (i=0; i<threads->nr_entries; i++) {
+		thread=&threads->entries[i];
+
+		if (groups->key==PMCT_ROLLUP_COMM)
+			group=pmct_thread_table_get_comm(groups,thread->comm);
+		else if (thread->tgid!=-1)
+			group=pmct_thread_table_get(groups,thread->tgid);
+		else
+			/* Unknown process */
+			group=pmct_thread_table_get(groups,thread->pid);
+
+		if (!group)
+			return -ENOMEM;
+
+		group->tgid=thread->tgid;
+		group->nr_threads++;
+
+		for (j=0; j<threads->nr_experiments; j++) {
+			sample=&thread->samples[j];
+
+			/*
+			 * Event sets that never got to count for this thread
+			 * would only add time with no counts to the group
+			 */
+			if (!(thread->exp_mask & (1UL<<j)) ||
+			    (sample->time_running==0 && sample->time_enabled!=0))
+				continue;
+
+			copy_metadata=!(group->exp_mask & (1UL<<j));
+			group->exp_mask|=1UL<<j;
+			group->nr_samples_accum[j]+=thread->nr_samples_accum[j];
+			pmct_accumulate_sample(groups->nr_experiments,pmcmask,virtual_mask,copy_metadata,
+			                       sample,&group->samples[j]);
+			group->samples[j].pid=group->pid;
+		}
+	}
+
+	/*
+	 * The counts of the threads were scaled already, so the groups
+	 * must not be subject to multiplexing extrapolation again
+	 */
+	for (i=0; i<groups->nr_entries; i++)
+		for (j=0; j<groups->nr_experiments; j++)
+			groups->entries[i].samples[j].time_running=groups->entries[i].samples[j].time_enabled;
+
+	return 0;
+}
+
+/* Read the first line of a /proc file */
+static int read_comm_file(const char* path, char* comm)
+{
+	FILE* fcomm;
+	char* eol;
+
+	if ((fcomm=fopen(path,"r"))==NULL)
+		return -1;
+
+	if (!fgets(comm,PMCT_COMM_LEN,fcomm)) {
+		fclose(fcomm);
+		return -1;
+	}
+
+	fclose(fcomm);
+
+	if ((eol=strchr(comm,'\n')))
+		*eol='\0';
+
+	return 0;
+}
+
+int pmct_get_thread_comm(pid_t tid, pid_t tgid, char* comm)
+{
+	char path[64];
+
+	sprintf(path,"/proc/%d/comm",tid);
+	if (!read_comm_file(path,comm))
+		return 0;
+
+	if (tgid>0) {
+		sprintf(path,"/proc/%d/comm",tgid);
+		if (!read_comm_file(path,comm))
+			return 0;
+	}
+
+	strcpy(comm,"?");
+	return -1;
+}
@@ -47,7 +47,7 @@ cbuffer_t* create_cbuffer_t (unsigned int max_size)
 	cbuffer->data=buf_mem_alloc(max_size);
 
 	if ( cbuffer->data == NULL) {
-		buf_mem_free(cbuffer->data);
+		buf_mem_free(cbuffer);
 		return NULL;
 	}
 	return cbuffer;
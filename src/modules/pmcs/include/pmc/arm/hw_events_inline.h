@@ -176,6 +176,32 @@ static inline void  __start_count_hw_event ( struct hw_event* exp )
 
 }
 
+/* This function resumes the count of a HW event stopped with __stop_count_hw_event() */
+static inline void  __resume_count_hw_event ( struct hw_event* exp )
+{
+	simple_exp *s_exp=NULL;
+
+	u32 state;
+	state = armv7_pmnc_read();
+	if( ! (state & ARMV7_PMNC_E) )
+		armv7_pmnc_write(state | ARMV7_PMNC_E);
+
+	armv7_pmnc_enable_intens(exp->g_event.s_exp.pmc.counter_idx);
+
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		armv7_pmnc_write_evtsel(s_exp->evtsel.counter_idx,s_exp->evtsel.new_value);	/* Evtsel Configuration */
+		armv7_pmnc_enable_counter(s_exp->evtsel.counter_idx);
+		break;
+	case _FIXED:
+		armv7_pmnc_enable_counter(exp->g_event.f_exp.pmc.counter_idx);
+		break;
+	default:
+		break;
+	}
+}
+
 /* This function starts the count of a HW event */
 static inline void  __restart_count_hw_event ( struct hw_event* exp )
 {
@@ -325,6 +351,23 @@ static inline uint64_t __get_last_value_hw_event ( struct hw_event* exp )
 	return 0;
 }
 
+/* This function sets the value to be loaded into the PMC when the count is started */
+static inline void __set_last_value_hw_event ( struct hw_event* exp, uint64_t value )
+{
+	simple_exp *s_exp=NULL;
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		s_exp->pmc.new_value=value;
+		break;
+	case _FIXED:
+		exp->g_event.f_exp.pmc.new_value=value;
+		break;
+	default:
+		break;
+	}
+}
+
 /* This function returns PMC's reset value */
 static inline uint64_t __get_reset_value_hw_event ( struct hw_event* exp )
 {
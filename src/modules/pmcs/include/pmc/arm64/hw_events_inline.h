@@ -173,6 +173,30 @@ static inline void  __start_count_hw_event ( struct hw_event* exp )
 
 }
 
+/* This function resumes the count of a HW event stopped with __stop_count_hw_event() */
+static inline void  __resume_count_hw_event ( struct hw_event* exp )
+{
+	simple_exp *s_exp=NULL;
+
+	u32 state;
+	state = armv8pmu_pmcr_read();
+	if( ! (state & ARMV8_PMCR_E) )
+		armv8pmu_pmcr_write(state | ARMV8_PMCR_E);
+
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		armv8pmu_write_evtype(s_exp->evtsel.counter_idx,s_exp->evtsel.new_value);	/* Evtsel Configuration */
+		armv8pmu_enable_counter(s_exp->evtsel.counter_idx);
+		break;
+	case _FIXED:
+		armv8pmu_enable_counter(exp->g_event.f_exp.pmc.counter_idx);
+		break;
+	default:
+		break;
+	}
+}
+
 /* This function starts the count of a HW event */
 static inline void  __restart_count_hw_event ( struct hw_event* exp )
 {
@@ -320,6 +344,23 @@ static inline uint64_t __get_last_value_hw_event ( struct hw_event* exp )
 	return 0;
 }
 
+/* This function sets the value to be loaded into the PMC when the count is started */
+static inline void __set_last_value_hw_event ( struct hw_event* exp, uint64_t value )
+{
+	simple_exp *s_exp=NULL;
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		s_exp->pmc.new_value=value;
+		break;
+	case _FIXED:
+		exp->g_event.f_exp.pmc.new_value=value;
+		break;
+	default:
+		break;
+	}
+}
+
 /* This function returns PMC's reset value */
 static inline uint64_t __get_reset_value_hw_event ( struct hw_event* exp )
 {
@@ -212,6 +212,24 @@ static inline void  __start_count_hw_event ( struct hw_event* exp )
 
 }
 
+/* This function resumes the count of a HW event stopped with __stop_count_hw_event() */
+static inline void  __resume_count_hw_event ( struct hw_event* exp )
+{
+	simple_exp *s_exp=NULL;
+
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		writeMSR ( &s_exp->evtsel );	/* Evtsel Configuration (the counter keeps its value) */
+		break;
+	case _FIXED:
+		writeMSR ( &exp->g_event.f_exp.evtsel );	/* Evtsel Configuration*/
+		break;
+	default:
+		break;
+	}
+}
+
 /* This function starts the count of a HW event */
 static inline void  __restart_count_hw_event ( struct hw_event* exp )
 {
@@ -392,6 +410,23 @@ static inline uint64_t __get_last_value_hw_event ( struct hw_event* exp )
 	return 0;
 }
 
+/* This function sets the value to be loaded into the PMC when the count is started */
+static inline void __set_last_value_hw_event ( struct hw_event* exp, uint64_t value )
+{
+	simple_exp *s_exp=NULL;
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		s_exp->pmc.msr.new_value=value;
+		break;
+	case _FIXED:
+		exp->g_event.f_exp.pmc.new_value=value;
+		break;
+	default:
+		break;
+	}
+}
+
 /* This function returns PMC's reset value */
 static inline uint64_t __get_reset_value_hw_event ( struct hw_event* exp )
 {
@@ -0,0 +1,333 @@
+/*
+ *  include/pmc/data_str/sample_ring.h
+ *
+ * 	Per-CPU ring of variable-length PMC records (producer side)
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+#ifndef PMC_SAMPLE_RING_H
+#define PMC_SAMPLE_RING_H
+#include <pmc/pmc_user.h>
+
+#ifdef __KERNEL__
+#include <linux/compiler.h>
+#include <linux/cache.h>
+#include <linux/errno.h>
+#include <asm/atomic.h>
+#else
+/* Userspace build (unit tests and benchmarks) */
+#include <errno.h>
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+#define smp_wmb() __sync_synchronize()
+#define cmpxchg(ptr,old,new) __sync_val_compare_and_swap(ptr,old,new)
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#endif
+
+/*
+ * Single-producer ring of PMC records bound to a CPU.
+ *
+ * Only code running on the ring's CPU (with interrupts disabled)
+ * inserts records into it, so producers never need to grab a
+ * shared lock. The monitor process (or the read() callback on its
+ * behalf) is the only consumer. Ring indices live in the control area
+ * of the buffer, which can be mapped into the monitor's address space
+ * along with the data area (see pmc_ring_control_t in pmc_user.h).
+ */
+typedef struct {
+	/* Producer side */
+	pmc_ring_index_t* idx;			/* Producer/consumer indices (in the control area) */
+	char* data;						/* Data area (stream of records) */
+	unsigned long first_stamp;		/* Time (jiffies) when the oldest unread sample was pushed */
+	unsigned int last_record_size;	/* Size of the last sample record pushed */
+	unsigned int nr_lost_pending;	/* Samples lost since the last record stored */
+	unsigned int schema_valid;		/* Bitmask of 'schemas' entries already emitted */
+	struct {
+		unsigned int pmc_mask;
+		unsigned int virt_mask;
+	} schemas[PMC_SCHEMA_MAX_CORETYPES][PMC_SCHEMA_MAX_EXPS];	/* Schemas emitted so far */
+	/* Consumer side (read() path) */
+	pmc_schema_table_t consumer_schemas ____cacheline_aligned_in_smp;
+} ____cacheline_aligned_in_smp pmc_samples_ring_t;
+
+/*
+ * Reserve room for a record of 'size' bytes in a per-CPU ring.
+ * If the record does not fit before the end of the data area, the gap
+ * is filled with a padding record and the new record starts at offset 0.
+ *
+ * Returns a pointer to the record (or NULL if the ring is full) and
+ * stores the value of the head index after the record in 'next_head'.
+ */
+static inline void* __reserve_ring_record(pmc_samples_ring_t* ring, unsigned int data_size,
+        unsigned int size, uint32_t* next_head)
+{
+	pmc_ring_index_t* idx=ring->idx;
+	uint32_t head=idx->head;
+	uint32_t offset=head & (data_size-1);
+	uint32_t room=data_size-offset;
+	pmc_record_header_t* pad;
+
+	if (head+size+(room<size?room:0)-ACCESS_ONCE(idx->tail) > data_size)
+		return NULL;
+
+	if (room<size) {
+		pad=(pmc_record_header_t*)(ring->data+offset);
+		pad->type=PMC_RECORD_PAD;
+		pad->flags=0;
+		pad->size=room;
+		head+=room;
+		offset=0;
+	}
+
+	*next_head=head+size;
+	return ring->data+offset;
+}
+
+/* Publish the records reserved so far */
+static inline void __commit_ring_record(pmc_samples_ring_t* ring, uint32_t next_head)
+{
+	/* Make sure the record is visible before publishing the new head */
+	smp_wmb();
+	ring->idx->head=next_head;
+}
+
+/*
+ * Return the index of the bit in 'schema_valid' for an experiment
+ * or -1 if the producer does not keep track of its schema.
+ */
+static inline int __schema_slot(int coretype, int exp_idx)
+{
+	if (coretype<0 || coretype>=PMC_SCHEMA_MAX_CORETYPES || exp_idx<0 || exp_idx>=PMC_SCHEMA_MAX_EXPS)
+		return -1;
+	return coretype*PMC_SCHEMA_MAX_EXPS+exp_idx;
+}
+
+/*
+ * Emit a schema record for an experiment unless
+ * the ring already holds an up-to-date one.
+ *
+ * Returns 0 on success and -ENOSPC if the ring is full.
+ */
+static inline int __push_schema_ring(pmc_samples_ring_t* ring, unsigned int data_size, int coretype, int exp_idx,
+                                     unsigned int pmc_mask, unsigned int virt_mask)
+{
+	pmc_schema_record_t* schema;
+	int slot=__schema_slot(coretype,exp_idx);
+	uint32_t next_head;
+
+	if (slot>=0) {
+		if ((ring->schema_valid & (1U<<slot)) &&
+		    ring->schemas[coretype][exp_idx].pmc_mask==pmc_mask &&
+		    ring->schemas[coretype][exp_idx].virt_mask==virt_mask)
+			return 0;
+	}
+
+	schema=__reserve_ring_record(ring,data_size,sizeof(pmc_schema_record_t),&next_head);
+
+	if (!schema)
+		return -ENOSPC;
+
+	schema->header.type=PMC_RECORD_SCHEMA;
+	schema->header.flags=0;
+	schema->header.size=sizeof(pmc_schema_record_t);
+	schema->coretype=coretype;
+	schema->exp_idx=exp_idx;
+	schema->pmc_mask=pmc_mask;
+	schema->virt_mask=virt_mask;
+	__commit_ring_record(ring,next_head);
+
+	if (slot>=0) {
+		ring->schemas[coretype][exp_idx].pmc_mask=pmc_mask;
+		ring->schemas[coretype][exp_idx].virt_mask=virt_mask;
+		ring->schema_valid|=(1U<<slot);
+	}
+
+	return 0;
+}
+
+/*
+ * Emit a record with the number of samples lost since the last
+ * record stored in the ring (if any).
+ *
+ * Returns 0 on success and -ENOSPC if the ring is full.
+ */
+static inline int __push_lost_ring(pmc_samples_ring_t* ring, unsigned int data_size)
+{
+	pmc_lost_record_t* lost;
+	uint32_t next_head;
+
+	if (!ring->nr_lost_pending)
+		return 0;
+
+	lost=__reserve_ring_record(ring,data_size,sizeof(pmc_lost_record_t),&next_head);
+
+	if (!lost)
+		return -ENOSPC;
+
+	lost->header.type=PMC_RECORD_LOST;
+	lost->header.flags=0;
+	lost->header.size=sizeof(pmc_lost_record_t);
+	lost->nr_lost=ring->nr_lost_pending;
+	lost->__pad=0;
+	__commit_ring_record(ring,next_head);
+	ring->nr_lost_pending=0;
+	return 0;
+}
+
+/*
+ * Discard the oldest record of a ring to make room for new ones
+ * (PMC_OVERFLOW_OVERWRITE policy). Since the consumer may advance
+ * the tail concurrently, both sides update it with cmpxchg().
+ *
+ * Returns a non-zero value if the ring may have more room now.
+ */
+static inline int __evict_ring_record(pmc_samples_ring_t* ring, unsigned int data_size)
+{
+	pmc_ring_index_t* idx=ring->idx;
+	uint32_t head=idx->head;
+	uint32_t tail=ACCESS_ONCE(idx->tail);
+	pmc_record_header_t* header;
+	pmc_schema_record_t* schema;
+	uint32_t size;
+	int slot;
+
+	/* Do not trust indices that may be updated from user space */
+	if (tail==head || head-tail>data_size || (tail & (PMC_RECORD_ALIGN-1)))
+		return 0;
+
+	/* Only the producer writes records, so the header is stable */
+	header=(pmc_record_header_t*)(ring->data+(tail & (data_size-1)));
+	size=header->size;
+
+	if (size<sizeof(pmc_record_header_t) || size>head-tail)
+		return 0;
+
+	if (cmpxchg(&idx->tail,tail,tail+size)!=tail)
+		return 1;	/* The consumer made room in the meantime */
+
+	switch (header->type) {
+	case PMC_RECORD_SAMPLE:
+		idx->nr_lost++;
+		ring->nr_lost_pending++;
+		break;
+	case PMC_RECORD_LOST:
+		/* Report these losses again in the next record */
+		ring->nr_lost_pending+=((pmc_lost_record_t*)header)->nr_lost;
+		break;
+	case PMC_RECORD_SCHEMA:
+		/* Emit the schema again before the next sample of the experiment */
+		schema=(pmc_schema_record_t*)header;
+		slot=__schema_slot(schema->coretype,schema->exp_idx);
+		if (slot>=0)
+			ring->schema_valid&=~(1U<<slot);
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/*
+ * Reserve a sample record in a per-CPU ring so that the producer can
+ * store the counts in place. The record has room for 'nr_counts' PMC
+ * counts followed by 'nr_virt_counts' virtual counts. Pending
+ * lost-sample and schema records are emitted first. If the ring is
+ * full, either the oldest records are discarded (PMC_OVERFLOW_OVERWRITE)
+ * or the sample is dropped. Losses are accounted for in 'nr_lost'
+ * and reported in the stream with a PMC_RECORD_LOST record.
+ *
+ * Only the header and the layout of the record (coretype, exp_idx and
+ * number of counts) are filled in. The caller stores the other fields
+ * and publishes the record with __commit_sample_ring(), without pushing
+ * anything else into the ring in between.
+ *
+ * Returns NULL if the sample was dropped.
+ */
+static inline pmc_sample_record_t* __reserve_sample_ring(pmc_samples_ring_t* ring, unsigned int data_size,
+        pmc_overflow_policy_t overflow_policy,
+        int coretype, int exp_idx,
+        unsigned int pmc_mask, unsigned int nr_counts,
+        unsigned int virt_mask, unsigned int nr_virt_counts,
+        uint32_t* next_head)
+{
+	pmc_sample_record_t* rec;
+	unsigned int size;
+
+	if (nr_counts>MAX_PERFORMANCE_COUNTERS)
+		nr_counts=MAX_PERFORMANCE_COUNTERS;
+	if (nr_virt_counts>MAX_VIRTUAL_COUNTERS)
+		nr_virt_counts=MAX_VIRTUAL_COUNTERS;
+
+	size=pmc_sample_record_size(nr_counts,nr_virt_counts);
+
+	for (;;) {
+		if (!__push_lost_ring(ring,data_size) &&
+		    !__push_schema_ring(ring,data_size,coretype,exp_idx,pmc_mask,virt_mask) &&
+		    (rec=__reserve_ring_record(ring,data_size,size,next_head)))
+			break;
+
+		/* The ring is full */
+		if (overflow_policy!=PMC_OVERFLOW_OVERWRITE || !__evict_ring_record(ring,data_size)) {
+			ring->idx->nr_lost++;
+			ring->nr_lost_pending++;
+			return NULL;
+		}
+	}
+
+	rec->header.type=PMC_RECORD_SAMPLE;
+	rec->header.flags=0;
+	rec->header.size=size;
+	rec->coretype=coretype;
+	rec->exp_idx=exp_idx;
+	rec->nr_counts=nr_counts;
+	rec->nr_virt_counts=nr_virt_counts;
+	return rec;
+}
+
+/* Publish a sample record obtained with __reserve_sample_ring() */
+static inline void __commit_sample_ring(pmc_samples_ring_t* ring, pmc_sample_record_t* rec, uint32_t next_head)
+{
+	__commit_ring_record(ring,next_head);
+	ring->last_record_size=rec->header.size;
+}
+
+/*
+ * Encode a sample as a variable-length record and insert it into a
+ * per-CPU ring (see __reserve_sample_ring()). Only the counts in use
+ * are stored.
+ *
+ * Returns a non-zero value if the sample was stored.
+ */
+static inline int __store_sample_ring(pmc_samples_ring_t* ring, unsigned int data_size,
+                                      pmc_overflow_policy_t overflow_policy, pmc_sample_v2_t* sample,
+                                      int32_t tid, int32_t tgid, int32_t cpu)
+{
+	pmc_sample_record_t* rec;
+	uint32_t next_head;
+	int i;
+
+	rec=__reserve_sample_ring(ring,data_size,overflow_policy,sample->coretype,sample->exp_idx,
+	                          sample->pmc_mask,sample->nr_counts,sample->virt_mask,sample->nr_virt_counts,
+	                          &next_head);
+	if (!rec)
+		return 0;
+
+	rec->type=sample->type;
+	rec->tid=tid;
+	rec->tgid=tgid;
+	rec->cpu=cpu;
+	rec->timestamp=sample->timestamp;
+	rec->time_enabled=sample->time_enabled;
+	rec->time_running=sample->time_running;
+
+	for (i=0; i<rec->nr_counts; i++)
+		rec->counts[i]=sample->pmc_counts[i];
+	for (i=0; i<rec->nr_virt_counts; i++)
+		rec->counts[rec->nr_counts+i]=sample->virtual_counts[i];
+
+	__commit_sample_ring(ring,rec,next_head);
+	return 1;
+}
+
+#endif
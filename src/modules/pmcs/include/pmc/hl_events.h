@@ -15,6 +15,7 @@
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <pmc/common/pmc_const.h>
+#include <pmc/pmc_expr.h>
 #define MAX_REL_ARGS 2
 
 
@@ -30,6 +31,7 @@ typedef enum {
 	op_rate,
 	op_rate2,
 	op_none,
+	op_expr,	/* Compiled expression (see pmc_expr.h) */
 	_AVAILABLE_RELATIONS
 } pmc_relation_mode_t;
 
@@ -57,12 +59,14 @@ typedef struct {
 	/* Extra parameters: */
 	unsigned long scale_factor; 	/* Fixed point management field (rate) */
 	uint64_t count;			/* Last computed value */
+	pmc_expr_t* expr;		/* Program for op_expr metrics (shared by the copies) */
+	int64_t value;			/* Last computed value (fixed point, see pmc_expr.h) */
 }
 pmc_metric_t;
 
 /* Helper macros to build simple metric sets */
 #define PMC_ARG(arg) {.type=hw_event_arg,.index=(arg)}
-#define PMC_METRIC(id,op,arg1,arg2,scale_factor) {id,op,PMC_ARG(arg1),PMC_ARG(arg2),scale_factor,0}
+#define PMC_METRIC(id,op,arg1,arg2,scale_factor) {id,op,PMC_ARG(arg1),PMC_ARG(arg2),scale_factor,0,NULL,0}
 
 /* Helper type for evaluating the value of hl_events */
 typedef struct {
@@ -97,9 +101,11 @@ static inline void init_pmc_metric ( pmc_metric_t* metric,
 	metric->arg1=arguments[0];
 	metric->arg2=arguments[1];
 	metric->scale_factor=scale_factor;
+	metric->expr=NULL;
+	metric->value=0;
 }
 
-#define MAX_METRICS_PER_SET 5
+#define MAX_METRICS_PER_SET 8
 #define MAX_MULTIPLEX_EXP_PER_CORETYPE 4
 
 /* Set of metrics associated with a experiment set */
@@ -121,6 +127,17 @@ typedef struct {
 } metric_experiment_set_t;
 
 
+/*
+ * Append a metric defined by an expression (e.g., "1000*ev0/ev1") to
+ * a set of metrics. The expression may refer to the metrics defined
+ * before in the same set by their name. The count of the metric is the
+ * integer part of the value of the expression (0 if negative).
+ *
+ * Returns 0 on success, -ENOSPC if the set is full, or the error
+ * returned by pmc_expr_compile().
+ */
+int add_pmc_metric_expr(metric_experiment_t* m_exp, const char* name, const char* expr);
+
 /* Events graph initialization function (per CPU)*/
 static inline void init_metric_experiment_t(metric_experiment_t* m_exp,int exp_idx)
 {
@@ -157,6 +174,26 @@ static inline void clone_metric_experiment_set_t(metric_experiment_set_t* dst,
 		clone_metric_experiment_t(&dst->exps[i],&orig->exps[i]);
 }
 
+/*
+ * Free up the programs of op_expr metrics. Copies of the set
+ * share them, so this must be invoked on the original set only,
+ * once the copies are no longer used.
+ */
+static inline void free_metric_experiment_set_t(metric_experiment_set_t* m_set)
+{
+	int i,j;
+
+	for (i=0; i<m_set->nr_exps; i++)
+		for (j=0; j<m_set->exps[i].size; j++) {
+			pmc_metric_t* metric=&m_set->exps[i].metrics[j];
+
+			if (metric->expr) {
+				pmc_expr_free(metric->expr);
+				metric->expr=NULL;
+			}
+		}
+}
+
 
 /* For SF-enabled monitoring modules */
 static inline int normalize_speedup_factor (int sf)
@@ -27,6 +27,9 @@ typedef struct hw_event hw_event_t;
 /* This function starts the count of a HW event (from its previous value) */
 static inline   void __start_count_hw_event ( struct hw_event* exp );
 
+/* This function resumes the count of a HW event stopped with __stop_count_hw_event() */
+static inline   void __resume_count_hw_event ( struct hw_event* exp );
+
 /* This function starts the count of a HW event (from 0) */
 static inline   void __restart_count_hw_event ( struct hw_event* exp );
 
@@ -42,6 +45,9 @@ static inline   void __read_count_hw_event (struct hw_event* exp );
 /* This function returns the last value gathered from the PMC */
 static inline uint64_t __get_last_value_hw_event (struct hw_event* exp );
 
+/* This function sets the value loaded into the PMC by __start_count_hw_event() */
+static inline void __set_last_value_hw_event (struct hw_event* exp, uint64_t value );
+
 /* This function saves the context of a HW event */
 static inline void __save_context_hw_event (struct hw_event* exp);
 
@@ -85,11 +91,15 @@ static inline uint64_t __get_reset_value_hw_event (struct hw_event* exp );
 #endif
 
 
-/* A low level event is a HW event with an additional identifier*/
+/*
+ * A low level event is a HW event with an additional identifier.
+ * The identifier is not stored inline, to keep the arrays of low-level
+ * events scanned on every PMC read as compact as possible.
+ */
 typedef struct {
-	char id[MAX_EXP_ID]; 	/*Event ID*/
 	struct hw_event event;
 	unsigned int pmc_id;	/* Performance counter id associated with this event */
+	const char* id; 		/* Event ID (must be a string with static storage duration) */
 }
 low_level_exp;
 
@@ -97,14 +107,14 @@ low_level_exp;
 /*************** Available operations for low_level_events  ***************************/
 static inline void init_low_level_exp ( low_level_exp* exp,const char *name)
 {
-	strcpy ( exp->id,name );
+	exp->id=name;
 	exp->pmc_id=0;
 }
 
 
 static inline void init_low_level_exp_id ( low_level_exp* exp,const char *name, unsigned int pmc_id)
 {
-	strcpy ( exp->id,name );
+	exp->id=name;
 	exp->pmc_id=pmc_id;
 }
 
@@ -112,6 +122,7 @@ static inline void init_low_level_exp_id ( low_level_exp* exp,const char *name,
 /* Wrapper operations for low_level_exps */
 #define __start_count(p_exp)		__start_count_hw_event(&((p_exp)->event))
 #define __restart_count(p_exp)		__restart_count_hw_event(&((p_exp)->event))
+#define __resume_count(p_exp)		__resume_count_hw_event(&((p_exp)->event))
 #define __stop_count(p_exp)  		__stop_count_hw_event(&((p_exp)->event))
 #define __clear_count(p_exp)  		__clear_count_hw_event(&((p_exp)->event))
 #define __read_count(p_exp)   		__read_count_hw_event(&((p_exp)->event))
@@ -120,5 +131,30 @@ static inline void init_low_level_exp_id ( low_level_exp* exp,const char *name,
 #define __restore_context_event(p_exp) 	__restore_context_hw_event(&((p_exp)->event))
 #define __get_reset_value(p_exp) 	__get_reset_value_hw_event(&((p_exp)->event))
 
+/*
+ * low_level_exps may be shared by several threads and CPUs
+ * (see core_experiment_t), so the operations below work
+ * on a private copy of the HW event rather than
+ * storing PMC values in the descriptor itself.
+ */
+
+/* Read the HW event's PMC and return its value */
+static inline uint64_t __read_value(low_level_exp* exp)
+{
+	struct hw_event event=exp->event;
+
+	__read_count_hw_event(&event);
+	return __get_last_value_hw_event(&event);
+}
+
+/* Start the count of a HW event from a given value */
+static inline void __start_count_from(low_level_exp* exp, uint64_t value)
+{
+	struct hw_event event=exp->event;
+
+	__set_last_value_hw_event(&event,value);
+	__start_count_hw_event(&event);
+}
+
 
 #endif
@@ -23,7 +23,8 @@
 #endif
 
 #define MAX_32_B 0xffffffff
-#define AMP_MAX_EXP_CORETYPE	5
+/* Max number of event sets per core type (event multiplexing) */
+#define AMP_MAX_EXP_CORETYPE	32
 #define AMP_MAX_CORETYPES	2
 #define PMC_NEW_THREAD  (CLONE_FS| CLONE_FILES | CLONE_VM| \
 CLONE_SIGHAND| CLONE_THREAD )
@@ -36,24 +37,52 @@ CLONE_SIGHAND| CLONE_THREAD )
 #include <asm/atomic.h>
 #include <pmc/pmc_user.h> /*For the data type */
 #include <pmc/data_str/cbuffer.h>
+#include <pmc/data_str/sample_ring.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
 #include <linux/timer.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
 
 /**************** Monitoring experiments ********************************/
 
+/* Upper bound for the weight of an event set (event multiplexing) */
+#define PMC_MUX_MAX_WEIGHT	16
+
 /*
- * Structure to store platform-specific configuration for a set of hardware events
+ * Statistics that drive the adaptive multiplexing policy
+ * for an event set of a thread (or CPU).
+ * Rates are expressed in events per 1024ns (scaled by 1024).
  */
 typedef struct {
-	low_level_exp	array[MAX_LL_EXPS];	/* HW counters opaque descriptor */
+	uint64_t avg[MAX_LL_EXPS];	/* Moving average of the rate of each event */
+	uint64_t dev[MAX_LL_EXPS];	/* Moving average of the absolute deviation from avg */
+	unsigned int nr_samples;
+	unsigned int weight;		/* Weight derived from the variability of the rates */
+} mux_stats_t;
+
+/*
+ * Structure to store platform-specific configuration for a set of hardware events.
+ *
+ * Once set up, a core_experiment_t is never modified: all threads and CPUs
+ * monitoring the same events share one instance ("program"), which is
+ * freed when the last reference is dropped (see put_core_experiment()).
+ * Counter values and overflow counts are kept in a separate
+ * core_experiment_state_t owned by each thread or CPU.
+ */
+typedef struct {
+	/* Fields read along with the counters come first */
 	unsigned int	size;				/* Number of HW counters used for this event */
 	unsigned int	used_pmcs;			/* PMC mask used */
 	int 		ebs_idx;				/* A -1 value means that ebs is disabled.
 									 	 * Otherwise it stores the ll_exp ID
 									 	 * for which ebs is enabled */
-	unsigned char need_setup; 			/* Non-zero if a first-time PMCs configuration
-										 * needs to be done */
 	int exp_idx;						/* Exp index (for event multiplexing) */
+	low_level_exp	array[MAX_LL_EXPS];	/* HW counters opaque descriptor */
 	/* Structures to control PMC counter overflow in EBS mode */
 	unsigned int log_to_phys[MAX_LL_EXPS];	/* Table to obtain the physical PMC id
 											 * from a low-level_exp (logical) ID
@@ -61,21 +90,65 @@ typedef struct {
 	unsigned int phys_to_log[MAX_LL_EXPS];	/* Table to obtain the low-level_exp (logical) ID
 											 * from a physical PMC id
 											 */
-	unsigned int nr_overflows[MAX_LL_EXPS];	/* Overflow counts for each low_level_exp */
+	atomic_t ref_counter;				/* Number of experiment sets holding a reference */
+	unsigned int mux_weight;			/* Sampling intervals the event set keeps the PMU
+										 * for in a multiplexing round ("weight=N" flag) */
 }
 core_experiment_t;
 
+/*
+ * Per-thread (or per-CPU) state associated with the
+ * core_experiment_t currently in use
+ */
+typedef struct {
+	unsigned char need_setup; 			/* Non-zero if a first-time PMCs configuration
+										 * needs to be done */
+	unsigned int nr_overflows[MAX_LL_EXPS];	/* Overflow counts for each low_level_exp */
+	uint64_t saved_values[MAX_LL_EXPS];	/* PMC values when the counters were last stopped or read */
+	int pmu_cpu;						/* CPU whose PMCs were last loaded with these values */
+}
+core_experiment_state_t;
+
+/*
+ * Array of experiments of a multiplexing set. Its size grows on demand
+ * (up to AMP_MAX_EXP_CORETYPE). The array is shared by all the copies
+ * of the set (threads, CPUs in system-wide mode) and holds a reference
+ * to each experiment.
+ */
+typedef struct {
+	atomic_t ref_counter;
+	int nr_exps;
+	int max_exps;
+	core_experiment_t* exps[0];
+} core_experiment_vector_t;
+
 /*
  * Set of core_experiment_t structures.
  * This is the basic structure to support the event multiplexing feature:
- * several sets of HW events are monitored in a round-robin fashion.
+ * several sets of HW events are monitored in turns. Each event set keeps
+ * the PMU for as many sampling intervals as its weight.
  */
 typedef struct {
-	core_experiment_t* exps[AMP_MAX_EXP_CORETYPE];
+	core_experiment_vector_t* vector;	/* NULL for an empty set */
 	int nr_exps;
 	int cur_exp;	/* Contador modular entre 0 y nr_exps */
+	unsigned int nr_intervals;	/* Sampling intervals cur_exp has been on the PMU */
+	mux_stats_t* mux_stats;		/* Adaptive multiplexing policy (one entry per experiment).
+								 * Owned by the set (never shared), allocated on the first sample */
+	int nr_mux_stats;			/* Entries in mux_stats */
 } core_experiment_set_t;
 
+/* Multiplexing policies */
+typedef enum {
+	PMC_MUX_ROUND_ROBIN=0,	/* One sampling interval per event set */
+	PMC_MUX_WEIGHTED,		/* Event sets get as many intervals as their weight */
+	PMC_MUX_ADAPTIVE,		/* Weights scaled by the variability of the event rates */
+	PMC_NR_MUX_POLICIES
+} pmc_mux_policy_t;
+
+/* Global multiplexing policy */
+extern pmc_mux_policy_t pmc_mux_policy;
+
 /* Load extensions for the QuickIA prototype system */
 #ifdef CONFIG_PMC_CORE_2_DUO
 #define PMCTRACK_QUICKIA
@@ -121,19 +194,49 @@ typedef enum {
 	EBS_MODE			/* User-requested event-based sampling */
 } pmc_profiling_mode_t;
 
+/*
+ * Conditions to wake up the monitor process when samples become available.
+ * The monitor is woken up as soon as any of the enabled conditions
+ * is met on any per-CPU ring.
+ */
+typedef struct {
+	unsigned int nr_samples;		/* Unread samples in a ring (0 -> disabled) */
+	unsigned int fill_percent;		/* Ring occupancy in % (0 -> disabled) */
+	unsigned long latency;			/* Age of the oldest unread sample in jiffies (0 -> disabled) */
+} pmc_wakeup_cfg_t;
+
 /*
  * SMP-safe data structure to store
  * PMC samples and virtual counter values.
  *
  * The pmctrack program interacts with the kernel
  * by retrieving samples from this data structure.
+ * Samples are stored in per-CPU rings allocated on the
+ * CPU's local NUMA node. The monitor process can either
+ * consume them in place (by mapping the rings) or retrieve
+ * a merged copy of them by reading from /proc/pmc/monitor.
  */
 typedef struct {
-	cbuffer_t* pmc_samples; 		/* Ring buffer */
-	spinlock_t lock;				/* Spin lock to serialize accesses to this data structure */
-	struct semaphore sem_queue;		/* Semaphore for blocking the monitor program */
-	volatile int monitor_waiting;	/* Flag to indicate that the monitor is waiting
-										for new samples */
+	pmc_samples_ring_t* rings;		/* Per-CPU rings (indexed by CPU id) */
+	pmc_ring_control_t* control;	/* Control area (header + per-CPU indices) */
+	unsigned int control_size;		/* Size of the control area (in bytes, page aligned) */
+	unsigned int data_size;			/* Size of the data area of each ring (in bytes, power of two) */
+	pmc_overflow_policy_t overflow_policy;	/* What to do when a ring fills up */
+	unsigned int next_cpu;			/* First ring to drain on the next read (fairness) */
+	atomic_t nr_user_mappings;		/* Number of user mappings of the rings */
+	struct mutex consumer_lock;		/* Serializes readers of the buffer */
+	wait_queue_head_t wq;			/* Wait queue for blocking the monitor program */
+	struct irq_work wakeup_work;	/* To wake up the monitor from NMI context */
+	struct hrtimer latency_timer;	/* Wakes up the monitor when the oldest sample
+										of a ring exceeds the latency bound */
+	struct irq_work latency_work;	/* To arm the latency timer from NMI context */
+	unsigned int wakeup_threshold;	/* Wake up the monitor when a ring holds
+										this many unread samples */
+	unsigned int wakeup_fill_bytes;	/* ... or this many unread bytes (0 -> disabled) */
+	unsigned long wakeup_latency;	/* ... or when its oldest sample is this old (jiffies) */
+	volatile int flush_pending;		/* Set when a thread exits so that samples are handed over
+										regardless of the wakeup conditions */
+	struct work_struct free_work;	/* Deferred release of vmalloc()ed memory */
 	atomic_t ref_counter;			/*
 									 * Reference counter for this object. It reflects
 									 * the number of processes/threads that hold a
@@ -147,58 +250,175 @@ typedef struct {
 /* Predeclaration for monitoring_module type */
 struct monitoring_module;
 
+/* Max number of monitoring sessions a thread may take part in at once (TBS mode) */
+#define PMC_MAX_TASK_SESSIONS	4
+
+/*
+ * Monitoring session of a thread waiting for the PMU.
+ *
+ * Several monitor processes may attach to the same thread in TBS mode.
+ * Each one gets its own session: its own buffer, event sets, virtual
+ * counters and sampling period. Sessions time-share the PMU of the
+ * thread in round-robin order, one sampling interval of the session
+ * at a time. The session that has the PMU keeps its state in the
+ * fields of pmon_prof_t (pid_monitor, pmc_samples_buffer, ...). The
+ * state of the other ones is kept in this structure meanwhile.
+ */
+typedef struct {
+	pid_t pid_monitor;							/* PID of the monitor process */
+	pmc_samples_buffer_t* pmc_samples_buffer;	/* Buffer of the monitor process */
+	core_experiment_set_t pmcs_multiplex_cfg[AMP_MAX_CORETYPES];	/* Event sets of the session */
+	uint_t virt_counter_mask;					/* Virtual counter mask */
+	int pmc_jiffies_interval;					/* Sampling period (in jiffies) */
+	uint64_t pmc_sampling_period;				/* Sampling period (ns) */
+	uint64_t time_enabled;						/* Time (ns) the thread was monitored since the last sample of the session */
+	uint64_t time_running;						/* Time (ns) the events of the session were counting since then */
+} pmc_task_session_t;
+
+/*
+ * Space (in bytes) reserved for the fields of pmon_prof_t accessed
+ * on every context switch and tick (two cachelines on most platforms).
+ * The layout is checked at build time (see check_pmon_prof_layout()).
+ */
+#define PMON_PROF_HOT_BYTES	128
+
 /*
  * Per-thread data structure maintained
  * by PMCTrack's kernel module
  */
 typedef struct {
-	uint64_t pmc_values[MAX_LL_EXPS]; 	/* Accumulator for PMC values */
+	/*** Hot fields: read or updated on every context switch and tick ***/
 	struct task_struct *this_tsk;		/* Backwards pointer to the task struct of this thread */
+	core_experiment_t* pmcs_config;		/* Current PMC configuration in use */
+	pmc_profiling_mode_t profiling_mode; 	/* Sampling mode selected for the current thread */
+	int last_cpu;							/* Field to detect migrations */
+	unsigned long flags;					/* Per-process flags (defined right below) */
+	unsigned long context_switch_timestamp; /* Timestamp of the last context switch */
+	uint64_t time_enabled;					/* Time (ns) the thread ran with monitoring enabled since the last sample */
+	uint64_t time_running;					/* Time (ns) the counters were actually counting since the last sample */
+	uint64_t time_stamp;					/* pmc_sample_clock() value when the two fields above were last updated */
+	unsigned char time_on_cpu;				/* Nonzero if the thread is running (between switch in and out) */
+	unsigned char time_counting;			/* Nonzero if the counters are active while the thread runs */
 	unsigned int pmc_ticks_counter; 	/* Sampling interval control field for TBS.
 	                                     * Saturated counter (no reset on context switch).
 	                                     */
-	unsigned int samples_counter;   	/* The number of PMC samples collected for the thread */
+	uint_t nticks_sampling_period;			/* Scheduler-mode tick-based sampling period */
 	int pmc_jiffies_interval;			/* TBS sampling period length (in jiffies) */
-	unsigned long pmc_jiffies_timeout;	/* Timestamp to read performance and virtual counters */
-	core_experiment_t* pmcs_config;		/* Current PMC configuration in use */
-	core_experiment_set_t pmcs_multiplex_cfg[AMP_MAX_CORETYPES]; /* Per-thread PMCs configuration
-																  * (May include many experiments -> support for event multiplexing
-																  */
-	int last_cpu;							/* Field to detect migrations */
-	pmc_profiling_mode_t profiling_mode; 	/* Sampling mode selected for the current thread */
-	unsigned long context_switch_timestamp; /* Timestamp of the last context switch */
-	unsigned long flags;					/* Per-process flags (defined right below) */
+	uint64_t pmc_sample_deadline;		/* Time (ns, ktime_get()) to read performance and virtual counters */
 	uint_t virt_counter_mask;				/* Virtual counter mask */
-#ifdef TBS_TIMER
-	struct timer_list timer;				/* Timer used in TBS mode */
-#endif
+	unsigned int samples_counter;   	/* The number of PMC samples collected for the thread */
+	/*
+	 * Buffer shared between monitor process and threads being monitored
+	 * (the one of the session that has the PMU, see pmc_task_session_t)
+	 */
+	pmc_samples_buffer_t* pmc_samples_buffer;
+	struct monitoring_module* task_mod;		/* Pointer to the monitoring module assigned to this task */
+	void* 	monitoring_mod_priv_data;		/* Per-thread private data for current monitoring module */
 	spinlock_t lock;					/* Lock for PMC experiments */
+
+	/*** Counter values and state (hot as well, size depends on MAX_LL_EXPS) ***/
+	uint64_t pmc_values[MAX_LL_EXPS] ____cacheline_aligned; 	/* Accumulator for PMC values */
+	core_experiment_state_t pmcs_state;	/* Counter state associated with pmcs_config */
+
+	/*** Cold fields: configuration and monitor-side data ***/
+	core_experiment_set_t pmcs_multiplex_cfg[AMP_MAX_CORETYPES] ____cacheline_aligned; /* Per-thread PMCs configuration
+																  * (May include many experiments -> support for event multiplexing
+																  */
+	uint64_t pmc_sampling_period;			/* TBS sampling period length (ns) */
 	pid_t pid_monitor;					/* PID of the monitor process */
 	pmc_sample_t* pmc_user_samples;			/* Intermediate buffer to transfer data from kernel space
 	 								         * to the virtual address space of the monitor process
 	 								         * (Allocated on first use)
 	 								         */
 	pmc_sample_t* pmc_kernel_samples;		/* Shared memory region between user and kernel space!! */
-	pmc_samples_buffer_t* pmc_samples_buffer; /* Buffer shared between monitor process and threads being monitored */
-	uint_t nticks_sampling_period;			/* Scheduler-mode tick-based sampling period */
+	pmc_wakeup_cfg_t wakeup_cfg;			/* When to wake up this thread if it acts as a monitor */
 	uint_t  kernel_buffer_size;				/* Max capacity (in bytes) of the ring buffer in "pmc_samples_buffer" */
-	struct monitoring_module* task_mod;		/* Pointer to the monitoring module assigned to this task */
-	void* 	monitoring_mod_priv_data;		/* Per-thread private data for current monitoring module */
+	pmc_overflow_policy_t overflow_policy;	/* What to do when "pmc_samples_buffer" fills up */
+	pmc_task_session_t* waiting_sessions[PMC_MAX_TASK_SESSIONS-1];	/* Sessions waiting for the PMU (in round-robin order) */
+	unsigned int nr_waiting_sessions;		/* Number of entries in "waiting_sessions" */
+	uint64_t session_wait;					/* Time (ns) the current session waited before getting the PMU */
 } pmon_prof_t;
 
 /** Various flag values for the "flags" field in pmon_prof_t ***/
 #define PMC_EXITING	0x1
 #define PMC_SELF_MONITORING	0x2
 #define PMCTRACK_SF_NOTIFICATIONS 0x4
-#define PMC_PREPARE_MULTIPLEXING	0x8
 #define PMC_READ_SELF_MONITORING 0x10
 
 /** Operations on core_experiment_t **/
+
+/* core_experiment_t objects are allocated from a dedicated slab cache */
+extern struct kmem_cache* core_experiment_cache;
+int init_core_experiment_cache(void);
+void destroy_core_experiment_cache(void);
+
+/* Allocate a core_experiment_t (the caller holds the only reference) */
+static inline core_experiment_t* alloc_core_experiment(void)
+{
+	core_experiment_t* exp=kmem_cache_alloc(core_experiment_cache,GFP_KERNEL);
+
+	if (exp)
+		atomic_set(&exp->ref_counter,1);
+	return exp;
+}
+
+/* Get a new reference to a PMC experiment */
+static inline core_experiment_t* get_core_experiment(core_experiment_t* exp)
+{
+	atomic_inc(&exp->ref_counter);
+	return exp;
+}
+
+/* Drop a reference to a PMC experiment, and free it up if it was the last one */
+static inline void put_core_experiment(core_experiment_t* exp)
+{
+	if (exp && atomic_dec_and_test(&exp->ref_counter))
+		kmem_cache_free(core_experiment_cache,exp);
+}
+
 /* Initialize core_experiment_t structure */
 void init_core_experiment_t(core_experiment_t* core_experiment, int exp_idx);
 
+/* Initialize the per-thread state of a PMC experiment */
+static inline void init_core_experiment_state_t(core_experiment_state_t* state)
+{
+	state->need_setup=1;	/* Requires configuration on related CPU */
+	memset(state->nr_overflows,0,sizeof(state->nr_overflows));
+	state->pmu_cpu=-1;
+}
+
+/*
+ * Per-CPU pointer to the experiment state whose values are held
+ * by the (stopped) PMCs of the CPU. When a thread is switched back in
+ * on a CPU whose PMU nobody else used since the thread was switched out,
+ * the count is resumed without reprogramming the PMCs.
+ *
+ * Any code that modifies the PMCs of a CPU other than on behalf of
+ * the current thread must call invalidate_pmu_owner() on that CPU.
+ */
+DECLARE_PER_CPU(core_experiment_state_t*, pmc_pmu_owner);
+
+/* Record that the PMCs of "cpu" hold the values in "state" */
+static inline void set_pmu_owner(core_experiment_state_t* state, int cpu)
+{
+	per_cpu(pmc_pmu_owner,cpu)=state;
+	state->pmu_cpu=cpu;
+}
+
+/* Returns non-zero if the PMCs of "cpu" still hold the values in "state" */
+static inline int is_pmu_owner(core_experiment_state_t* state, int cpu)
+{
+	return per_cpu(pmc_pmu_owner,cpu)==state && state->pmu_cpu==cpu;
+}
+
+/* The PMCs of the current CPU are about to be overwritten */
+static inline void invalidate_pmu_owner(void)
+{
+	__this_cpu_write(pmc_pmu_owner,NULL);
+}
+
 /* Restart PMCs used by a core_experiment_t */
-void mc_restart_all_counters(core_experiment_t* core_experiment);
+void mc_restart_all_counters(core_experiment_t* core_experiment, core_experiment_state_t* state);
 
 /* Stop PMCs used by a core_experiment_t */
 void mc_stop_all_counters(core_experiment_t* core_experiment);
@@ -206,11 +426,11 @@ void mc_stop_all_counters(core_experiment_t* core_experiment);
 /* Clear PMCs used by a core_experiment_t */
 void mc_clear_all_counters(core_experiment_t* core_experiment);
 
-/* Save context associated with PMCs (context switch out) */
-void mc_save_all_counters(core_experiment_t* core_experiment);
+/* Stop PMCs and save their values (context switch out) */
+void mc_save_all_counters(core_experiment_t* core_experiment, core_experiment_state_t* state, int cpu);
 
 /* Restore context associated with PMCs (context switch in) */
-void mc_restore_all_counters(core_experiment_t* core_experiment);
+void mc_restore_all_counters(core_experiment_t* core_experiment, core_experiment_state_t* state, int cpu);
 
 /*
  * Given a null-terminated array of raw-formatted PMC configuration
@@ -227,127 +447,245 @@ void restore_context_perfregs ( core_experiment_t* core_experiment);
 
 /**** Operations on core experiment set_t ****/
 
-/* Free up memory from a set of PMC experiments */
-static inline void free_experiment_set(core_experiment_set_t* cset)
+/* Drop a reference to the array of experiments of a set */
+static inline void put_core_experiment_vector(core_experiment_vector_t* vector)
 {
 	int i=0;
 
-	for (i=0; i<cset->nr_exps; i++) {
-		kfree(cset->exps[i]);
-		cset->exps[i]=NULL;
-	}
+	if (!vector || !atomic_dec_and_test(&vector->ref_counter))
+		return;
+
+	for (i=0; i<vector->nr_exps; i++)
+		put_core_experiment(vector->exps[i]);
+
+	kfree(vector);
+}
 
+/* Free up memory from a set of PMC experiments */
+static inline void free_experiment_set(core_experiment_set_t* cset)
+{
+	put_core_experiment_vector(cset->vector);
+	cset->vector=NULL;
 	cset->nr_exps=0;
+	cset->cur_exp=0;
+	cset->nr_intervals=0;
+	kfree(cset->mux_stats);
+	cset->mux_stats=NULL;
+	cset->nr_mux_stats=0;
 }
 
-/* Add one PMC experiment to a given experiment set */
-static inline void add_experiment_to_set(core_experiment_set_t* cset, core_experiment_t* exp)
+/*
+ * Add one PMC experiment to a given experiment set.
+ * The set takes over the caller's reference to the experiment.
+ * The array of experiments is reallocated if it is full or shared
+ * with other sets (interrupts may be disabled).
+ *
+ * Returns 0 on success, -ENOSPC if the set is full and -ENOMEM
+ * if memory could not be allocated.
+ */
+static inline int add_experiment_to_set(core_experiment_set_t* cset, core_experiment_t* exp)
 {
+	core_experiment_vector_t* vector=cset->vector;
+	core_experiment_vector_t* new_vector;
+	int max_exps;
+	int i=0;
+
+	if (cset->nr_exps==AMP_MAX_EXP_CORETYPE)
+		return -ENOSPC;
+
+	if (!vector || cset->nr_exps==vector->max_exps || atomic_read(&vector->ref_counter)>1) {
+		max_exps=vector?2*vector->max_exps:4;
+		if (max_exps<=cset->nr_exps)
+			max_exps=cset->nr_exps+1;
+		if (max_exps>AMP_MAX_EXP_CORETYPE)
+			max_exps=AMP_MAX_EXP_CORETYPE;
+
+		new_vector=kmalloc(sizeof(core_experiment_vector_t)+max_exps*sizeof(core_experiment_t*),GFP_ATOMIC);
+
+		if (!new_vector)
+			return -ENOMEM;
+
+		atomic_set(&new_vector->ref_counter,1);
+		new_vector->max_exps=max_exps;
+		new_vector->nr_exps=cset->nr_exps;
+
+		for (i=0; i<cset->nr_exps; i++)
+			new_vector->exps[i]=get_core_experiment(vector->exps[i]);
+
+		put_core_experiment_vector(vector);
+		cset->vector=vector=new_vector;
+	}
+
 	/* Modifies the exp_idx with the position in the vector !!! */
 	exp->exp_idx=cset->nr_exps;
-	cset->exps[cset->nr_exps++]=exp;
+	vector->exps[vector->nr_exps++]=exp;
+	cset->nr_exps++;
+	return 0;
+}
+
+/* Return PMC configuration of the current event set being monitored */
+static inline core_experiment_t* get_cur_experiment_in_set(core_experiment_set_t* cset)
+{
+	return cset->nr_exps?cset->vector->exps[cset->cur_exp]:NULL;
 }
 
 /* Rewind the pointer for event multiplexing */
 static inline core_experiment_t* rewind_experiments_in_set(core_experiment_set_t* cset)
 {
 	cset->cur_exp=0;
-	return cset->exps[0];
+	cset->nr_intervals=0;
+	return get_cur_experiment_in_set(cset);
 }
 
-/* Select the next PMC experiment from the multiplexing event set */
+/* Number of sampling intervals the current event set of "cset" keeps the PMU for */
+static inline unsigned int get_mux_weight(core_experiment_set_t* cset)
+{
+	core_experiment_t* exp=cset->vector->exps[cset->cur_exp];
+
+	switch (pmc_mux_policy) {
+	case PMC_MUX_WEIGHTED:
+		return exp->mux_weight;
+	case PMC_MUX_ADAPTIVE:
+		/* No statistics yet: start off with the static weight */
+		if (cset->cur_exp>=cset->nr_mux_stats || !cset->mux_stats[cset->cur_exp].nr_samples)
+			return exp->mux_weight;
+		return cset->mux_stats[cset->cur_exp].weight;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Select the next PMC experiment from the multiplexing event set.
+ * This function must be invoked at the end of every sampling interval.
+ */
 static inline core_experiment_t* get_next_experiment_in_set(core_experiment_set_t* cset)
 {
-	if (cset->nr_exps>1) {
+	if (cset->nr_exps>1 &&
+	    ++cset->nr_intervals>=get_mux_weight(cset)) {
+		cset->nr_intervals=0;
 		cset->cur_exp++;
 
 		if (cset->cur_exp==cset->nr_exps)
 			cset->cur_exp=0;
 	}
-	return cset->exps[cset->cur_exp];
-}
-
-/* Return PMC configuration of the current event set being monitored */
-static inline core_experiment_t* get_cur_experiment_in_set(core_experiment_set_t* cset)
-{
-	return cset->exps[cset->cur_exp];
+	return get_cur_experiment_in_set(cset);
 }
 
 /* Initialize a set of multiplexing experiments (empty set by default) */
 static inline void init_core_experiment_set_t(core_experiment_set_t* cset)
 {
-	int i=0;
-
-	for (i=0; i<AMP_MAX_EXP_CORETYPE; i++)
-		cset->exps[i]=NULL;
-
+	cset->vector=NULL;
 	cset->nr_exps=0;
 	cset->cur_exp=0;
+	cset->nr_intervals=0;
+	cset->mux_stats=NULL;
+	cset->nr_mux_stats=0;
 }
 
-/* Copy the configuration of a experiment set into another */
+/*
+ * Copy the configuration of a experiment set into another.
+ * Experiments are shared: the destination set just gets
+ * a reference to the array of experiments of the source set.
+ * The multiplexing statistics are not copied.
+ */
 static inline int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t* src)
 {
-	int i=0,j=0;
-	core_experiment_t* exp=NULL;
-
-	dst->nr_exps=0;
+	dst->vector=src->vector;
+	dst->nr_exps=src->nr_exps;
 	dst->cur_exp=0;
+	dst->nr_intervals=0;
+	dst->mux_stats=NULL;
+	dst->nr_mux_stats=0;
 
-	for (i=0; i<src->nr_exps; i++) {
-		if (src->exps[i]!=NULL) {
-			exp= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
-			if (!exp)
-				goto free_allocated_experiments;
-			memcpy(exp,src->exps[i],sizeof(core_experiment_t));
-			/* Do not inherit overflow counters */
-			for (j=0; j<MAX_LL_EXPS; j++)
-				exp->nr_overflows[j]=0;
-			dst->exps[i]=exp;
-			dst->nr_exps++;
-		}
-
-	}
+	if (dst->vector)
+		atomic_inc(&dst->vector->ref_counter);
 
 	return 0;
-free_allocated_experiments:
-	for (i=0; i<dst->nr_exps; i++) {
-		kfree(dst->exps[i]);
-		dst->exps[i]=NULL;
-	}
-	return -ENOMEM;
 }
 
-/* Copy the configuration of a experiment set into another */
+/*
+ * Move the experiments of a set into another
+ * (the references held by "src" are transferred to "dst",
+ * which leaves "src" empty)
+ */
 static inline int clone_core_experiment_set_t_noalloc(core_experiment_set_t* dst,core_experiment_set_t* src)
 {
-	int i=0,j=0;
-
-	dst->nr_exps=0;
+	dst->vector=src->vector;
+	dst->nr_exps=src->nr_exps;
 	dst->cur_exp=0;
+	dst->nr_intervals=0;
+	dst->mux_stats=src->mux_stats;
+	dst->nr_mux_stats=src->nr_mux_stats;
+	init_core_experiment_set_t(src);
+	return 0;
+}
 
-	for (i=0; i<src->nr_exps; i++) {
-		if (src->exps[i]!=NULL) {
-			/* Just copy the pointer ... */
-			dst->exps[i]=src->exps[i];
-			/* Do not inherit overflow counters */
-			for (j=0; j<MAX_LL_EXPS; j++)
-				dst->exps[i]->nr_overflows[j]=0;
-			dst->nr_exps++;
-		}
+/*
+ * Update the statistics of the adaptive multiplexing policy with
+ * a sample of the current event set of "cset"
+ */
+void __mux_account_sample(core_experiment_set_t* cset, const uint64_t* counts, unsigned int nr_counts,
+                          uint64_t time_running);
 
-	}
-	return 0;
+static inline void mux_account_sample(core_experiment_set_t* cset, const uint64_t* counts,
+                                      unsigned int nr_counts, uint64_t time_running)
+{
+	if (pmc_mux_policy==PMC_MUX_ADAPTIVE && cset->nr_exps>1)
+		__mux_account_sample(cset,counts,nr_counts,time_running);
 }
 
 
 /**** Operations on a PMC sample buffer ****/
 
 /*
- * Allocate a buffer with capacity 'size_bytes'
+ * Allocate a buffer whose per-CPU rings have capacity 'size_bytes'
+ * (rounded up to a power of two, at least one page) and that handles
+ * overflows as indicated by 'policy'.
  * The function returns a non-null value on success.
  */
-pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes);
+pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes, pmc_overflow_policy_t policy);
+
+/*
+ * Free up the buffer and its per-CPU rings.
+ * Safe to call from atomic context (the memory is released
+ * later on from a workqueue if necessary).
+ */
+void free_pmc_samples_buffer(pmc_samples_buffer_t* sbuf);
+
+/* Apply the wakeup conditions requested by the monitor process */
+void set_wakeup_cfg_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, pmc_wakeup_cfg_t* cfg);
+
+/*
+ * Returns a non-zero value if the buffer's wakeup conditions are met,
+ * that is, if the monitor should process the samples right away
+ */
+int is_ready_pmc_samples_buffer(pmc_samples_buffer_t* sbuf);
+
+/* Returns the number of unread bytes (records) stored in the buffer */
+unsigned int nr_bytes_pmc_samples_buffer(pmc_samples_buffer_t* sbuf);
+
+/* Returns a non-zero value if no per-CPU ring holds records */
+static inline int is_empty_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	return nr_bytes_pmc_samples_buffer(sbuf)==0;
+}
+
+/*
+ * Move as many samples as fit in 'max_bytes' from the per-CPU rings into
+ * the 'dst' array, converting them into the legacy pmc_sample_t format.
+ * The function returns the number of bytes written into 'dst'.
+ *
+ * Only one consumer may invoke this function at a time.
+ */
+int drain_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* dst, unsigned int max_bytes);
+
+/*
+ * Return the page backing offset 'offset' of the buffer's user-visible
+ * layout (control area followed by the per-CPU data areas) or NULL if
+ * the offset is out of range.
+ */
+struct page* get_page_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, unsigned long offset);
 
 /* Increment the buffer's reference counter */
 static inline void get_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
@@ -361,59 +699,334 @@ static inline int get_pmc_samples_buffer_refs(pmc_samples_buffer_t* sbuf)
 	return atomic_read(&sbuf->ref_counter);
 }
 
+/*
+ * Return the number of references held by tasks (the monitored threads
+ * and the monitor process), leaving out those of the user mappings of
+ * the rings. The counter of mappings is read first, as a mapping takes
+ * its buffer reference before it is accounted for, so a concurrent
+ * mmap() never makes the result drop below the actual value.
+ */
+static inline int get_pmc_samples_buffer_task_refs(pmc_samples_buffer_t* sbuf)
+{
+	int nr_mappings=atomic_read(&sbuf->nr_user_mappings);
+
+	smp_rmb();
+	return atomic_read(&sbuf->ref_counter)-nr_mappings;
+}
+
 /* Decrement the buffer's reference counter */
 static inline void put_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
 {
-	if (atomic_dec_and_test(&sbuf->ref_counter)) {
-		destroy_cbuffer_t(sbuf->pmc_samples);
-		sbuf->pmc_samples=NULL;
-		kfree(sbuf);
-	}
+	if (atomic_dec_and_test(&sbuf->ref_counter))
+		free_pmc_samples_buffer(sbuf);
 }
 
 /*
- * Pushes a sample (PMC counts and virtual-counter values) into the buffer and
- * notifies the userspace program if necessary.
- *
- * The function must be invoked with the buffer's lock held.
+ * Make sure that the monitor is woken up when the latency bound of
+ * the sample being pushed expires, even if the monitor is waiting in
+ * poll() and the other wakeup conditions are not met by then.
+ * If the timer is already armed, it fires for an older sample and
+ * then re-arms itself for the remaining ones.
  */
-static inline void __push_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+static inline void __arm_latency_timer(pmc_samples_buffer_t* sbuf)
 {
+	if (!sbuf->wakeup_latency || hrtimer_active(&sbuf->latency_timer))
+		return;
 
-	insert_items_cbuffer_t (sbuf->pmc_samples, sample, sizeof(pmc_sample_t));
+	/* Timers cannot be armed from NMI context */
+	if (in_nmi())
+		irq_work_queue(&sbuf->latency_work);
+	else
+		hrtimer_start(&sbuf->latency_timer,ns_to_ktime(jiffies_to_nsecs(sbuf->wakeup_latency)),
+		              HRTIMER_MODE_REL);
+}
 
-	if (sbuf->monitor_waiting) {
-		sbuf->monitor_waiting=0;
-		up(&sbuf->sem_queue);
+/* Keep track of the age of the oldest unread sample in a ring */
+static inline void __track_ring_latency(pmc_samples_buffer_t* sbuf, pmc_samples_ring_t* ring)
+{
+	/* First unread sample: start counting latency from now on */
+	if (ring->idx->head==ACCESS_ONCE(ring->idx->tail)) {
+		ring->first_stamp=jiffies;
+		__arm_latency_timer(sbuf);
 	}
 }
 
 /*
- * Pushes a sample (PMC counts and virtual-counter values) into the buffer.
+ * Insert a sample into a per-CPU ring (see __store_sample_ring())
+ * and keep track of the age of the oldest unread sample.
+ *
+ * 'p' is the monitored task (NULL in system-wide mode, where
+ * the sample's pid field holds the CPU the values belong to).
  *
- * The function must be invoked with the buffer's lock held.
+ * Returns a non-zero value if the sample was stored.
  */
-static inline void __push_sample_cbuffer_nowakeup(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+static inline int __push_sample_ring(pmc_samples_buffer_t* sbuf, pmc_samples_ring_t* ring,
+                                     pmc_sample_v2_t* sample, struct task_struct* p)
 {
-	insert_items_cbuffer_t (sbuf->pmc_samples, (const char*) sample, sizeof(pmc_sample_t));
+	__track_ring_latency(sbuf,ring);
+
+	if (p)
+		return __store_sample_ring(ring,sbuf->data_size,sbuf->overflow_policy,sample,
+		                           p->pid,p->tgid,smp_processor_id());
+	else
+		return __store_sample_ring(ring,sbuf->data_size,sbuf->overflow_policy,sample,
+		                           -1,-1,sample->pid);
 }
 
 /*
  * Wake up the userspace monitor process so that it can retrieve
  * values from the buffer of samples.
  *
- * The function must be invoked with the buffer's lock held.
+ * The function must be invoked with interrupts disabled.
  */
 static inline void __wake_up_monitor_program(pmc_samples_buffer_t* sbuf)
 {
-	if (sbuf->monitor_waiting) {
-		sbuf->monitor_waiting=0;
-		up(&sbuf->sem_queue);
+	/* Order the publication of samples with the check of the wait queue */
+	smp_mb();
+
+	if (!waitqueue_active(&sbuf->wq))
+		return;
+
+	/* The wait queue's lock cannot be taken from NMI context */
+	if (in_nmi())
+		irq_work_queue(&sbuf->wakeup_work);
+	else
+		wake_up_interruptible(&sbuf->wq);
+}
+
+/*
+ * Wake up the monitor regardless of the wakeup conditions
+ * (e.g., when a monitored thread exits)
+ *
+ * The function must be invoked with interrupts disabled.
+ */
+static inline void __flush_monitor_program(pmc_samples_buffer_t* sbuf)
+{
+	sbuf->flush_pending=1;
+	__wake_up_monitor_program(sbuf);
+}
+
+/*
+ * Returns a non-zero value if 'nr_unread' bytes in a ring
+ * meet the wakeup conditions based on occupancy.
+ */
+static inline int __ring_fill_exceeded(pmc_samples_buffer_t* sbuf, pmc_samples_ring_t* ring, uint32_t nr_unread)
+{
+	/* Sample-count threshold, based on the size of the records being pushed */
+	if (nr_unread>=sbuf->wakeup_threshold*ring->last_record_size)
+		return 1;
+
+	return sbuf->wakeup_fill_bytes && nr_unread>=sbuf->wakeup_fill_bytes;
+}
+
+/*
+ * Check the wakeup conditions of a ring after inserting a sample
+ * Returns a non-zero value if the monitor must be woken up.
+ */
+static inline int __ring_needs_wakeup(pmc_samples_buffer_t* sbuf, pmc_samples_ring_t* ring)
+{
+	uint32_t nr_unread=ring->idx->head-ACCESS_ONCE(ring->idx->tail);
+
+	if (__ring_fill_exceeded(sbuf,ring,nr_unread))
+		return 1;
+
+	return sbuf->wakeup_latency && time_after_eq(jiffies,ring->first_stamp+sbuf->wakeup_latency);
+}
+
+/*
+ * Pushes a sample (PMC counts and virtual-counter values) into the
+ * ring of the current CPU.
+ *
+ * The function must be invoked with interrupts disabled.
+ */
+static inline void __push_sample_cbuffer_nowakeup(pmc_samples_buffer_t* sbuf, pmc_sample_v2_t* sample,
+        struct task_struct* p)
+{
+	__push_sample_ring(sbuf,&sbuf->rings[smp_processor_id()],sample,p);
+}
+
+/*
+ * Pushes a sample (PMC counts and virtual-counter values) into the buffer and
+ * notifies the userspace program if the wakeup conditions are met.
+ *
+ * The function must be invoked with interrupts disabled.
+ */
+static inline void __push_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_v2_t* sample,
+        struct task_struct* p)
+{
+	pmc_samples_ring_t* ring=&sbuf->rings[smp_processor_id()];
+
+	/* Wake up the monitor right away if the ring is full */
+	if (!__push_sample_ring(sbuf,ring,sample,p) || __ring_needs_wakeup(sbuf,ring))
+		__wake_up_monitor_program(sbuf);
+}
+
+/*
+ * Reserve a sample record of task 'p' in the ring of the current CPU
+ * so that the caller can store the timing fields and the counts in
+ * place (see __reserve_sample_ring()). The record is published with
+ * __commit_sample_cbuffer().
+ *
+ * The function must be invoked with interrupts disabled, which must
+ * stay disabled until the record is committed.
+ *
+ * Returns NULL if the sample was dropped.
+ */
+static inline pmc_sample_record_t* __reserve_sample_cbuffer(pmc_samples_buffer_t* sbuf, struct task_struct* p,
+        sample_type_t type, int coretype, int exp_idx,
+        unsigned int pmc_mask, unsigned int nr_counts,
+        uint32_t* next_head)
+{
+	pmc_samples_ring_t* ring=&sbuf->rings[smp_processor_id()];
+	pmc_sample_record_t* rec;
+
+	__track_ring_latency(sbuf,ring);
+
+	rec=__reserve_sample_ring(ring,sbuf->data_size,sbuf->overflow_policy,coretype,exp_idx,
+	                          pmc_mask,nr_counts,0,0,next_head);
+	if (!rec)
+		return NULL;
+
+	rec->type=type;
+	rec->tid=p->pid;
+	rec->tgid=p->tgid;
+	rec->cpu=smp_processor_id();
+	return rec;
+}
+
+/*
+ * Publish a record obtained with __reserve_sample_cbuffer() and,
+ * if 'wakeup' is set, notify the userspace program if the wakeup
+ * conditions are met. Pass a NULL record if the reservation failed.
+ */
+static inline void __commit_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_record_t* rec,
+        uint32_t next_head, int wakeup)
+{
+	pmc_samples_ring_t* ring=&sbuf->rings[smp_processor_id()];
+
+	if (rec)
+		__commit_sample_ring(ring,rec,next_head);
+
+	/* Wake up the monitor right away if the ring is full */
+	if (wakeup && (!rec || __ring_needs_wakeup(sbuf,ring)))
+		__wake_up_monitor_program(sbuf);
+}
+
+/*
+ * Report that a CPU was brought online or taken offline in the ring of
+ * the current CPU, and wake up the monitor right away.
+ *
+ * The function must be invoked with interrupts disabled.
+ */
+static inline void __push_cpu_state_cbuffer(pmc_samples_buffer_t* sbuf, int cpu, int online, uint64_t timestamp)
+{
+	pmc_samples_ring_t* ring=&sbuf->rings[smp_processor_id()];
+	pmc_cpu_state_record_t* rec;
+	uint32_t next_head;
+
+	for (;;) {
+		if (!__push_lost_ring(ring,sbuf->data_size) &&
+		    (rec=__reserve_ring_record(ring,sbuf->data_size,sizeof(pmc_cpu_state_record_t),&next_head)))
+			break;
+
+		/* The ring is full */
+		if (sbuf->overflow_policy!=PMC_OVERFLOW_OVERWRITE || !__evict_ring_record(ring,sbuf->data_size)) {
+			ring->idx->nr_lost++;
+			ring->nr_lost_pending++;
+			__wake_up_monitor_program(sbuf);
+			return;
+		}
+	}
+
+	rec->header.type=PMC_RECORD_CPU_STATE;
+	rec->header.flags=0;
+	rec->header.size=sizeof(pmc_cpu_state_record_t);
+	rec->cpu=cpu;
+	rec->online=online?1:0;
+	rec->timestamp=timestamp;
+	__commit_ring_record(ring,next_head);
+
+	__flush_monitor_program(sbuf);
+}
+
+/*
+ * Clock used to timestamp samples and to account the time event sets
+ * are enabled/running (ns). It is monotonic, consistent across CPUs
+ * (so samples collected on different CPUs can be merged by timestamp)
+ * and can be read from NMI context.
+ */
+static inline uint64_t pmc_sample_clock(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+	return ktime_get_mono_fast_ns();
+#else
+	return ktime_to_ns(ktime_get());
+#endif
+}
+
+/*
+ * Account the time elapsed since the last update of the timing
+ * fields of a thread and return the current time.
+ *
+ * These functions must be invoked with prof->lock held.
+ */
+static inline uint64_t __update_sample_times(pmon_prof_t* prof)
+{
+	uint64_t now=pmc_sample_clock();
+	uint64_t delta;
+
+	/*
+	 * The fast clock may step back slightly when read from NMI
+	 * context during a clock update: do not account negative deltas
+	 */
+	if (prof->time_on_cpu && now>prof->time_stamp) {
+		delta=now-prof->time_stamp;
+		prof->time_enabled+=delta;
+		if (prof->time_counting)
+			prof->time_running+=delta;
 	}
+
+	prof->time_stamp=now;
+	return now;
 }
 
-/* SMP-safe version of __push_sample_cbuffer() */
-static inline void push_sample_cbuffer(pmon_prof_t* prof,pmc_sample_t* sample)
+/* Start accounting time when the thread is switched in */
+static inline void sample_times_switch_in(pmon_prof_t* prof, int counting)
+{
+	__update_sample_times(prof);
+	prof->time_on_cpu=1;
+	prof->time_counting=counting;
+}
+
+/* Stop accounting time when the thread is switched out */
+static inline void sample_times_switch_out(pmon_prof_t* prof)
+{
+	__update_sample_times(prof);
+	prof->time_on_cpu=0;
+}
+
+/*
+ * Get the timestamp of a new sample and the time the event set was
+ * enabled/running since the previous sample of the thread.
+ */
+static inline void take_sample_times(pmon_prof_t* prof, uint64_t* timestamp,
+                                     uint64_t* time_enabled, uint64_t* time_running)
+{
+	*timestamp=__update_sample_times(prof);
+	*time_enabled=prof->time_enabled;
+	*time_running=prof->time_running;
+	prof->time_enabled=0;
+	prof->time_running=0;
+}
+
+/* Timestamp a sample and store its timing fields (see take_sample_times()) */
+static inline void fill_sample_times(pmon_prof_t* prof, pmc_sample_v2_t* sample)
+{
+	take_sample_times(prof,&sample->timestamp,&sample->time_enabled,&sample->time_running);
+}
+
+/* Interrupt-safe version of __push_sample_cbuffer() */
+static inline void push_sample_cbuffer(pmon_prof_t* prof,pmc_sample_v2_t* sample)
 {
 
 	unsigned long flags;
@@ -422,10 +1035,69 @@ static inline void push_sample_cbuffer(pmon_prof_t* prof,pmc_sample_t* sample)
 	if (!prof->pmc_samples_buffer)
 		return;
 
-	/* Push current counter values into the buffer */
-	spin_lock_irqsave(&prof->pmc_samples_buffer->lock,flags);
-	__push_sample_cbuffer(prof->pmc_samples_buffer,sample);
-	spin_unlock_irqrestore(&prof->pmc_samples_buffer->lock,flags);
+	/* Push current counter values into the ring of the local CPU */
+	local_irq_save(flags);
+	__push_sample_cbuffer(prof->pmc_samples_buffer,sample,prof->this_tsk);
+	local_irq_restore(flags);
+}
+
+/* Room needed in a ring to store a sample without losing anything */
+#define PMC_THROTTLE_MIN_ROOM \
+	(sizeof(pmc_lost_record_t)+sizeof(pmc_schema_record_t)+2*PMC_MAX_RECORD_SIZE)
+
+/*
+ * Returns a non-zero value if a new sample must be deferred because
+ * the ring of the current CPU is full and the buffer uses the
+ * PMC_OVERFLOW_THROTTLE policy. The caller must then leave the
+ * accumulated counts in place so that the next sample includes them.
+ *
+ * The function must be invoked with interrupts disabled.
+ */
+static inline int __throttle_sample_cbuffer(pmc_samples_buffer_t* sbuf)
+{
+	pmc_samples_ring_t* ring;
+
+	if (sbuf->overflow_policy!=PMC_OVERFLOW_THROTTLE)
+		return 0;
+
+	ring=&sbuf->rings[smp_processor_id()];
+
+	if (sbuf->data_size-(ring->idx->head-ACCESS_ONCE(ring->idx->tail))>=PMC_THROTTLE_MIN_ROOM)
+		return 0;
+
+	ring->idx->nr_throttled++;
+	__wake_up_monitor_program(sbuf);
+	return 1;
+}
+
+/* Interrupt-safe version of __throttle_sample_cbuffer() */
+static inline int throttle_sample_cbuffer(pmon_prof_t* prof)
+{
+	unsigned long flags;
+	int throttle;
+
+	if (!prof->pmc_samples_buffer)
+		return 0;
+
+	local_irq_save(flags);
+	throttle=__throttle_sample_cbuffer(prof->pmc_samples_buffer);
+	local_irq_restore(flags);
+
+	return throttle;
+}
+
+/*
+ * Arm a pinned hrtimer to expire at an absolute time.
+ * Safe to use in the context-switch path: on older kernels
+ * ksoftirqd must not be woken up with the runqueue lock held.
+ */
+static inline void pmct_hrtimer_start_pinned(struct hrtimer* timer, ktime_t expires)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
+	__hrtimer_start_range_ns(timer,expires,0,HRTIMER_MODE_ABS_PINNED,0);
+#else
+	hrtimer_start(timer,expires,HRTIMER_MODE_ABS_PINNED);
+#endif
 }
 
 
@@ -86,7 +86,7 @@ typedef struct monitoring_module {
 	 * The function returns 0 on success, and a non-zero value upon failure
 	 */
 	int		(*on_new_sample)(	pmon_prof_t* prof,				/* Current thread's pmon structure */
-	                            int cpu,pmc_sample_t* sample,	/* Array of freshly gathered PMC values */
+	                            int cpu,pmc_sample_v2_t* sample,	/* Array of freshly gathered PMC values */
 	                            int flags,						/* Flags indicating the context where this sample has been taken */
 	                            void* data);
 	void	(*on_migrate)(pmon_prof_t* p, int prev_cpu, int new_cpu);	/*	Invoked when a process is migrated to a different CPU
@@ -119,8 +119,8 @@ typedef struct monitoring_module {
 																					stopping system-wide monitoring mode */
 	void 	(*on_syswide_refresh_monitor)(int cpu, unsigned int virtual_mask);	/* 	Invoked on each CPU to update virtual-counter
 																					counts in system-wide monitoring mode */
-	/* 	Invoked on each CPU to dump virtual-counter values into a pmc_sample_t structure */
-	void 	(*on_syswide_dump_virtual_counters)(int cpu, unsigned int virtual_mask, pmc_sample_t* sample);
+	/* 	Invoked on each CPU to dump virtual-counter values into a pmc_sample_v2_t structure */
+	void 	(*on_syswide_dump_virtual_counters)(int cpu, unsigned int virtual_mask, pmc_sample_v2_t* sample);
 } monitoring_module_t;
 
 
@@ -141,7 +141,9 @@ int mm_on_read_config(char* str, unsigned int len);
 int mm_on_write_config(const char *str, unsigned int len);
 int mm_on_fork(unsigned long clone_flags, pmon_prof_t* prof);
 void mm_on_exec(pmon_prof_t* prof);
-int mm_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data);
+/* Returns a non-zero value if the monitoring module of the thread processes its samples */
+int mm_handles_samples(pmon_prof_t* prof);
+int mm_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data);
 void mm_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu);
 void mm_on_exit(pmon_prof_t* prof);
 void mm_on_free_task(pmon_prof_t* prof);
@@ -152,7 +154,7 @@ void mm_module_counter_usage(monitoring_module_counter_usage_t* usage);
 int mm_on_syswide_start_monitor(int cpu, unsigned int virtual_mask);
 void mm_on_syswide_stop_monitor(int cpu, unsigned int virtual_mask);
 void mm_on_syswide_refresh_monitor(int cpu, unsigned int virtual_mask);
-void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample);
+void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_v2_t* sample);
 
 
 /* Safe and generic open/close operations for /proc entries */
@@ -0,0 +1,120 @@
+/*
+ *  include/pmc/pmc_expr.h
+ *
+ *  Compiled expressions for high-level performance metrics.
+ *  Metric definitions such as "(ev2*64)/(ev1/2400)" are translated
+ *  into a compact stack-machine program once, and the program is
+ *  evaluated in fixed point for every sample.
+ *  (This code can be built in user space as well)
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+#ifndef PMC_EXPR_H
+#define PMC_EXPR_H
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <sys/types.h>
+#include <stdint.h>
+#endif
+
+/*
+ * Values are signed 64-bit fixed-point numbers
+ * with PMC_EXPR_FRAC_BITS fractional bits
+ */
+#define PMC_EXPR_FRAC_BITS	16
+#define PMC_EXPR_ONE		(1LL<<PMC_EXPR_FRAC_BITS)
+#define PMC_EXPR_MAX		0x7fffffffffffffffLL
+#define PMC_EXPR_MIN		(-PMC_EXPR_MAX-1)
+
+/* Conversions between integers and fixed-point values */
+#define pmc_expr_from_int(x)	((int64_t)(x)<<PMC_EXPR_FRAC_BITS)
+#define pmc_expr_to_int(x)	((x)>>PMC_EXPR_FRAC_BITS)
+
+/* Limits of a compiled program */
+#define PMC_EXPR_MAX_INSNS	48
+#define PMC_EXPR_MAX_CONSTS	16
+#define PMC_EXPR_MAX_STACK	16
+#define PMC_EXPR_MAX_LENGTH	256	/* Max length of an expression string */
+
+/* Bytecode instructions */
+typedef enum {
+	PMC_EXPR_PUSH_CONST=0,	/* operand: index in the constant pool */
+	PMC_EXPR_PUSH_EVENT,	/* operand: index in the hw_events array */
+	PMC_EXPR_PUSH_METRIC,	/* operand: index of a previous metric */
+	PMC_EXPR_ADD,		/* operand: number of arguments (also sum(...)) */
+	PMC_EXPR_SUB,
+	PMC_EXPR_MUL,
+	PMC_EXPR_DIV,		/* Division by zero yields zero */
+	PMC_EXPR_NEG,
+	PMC_EXPR_MIN_N,		/* operand: number of arguments */
+	PMC_EXPR_MAX_N,		/* operand: number of arguments */
+	PMC_EXPR_NR_OPCODES
+} pmc_expr_opcode_t;
+
+typedef struct {
+	uint8_t opcode;
+	uint8_t reserved;
+	uint16_t operand;
+} pmc_expr_insn_t;
+
+/* A compiled expression (immutable once compiled) */
+typedef struct {
+	pmc_expr_insn_t code[PMC_EXPR_MAX_INSNS];
+	int64_t consts[PMC_EXPR_MAX_CONSTS];
+	unsigned int nr_insns;
+	unsigned int nr_consts;
+	unsigned int max_depth;		/* Max stack depth reached by the program */
+	unsigned int nr_events;		/* 1 + highest hw_events index used */
+} pmc_expr_t;
+
+/*
+ * Callback to resolve a name referenced in an expression.
+ * It returns the index of the metric or -1 if the name is unknown.
+ * Names of events may be resolved as well: in that case
+ * the index in the hw_events array is returned and *opcode must be
+ * set to PMC_EXPR_PUSH_EVENT.
+ */
+typedef int (*pmc_expr_lookup_t)(const char* name, void* data, pmc_expr_opcode_t* opcode);
+
+/*
+ * Compile an expression. The grammar is:
+ *
+ *   expr    := term { ('+'|'-') term }
+ *   term    := factor { ('*'|'/') factor }
+ *   factor  := ['-'] primary
+ *   primary := number | "ev"N | name | func '(' expr { ',' expr } ')' | '(' expr ')'
+ *   func    := "min" | "max" | "sum"
+ *
+ * Numbers may have a fractional part (e.g., 2.5) or be in hex (0x40).
+ * "evN" stands for the N-th element of the hw_events array and
+ * other names are resolved via lookup(). Operations whose arguments
+ * are constants are folded.
+ *
+ * Returns 0 and a newly allocated program in *prog on success, or
+ * -EINVAL (syntax error or unknown name), -E2BIG (too complex) or -ENOMEM.
+ */
+int pmc_expr_compile(const char* str, pmc_expr_lookup_t lookup, void* data, pmc_expr_t** prog);
+
+/* Free up a program returned by pmc_expr_compile() */
+void pmc_expr_free(pmc_expr_t* prog);
+
+/*
+ * Check that a program only reads the first nr_hw_events elements
+ * of the hw_events array. Returns 0 if so, and -EINVAL otherwise.
+ */
+int pmc_expr_check_events(const pmc_expr_t* prog, unsigned int nr_hw_events);
+
+/*
+ * Evaluate a program. Metric values are read from metric_values,
+ * an array of fixed-point values whose elements are "stride" bytes apart
+ * (so that the value field of an array of structures can be passed).
+ * Results that do not fit in 64 bits saturate.
+ */
+int64_t pmc_expr_eval(const pmc_expr_t* prog,
+                      const uint64_t* hw_events,
+                      const int64_t* metric_values,
+                      unsigned int stride);
+
+#endif
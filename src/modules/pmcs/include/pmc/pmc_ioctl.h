@@ -0,0 +1,98 @@
+/*
+ *  include/pmc/pmc_ioctl.h
+ *
+ *  Binary control interface exported by PMCTrack via /dev/pmctrack
+ *  (shared by the kernel module and user space)
+ *
+ *  Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+#ifndef PMC_IOCTL_H
+#define PMC_IOCTL_H
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+
+#define PMCT_IOC_DEVICE_NAME	"pmctrack"
+#define PMCT_IOC_DEVICE_PATH	"/dev/pmctrack"
+
+/*
+ * Version of the binary ABI. It must be bumped whenever
+ * the layout of any of the structures below changes.
+ */
+#define PMCT_IOC_ABI_VERSION	2
+
+/* Maximum number of precompiled configurations per open file */
+#define PMCT_IOC_MAX_HANDLES	32
+/* Maximum number of event sets (multiplexing) per configuration */
+#define PMCT_IOC_MAX_EVENT_SETS	32
+/* Maximum length of a raw PMC configuration string */
+#define PMCT_IOC_MAX_CFG_LEN	256
+/* Maximum number of PIDs in a PMCT_IOC_ATTACH_LIST request */
+#define PMCT_IOC_MAX_PIDS	65536
+
+/* Flags for PMCT_IOC_START and PMCT_IOC_STOP */
+#define PMCT_IOC_SYSWIDE	0x1	/* System-wide session (otherwise per-thread) */
+
+/* PMCT_IOC_GET_VERSION */
+struct pmct_ioc_version {
+	uint32_t abi_version;
+	uint32_t max_handles;
+	uint32_t max_event_sets;
+	uint32_t max_cfg_len;
+};
+
+/*
+ * PMCT_IOC_COMPILE: validate a set of raw PMC configuration strings
+ * (one per event set) and keep the low-level representation in the
+ * kernel. The handle to reference it is returned in "handle".
+ */
+struct pmct_ioc_config {
+	uint32_t nr_sets;
+	int32_t handle;
+	char strcfg[PMCT_IOC_MAX_EVENT_SETS][PMCT_IOC_MAX_CFG_LEN];
+};
+
+/* PMCT_IOC_ATTACH and PMCT_IOC_ATTACH_TGID */
+struct pmct_ioc_attach {
+	int32_t handle;
+	int32_t pid;
+};
+
+/*
+ * PMCT_IOC_ATTACH_LIST: attach a set of processes at once.
+ * "pids" holds the user address of an array of "nr_pids" int32_t.
+ */
+struct pmct_ioc_attach_list {
+	int32_t handle;
+	uint32_t nr_pids;
+	uint64_t pids;
+};
+
+/* PMCT_IOC_START */
+struct pmct_ioc_start {
+	int32_t handle;
+	uint32_t flags;
+};
+
+#define PMCT_IOC_MAGIC		0xE7
+
+#define PMCT_IOC_GET_VERSION	_IOR(PMCT_IOC_MAGIC, 0, struct pmct_ioc_version)
+#define PMCT_IOC_COMPILE	_IOWR(PMCT_IOC_MAGIC, 1, struct pmct_ioc_config)
+#define PMCT_IOC_DESTROY	_IOW(PMCT_IOC_MAGIC, 2, int32_t)
+#define PMCT_IOC_ATTACH		_IOW(PMCT_IOC_MAGIC, 3, struct pmct_ioc_attach)
+#define PMCT_IOC_DETACH		_IOW(PMCT_IOC_MAGIC, 4, int32_t)
+#define PMCT_IOC_START		_IOW(PMCT_IOC_MAGIC, 5, struct pmct_ioc_start)
+#define PMCT_IOC_STOP		_IOW(PMCT_IOC_MAGIC, 6, uint32_t)
+#define PMCT_IOC_ATTACH_TGID	_IOW(PMCT_IOC_MAGIC, 7, struct pmct_ioc_attach)
+#define PMCT_IOC_DETACH_TGID	_IOW(PMCT_IOC_MAGIC, 8, int32_t)
+#define PMCT_IOC_ATTACH_LIST	_IOW(PMCT_IOC_MAGIC, 9, struct pmct_ioc_attach_list)
+
+#endif
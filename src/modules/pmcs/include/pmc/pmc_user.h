@@ -30,10 +30,16 @@ typedef enum {
 	PMC_EXIT_SAMPLE,
 	PMC_MIGRATION_SAMPLE,
 	PMC_SELF_SAMPLE,
+	PMC_CPU_ONLINE_SAMPLE,	/* System-wide mode: CPU brought online (no counts) */
+	PMC_CPU_OFFLINE_SAMPLE,	/* System-wide mode: CPU taken offline (no counts) */
 	PMC_NR_SAMPLE_TYPES
 } sample_type_t;
 
-/* Structure to store PMC and virtual-counter values */
+/*
+ * Structure to store PMC and virtual-counter values.
+ * This is the format returned by read() on /proc/pmc/monitor:
+ * its layout must not change.
+ */
 typedef struct pmc_sample {
 	sample_type_t type;     /* Sample type */
 	int coretype;           /* Core type where this sample was registered */
@@ -47,4 +53,290 @@ typedef struct pmc_sample {
 	uint64_t virtual_counts[MAX_VIRTUAL_COUNTERS];	/* Raw virtual-counter values */
 } pmc_sample_t;
 
+/*
+ * Extended sample, as obtained from the record stream of the sample
+ * rings. It is also the format used for samples inside the kernel.
+ */
+typedef struct pmc_sample_v2 {
+	sample_type_t type;     /* Sample type */
+	int coretype;           /* Core type where this sample was registered */
+	int exp_idx;            /* Index of the experiment set related to this counter setup */
+	pid_t pid;              /* To store a process id (per-thread mode) or CPU (system-wide mode) */
+	unsigned int pmc_mask;  /* PMC mask for this sample */
+	unsigned int nr_counts; /* Number of performance counts associated with this sample */
+	uint64_t pmc_counts[MAX_PERFORMANCE_COUNTERS]; /* Raw PMC counts */
+	unsigned int virt_mask;  /* Virtual counter mask for this sample */
+	unsigned int nr_virt_counts; /* Number of virtual counts associated with this sample */
+	uint64_t virtual_counts[MAX_VIRTUAL_COUNTERS];	/* Raw virtual-counter values */
+	pid_t tgid;             /* Thread group of the thread (-1 in system-wide mode) */
+	uint64_t timestamp;     /* Time when the sample was collected (ns, monotonic) */
+	uint64_t time_enabled;  /* Time the event set was enabled during the sampling interval (ns) */
+	uint64_t time_running;  /* Time the event set was actually counting during the interval (ns) */
+} pmc_sample_v2_t;
+
+/* Convert an extended sample into the legacy format (tgid and timing information are lost) */
+static inline void pmc_sample_to_legacy(const pmc_sample_v2_t* sample, pmc_sample_t* legacy)
+{
+	unsigned int i;
+
+	legacy->type=sample->type;
+	legacy->coretype=sample->coretype;
+	legacy->exp_idx=sample->exp_idx;
+	legacy->pid=sample->pid;
+	legacy->pmc_mask=sample->pmc_mask;
+	legacy->nr_counts=sample->nr_counts;
+	legacy->virt_mask=sample->virt_mask;
+	legacy->nr_virt_counts=sample->nr_virt_counts;
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS; i++)
+		legacy->pmc_counts[i]=sample->pmc_counts[i];
+	for (i=0; i<MAX_VIRTUAL_COUNTERS; i++)
+		legacy->virtual_counts[i]=sample->virtual_counts[i];
+}
+
+/* Convert a legacy sample into the extended format (with no tgid or timing information) */
+static inline void pmc_sample_from_legacy(const pmc_sample_t* legacy, pmc_sample_v2_t* sample)
+{
+	unsigned int i;
+
+	sample->type=legacy->type;
+	sample->coretype=legacy->coretype;
+	sample->exp_idx=legacy->exp_idx;
+	sample->pid=legacy->pid;
+	sample->tgid=-1;
+	sample->pmc_mask=legacy->pmc_mask;
+	sample->nr_counts=legacy->nr_counts;
+	sample->virt_mask=legacy->virt_mask;
+	sample->nr_virt_counts=legacy->nr_virt_counts;
+	sample->timestamp=0;
+	sample->time_enabled=0;
+	sample->time_running=0;
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS; i++)
+		sample->pmc_counts[i]=legacy->pmc_counts[i];
+	for (i=0; i<MAX_VIRTUAL_COUNTERS; i++)
+		sample->virtual_counts[i]=legacy->virtual_counts[i];
+}
+
+/*
+ * Variable-length records (schema version 3)
+ *
+ * Besides the legacy pmc_sample_t format (still returned by read()),
+ * the kernel stores PMC samples as a stream of variable-length records.
+ * Every record starts with a pmc_record_header_t and its size is a
+ * multiple of 8 bytes. The event-set metadata of an experiment (PMC and
+ * virtual-counter masks) is emitted once as a schema record, so
+ * that each sample record only carries the counts actually in use.
+ */
+#define PMC_RECORD_ALIGN	8
+
+typedef enum {
+	PMC_RECORD_PAD=0,		/* Unused space up to the end of a ring */
+	PMC_RECORD_SCHEMA,		/* Event-set metadata of an experiment */
+	PMC_RECORD_SAMPLE,		/* PMC and virtual-counter values */
+	PMC_RECORD_LOST,		/* Samples dropped since the previous record */
+	PMC_RECORD_CPU_STATE,	/* CPU brought online or taken offline (system-wide mode) */
+	PMC_NR_RECORD_TYPES
+} pmc_record_type_t;
+
+typedef struct pmc_record_header {
+	uint16_t type;			/* Record type (pmc_record_type_t) */
+	uint16_t flags;			/* Reserved (0) */
+	uint32_t size;			/* Size of the record (in bytes) including the header */
+} pmc_record_header_t;
+
+/*
+ * Event-set metadata. It applies to the sample records with the
+ * same <coretype,exp_idx> that follow it in the same stream (ring).
+ */
+typedef struct pmc_schema_record {
+	pmc_record_header_t header;
+	int32_t coretype;		/* Core type of the experiment */
+	int32_t exp_idx;		/* Index of the experiment in the multiplexing set */
+	uint32_t pmc_mask;		/* PMCs used by the experiment */
+	uint32_t virt_mask;		/* Virtual counters associated with the experiment */
+} pmc_schema_record_t;
+
+typedef struct pmc_sample_record {
+	pmc_record_header_t header;
+	uint8_t type;			/* Sample type (sample_type_t) */
+	uint8_t coretype;		/* Core type where this sample was registered */
+	uint8_t exp_idx;		/* Index of the experiment (see schema record) */
+	uint8_t nr_counts;		/* Number of PMC counts in 'counts' */
+	uint8_t nr_virt_counts;	/* Number of virtual counts (after the PMC counts) */
+	uint8_t __reserved[3];
+	int32_t tid;			/* Thread ID (-1 in system-wide mode) */
+	int32_t tgid;			/* Process ID (-1 in system-wide mode) */
+	int32_t cpu;			/* CPU where the sample was collected */
+	uint32_t __pad;
+	uint64_t timestamp;		/* Monotonic time (ns) when the sample was collected */
+	uint64_t time_enabled;		/* Time the event set was enabled (ns) */
+	uint64_t time_running;		/* Time the event set was actually counting (ns) */
+	uint64_t counts[0];		/* PMC counts followed by virtual counts */
+} pmc_sample_record_t;
+
+/* Emitted before the next record stored after the ring overflowed */
+typedef struct pmc_lost_record {
+	pmc_record_header_t header;
+	uint32_t nr_lost;		/* Number of samples lost */
+	uint32_t __pad;
+} pmc_lost_record_t;
+
+/*
+ * Emitted in system-wide mode when a monitored CPU goes offline
+ * (right after its last sample) or comes back online
+ */
+typedef struct pmc_cpu_state_record {
+	pmc_record_header_t header;
+	int32_t cpu;			/* CPU whose state changed */
+	uint32_t online;		/* 1 -> online, 0 -> offline */
+	uint64_t timestamp;		/* Monotonic time (ns) of the state change */
+} pmc_cpu_state_record_t;
+
+/* Size of a sample record with the given number of counts */
+#define pmc_sample_record_size(nr_counts,nr_virt_counts) \
+	(sizeof(pmc_sample_record_t)+((nr_counts)+(nr_virt_counts))*sizeof(uint64_t))
+
+/* Largest record that may be found in a stream */
+#define PMC_MAX_RECORD_SIZE \
+	pmc_sample_record_size(MAX_PERFORMANCE_COUNTERS,MAX_VIRTUAL_COUNTERS)
+
+/*
+ * Schemas seen by the consumer of a record stream.
+ * Schemas of experiments not fitting in the table are
+ * emitted right before each sample and kept in 'last'.
+ */
+#define PMC_SCHEMA_MAX_CORETYPES	2
+#define PMC_SCHEMA_MAX_EXPS		16
+
+typedef struct pmc_schema_table {
+	pmc_schema_record_t schemas[PMC_SCHEMA_MAX_CORETYPES][PMC_SCHEMA_MAX_EXPS];
+	pmc_schema_record_t last;
+} pmc_schema_table_t;
+
+/* Record a schema in the consumer's table */
+static inline void pmc_schema_table_update(pmc_schema_table_t* table, const pmc_schema_record_t* schema)
+{
+	if (schema->coretype>=0 && schema->coretype<PMC_SCHEMA_MAX_CORETYPES &&
+	    schema->exp_idx>=0 && schema->exp_idx<PMC_SCHEMA_MAX_EXPS)
+		table->schemas[schema->coretype][schema->exp_idx]=*schema;
+	table->last=*schema;
+}
+
+/*
+ * Convert a sample record into a pmc_sample_v2_t,
+ * based on the schemas seen so far in the stream.
+ * Returns 0 on success and -1 if the record is malformed
+ * or its schema is unknown.
+ */
+static inline int pmc_sample_record_decode(const pmc_sample_record_t* rec, const pmc_schema_table_t* table, pmc_sample_v2_t* sample)
+{
+	const pmc_schema_record_t* schema=&table->last;
+	unsigned int nr_counts=rec->nr_counts;
+	unsigned int nr_virt_counts=rec->nr_virt_counts;
+	unsigned int i;
+
+	if (nr_counts>MAX_PERFORMANCE_COUNTERS || nr_virt_counts>MAX_VIRTUAL_COUNTERS ||
+	    rec->header.size<pmc_sample_record_size(nr_counts,nr_virt_counts))
+		return -1;
+
+	if (rec->coretype<PMC_SCHEMA_MAX_CORETYPES && rec->exp_idx<PMC_SCHEMA_MAX_EXPS)
+		schema=&table->schemas[rec->coretype][rec->exp_idx];
+
+	/* The schema was overwritten before the consumer could see it */
+	if (schema->header.type!=PMC_RECORD_SCHEMA)
+		return -1;
+
+	sample->type=(sample_type_t)rec->type;
+	sample->coretype=rec->coretype;
+	sample->exp_idx=rec->exp_idx;
+	/* The legacy format stores the CPU in system-wide mode */
+	sample->pid=rec->tid>=0?rec->tid:rec->cpu;
+	sample->tgid=rec->tgid;
+	sample->pmc_mask=schema->pmc_mask;
+	sample->nr_counts=nr_counts;
+	sample->virt_mask=schema->virt_mask;
+	sample->nr_virt_counts=nr_virt_counts;
+	sample->timestamp=rec->timestamp;
+	sample->time_enabled=rec->time_enabled;
+	sample->time_running=rec->time_running;
+
+	for (i=0; i<nr_counts; i++)
+		sample->pmc_counts[i]=rec->counts[i];
+	for (i=0; i<nr_virt_counts; i++)
+		sample->virtual_counts[i]=rec->counts[nr_counts+i];
+
+	return 0;
+}
+
+/*
+ * Convert a CPU state record into a pmc_sample_v2_t with no counts
+ * (PMC_CPU_ONLINE_SAMPLE or PMC_CPU_OFFLINE_SAMPLE)
+ */
+static inline void pmc_cpu_state_record_decode(const pmc_cpu_state_record_t* rec, pmc_sample_v2_t* sample)
+{
+	sample->type=rec->online?PMC_CPU_ONLINE_SAMPLE:PMC_CPU_OFFLINE_SAMPLE;
+	sample->coretype=0;
+	sample->exp_idx=0;
+	sample->pid=rec->cpu;
+	sample->tgid=-1;
+	sample->pmc_mask=0;
+	sample->nr_counts=0;
+	sample->virt_mask=0;
+	sample->nr_virt_counts=0;
+	sample->timestamp=rec->timestamp;
+	sample->time_enabled=0;
+	sample->time_running=0;
+}
+
+/*
+ * Layout of the sample rings exported by /proc/pmc/monitor when the file
+ * is mmap()ed at page offset PMC_RING_MMAP_PGOFF (offset 0 maps the
+ * legacy single-page buffer filled by read()).
+ *
+ * The mapping starts with a control area (pmc_ring_control_t followed by
+ * one pmc_ring_index_t per CPU) and continues with the data area of
+ * each per-CPU ring, which holds a stream of variable-length records.
+ * The kernel only writes 'head' and the monitor process only writes
+ * 'tail'. Both are free-running byte counters; the record at index i
+ * starts at offset (i & (data_size-1)) of the data area. Records never
+ * wrap around the end of the data area (a PMC_RECORD_PAD record fills
+ * the gap instead).
+ */
+#define PMC_RING_VERSION	3
+#define PMC_RING_MMAP_PGOFF	1
+
+/* What the kernel does when a ring fills up */
+typedef enum {
+	PMC_OVERFLOW_DROP=0,		/* Drop new samples */
+	PMC_OVERFLOW_OVERWRITE,		/* Overwrite the oldest records (whole records only) */
+	PMC_OVERFLOW_THROTTLE,		/* Defer new samples: counts keep accumulating and go
+								   into the next sample that fits (scheduler-driven and
+								   TBS modes only; other modes drop samples instead) */
+	PMC_NR_OVERFLOW_POLICIES
+} pmc_overflow_policy_t;
+
+typedef struct pmc_ring_index {
+	volatile uint32_t head;	/* Producer index (written by the kernel) */
+	volatile uint32_t tail;	/* Consumer index (written by the monitor process) */
+	volatile uint32_t nr_lost;	/* Samples dropped or overwritten because the ring was full */
+	volatile uint32_t nr_throttled;	/* Samples deferred because the ring was full */
+	uint32_t __reserved[12];	/* Pad up to a cache line */
+} pmc_ring_index_t;
+
+typedef struct pmc_ring_control {
+	uint32_t version;		/* PMC_RING_VERSION */
+	uint32_t nr_rings;		/* Number of per-CPU rings */
+	uint32_t data_size;		/* Size of the data area of each ring (in bytes, power of two) */
+	uint32_t max_record_size;	/* Largest record the kernel may emit */
+	uint64_t mmap_size;		/* Size of the whole mapping (in bytes) */
+	uint64_t data_offset;	/* Offset of the data area of the first ring */
+	uint64_t ring_stride;	/* Distance (in bytes) between the data areas of consecutive rings */
+	uint32_t overflow_policy;	/* pmc_overflow_policy_t. With PMC_OVERFLOW_OVERWRITE the kernel
+								   may advance 'tail' too, so the consumer must copy each record
+								   and then claim it with a compare-and-swap on 'tail' */
+	uint32_t __reserved[5];	/* Pad up to a cache line */
+	pmc_ring_index_t index[0];	/* Per-ring indices */
+} pmc_ring_control_t;
+
 #endif
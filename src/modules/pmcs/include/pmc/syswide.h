@@ -26,10 +26,13 @@ int syswide_monitoring_enabled(void);
 int syswide_monitoring_switch_in(int cpu);
 int syswide_monitoring_switch_out(int cpu);
 
-/* Returns true if "p" is current syswide monitor process */
+/* Returns true if "p" is the monitor process of a syswide session */
 int is_syswide_monitor(struct task_struct* p);
 
-/* Start/Stop syswide_monitoring */
+/*
+ * Start/Stop the syswide_monitoring session of the current process.
+ * Several sessions may be active at once and time-share the PMU.
+ */
 int syswide_monitoring_start(void);
 int syswide_monitoring_stop(void);
 
@@ -38,6 +41,19 @@ int syswide_monitoring_stop(void);
 int syswide_monitoring_pause(void);
 int syswide_monitoring_resume(void);
 
+/* Select the CPUs to monitor (cpulist format) and print them out */
+int syswide_monitoring_set_cpus(const char* cpulist);
+int syswide_monitoring_print_cpus(char* buf, int len);
+
+/* Print the active sessions and the share of the PMU each one got */
+int syswide_monitoring_print_sessions(char* buf, int len);
+
+/*
+ * Count only while tasks in the cgroup of process "pid" run
+ * (cgroup mode). A pid<=0 disables the cgroup mode.
+ */
+int syswide_monitoring_set_cgroup(pid_t pid);
+
 
 #endif
 
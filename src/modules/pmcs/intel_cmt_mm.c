@@ -267,7 +267,7 @@ static void intel_cmt_on_exec(pmon_prof_t* prof) { }
  * Read the LLC occupancy and cumulative memory bandwidth counters
  * and set the associated virtual counts in the PMC sample structure
  */
-static int intel_cmt_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+static int intel_cmt_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
 {
 	intel_cmt_thread_data_t* tdata=prof->monitoring_mod_priv_data;
 	uint64_t val;
@@ -279,7 +279,7 @@ static inline void do_read_energy_msrs(intel_rapl_thread_data_t* tdata, int acum
  * Update cumulative energy counters in the thread structure and
  * set the associated virtual counts in the PMC sample structure
  */
-static int intel_rapl_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+static int intel_rapl_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
 {
 	intel_rapl_thread_data_t* tdata=prof->monitoring_mod_priv_data;
 	int i=0;
@@ -419,7 +419,7 @@ static void intel_rapl_on_syswide_refresh_monitor(int cpu, unsigned int virtual_
 }
 
 /* 	Dump virtual-counter values for this CPU */
-static void intel_rapl_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample)
+static void intel_rapl_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_v2_t* sample)
 {
 	intel_rapl_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
 	int i=0;
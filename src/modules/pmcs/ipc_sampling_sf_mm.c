@@ -85,25 +85,16 @@ static void ipc_sampling_module_counter_usage(monitoring_module_counter_usage_t*
 }
 
 /* Create a simple set of performance metric descriptors (IPC) */
-static void init_ipc_metric(metric_experiment_set_t* metric_set)
+static int init_ipc_metric(metric_experiment_set_t* metric_set)
 {
-	pmc_metric_t* metric=NULL;
 	metric_experiment_t* metricExp;
-	pmc_arg_t arguments[2];
 	init_metric_experiment_set_t(metric_set);
 
 	/*######## EXP1 #########*/
 	metricExp=&metric_set->exps[metric_set->nr_exps++];
 
-	/* IPC */
-	metric=&metricExp->metrics[metricExp->size++];
-
-	arguments[0].index=0;
-	arguments[0].type=hw_event_arg;
-	arguments[1].index=1;
-	arguments[1].type=hw_event_arg;
-
-	init_pmc_metric(metric,"IPC",op_rate,arguments,1000);
+	/* IPC (fixed point: three decimal places) */
+	return add_pmc_metric_expr(metricExp,"IPC","1000*ev0/ev1");
 }
 
 /* MM initialization function */
@@ -116,8 +107,16 @@ static int ipc_sampling_enable_module(void)
 		return -EINVAL;
 	}
 
-	for (i=0; i<AMP_CORE_TYPES; i++)
-		init_ipc_metric(&ipc_sampling_metric_set[i]);
+	for (i=0; i<AMP_CORE_TYPES; i++) {
+		if (init_ipc_metric(&ipc_sampling_metric_set[i])) {
+			printk("Can't create the IPC metric\n");
+			while (--i>=0)
+				free_metric_experiment_set_t(&ipc_sampling_metric_set[i]);
+			for (i=0; i<AMP_CORE_TYPES; i++)
+				free_experiment_set(&ipc_sampling_pmc_configuration[i]);
+			return -ENOMEM;
+		}
+	}
 
 	/* init configuration parameters */
 	ipc_sampling_sfmodel_config.sfmodel_running_average_factor=35; 	/* Percentage of the previous moving average of
@@ -135,8 +134,10 @@ static int ipc_sampling_enable_module(void)
 static void ipc_sampling_disable_module(void)
 {
 	int i=0;
-	for (i=0; i<AMP_CORE_TYPES; i++)
+	for (i=0; i<AMP_CORE_TYPES; i++) {
 		free_experiment_set(&ipc_sampling_pmc_configuration[i]);
+		free_metric_experiment_set_t(&ipc_sampling_metric_set[i]);
+	}
 
 	printk(KERN_ALERT "%s monitoring module unloaded!!\n",IPC_MODEL_STRING);
 }
@@ -225,7 +226,7 @@ static void ipc_sampling_on_exec(pmon_prof_t* prof)
  * Update the thread's SF based on the latest IPC value on both core types and
  * set the associated virtual count (SF value) in the PMC sample structure
  */
-static int ipc_sampling_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+static int ipc_sampling_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
 {
 	int cur_coretype=get_coretype_cpu(cpu);
 	//core_experiment_t *cur_exp=prof->pmcs_config;
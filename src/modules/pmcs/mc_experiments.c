@@ -10,6 +10,10 @@
 #include <pmc/hl_events.h>
 #include <linux/module.h>
 #include <pmc/pmu_config.h>
+#include <linux/topology.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 
 #if defined(_DEBUG_USER_MODE)
 #include <printk.h>
@@ -25,6 +29,32 @@
 /* Nothing at all */
 #endif
 
+/* Experiment state held by the PMCs of each CPU (see set_pmu_owner()) */
+DEFINE_PER_CPU(core_experiment_state_t*, pmc_pmu_owner);
+
+/* Global multiplexing policy (see get_next_experiment_in_set()) */
+pmc_mux_policy_t pmc_mux_policy=PMC_MUX_WEIGHTED;
+
+/* Slab cache for PMC experiments (see alloc_core_experiment()) */
+struct kmem_cache* core_experiment_cache=NULL;
+
+/* Create the slab cache for core_experiment_t objects */
+int init_core_experiment_cache(void)
+{
+	core_experiment_cache=kmem_cache_create("pmctrack_experiment",sizeof(core_experiment_t),
+	                                        0,SLAB_HWCACHE_ALIGN,NULL);
+	return core_experiment_cache?0:-ENOMEM;
+}
+
+/* Destroy the slab cache for core_experiment_t objects */
+void destroy_core_experiment_cache(void)
+{
+	if (core_experiment_cache) {
+		kmem_cache_destroy(core_experiment_cache);
+		core_experiment_cache=NULL;
+	}
+}
+
 /* Initialize core_experiment_t structure */
 void init_core_experiment_t(core_experiment_t* c_exp,int exp_idx)
 {
@@ -32,16 +62,96 @@ void init_core_experiment_t(core_experiment_t* c_exp,int exp_idx)
 	c_exp->size = 0;   		/* Empty set (no nodes)*/
 	c_exp->used_pmcs = 0;   	/* For now no pmcs are used */
 	c_exp->ebs_idx=-1;		/* EBS disabled by default -1 */
-	c_exp->need_setup = 1;          /* Requires configuration on related CPU*/
 	c_exp->exp_idx=exp_idx;
+	c_exp->mux_weight=1;
 
 	for (i=0; i<MAX_LL_EXPS; i++) {
 		c_exp->log_to_phys[i]=-1;
 		c_exp->phys_to_log[i]=-1;
-		c_exp->nr_overflows[i]=0;
 	}
 }
 
+/*
+ * Each 10% of relative deviation in the rate of the least stable
+ * event of a set grants the set an extra sampling interval
+ */
+#define MUX_DEV_PERCENT_PER_INTERVAL	10
+
+/*
+ * Update the statistics of the adaptive multiplexing policy with a
+ * sample of experiment "exp". Event sets whose event rates vary the
+ * most from one interval to another get more intervals in each
+ * multiplexing round, as their counts are the hardest to extrapolate.
+ *
+ * The statistics belong to the set of the thread (or CPU) the sample
+ * comes from, so the caller must hold the lock that protects the set.
+ * They are allocated on the first sample (interrupts may be disabled);
+ * if memory is not available, the sample is not accounted.
+ */
+void __mux_account_sample(core_experiment_set_t* cset, const uint64_t* counts, unsigned int nr_counts,
+                          uint64_t time_running)
+{
+	core_experiment_t* exp=cset->vector->exps[cset->cur_exp];
+	mux_stats_t* stats;
+	uint64_t rate, diff, max_dev_percent=0, dev_percent;
+	unsigned int weight;
+	int i;
+
+	/* The set has grown since the statistics were allocated */
+	if (cset->nr_mux_stats<cset->nr_exps) {
+		stats=kzalloc(cset->nr_exps*sizeof(mux_stats_t),GFP_ATOMIC);
+		if (!stats)
+			return;
+		if (cset->mux_stats)
+			memcpy(stats,cset->mux_stats,cset->nr_mux_stats*sizeof(mux_stats_t));
+		kfree(cset->mux_stats);
+		cset->mux_stats=stats;
+		cset->nr_mux_stats=cset->nr_exps;
+	}
+
+	stats=&cset->mux_stats[cset->cur_exp];
+	time_running=(time_running>>10)+1;
+
+	for (i=0; i<nr_counts && i<MAX_LL_EXPS; i++) {
+		rate=div64_u64(counts[i]<<10,time_running);
+
+		if (stats->nr_samples==0) {
+			stats->avg[i]=rate;
+			stats->dev[i]=0;
+			continue;
+		}
+
+		diff=rate>stats->avg[i]?rate-stats->avg[i]:stats->avg[i]-rate;
+
+		/* Moving averages with alpha=1/8 */
+		if (rate>stats->avg[i])
+			stats->avg[i]+=(rate-stats->avg[i])>>3;
+		else
+			stats->avg[i]-=(stats->avg[i]-rate)>>3;
+
+		if (diff>stats->dev[i])
+			stats->dev[i]+=(diff-stats->dev[i])>>3;
+		else
+			stats->dev[i]-=(stats->dev[i]-diff)>>3;
+
+		if (stats->avg[i]) {
+			dev_percent=div64_u64(stats->dev[i]*100,stats->avg[i]);
+			if (dev_percent>max_dev_percent)
+				max_dev_percent=dev_percent;
+		}
+	}
+
+	stats->nr_samples++;
+
+	/* Scale the static weight of the set */
+	weight=exp->mux_weight*(1+(unsigned int)min_t(uint64_t,max_dev_percent/MUX_DEV_PERCENT_PER_INTERVAL,PMC_MUX_MAX_WEIGHT));
+
+	if (weight>PMC_MUX_MAX_WEIGHT)
+		weight=PMC_MUX_MAX_WEIGHT;
+
+	stats->weight=weight;
+}
+
 /* Monitor resets the Global PMU context (per CPU) ==> for 'old' events */
 void restore_context_perfregs ( core_experiment_t* ce )
 {
@@ -55,18 +165,23 @@ void restore_context_perfregs ( core_experiment_t* ce )
 }
 
 /* Restart PMCs used by a core_experiment_t */
-void mc_restart_all_counters(core_experiment_t* core_experiment)
+void mc_restart_all_counters(core_experiment_t* core_experiment, core_experiment_state_t* state)
 {
 	unsigned int j;
 
+	invalidate_pmu_owner();
+
 	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
 		__restart_count(lle);
+		/* Counts start over, so do overflows */
+		state->nr_overflows[j]=0;
+		state->saved_values[j]=__get_reset_value(lle);
 	}
 
 	/* Current CPU PMU Context is ready => flag cleared */
-	core_experiment->need_setup = 0;
+	state->need_setup = 0;
 	reset_overflow_status();
 }
 
@@ -88,6 +203,9 @@ void mc_stop_all_counters(core_experiment_t* core_experiment)
 void mc_clear_all_counters(core_experiment_t* core_experiment)
 {
 	unsigned int j;
+
+	invalidate_pmu_owner();
+
 	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
@@ -96,35 +214,57 @@ void mc_clear_all_counters(core_experiment_t* core_experiment)
 	reset_overflow_status();
 }
 
-/* For EBS: Save context associated with PMCs (context switch out) */
-void mc_save_all_counters(core_experiment_t* core_experiment)
+/*
+ * Stop PMCs used by a core_experiment_t and save their values
+ * (context switch out). The PMCs are not reset, so the count
+ * can be resumed cheaply if the thread is switched back in
+ * on the same CPU (see mc_restore_all_counters()).
+ */
+void mc_save_all_counters(core_experiment_t* core_experiment, core_experiment_state_t* state, int cpu)
 {
 	unsigned int j;
 
-	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
-		__save_context_event(lle);
+		__stop_count(lle);
+		state->saved_values[j]=__read_value(lle);
 	}
 
 	/* Current CPU PMU Context is ready => flag cleared */
-	core_experiment->need_setup = 0;
+	state->need_setup = 0;
+	set_pmu_owner(state,cpu);
 }
 
 /* Restore context associated with PMCs (context switch in) */
-void mc_restore_all_counters(core_experiment_t* core_experiment)
+void mc_restore_all_counters(core_experiment_t* core_experiment, core_experiment_state_t* state, int cpu)
 {
 	unsigned int j;
+	int resume=!state->need_setup && is_pmu_owner(state,cpu);
+
+	/* The values will be stale as soon as the counters start */
+	invalidate_pmu_owner();
 
-	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
-		/* Start count now does the trick, since it loads whatever there was in PMCs before */
-		__start_count(lle);
+
+		if (resume) {
+			/* The PMCs still hold our values: just enable them */
+			__resume_count(lle);
+			continue;
+		}
+
+		/* First time: start from the reset value */
+		if (state->need_setup) {
+			state->saved_values[j]=__get_reset_value(lle);
+			state->nr_overflows[j]=0;
+		}
+
+		/* Pick up the count where we left off */
+		__start_count_from(lle,state->saved_values[j]);
 	}
 
 	/* Current CPU PMU Context is ready => flag cleared */
-	core_experiment->need_setup = 0;
+	state->need_setup = 0;
 
 	reset_overflow_status();
 }
@@ -165,8 +305,9 @@ void compute_value(pmc_metric_t* metric, uint64_t* hw_events, pmc_metric_t* metr
 		get_operands(metric, hw_events, metric_vector, operands, 2);
 		if(operands[0].value >= operands[1].value ) {
 			metric->count = operands[0].value-operands[1].value;
+		} else {
+			metric->count=0;
 		}
-		metric->count=0;
 		break;
 	case op_rate:
 		get_operands(metric, hw_events, metric_vector, operands, 2);
@@ -202,10 +343,61 @@ void compute_value(pmc_metric_t* metric, uint64_t* hw_events, pmc_metric_t* metr
 		/*Just gets the value from the first related argument's descriptor*/
 		metric->count = operands[0].value;
 		break;
+	case op_expr:
+		metric->value = pmc_expr_eval(metric->expr, hw_events, &metric_vector[0].value, sizeof(pmc_metric_t));
+		metric->count = metric->value<0 ? 0 : pmc_expr_to_int(metric->value);
+		return;
 	default:
 		metric->count = 0;
 		break;
 	}
+
+	/* Keep the fixed-point value for the expressions that use this metric */
+	if (metric->count >= (1ULL<<(63-PMC_EXPR_FRAC_BITS)))
+		metric->value = PMC_EXPR_MAX;
+	else
+		metric->value = pmc_expr_from_int(metric->count);
+}
+
+/* Resolve metric names in expressions (metrics defined before in the same set) */
+static int lookup_metric(const char* name, void* data, pmc_expr_opcode_t* opcode)
+{
+	metric_experiment_t* m_exp=data;
+	int i;
+
+	for (i=0; i<m_exp->size; i++)
+		if (strcmp(m_exp->metrics[i].id,name)==0)
+			return i;
+	return -1;
+}
+
+int add_pmc_metric_expr(metric_experiment_t* m_exp, const char* name, const char* expr)
+{
+	pmc_metric_t* metric;
+	pmc_expr_t* prog;
+	int ret;
+
+	if (m_exp->size==MAX_METRICS_PER_SET)
+		return -ENOSPC;
+
+	if ((ret=pmc_expr_compile(expr,lookup_metric,m_exp,&prog)))
+		return ret;
+
+	/* The values of the metrics are computed from MAX_LL_EXPS counts */
+	if ((ret=pmc_expr_check_events(prog,MAX_LL_EXPS))) {
+		pmc_expr_free(prog);
+		return ret;
+	}
+
+	metric=&m_exp->metrics[m_exp->size++];
+	strncpy(metric->id,name,MAX_EXP_ID-1);
+	metric->id[MAX_EXP_ID-1]='\0';
+	metric->mode=op_expr;
+	metric->expr=prog;
+	metric->scale_factor=1;
+	metric->count=0;
+	metric->value=0;
+	return 0;
 }
 
 /* This function builds a structure with the descriptors
@@ -304,29 +496,421 @@ int get_any_cpu_coretype(int coretype)
 }
 #endif
 
-/* Allocate a buffer with capacity 'size_bytes' */
-pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes)
+/*
+ * Allocate zero-filled memory for the rings on a given NUMA node.
+ * Single pages come from the page allocator; larger regions
+ * are vmalloc()ed, since they need not be physically contiguous.
+ */
+static void* alloc_ring_memory(unsigned int size, int node)
+{
+	struct page* page;
+
+	if (size==PAGE_SIZE) {
+		page=alloc_pages_node(node,GFP_KERNEL|__GFP_ZERO,0);
+		return page?page_address(page):NULL;
+	}
+
+	return vzalloc_node(size,node);
+}
+
+static void free_ring_memory(void* addr)
+{
+	if (!addr)
+		return;
+
+	if (is_vmalloc_addr(addr))
+		vfree(addr);
+	else
+		free_page((unsigned long)addr);
+}
+
+static void __free_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	int cpu;
+
+	if (sbuf->rings) {
+		for_each_possible_cpu(cpu)
+			free_ring_memory(sbuf->rings[cpu].data);
+		kfree(sbuf->rings);
+	}
+
+	free_ring_memory(sbuf->control);
+	kfree(sbuf);
+}
+
+static void free_pmc_samples_buffer_work(struct work_struct *work)
+{
+	pmc_samples_buffer_t* sbuf=container_of(work,pmc_samples_buffer_t,free_work);
+
+	/* Make sure no wakeup requested from NMI context is in flight */
+	irq_work_sync(&sbuf->wakeup_work);
+	irq_work_sync(&sbuf->latency_work);
+	hrtimer_cancel(&sbuf->latency_timer);
+	__free_pmc_samples_buffer(sbuf);
+}
+
+/* Deferred wakeup of the monitor (requested from NMI context) */
+static void wake_up_monitor_irq_work(struct irq_work *work)
+{
+	pmc_samples_buffer_t* sbuf=container_of(work,pmc_samples_buffer_t,wakeup_work);
+
+	wake_up_interruptible(&sbuf->wq);
+}
+
+/* Deferred activation of the latency timer (requested from NMI context) */
+static void arm_latency_timer_irq_work(struct irq_work *work)
+{
+	pmc_samples_buffer_t* sbuf=container_of(work,pmc_samples_buffer_t,latency_work);
+
+	__arm_latency_timer(sbuf);
+}
+
+/*
+ * Wake up the monitor if the oldest unread sample of any ring
+ * exceeded the latency bound, and re-arm the timer for the
+ * rings whose samples have not reached it yet
+ */
+static enum hrtimer_restart latency_timer_fire(struct hrtimer* timer)
+{
+	pmc_samples_buffer_t* sbuf=container_of(timer,pmc_samples_buffer_t,latency_timer);
+	unsigned long latency=sbuf->wakeup_latency;
+	unsigned long now=jiffies;
+	unsigned long deadline,next=0;
+	pmc_samples_ring_t* ring;
+	int expired=0,pending=0;
+	int cpu;
+
+	if (!latency)
+		return HRTIMER_NORESTART;
+
+	for_each_possible_cpu(cpu) {
+		ring=&sbuf->rings[cpu];
+
+		if (ring->idx->head==ring->idx->tail)
+			continue;
+
+		deadline=ring->first_stamp+latency;
+
+		if (time_after_eq(now,deadline))
+			expired=1;
+		else if (!pending || time_before(deadline,next)) {
+			next=deadline;
+			pending=1;
+		}
+	}
+
+	if (expired)
+		wake_up_interruptible(&sbuf->wq);
+
+	if (!pending)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer,ns_to_ktime(jiffies_to_nsecs(next-now)));
+	return HRTIMER_RESTART;
+}
+
+/* Allocate a buffer whose per-CPU rings have capacity 'size_bytes' */
+pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes, pmc_overflow_policy_t policy)
 {
 	pmc_samples_buffer_t* pmc_samples_buf=NULL;
+	pmc_ring_control_t* control;
+	unsigned int data_size=size_bytes<PAGE_SIZE?PAGE_SIZE:size_bytes;
+	int cpu;
 
-	pmc_samples_buf=kmalloc(sizeof(pmc_samples_buffer_t),GFP_KERNEL);
+	pmc_samples_buf=kzalloc(sizeof(pmc_samples_buffer_t),GFP_KERNEL);
 
 	if (!pmc_samples_buf)
 		return NULL;
 
-	pmc_samples_buf->pmc_samples=create_cbuffer_t(size_bytes);
-
-	if (!pmc_samples_buf->pmc_samples) {
-		kfree(pmc_samples_buf);
-		return NULL;
+	/* Power-of-two data areas, so that the indices can wrap around freely */
+	pmc_samples_buf->data_size=roundup_pow_of_two(data_size);
+	pmc_samples_buf->overflow_policy=policy;
+	pmc_samples_buf->control_size=PAGE_ALIGN(sizeof(pmc_ring_control_t)+nr_cpu_ids*sizeof(pmc_ring_index_t));
+
+	pmc_samples_buf->rings=kzalloc(nr_cpu_ids*sizeof(pmc_samples_ring_t),GFP_KERNEL);
+	pmc_samples_buf->control=alloc_ring_memory(pmc_samples_buf->control_size,numa_node_id());
+
+	if (!pmc_samples_buf->rings || !pmc_samples_buf->control)
+		goto free_buffer;
+
+	control=pmc_samples_buf->control;
+	control->version=PMC_RING_VERSION;
+	control->nr_rings=nr_cpu_ids;
+	control->data_size=pmc_samples_buf->data_size;
+	control->max_record_size=PMC_MAX_RECORD_SIZE;
+	control->data_offset=pmc_samples_buf->control_size;
+	control->ring_stride=pmc_samples_buf->data_size;
+	control->overflow_policy=policy;
+	control->mmap_size=control->data_offset+(uint64_t)nr_cpu_ids*control->ring_stride;
+
+	/* Place each ring on the NUMA node of the CPU that fills it */
+	for_each_possible_cpu(cpu) {
+		pmc_samples_buf->rings[cpu].idx=&control->index[cpu];
+		pmc_samples_buf->rings[cpu].data=alloc_ring_memory(pmc_samples_buf->data_size,cpu_to_node(cpu));
+		if (!pmc_samples_buf->rings[cpu].data)
+			goto free_buffer;
 	}
 
-	sema_init(&pmc_samples_buf->sem_queue,0);
-	spin_lock_init(&pmc_samples_buf->lock);
+	pmc_samples_buf->next_cpu=0;
+	atomic_set(&pmc_samples_buf->nr_user_mappings,0);
+	mutex_init(&pmc_samples_buf->consumer_lock);
+	init_waitqueue_head(&pmc_samples_buf->wq);
+	init_irq_work(&pmc_samples_buf->wakeup_work,wake_up_monitor_irq_work);
+	init_irq_work(&pmc_samples_buf->latency_work,arm_latency_timer_irq_work);
+	hrtimer_init(&pmc_samples_buf->latency_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+	pmc_samples_buf->latency_timer.function=latency_timer_fire;
+	INIT_WORK(&pmc_samples_buf->free_work,free_pmc_samples_buffer_work);
 	atomic_set(&pmc_samples_buf->ref_counter,1);
 
-	pmc_samples_buf->monitor_waiting=0;
+	/* Wake up the monitor on every sample by default */
+	pmc_samples_buf->wakeup_threshold=1;
+	pmc_samples_buf->wakeup_fill_bytes=0;
+	pmc_samples_buf->wakeup_latency=0;
 
 	return pmc_samples_buf;
+free_buffer:
+	__free_pmc_samples_buffer(pmc_samples_buf);
+	return NULL;
+}
+
+/* Free up the buffer and its per-CPU rings */
+void free_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	/*
+	 * vfree() must not be called with interrupts disabled,
+	 * and irq_work_sync() may have to wait.
+	 */
+	if (in_interrupt() || irqs_disabled())
+		schedule_work(&sbuf->free_work);
+	else
+		free_pmc_samples_buffer_work(&sbuf->free_work);
+}
+
+/* Apply the wakeup conditions requested by the monitor process */
+void set_wakeup_cfg_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, pmc_wakeup_cfg_t* cfg)
+{
+	/* Upper bound for the number of records a ring can hold */
+	unsigned int max_samples=sbuf->data_size/pmc_sample_record_size(0,0);
+	unsigned int threshold=max_samples;
+	unsigned int fill_bytes=0;
+
+	if (cfg->nr_samples && cfg->nr_samples<threshold)
+		threshold=cfg->nr_samples;
+
+	if (cfg->fill_percent) {
+		fill_bytes=((uint64_t)sbuf->data_size*cfg->fill_percent)/100;
+		/* Leave room for the next record */
+		if (fill_bytes>sbuf->data_size-PMC_MAX_RECORD_SIZE)
+			fill_bytes=sbuf->data_size-PMC_MAX_RECORD_SIZE;
+	}
+
+	/* Default behavior: wake up the monitor on every sample */
+	if (!cfg->nr_samples && !cfg->fill_percent && !cfg->latency)
+		threshold=1;
+
+	sbuf->wakeup_threshold=threshold?threshold:1;
+	sbuf->wakeup_fill_bytes=fill_bytes;
+
+	/* Samples pushed before the latency bound was set must be covered too */
+	if (sbuf->wakeup_latency!=cfg->latency) {
+		sbuf->wakeup_latency=cfg->latency;
+		__arm_latency_timer(sbuf);
+	}
 }
 
+/* Returns a non-zero value if the buffer's wakeup conditions are met */
+int is_ready_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	pmc_samples_ring_t* ring;
+	uint32_t nr_unread;
+	int cpu;
+
+	if (sbuf->flush_pending) {
+		/* See samples pushed before the flag was raised */
+		smp_rmb();
+		if (!is_empty_pmc_samples_buffer(sbuf))
+			return 1;
+		sbuf->flush_pending=0;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ring=&sbuf->rings[cpu];
+		nr_unread=ring->idx->head-ring->idx->tail;
+
+		if (nr_unread==0)
+			continue;
+
+		if (__ring_fill_exceeded(sbuf,ring,nr_unread) ||
+		    (sbuf->wakeup_latency && time_after_eq(jiffies,ring->first_stamp+sbuf->wakeup_latency)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Returns the number of unread bytes (records) stored in the buffer */
+unsigned int nr_bytes_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	pmc_ring_index_t* idx;
+	unsigned int nr_bytes=0;
+	uint32_t count;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		idx=sbuf->rings[cpu].idx;
+		count=idx->head-idx->tail;
+		/* Do not trust indices that may be updated from user space */
+		nr_bytes+=count>sbuf->data_size?sbuf->data_size:count;
+	}
+
+	return nr_bytes;
+}
+
+/*
+ * Decode records from a ring into 'dst' (up to 'max_samples')
+ * and hand the space back to the producer.
+ *
+ * With the PMC_OVERFLOW_OVERWRITE policy the producer may discard
+ * the record being read, so each record is copied first and then
+ * claimed by advancing the tail with cmpxchg().
+ */
+static unsigned int drain_pmc_samples_ring(pmc_samples_buffer_t* sbuf, pmc_samples_ring_t* ring,
+        pmc_sample_t* dst, unsigned int max_samples)
+{
+	pmc_ring_index_t* idx=ring->idx;
+	unsigned int mask=sbuf->data_size-1;
+	int overwrite=(sbuf->overflow_policy==PMC_OVERFLOW_OVERWRITE);
+	unsigned int nr_samples=0;
+	pmc_record_header_t* header;
+	uint32_t head,tail,size;
+	pmc_sample_v2_t sample;
+	union {
+		pmc_record_header_t header;
+		char raw[PMC_MAX_RECORD_SIZE];
+	} rec;
+
+	head=idx->head;
+	/* Read the head before the records it covers */
+	smp_rmb();
+	tail=ACCESS_ONCE(idx->tail);
+
+	while (nr_samples<max_samples) {
+		/* The producer may have overwritten everything up to 'head' */
+		if (tail==head || (overwrite && (int32_t)(head-tail)<0))
+			break;
+
+		/* Do not trust indices that may be updated from user space */
+		if (head-tail>sbuf->data_size || (tail & (PMC_RECORD_ALIGN-1)))
+			goto bad_record;
+
+		header=(pmc_record_header_t*)(ring->data+(tail & mask));
+		size=ACCESS_ONCE(header->size);
+
+		if (size<sizeof(pmc_record_header_t) || size>head-tail ||
+		    size>sbuf->data_size-(tail & mask) || (size & (PMC_RECORD_ALIGN-1)))
+			goto bad_record;
+
+		/* Only the header is needed for padding (or oversized) records */
+		memcpy(&rec,header,size>sizeof(rec)?sizeof(pmc_record_header_t):size);
+
+		if (overwrite && cmpxchg(&idx->tail,tail,tail+size)!=tail) {
+			/* Overwritten while we were copying it */
+			tail=ACCESS_ONCE(idx->tail);
+			continue;
+		}
+
+		tail+=size;
+
+		if (size>sizeof(rec))
+			continue;
+
+		switch (rec.header.type) {
+		case PMC_RECORD_SCHEMA:
+			pmc_schema_table_update(&ring->consumer_schemas,(pmc_schema_record_t*)&rec);
+			break;
+		case PMC_RECORD_SAMPLE:
+			if (!pmc_sample_record_decode((pmc_sample_record_t*)&rec,&ring->consumer_schemas,&sample))
+				pmc_sample_to_legacy(&sample,&dst[nr_samples++]);
+			break;
+		case PMC_RECORD_CPU_STATE:
+			pmc_cpu_state_record_decode((pmc_cpu_state_record_t*)&rec,&sample);
+			pmc_sample_to_legacy(&sample,&dst[nr_samples++]);
+			break;
+		default:
+			/* Padding and records not supported by read() */
+			break;
+		}
+		continue;
+bad_record:
+		/* Skip the rest of the ring if the stream is corrupted */
+		if (!overwrite) {
+			tail=head;
+			break;
+		}
+
+		if (cmpxchg(&idx->tail,tail,head)==tail)
+			break;
+
+		tail=ACCESS_ONCE(idx->tail);
+	}
+
+	if (!overwrite) {
+		/* Finish reading the records before handing them back to the producer */
+		smp_mb();
+		idx->tail=tail;
+	}
+
+	return nr_samples;
+}
+
+/*
+ * Move samples from the per-CPU rings into 'dst'.
+ * Rings are visited in a round-robin fashion, starting from
+ * a different CPU on each invocation, so that a busy CPU
+ * cannot starve the rest when 'dst' is small.
+ *
+ * Records are decoded into the legacy pmc_sample_t format
+ * using the schemas previously found in the same ring.
+ */
+int drain_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* dst, unsigned int max_bytes)
+{
+	unsigned int max_samples=max_bytes/sizeof(pmc_sample_t);
+	unsigned int nr_samples=0;
+	int cpu=sbuf->next_cpu;
+	int i;
+
+	for (i=0; i<nr_cpu_ids && nr_samples<max_samples; i++,cpu++) {
+		if (cpu>=nr_cpu_ids)
+			cpu=0;
+
+		if (!cpu_possible(cpu))
+			continue;
+
+		nr_samples+=drain_pmc_samples_ring(sbuf,&sbuf->rings[cpu],&dst[nr_samples],max_samples-nr_samples);
+	}
+
+	sbuf->next_cpu=cpu>=nr_cpu_ids?0:cpu;
+
+	return nr_samples*sizeof(pmc_sample_t);
+}
+
+/* Return the page backing a given offset of the buffer's user-visible layout */
+struct page* get_page_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, unsigned long offset)
+{
+	void* addr;
+	unsigned long cpu;
+
+	if (offset<sbuf->control_size) {
+		addr=(char*)sbuf->control+offset;
+	} else {
+		offset-=sbuf->control_size;
+		cpu=offset/sbuf->data_size;
+
+		if (cpu>=nr_cpu_ids || !cpu_possible(cpu))
+			return NULL;
+
+		addr=sbuf->rings[cpu].data+(offset%sbuf->data_size);
+	}
+
+	return is_vmalloc_addr(addr)?vmalloc_to_page(addr):virt_to_page(addr);
+}
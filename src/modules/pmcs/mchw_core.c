@@ -31,9 +31,16 @@
 #include <linux/vmalloc.h>
 #include <asm-generic/errno.h>
 #include <linux/mm.h>  /* mmap related stuff */
+#include <linux/poll.h> /* poll() support */
 #include <pmc/monitoring_mod.h>
 #include <pmc/syswide.h>
 #include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <pmc/pmc_ioctl.h>
 
 #define BUF_LEN_PMC_SAMPLES_EBS_KERNEL (((PAGE_SIZE)/sizeof(pmc_sample_t))*sizeof(pmc_sample_t))
 
@@ -63,6 +70,9 @@ typedef struct {
 	uint_t pmon_kernel_buffer_size;	 /* Default capacity for the kernel
 									  * buffer that stores PMC samples
 									  */
+	pmc_overflow_policy_t pmon_overflow_policy; /* Default behavior when
+												 * the buffer fills up
+												 */
 } pmon_config_t;
 pmon_config_t pmcs_pmon_config;
 
@@ -85,13 +95,100 @@ static void  mod_free_per_thread_data(struct task_struct* tsk);
 static void  mod_exit_thread(struct task_struct* tsk);
 static int   mod_get_current_metric_value(struct task_struct* task, int key, uint64_t* value);
 
+/* Minimum sampling period for the TBS mode (in us) */
+#define TBS_MIN_SAMPLING_PERIOD_US	10
+
+/* Clock used for TBS sampling deadlines (same as the hrtimers') */
+static inline uint64_t tbs_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* Set the TBS sampling period of a thread */
+static inline void set_sampling_period_us(pmon_prof_t* prof, unsigned int usecs)
+{
+	if (usecs<TBS_MIN_SAMPLING_PERIOD_US)
+		usecs=TBS_MIN_SAMPLING_PERIOD_US;
+	prof->pmc_sampling_period=(uint64_t)usecs*NSEC_PER_USEC;
+	/* The system-wide mode still works with jiffies */
+	prof->pmc_jiffies_interval=usecs_to_jiffies(usecs)?:1;
+}
+
 #ifdef TBS_TIMER
-/* Timer function used for TBS mode */
-static void tbs_mode_fire_timer(unsigned long data);
+/*
+ * Per-CPU sampling engine for the TBS mode: a pinned hrtimer
+ * samples the monitored thread that runs on the CPU (if any)
+ * when its sampling deadline expires. The timer is armed on
+ * context switch in and cancelled on context switch out,
+ * so the counters are always read on the CPU they belong to.
+ */
+typedef struct {
+	struct hrtimer timer;
+	pmon_prof_t* prof;	/* TBS-mode thread running on this CPU (NULL if none) */
+} tbs_sampler_t;
+
+static DEFINE_PER_CPU(tbs_sampler_t, tbs_sampler);
+
+static enum hrtimer_restart tbs_sampler_fire(struct hrtimer* timer);
 static inline void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_exp, pmc_sampling_event_t event, int cpu);
-static inline int refresh_event_multiplexing_cpu(pmon_prof_t* prof,int coretype);
+
+/* Start sampling a thread on the current CPU */
+static inline void tbs_sampler_start(pmon_prof_t* prof, int cpu)
+{
+	tbs_sampler_t* sampler=&per_cpu(tbs_sampler,cpu);
+
+	if (!prof->pmc_sampling_period)
+		return;
+
+	sampler->prof=prof;
+	pmct_hrtimer_start_pinned(&sampler->timer,ns_to_ktime(prof->pmc_sample_deadline));
+}
+
+/* Stop sampling a thread on the current CPU */
+static inline void tbs_sampler_stop(pmon_prof_t* prof, int cpu)
+{
+	tbs_sampler_t* sampler=&per_cpu(tbs_sampler,cpu);
+
+	if (sampler->prof==prof) {
+		sampler->prof=NULL;
+		/* The timer is pinned, so its callback cannot be running now */
+		hrtimer_try_to_cancel(&sampler->timer);
+	}
+}
 #endif
 
+/*
+ * Context switch out in TBS mode: stop the counters and accumulate
+ * the events counted since they were last read. Unlike
+ * do_count_mc_experiment(), the PMCs are not reset, so the count
+ * is resumed without reprogramming them if the thread gets back
+ * to this CPU before anybody else uses the PMU.
+ */
+static inline void save_counters_tbs(pmon_prof_t* prof, core_experiment_t* core_exp, int cpu)
+{
+	core_experiment_state_t* state=&prof->pmcs_state;
+	pmu_props_t* pmu_props=get_pmu_props_cpu(cpu);
+	uint64_t value;
+	unsigned int i;
+
+	/* Counters not set up for this thread yet */
+	if (state->need_setup) {
+		mc_stop_all_counters(core_exp);
+		return;
+	}
+
+	for(i=0; i<core_exp->size; i++) {
+		low_level_exp* lle = &core_exp->array[i];
+		__stop_count(lle);
+		value=__read_value(lle);
+		prof->pmc_values[i]+=value+state->nr_overflows[i]*(pmu_props->pmc_width_mask+1)-state->saved_values[i];
+		state->nr_overflows[i]=0;
+		state->saved_values[i]=value;
+	}
+
+	set_pmu_owner(state,cpu);
+}
+
 /*** PMCTrack's /proc/pmc/- callback functions **/
 
 /* /proc/pmc/config */
@@ -140,11 +237,13 @@ static const struct file_operations proc_pmc_info_fops = {
 static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf, size_t len, loff_t *off);
 static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size_t len, loff_t *off);
 static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma);
+static unsigned int proc_monitor_pmcs_poll(struct file *filp, struct poll_table_struct *wait);
 
 static const struct file_operations proc_monitor_pmcs_fops = {
 	.read = proc_monitor_pmcs_read,
 	.write = proc_monitor_pmcs_write,
 	.mmap=proc_monitor_pmcs_mmap,
+	.poll=proc_monitor_pmcs_poll,
 	.open = proc_generic_open,
 	.release = proc_generic_close,
 };
@@ -177,10 +276,11 @@ int do_count_mc_experiment(pmon_prof_t* prof,
 	unsigned int i;
 	uint64_t last_value;
 	pmu_props_t* pmu_props=get_pmu_props_cpu(smp_processor_id());
+	core_experiment_state_t* state=&prof->pmcs_state;
 
 	/* PMCS are just configured for the first time */
-	if(core_experiment->need_setup) {
-		mc_restart_all_counters(core_experiment);
+	if(state->need_setup) {
+		mc_restart_all_counters(core_experiment,state);
 		return 1;
 	} else {
 
@@ -188,19 +288,20 @@ int do_count_mc_experiment(pmon_prof_t* prof,
 			low_level_exp* lle = &core_experiment->array[i];
 			/* Gather PMC values (stop,read and reset) */
 			__stop_count(lle);
-			__read_count(lle);
+			last_value = __read_value(lle);
 			__restart_count(lle);
 
-			/* get Last value */
-			last_value = __get_last_value(lle);
-			if (core_experiment->nr_overflows[i]) {
+			if (state->nr_overflows[i]) {
 				/* Accumulate real value */
-				last_value+=core_experiment->nr_overflows[i]*(pmu_props->pmc_width_mask+1);
+				last_value+=state->nr_overflows[i]*(pmu_props->pmc_width_mask+1);
 				/* Clear overflow */
-				core_experiment->nr_overflows[i]=0;
+				state->nr_overflows[i]=0;
 				trace_printk("Acumulating overflow data from phys_counter %d\n",
 				             core_experiment->log_to_phys[i]);
 			}
+			/* Discount events already accumulated on context switch out */
+			last_value-=state->saved_values[i];
+			state->saved_values[i]=__get_reset_value(lle);
 			if(update_acum) {
 				prof->pmc_values[i]+=last_value;
 			}
@@ -213,21 +314,22 @@ int do_count_mc_experiment(pmon_prof_t* prof,
 
 /*
  * Read performance counters associated with the PMC configuration
- * described by core_experiment, and store gathered values in the
- * "samples" array.
+ * described by core_experiment (whose counter state is "state"),
+ * and store gathered values in the "samples" array.
  * Unlike do_count_mc_experiment(), this function takes into account
  * the fact that counters may have overflowed, since the last time
  * counters were reset.
  */
 int do_count_mc_experiment_buffer(core_experiment_t* core_experiment,
+                                  core_experiment_state_t* state,
                                   pmu_props_t* pmu_props,
                                   uint64_t* samples)
 {
 	unsigned int i;
 
 	/* PMCS are just configured for the first time */
-	if(core_experiment->need_setup) {
-		mc_restart_all_counters(core_experiment);
+	if(state->need_setup) {
+		mc_restart_all_counters(core_experiment,state);
 		return 1;
 	} else {
 		/*Monitoring Procedure*/
@@ -235,16 +337,15 @@ int do_count_mc_experiment_buffer(core_experiment_t* core_experiment,
 			low_level_exp* lle = &core_experiment->array[i];
 			/* Gather PMC values (stop,read and reset) */
 			__stop_count(lle);
-			__read_count(lle);
+			samples[i] = __read_value(lle);
 			__restart_count(lle);
+			state->saved_values[i]=__get_reset_value(lle);
 
-			/* get Last value */
-			samples[i] = __get_last_value(lle);
-			if (core_experiment->nr_overflows[i]) {
+			if (state->nr_overflows[i]) {
 				/* Accumulate real value */
-				samples[i]+=core_experiment->nr_overflows[i]*(pmu_props->pmc_width_mask+1);
+				samples[i]+=state->nr_overflows[i]*(pmu_props->pmc_width_mask+1);
 				/* Clear overflow */
-				core_experiment->nr_overflows[i]=0;
+				state->nr_overflows[i]=0;
 				trace_printk("Acumulating overflow data from phys_counter %d\n",
 				             core_experiment->log_to_phys[i]);
 			}
@@ -266,18 +367,21 @@ pmc_ops_t pmc_mc_prog = {
 	mod_get_current_metric_value
 };
 
-/* Invoked when forking a process/thread */
-static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_struct* p)
+/* Slab cache for the per-thread data structure (pmon_prof_t) */
+static struct kmem_cache* pmon_prof_cache=NULL;
+
+/*
+ * Allocate a pmon_prof_t structure for task "p"
+ * and initialize it with the default settings
+ */
+static pmon_prof_t* alloc_pmon_prof(struct task_struct* p)
 {
 	int i;
-	int ret;
-
-	/* Allocate memory to struct pmon_prof_t */
-	pmon_prof_t* prof = (pmon_prof_t*) kmalloc(sizeof(pmon_prof_t), GFP_KERNEL);
+	pmon_prof_t* prof = kmem_cache_alloc(pmon_prof_cache, GFP_KERNEL);
 
 	if(prof == NULL) {
 		printk(KERN_INFO "Can't allocate memory for pmon_prof_t.\n");
-		return -ENOMEM;
+		return NULL;
 	}
 
 	/* Basic prof_struct initialization */
@@ -285,8 +389,8 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	prof->samples_counter = 0;
 
 	prof->pmc_jiffies_interval=-1;	/* TBS disabled */
-
-	prof->pmc_jiffies_timeout=jiffies+3000*250;	/* Just in case: make sure it doesn't expire soon */
+	prof->pmc_sampling_period=0;
+	prof->pmc_sample_deadline=0;
 
 	prof->this_tsk=p;
 
@@ -295,6 +399,7 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	/* Set NULL */
 	prof->pmcs_config=NULL;
+	init_core_experiment_state_t(&prof->pmcs_state);
 
 	for(i=0; i<AMP_MAX_CORETYPES; i++)
 		init_core_experiment_set_t(&prof->pmcs_multiplex_cfg[i]);
@@ -309,6 +414,13 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	prof->context_switch_timestamp=jiffies;
 
+	/* Time accounting starts on the first context switch in */
+	prof->time_enabled=0;
+	prof->time_running=0;
+	prof->time_stamp=0;
+	prof->time_on_cpu=0;
+	prof->time_counting=0;
+
 	prof->flags=0;
 
 	prof->virt_counter_mask=0;	/* No virtual counters selected */
@@ -321,17 +433,18 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	prof->kernel_buffer_size=pmcs_pmon_config.pmon_kernel_buffer_size;
 
+	prof->overflow_policy=pmcs_pmon_config.pmon_overflow_policy;
+
+	/* Wake up the monitor on every sample by default */
+	memset(&prof->wakeup_cfg,0,sizeof(pmc_wakeup_cfg_t));
+
 	spin_lock_init(&prof->lock);
 
 	prof->pid_monitor=-1;
 
-#ifdef TBS_TIMER
-	/* Timer initialization (but timer is not added!!) */
-	init_timer(&prof->timer);
-	prof->timer.data=(unsigned long)prof;
-	prof->timer.function=tbs_mode_fire_timer;
-	prof->timer.expires=prof->pmc_jiffies_timeout;  /* It does not matter for now */
-#endif
+	/* No other monitoring sessions */
+	prof->nr_waiting_sessions=0;
+	prof->session_wait=0;
 
 	/* Associate this task to the current monitoring module */
 	prof->task_mod=current_monitoring_module();
@@ -339,46 +452,241 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	/* No per-thread private data by default */
 	prof->monitoring_mod_priv_data = NULL;
 
-	if (is_new_thread(clone_flags) && current->prof_enabled && current->pmc) {
-		pmon_prof_t* par_prof = (pmon_prof_t*)current->pmc;
+	return prof;
+}
 
-		if (!(par_prof->flags & PMC_SELF_MONITORING)) {
-			prof->profiling_mode=par_prof->profiling_mode;
-			if (par_prof->pmc_samples_buffer) {
-				get_pmc_samples_buffer(par_prof->pmc_samples_buffer);
-				prof->pmc_samples_buffer=par_prof->pmc_samples_buffer;
-			}
+/*
+ * Return the pmon_prof_t structure of a task, allocating it
+ * if the task had none. Per-thread data is allocated lazily:
+ * tasks get one the first time they (or a monitor process
+ * attaching to them) interact with PMCTrack.
+ */
+static pmon_prof_t* get_pmon_prof(struct task_struct* p)
+{
+	pmon_prof_t* prof=(pmon_prof_t*)ACCESS_ONCE(p->pmc);
+
+	if (prof)
+		return prof;
+
+	if ((prof=alloc_pmon_prof(p))==NULL)
+		return NULL;
+
+	/* Treat the allocation as if the task had just been created */
+	if (mm_on_fork(0,prof)) {
+		kmem_cache_free(pmon_prof_cache,prof);
+		return NULL;
+	}
+
+	/* Somebody else (the task itself or a monitor) may have beaten us to it */
+	if (cmpxchg(&p->pmc,NULL,prof)!=NULL) {
+		mm_on_free_task(prof);
+		kmem_cache_free(pmon_prof_cache,prof);
+		prof=(pmon_prof_t*)p->pmc;
+	}
+
+	return prof;
+}
+
+/*** Monitoring sessions of a thread (see pmc_task_session_t) ***/
+
+/* Release the buffer and the event sets of a session and free it up */
+static void free_task_session(pmc_task_session_t* session)
+{
+	int i;
+
+	if (session->pmc_samples_buffer)
+		put_pmc_samples_buffer(session->pmc_samples_buffer);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		free_experiment_set(&session->pmcs_multiplex_cfg[i]);
+
+	kfree(session);
+}
+
+/*
+ * Free up the sessions of a thread waiting for the PMU. If 'flush' is
+ * set, their monitors are woken up (e.g., when the thread exits).
+ */
+static void free_waiting_sessions(pmon_prof_t* prof, int flush)
+{
+	pmc_task_session_t* session;
+	int i;
+
+	for (i=0; i<prof->nr_waiting_sessions; i++) {
+		session=prof->waiting_sessions[i];
+		if (flush && session->pmc_samples_buffer)
+			__flush_monitor_program(session->pmc_samples_buffer);
+		free_task_session(session);
+	}
+
+	prof->nr_waiting_sessions=0;
+}
+
+/*
+ * Copy the configuration of a session into a new one
+ * (the buffer and the event sets are shared)
+ */
+static void clone_task_session(pmc_task_session_t* dst, pmc_task_session_t* src)
+{
+	int i;
+
+	dst->pid_monitor=src->pid_monitor;
+	dst->pmc_samples_buffer=src->pmc_samples_buffer;
+	if (dst->pmc_samples_buffer)
+		get_pmc_samples_buffer(dst->pmc_samples_buffer);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		clone_core_experiment_set_t(&dst->pmcs_multiplex_cfg[i],&src->pmcs_multiplex_cfg[i]);
+
+	dst->virt_counter_mask=src->virt_counter_mask;
+	dst->pmc_jiffies_interval=src->pmc_jiffies_interval;
+	dst->pmc_sampling_period=src->pmc_sampling_period;
+	dst->time_enabled=0;
+	dst->time_running=0;
+}
+
+/* Exchange the state of a waiting session with the one of the session that has the PMU */
+static void swap_task_session(pmon_prof_t* prof, pmc_task_session_t* session)
+{
+	pmc_task_session_t cur;
+	int i;
+
+	cur.pid_monitor=prof->pid_monitor;
+	cur.pmc_samples_buffer=prof->pmc_samples_buffer;
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		cur.pmcs_multiplex_cfg[i]=prof->pmcs_multiplex_cfg[i];
+	cur.virt_counter_mask=prof->virt_counter_mask;
+	cur.pmc_jiffies_interval=prof->pmc_jiffies_interval;
+	cur.pmc_sampling_period=prof->pmc_sampling_period;
+	cur.time_enabled=prof->time_enabled;
+	cur.time_running=prof->time_running;
+
+	prof->pid_monitor=session->pid_monitor;
+	prof->pmc_samples_buffer=session->pmc_samples_buffer;
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		prof->pmcs_multiplex_cfg[i]=session->pmcs_multiplex_cfg[i];
+	prof->virt_counter_mask=session->virt_counter_mask;
+	prof->pmc_jiffies_interval=session->pmc_jiffies_interval;
+	prof->pmc_sampling_period=session->pmc_sampling_period;
+	prof->time_enabled=session->time_enabled;
+	prof->time_running=session->time_running;
+
+	(*session)=cur;
+}
+
+/*
+ * Give the PMU of a thread to the first session waiting for it. The
+ * session that had it goes to the back of the queue. 'slot' is the time
+ * (ns) the thread was monitored while that session had the PMU: waiting
+ * sessions account it as enabled but not running, so their users can
+ * scale the counts as usual.
+ *
+ * The function must be invoked with prof->lock held. The caller
+ * then sets up the counters for the new session.
+ */
+static void rotate_task_sessions(pmon_prof_t* prof, uint64_t slot)
+{
+	pmc_task_session_t* next=prof->waiting_sessions[0];
+	int i;
+
+	for (i=0; i<prof->nr_waiting_sessions; i++)
+		prof->waiting_sessions[i]->time_enabled+=slot;
+
+	for (i=1; i<prof->nr_waiting_sessions; i++)
+		prof->waiting_sessions[i-1]=prof->waiting_sessions[i];
+
+	swap_task_session(prof,next);
+	prof->waiting_sessions[prof->nr_waiting_sessions-1]=next;
+	prof->session_wait=prof->time_enabled;
+}
+
+/*
+ * Invoked when forking a process/thread.
+ * The per-thread data structure is allocated right away only
+ * if the new thread inherits monitoring state from its parent.
+ */
+static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_struct* p)
+{
+	int i;
+	int ret;
+	pmon_prof_t* prof;
+	pmon_prof_t* par_prof = (pmon_prof_t*)current->pmc;
+	pmc_task_session_t* sessions[PMC_MAX_TASK_SESSIONS-1];
+	int nr_sessions;
+	unsigned long flags;
 
-			/* Clone pmcs */
-			if (par_prof->pmcs_config) {
-				for(i=0; i<AMP_MAX_CORETYPES; i++)
-					clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[i],&par_prof->pmcs_multiplex_cfg[i]);
-				/* For now start with slow core events */
-				prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
+	/* Fork/exit of unmonitored tasks is not penalized */
+	if (!(is_new_thread(clone_flags) && current->prof_enabled && par_prof)) {
+		p->pmc=NULL;
+		return 0;
+	}
+
+	if ((prof=alloc_pmon_prof(p))==NULL)
+		return -ENOMEM;
+
+	if (!(par_prof->flags & PMC_SELF_MONITORING)) {
+		/* The sessions waiting for the PMU are inherited as well */
+		nr_sessions=ACCESS_ONCE(par_prof->nr_waiting_sessions);
+		for (i=0; i<nr_sessions; i++) {
+			sessions[i]=kzalloc(sizeof(pmc_task_session_t),GFP_KERNEL);
+			if (!sessions[i]) {
+				while (i--)
+					kfree(sessions[i]);
+				kmem_cache_free(pmon_prof_cache,prof);
+				return -ENOMEM;
 			}
+		}
 
-			prof->virt_counter_mask=par_prof->virt_counter_mask;
+		/* Sessions of the parent may get the PMU in the meantime */
+		spin_lock_irqsave(&par_prof->lock,flags);
 
-			/* Inherit intervals from the parent process (sibling actually :-)) */
-			prof->pmc_jiffies_interval=par_prof->pmc_jiffies_interval;
-			prof->nticks_sampling_period=par_prof->nticks_sampling_period;
-			prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
-			/* Inherit monitor from the "parent thread" as well */
-			prof->pid_monitor=par_prof->pid_monitor;
-			p->prof_enabled=1;
-#ifdef TBS_TIMER
-			if (prof->profiling_mode==TBS_USER_MODE)
-				mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
-#endif
-		} else {
-			/* Inherit buffer size */
-			prof->kernel_buffer_size=par_prof->kernel_buffer_size;
+		prof->profiling_mode=par_prof->profiling_mode;
+		if (par_prof->pmc_samples_buffer) {
+			get_pmc_samples_buffer(par_prof->pmc_samples_buffer);
+			prof->pmc_samples_buffer=par_prof->pmc_samples_buffer;
+		}
+
+		/* Clone pmcs */
+		if (par_prof->pmcs_config) {
+			for(i=0; i<AMP_MAX_CORETYPES; i++)
+				clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[i],&par_prof->pmcs_multiplex_cfg[i]);
+			/* For now start with slow core events */
+			prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
+		}
+
+		prof->virt_counter_mask=par_prof->virt_counter_mask;
+
+		/* Inherit intervals from the parent process (sibling actually :-)) */
+		prof->pmc_jiffies_interval=par_prof->pmc_jiffies_interval;
+		prof->pmc_sampling_period=par_prof->pmc_sampling_period;
+		prof->nticks_sampling_period=par_prof->nticks_sampling_period;
+		/* The sampling timer is armed when the thread is first switched in */
+		prof->pmc_sample_deadline=tbs_clock()+prof->pmc_sampling_period;
+		/* Inherit monitor from the "parent thread" as well */
+		prof->pid_monitor=par_prof->pid_monitor;
+
+		for (i=0; i<nr_sessions && i<par_prof->nr_waiting_sessions; i++) {
+			clone_task_session(sessions[i],par_prof->waiting_sessions[i]);
+			prof->waiting_sessions[i]=sessions[i];
 		}
+		prof->nr_waiting_sessions=i;
 
+		spin_unlock_irqrestore(&par_prof->lock,flags);
+
+		/* Sessions detached in the meantime */
+		for (; i<nr_sessions; i++)
+			kfree(sessions[i]);
+
+		p->prof_enabled=1;
+	} else {
+		/* Inherit buffer size and overflow policy */
+		prof->kernel_buffer_size=par_prof->kernel_buffer_size;
+		prof->overflow_policy=par_prof->overflow_policy;
 	}
 
 	if ((ret=mm_on_fork(clone_flags,prof))) {
-		kfree(prof);
+		free_waiting_sessions(prof,0);
+		kmem_cache_free(pmon_prof_cache,prof);
 		return ret;
 	}
 
@@ -387,6 +695,113 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 }
 
 
+/*
+ * Slow path of push_thread_sample(): the monitoring module gets the
+ * sample first, as it may add virtual counts, and the sample is then
+ * copied into the ring. Kept out of line so that the fast path does
+ * not reserve room for a whole sample on the stack.
+ */
+static noinline uint64_t push_thread_sample_mm(pmon_prof_t* prof, core_experiment_t* core_exp, int cpu,
+        sample_type_t type, int mm_flags, void* mm_data,
+        core_experiment_set_t* mux_cset, int wakeup)
+{
+	pmc_sample_v2_t sample;
+	unsigned long flags;
+	int i;
+
+	/* Initialize sample*/
+	sample.type=type;
+	sample.coretype=get_coretype_cpu(cpu);
+	sample.exp_idx=core_exp->exp_idx;
+	sample.pmc_mask=core_exp->used_pmcs;
+	sample.nr_counts=core_exp->size;
+	sample.virt_mask=0;
+	sample.nr_virt_counts=0;
+	sample.pid=prof->this_tsk->pid;
+	sample.tgid=prof->this_tsk->tgid;
+	fill_sample_times(prof,&sample);
+
+	/* Copy and clear samples in prof */
+	for(i=0; i<MAX_LL_EXPS; i++) {
+		sample.pmc_counts[i]=prof->pmc_values[i];
+		prof->pmc_values[i]=0;
+	}
+
+	/* Call the monitoring module  */
+	mm_on_new_sample(prof,cpu,&sample,mm_flags,mm_data);
+
+	/* Push current counter values into the buffer */
+	if (prof->pmc_samples_buffer) {
+		local_irq_save(flags);
+		if (wakeup)
+			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample,prof->this_tsk);
+		else
+			__push_sample_cbuffer_nowakeup(prof->pmc_samples_buffer,&sample,prof->this_tsk);
+		local_irq_restore(flags);
+	}
+
+	if (mux_cset)
+		mux_account_sample(mux_cset,sample.pmc_counts,sample.nr_counts,sample.time_running);
+
+	return sample.time_enabled;
+}
+
+/*
+ * Turn the counts gathered for a thread (prof->pmc_values) into a new
+ * sample of type 'type', push it into the thread's buffer and clear
+ * the counts. Unless the monitoring module processes the samples of
+ * the thread ('mm_flags' and 'mm_data' are passed to it), the record
+ * is reserved in the ring of the current CPU and the counts are
+ * stored in place.
+ *
+ * If 'mux_cset' is not NULL, the sample is accounted for by the adaptive
+ * multiplexing policy of that set. The monitor is notified if 'wakeup'
+ * is set and the wakeup conditions are met.
+ *
+ * The function must be invoked with prof->lock held. It returns the
+ * time (ns) the thread was monitored during the sampling interval.
+ */
+static inline uint64_t push_thread_sample(pmon_prof_t* prof, core_experiment_t* core_exp, int cpu, sample_type_t type,
+                                      int mm_flags, void* mm_data, core_experiment_set_t* mux_cset, int wakeup)
+{
+	pmc_samples_buffer_t* sbuf=prof->pmc_samples_buffer;
+	pmc_sample_record_t* rec;
+	uint64_t timestamp, time_enabled, time_running;
+	uint32_t next_head=0;
+	unsigned long flags;
+	int i;
+
+	if (mm_handles_samples(prof))
+		return push_thread_sample_mm(prof,core_exp,cpu,type,mm_flags,mm_data,mux_cset,wakeup);
+
+	take_sample_times(prof,&timestamp,&time_enabled,&time_running);
+
+	if (mux_cset)
+		mux_account_sample(mux_cset,prof->pmc_values,core_exp->size,time_running);
+
+	/* Store current counter values straight into the ring of the local CPU */
+	if (sbuf) {
+		local_irq_save(flags);
+		rec=__reserve_sample_cbuffer(sbuf,prof->this_tsk,type,get_coretype_cpu(cpu),core_exp->exp_idx,
+		                             core_exp->used_pmcs,core_exp->size,&next_head);
+		if (rec) {
+			rec->timestamp=timestamp;
+			rec->time_enabled=time_enabled;
+			rec->time_running=time_running;
+			for (i=0; i<rec->nr_counts; i++)
+				rec->counts[i]=prof->pmc_values[i];
+		}
+		__commit_sample_cbuffer(sbuf,rec,next_head,wakeup);
+		local_irq_restore(flags);
+	}
+
+	/* Clear samples in prof */
+	for(i=0; i<MAX_LL_EXPS; i++)
+		prof->pmc_values[i]=0;
+
+	return time_enabled;
+}
+
 /*
  * This function is invoked from the tick processing
  * function and context-switch related callbacks
@@ -397,28 +812,26 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
  */
 static inline void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_exp, pmc_sampling_event_t event, int cpu)
 {
-	int i=0;
-	unsigned long flags;
-	pmc_sample_t sample;
+	sample_type_t type;
 	core_experiment_t* next;
+	uint64_t time_enabled;
 	int cur_coretype=get_coretype_cpu(cpu);
 #ifdef DEBUG
 	char strout[256];
 #endif
 	int callback_flags=MM_TICK;
 
-#ifdef TBS_TIMER
-	if ((event==PMC_TIMER_TICK_EVT) && (prof->this_tsk!=current))
-		callback_flags|=MM_NO_CUR_CPU;
-#endif
-	if (event==PMC_SAVE_EVT || event==PMC_SELF_EVT) {
+	if (event==PMC_SAVE_EVT) {
+		save_counters_tbs(prof,core_exp,cpu);
+		callback_flags|=MM_SAVE;
+	} else if (event==PMC_SELF_EVT) {
 		do_count_mc_experiment(prof,core_exp,1);
 		callback_flags|=MM_SAVE;
 	}
 
-	if (event==PMC_MIGRATION_EVT || event==PMC_SELF_EVT || event== PMC_TIMER_TICK_EVT || (prof->pmc_jiffies_interval>0 && prof->pmc_jiffies_timeout <=jiffies)) {
+	if (event==PMC_MIGRATION_EVT || event==PMC_SELF_EVT || event== PMC_TIMER_TICK_EVT || (prof->pmc_jiffies_interval>0 && prof->pmc_sample_deadline<=tbs_clock())) {
 		/* In tick() only read on demand */
-		if (event==PMC_TICK_EVT || (event==PMC_TIMER_TICK_EVT && (prof->this_tsk==current))) {
+		if (event==PMC_TICK_EVT || event==PMC_TIMER_TICK_EVT) {
 #ifdef DEBUG
 			print_pmu_msr_values_debug(strout);
 			printk (KERN_INFO "%s\n", strout);
@@ -426,69 +839,51 @@ static inline void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t
 			do_count_mc_experiment(prof,core_exp,1);
 		}
 
-		/* Prepare next timeout */
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
-#ifdef TBS_TIMER
-		if (prof->profiling_mode==TBS_USER_MODE && prof->this_tsk->prof_enabled)
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
-#endif
-		/* Initialize sample*/
+		/* Prepare next timeout (the per-CPU timer picks it up) */
+		prof->pmc_sample_deadline=tbs_clock()+prof->pmc_sampling_period;
+		/* Buffer full: counts keep accumulating until the next sample */
+		if (throttle_sample_cbuffer(prof))
+			return;
+
 		switch(event) {
 		case PMC_TIMER_TICK_EVT:
 		case PMC_TICK_EVT:
 		case PMC_SAVE_EVT:
-			sample.type=PMC_TICK_SAMPLE;
+			type=PMC_TICK_SAMPLE;
 			break;
 		case PMC_MIGRATION_EVT:
-			sample.type=PMC_MIGRATION_SAMPLE;
+			type=PMC_MIGRATION_SAMPLE;
 			break;
 		default:
-			sample.type=PMC_SELF_SAMPLE;
+			type=PMC_SELF_SAMPLE;
 			break;
 		}
 
-		sample.coretype=cur_coretype;
-		sample.exp_idx=core_exp->exp_idx;
-		sample.pmc_mask=core_exp->used_pmcs;
-		sample.nr_counts=core_exp->size;
-		sample.virt_mask=0;
-		sample.nr_virt_counts=0;
-		sample.pid=prof->this_tsk->pid;
-
-		/* Copy and clear samples in prof */
-		for(i=0; i<MAX_LL_EXPS; i++) {
-			sample.pmc_counts[i]=prof->pmc_values[i];
-			prof->pmc_values[i]=0;
-		}
-
-		/* Call the monitoring module  */
-		//if (prof->virt_counter_mask)
-		mm_on_new_sample(prof,cpu,&sample,callback_flags,NULL);
-
-		if (prof->pmc_samples_buffer) {
-			/* Push current counter values into the buffer */
-			spin_lock_irqsave(&prof->pmc_samples_buffer->lock,flags);
-			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-			spin_unlock_irqrestore(&prof->pmc_samples_buffer->lock,flags);
-		}
-
-		if (event==PMC_SAVE_EVT)
-			mc_stop_all_counters(core_exp);
+		/* Push current counter values into the buffer */
+		time_enabled=push_thread_sample(prof,core_exp,cpu,type,callback_flags,NULL,
+		                                &prof->pmcs_multiplex_cfg[cur_coretype],1);
 
 		/* Engage multiplexation */
 		next=get_next_experiment_in_set(&prof->pmcs_multiplex_cfg[cur_coretype]);
 
+		/* Give the PMU to the next monitoring session of the thread (if any) */
+		if (prof->nr_waiting_sessions) {
+			rotate_task_sessions(prof,time_enabled>prof->session_wait?time_enabled-prof->session_wait:0);
+			next=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[cur_coretype]);
+			if (!next)
+				next=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
+			prof->pmc_sample_deadline=tbs_clock()+prof->pmc_sampling_period;
+		}
+
 		if (next && prof->pmcs_config!=next) {
 			prof->pmcs_config=next;
-
-			if (! (callback_flags & MM_NO_CUR_CPU) ) {
-				/* Clear all counters in the platform */
-				mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
-				/* reconfigure counters as if it were the first time*/
-				mc_restart_all_counters(prof->pmcs_config);
-			} else {
-				prof->flags|=PMC_PREPARE_MULTIPLEXING;
-			}
+			/* Clear all counters in the platform */
+			mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
+			/* reconfigure counters as if it were the first time*/
+			mc_restart_all_counters(prof->pmcs_config,&prof->pmcs_state);
+			/* The thread is leaving the CPU */
+			if (event==PMC_SAVE_EVT)
+				mc_stop_all_counters(prof->pmcs_config);
 		}
 	}
 }
@@ -504,10 +899,6 @@ static inline void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t
  */
 static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_t* core_exp, pmc_sampling_event_t event,  int cpu)
 {
-	int i=0;
-	pmc_sample_t sample;
-	int cur_coretype=get_coretype_cpu(cpu);
-
 	switch (event) {
 	case PMC_TICK_EVT:
 		if(prof->pmc_ticks_counter >= (prof->nticks_sampling_period -1) ) {
@@ -517,54 +908,29 @@ static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_
 			/*Sampling interval counter is reseted*/
 			prof->pmc_ticks_counter = 0;
 
-			/* Initialize sample*/
-			sample.type=PMC_TICK_SAMPLE;
-			sample.coretype=cur_coretype;
-			sample.exp_idx=core_exp->exp_idx;
-			sample.pmc_mask=core_exp->used_pmcs;
-			sample.nr_counts=core_exp->size;
-			sample.virt_mask=0;
-			sample.nr_virt_counts=0;
-			sample.pid=prof->this_tsk->pid;
-
-			/* Copy and clear samples in prof */
-			for(i=0; i<MAX_LL_EXPS; i++) {
-				sample.pmc_counts[i]=prof->pmc_values[i];
-				prof->pmc_values[i]=0;
-			}
-
-			/* Call the monitoring module (This one controls multiplexation if necessary) !! */
-			mm_on_new_sample(prof,cpu,&sample,MM_TICK,NULL);
+			/* Buffer full: counts keep accumulating until the next sample */
+			if (throttle_sample_cbuffer(prof))
+				break;
 
-			/* Push sample if it's due time */
-			push_sample_cbuffer(prof,&sample);
+			/*
+			 * Push sample if it's due time
+			 * (the monitoring module controls multiplexation if necessary)
+			 */
+			push_thread_sample(prof,core_exp,cpu,PMC_TICK_SAMPLE,MM_TICK,NULL,NULL,1);
 		} else {
 			/*Performance tool sampling interval control sample is incremented*/
 			prof->pmc_ticks_counter++;
 		}
 		break;
 	case PMC_MIGRATION_EVT:
-		/* Initialize sample*/
-		sample.type=PMC_MIGRATION_SAMPLE;
-		sample.coretype=cur_coretype;
-		sample.exp_idx=core_exp->exp_idx;
-		sample.pmc_mask=core_exp->used_pmcs;
-		sample.nr_counts=core_exp->size;
-		sample.virt_mask=0;
-		sample.nr_virt_counts=0;
-		sample.pid=prof->this_tsk->pid;
-
-		/* Copy and clear samples in prof */
-		for(i=0; i<MAX_LL_EXPS; i++) {
-			sample.pmc_counts[i]=prof->pmc_values[i];
-			prof->pmc_values[i]=0;
+		/* Buffer full: counts keep accumulating until the next sample */
+		if (throttle_sample_cbuffer(prof)) {
+			prof->pmc_ticks_counter = 0;
+			break;
 		}
 
-		/* Call the monitoring module (This one controls multiplexation if necesary) !! */
-		mm_on_new_sample(prof,cpu,&sample,MM_MIGRATION,&prof->pmc_ticks_counter);
-
-		/* Push sample if it's due time */
-		push_sample_cbuffer(prof,&sample);
+		/* Push sample (the monitoring module controls multiplexation if necessary) */
+		push_thread_sample(prof,core_exp,cpu,PMC_MIGRATION_SAMPLE,MM_MIGRATION,&prof->pmc_ticks_counter,NULL,1);
 
 		/*Sampling interval counter is reseted*/
 		prof->pmc_ticks_counter = 0;
@@ -579,10 +945,17 @@ static void mod_save_callback_gen(void* v_prof, int cpu, int lock)
 	pmon_prof_t* prof=(pmon_prof_t*)v_prof;
 	core_experiment_t* core_exp;
 	unsigned long flags=0;
+	int counting=1;
 
 	/* System-wide monitoring mode has a higher priority than per-thread modes */
 	if (syswide_monitoring_enabled() && !syswide_monitoring_switch_out(cpu))
-		return;
+		counting=0;
+
+#ifdef TBS_TIMER
+	/* Stop sampling the thread on this CPU (even if monitoring was just disabled) */
+	if (prof)
+		tbs_sampler_stop(prof,cpu);
+#endif
 
 	if (!prof || !prof->this_tsk->prof_enabled)
 		return;
@@ -593,21 +966,25 @@ static void mod_save_callback_gen(void* v_prof, int cpu, int lock)
 	if (unlikely(!prof->this_tsk->prof_enabled))
 		goto unlock;
 
+	/* Account the time the thread ran since it was switched in */
+	sample_times_switch_out(prof);
+
+	if (!counting)
+		goto unlock;
+
 	core_exp = prof->pmcs_config?prof->pmcs_config:&per_cpu(cpu_exp, cpu);
 
 	switch(prof->profiling_mode) {
 	case EBS_MODE:
 		/* Save counter values in task_struct */
-		if (!core_exp->need_setup)	/* If first time ==> do this to avoid storing a different reset value !! */
-			mc_save_all_counters(core_exp);
-		mc_stop_all_counters(core_exp);
+		if (!prof->pmcs_state.need_setup)	/* If first time ==> do this to avoid storing a different reset value !! */
+			mc_save_all_counters(core_exp,&prof->pmcs_state,cpu);
+		else
+			mc_stop_all_counters(core_exp);
 		break;
 	case TBS_SCHED_MODE:
-		/* Just increase counts!! (But do not clear timing counters)
-		   - This function sets performance counters to the reset value
-		*/
-		do_count_mc_experiment(prof,core_exp,1);
-		mc_stop_all_counters(core_exp);
+		/* Just increase counts!! (But do not clear timing counters) */
+		save_counters_tbs(prof,core_exp,cpu);
 		break;
 	case TBS_USER_MODE:
 		sample_counters_user_tbs(prof,core_exp,PMC_SAVE_EVT,cpu);
@@ -639,10 +1016,11 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 	unsigned long flags;
 	int this_coretype=0,prev_coretype=0;
 	int migration=0;
+	int counting=1;
 
 	/* System-wide monitoring mode has a higher priority than per-thread modes */
 	if (syswide_monitoring_enabled() && !syswide_monitoring_switch_in(cpu))
-		return;
+		counting=0;
 
 	if (!prof || !prof->this_tsk->prof_enabled)
 		return;
@@ -654,6 +1032,21 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 			goto unlock;
 	}
 
+	/*
+	 * The thread is enabled from now on, but its counters only count
+	 * if the PMUs are not in use by the system-wide mode
+	 */
+	sample_times_switch_in(prof,counting);
+
+#ifdef TBS_TIMER
+	/* Sample the thread while it runs on this CPU */
+	if (prof->profiling_mode==TBS_USER_MODE)
+		tbs_sampler_start(prof,cpu);
+#endif
+
+	if (!counting)
+		goto unlock;
+
 	core_exp = prof->pmcs_config?prof->pmcs_config:&per_cpu(cpu_exp, cpu);
 
 	mm_on_switch_in(prof);
@@ -672,7 +1065,7 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 	switch(prof->profiling_mode) {
 	case EBS_MODE:
 		/* Restore counters to pick up the count where we left off */
-		mc_restore_all_counters(core_exp);
+		mc_restore_all_counters(core_exp,&prof->pmcs_state,cpu);
 		break;
 	case TBS_SCHED_MODE:
 		/* notify migration (to do whatever magic necesary) */
@@ -691,21 +1084,11 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 				mc_clear_all_platform_counters(get_pmu_props_coretype(this_coretype));
 				prof->pmcs_config=next;
 				/* reconfigure counters as if it were the first time*/
-				mc_restart_all_counters(prof->pmcs_config);
+				mc_restart_all_counters(prof->pmcs_config,&prof->pmcs_state);
 			}
 		} else {
-
-#ifdef TBS_TIMER
-			if (!refresh_event_multiplexing_cpu(prof,this_coretype)) {
-				/* Reprogram all the counters safely from here */
-				mc_clear_all_counters(core_exp);
-				mc_restart_all_counters(core_exp);
-			}
-#else
-			/* Reprogram all the counters safely from here */
-			mc_clear_all_counters(core_exp);
-			mc_restart_all_counters(core_exp);
-#endif
+			/* Resume the count (reprogramming the PMCs only if necessary) */
+			mc_restore_all_counters(core_exp,&prof->pmcs_state,cpu);
 		}
 
 		if (migration)
@@ -730,12 +1113,11 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 				mc_clear_all_platform_counters(get_pmu_props_coretype(this_coretype));
 				prof->pmcs_config=next;
 				/* reconfigure counters as if it were the first time*/
-				mc_restart_all_counters(prof->pmcs_config);
+				mc_restart_all_counters(prof->pmcs_config,&prof->pmcs_state);
 			}
 		} else {
-			/* Reprogram all the counters safely from here */
-			mc_clear_all_counters(core_exp);
-			mc_restart_all_counters(core_exp);
+			/* Resume the count (reprogramming the PMCs only if necessary) */
+			mc_restore_all_counters(core_exp,&prof->pmcs_state,cpu);
 		}
 		break;
 	}
@@ -756,19 +1138,6 @@ static void mod_restore_callback(void* v_prof, int cpu)
 
 
 #ifdef TBS_TIMER
-static inline int refresh_event_multiplexing_cpu(pmon_prof_t* prof,int cur_coretype)
-{
-	if (prof->flags & PMC_PREPARE_MULTIPLEXING) {
-		/* Clear all counters in the platform */
-		mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
-		/* reconfigure counters as if it were the first time*/
-		mc_restart_all_counters(prof->pmcs_config);
-		prof->flags&=~PMC_PREPARE_MULTIPLEXING;
-		return 1;
-	}
-	return 0;
-}
-
 /* Structure to aid in remote function invocation */
 struct remote_function_args {
 	struct 	task_struct	*p;
@@ -834,58 +1203,44 @@ pmct_cpu_function_call(struct task_struct *p, int cpu, int (*func) (void *info),
 	return data.ret;
 }
 
-/* Sample performance counters for a task in interrupt context */
-static int sample_counters_user_tbs_task(void *vprof)
+/*
+ * Callback of the per-CPU TBS sampling timer. It runs on the CPU
+ * where the sampled thread runs, so the counters are read locally.
+ */
+static enum hrtimer_restart tbs_sampler_fire(struct hrtimer* timer)
 {
-	pmon_prof_t* prof=(pmon_prof_t*) vprof;
-	core_experiment_t* core_exp;
+	tbs_sampler_t* sampler=container_of(timer,tbs_sampler_t,timer);
+	pmon_prof_t* prof=sampler->prof;
+	enum hrtimer_restart ret=HRTIMER_NORESTART;
 	unsigned long flags;
+	uint64_t now;
+
+	if (!prof)
+		return HRTIMER_NORESTART;
 
 	spin_lock_irqsave(&prof->lock,flags);
-	core_exp = prof->pmcs_config;
-	if (prof->this_tsk->prof_enabled && prof->pmcs_config && prof->pmc_jiffies_timeout==jiffies)
-		sample_counters_user_tbs(prof,core_exp,PMC_TIMER_TICK_EVT,smp_processor_id());
+
+	if (prof->this_tsk!=current || !prof->this_tsk->prof_enabled || prof->profiling_mode!=TBS_USER_MODE) {
+		sampler->prof=NULL;
+		goto unlock;
+	}
+
+	/* The deadline may have been pushed back by a sample collected meanwhile */
+	now=ktime_to_ns(hrtimer_cb_get_time(timer));
+	if (prof->pmc_sample_deadline<=now) {
+		if (prof->pmcs_config)
+			sample_counters_user_tbs(prof,prof->pmcs_config,PMC_TIMER_TICK_EVT,smp_processor_id());
+		else
+			prof->pmc_sample_deadline=now+prof->pmc_sampling_period;
+	}
+
+	hrtimer_set_expires(timer,ns_to_ktime(prof->pmc_sample_deadline));
+	ret=HRTIMER_RESTART;
+unlock:
 	spin_unlock_irqrestore(&prof->lock,flags);
-	return 0;
+	return ret;
 }
-
-/* Function associated with the kernel timer used for TBS mode */
-static void tbs_mode_fire_timer(unsigned long data)
-{
-	pmon_prof_t* prof=(pmon_prof_t*) data;
-	struct task_struct* p;
-	int cpu_task;
-	const int max_nr_tries=3;
-	int nr_tries=0;
-	int ret=-EAGAIN;
-
-	if (!prof)
-		return;
-
-	p=prof->this_tsk;
-	cpu_task=task_cpu_safe(p);
-
-	/*
-	 * Obtain CPU safely. Invoke the function to read HW counters
-	 * on the CPU where the task runs.
-	 */
-	if (cpu_task==-1 || p->state!=TASK_RUNNING) {
-		sample_counters_user_tbs_task(prof);
-	} else {
-		/*
-		 * Note that the task may go to sleep or be migrated in the meantime. That is not a big deal
-		 * since the save callback is invoked in that case. That callback already updates
-		 * auxiliary values for PMC counts.
-		 */
-		while (nr_tries<max_nr_tries && ret==-EAGAIN) {
-			ret=pmct_cpu_function_call(p, cpu_task, sample_counters_user_tbs_task,prof);
-			nr_tries++;
-		}
-		if (ret!=0)
-			trace_printk("TBS TIMER couldn't execute successfully in %d tries\n",nr_tries);
-	}
-}
-#endif
+#endif
 
 /* Invoked from scheduler_tick() */
 static void mod_tbs_tick(void* v_prof, int cpu)
@@ -893,13 +1248,36 @@ static void mod_tbs_tick(void* v_prof, int cpu)
 	pmon_prof_t* prof=(pmon_prof_t*)v_prof;
 	core_experiment_t* core_exp;
 	unsigned long flags=0;
-#ifdef TBS_TIMER
-	int cur_coretype=get_coretype_cpu(cpu);
-#endif
 
 	if (!prof || !prof->this_tsk->prof_enabled)
 		return;
 
+	/*
+	 * Fast path: return without taking the lock if there is nothing
+	 * to be done on this tick. The tick runs on the CPU where the thread
+	 * runs with interrupts disabled, so the context-switch callbacks
+	 * cannot race with it.
+	 */
+	switch(prof->profiling_mode) {
+	case EBS_MODE: /* In EBS-mode there is nothing to be done on tick */
+		return;
+	case TBS_SCHED_MODE:
+		if (prof->pmc_ticks_counter < (prof->nticks_sampling_period -1)) {
+			prof->pmc_ticks_counter++;
+			return;
+		}
+		break;
+	case TBS_USER_MODE:
+#ifdef TBS_TIMER
+		/* Sampled by the per-CPU timer (even if the tick is stopped) */
+		return;
+#else
+		if (prof->pmc_jiffies_interval<=0 || prof->pmc_sample_deadline > tbs_clock())
+			return;
+		break;
+#endif
+	}
+
 	spin_lock_irqsave(&prof->lock,flags);
 
 	core_exp = prof->pmcs_config?prof->pmcs_config:&per_cpu(cpu_exp, cpu);
@@ -914,9 +1292,7 @@ static void mod_tbs_tick(void* v_prof, int cpu)
 		sample_counters_sched_tbs(prof,core_exp,PMC_TICK_EVT,cpu);
 		break;
 	case TBS_USER_MODE:
-#ifdef TBS_TIMER
-		refresh_event_multiplexing_cpu(prof,cur_coretype);
-#else
+#ifndef TBS_TIMER
 		sample_counters_user_tbs(prof,core_exp,PMC_TICK_EVT,cpu);
 #endif
 		break;
@@ -941,12 +1317,18 @@ static void  mod_exec_thread(struct task_struct* tsk)
 static void mod_exit_thread(struct task_struct* tsk)
 {
 	unsigned long flags;
-	pmon_prof_t *prof= (pmon_prof_t*)tsk->pmc;
+	pmon_prof_t *prof;
 	core_experiment_t* core_exp;
-	pmc_sample_t sample;
-	int i=0;
 	int cpu=raw_smp_processor_id();
-	int cur_coretype=get_coretype_cpu(cpu);
+
+	/*
+	 * Order the setting of PF_EXITING with the read of tsk->pmc
+	 * (pairs with the cmpxchg() in get_pmon_prof()): a monitor
+	 * attaching concurrently either finds PF_EXITING set in
+	 * set_up_monitoring_task() or its pmon_prof_t is seen here.
+	 */
+	smp_mb();
+	prof=(pmon_prof_t*)tsk->pmc;
 
 	if (!tsk || !prof || tsk != prof->this_tsk)
 		return;
@@ -955,12 +1337,12 @@ static void mod_exit_thread(struct task_struct* tsk)
 	if (unlikely(is_syswide_monitor(tsk)))
 		syswide_monitoring_stop();
 
+	spin_lock_irqsave(&prof->lock,flags);
+
 #ifdef TBS_TIMER
-	/* Cancel per-thread timer if in TBS mode */
-	if (prof->profiling_mode==TBS_USER_MODE)
-		del_timer_sync(&prof->timer);
+	/* Stop sampling the thread (it runs on this CPU) */
+	tbs_sampler_stop(prof,smp_processor_id());
 #endif
-	spin_lock_irqsave(&prof->lock,flags);
 
 	core_exp = prof->pmcs_config?prof->pmcs_config:&per_cpu(cpu_exp, cpu);
 
@@ -970,38 +1352,15 @@ static void mod_exit_thread(struct task_struct* tsk)
 		do_count_mc_experiment(prof,core_exp,1);
 
 		/* Prepare next timeout (infinite hack) */
-		prof->pmc_jiffies_timeout=jiffies+HZ*3600;
-
-		/* Initialize sample*/
-		sample.type=PMC_EXIT_SAMPLE;
-		sample.coretype=cur_coretype;
-		sample.exp_idx=core_exp->exp_idx;
-		sample.pmc_mask=core_exp->used_pmcs;
-		sample.nr_counts=core_exp->size;
-		sample.virt_mask=0;
-		sample.nr_virt_counts=0;
-		sample.pid=prof->this_tsk->pid;
-
-		/* Copy and clear samples in prof */
-		for(i=0; i<MAX_LL_EXPS; i++) {
-			sample.pmc_counts[i]=prof->pmc_values[i];
-			prof->pmc_values[i]=0;
-		}
-
-		//if (prof->virt_counter_mask)
-		mm_on_new_sample(prof,cpu,&sample,MM_EXIT,NULL);
+		prof->pmc_sample_deadline=tbs_clock()+3600ULL*NSEC_PER_SEC;
 
+		/* Push current counter values into the buffer (IRQs are disabled) */
+		push_thread_sample(prof,core_exp,cpu,PMC_EXIT_SAMPLE,MM_EXIT,NULL,NULL,0);
 
 		if (prof->pmc_samples_buffer) {
-			/* Push current counter values into the buffer */
-			spin_lock(&prof->pmc_samples_buffer->lock);
-
 			//Common for everything
 			prof->flags|=PMC_EXITING;
-
-			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-
-			spin_unlock(&prof->pmc_samples_buffer->lock);
+			__flush_monitor_program(prof->pmc_samples_buffer);
 		}
 
 		break;
@@ -1009,15 +1368,11 @@ static void mod_exit_thread(struct task_struct* tsk)
 	case EBS_MODE:
 
 		if (prof->pmc_samples_buffer) {
-			/* Just Notify termination */
-			spin_lock(&prof->pmc_samples_buffer->lock);
-
 			//Common for everything
 			prof->flags|=PMC_EXITING;
 
-			__wake_up_monitor_program(prof->pmc_samples_buffer);
-
-			spin_unlock(&prof->pmc_samples_buffer->lock);
+			/* Just Notify termination */
+			__flush_monitor_program(prof->pmc_samples_buffer);
 		}
 
 		break;
@@ -1033,6 +1388,9 @@ static void mod_exit_thread(struct task_struct* tsk)
 		prof->pmc_samples_buffer=NULL;
 	}
 
+	/* The monitors of the other sessions see the thread exit as well */
+	free_waiting_sessions(prof,1);
+
 	spin_unlock_irqrestore(&prof->lock,flags);
 }
 
@@ -1071,6 +1429,8 @@ static void mod_free_per_thread_data(struct task_struct* tsk)
 		prof->pmcs_config=NULL;
 	}
 
+	free_waiting_sessions(prof,0);
+
 	if (prof->pmc_user_samples) {
 		kfree(prof->pmc_user_samples);
 		prof->pmc_user_samples=NULL;
@@ -1082,23 +1442,57 @@ static void mod_free_per_thread_data(struct task_struct* tsk)
 		prof->pmc_kernel_samples=NULL;
 	}
 
-	kfree(tsk->pmc);
+	kmem_cache_free(pmon_prof_cache,prof);
 	tsk->pmc = NULL;
 }
 
 
 /*** Implementation of /proc/pmc/- callback functions **/
 
+/* Names of the buffer overflow policies (indexed by pmc_overflow_policy_t) */
+static const char* overflow_policy_names[PMC_NR_OVERFLOW_POLICIES]= {"drop","overwrite","throttle"};
+
+static const char* mux_policy_names[PMC_NR_MUX_POLICIES]= {"rr","weighted","adaptive"};
+
+/* Returns the multiplexing policy whose name is 'str' or -1 if there is no such policy */
+static int parse_mux_policy(const char* str)
+{
+	int i;
+
+	for (i=0; i<PMC_NR_MUX_POLICIES; i++)
+		if (strcmp(str,mux_policy_names[i])==0)
+			return i;
+
+	return -1;
+}
+
+/* Returns the overflow policy whose name is 'str' or -1 if there is no such policy */
+static int parse_overflow_policy(const char* str)
+{
+	int i;
+
+	for (i=0; i<PMC_NR_OVERFLOW_POLICIES; i++)
+		if (strcmp(str,overflow_policy_names[i])==0)
+			return i;
+
+	return -1;
+}
+
 /* Write callback for /proc/pmc/config */
 static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
 {
 	int val;
 	char *kbuf;
+	char policy[16];
 	int ret=len;
 
 	if (*off>0)
 		return 0;
 
+	/* Processes configuring PMCTrack get their per-thread data on first use */
+	if (!get_pmon_prof(current))
+		return -ENOMEM;
+
 	if ((kbuf=vmalloc(len+1))==NULL)
 		return -ENOMEM;
 
@@ -1160,8 +1554,46 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
 
 		if (prof) {
-			prof->pmc_jiffies_interval=msecs_to_jiffies(val);
+			set_sampling_period_us(prof,val*USEC_PER_MSEC);
+		}
+	} else if (sscanf(kbuf, "timeout_us %i",&val)==1 && val>0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+
+		if (prof) {
+			set_sampling_period_us(prof,val);
 		}
+	} else if (sscanf(kbuf, "wakeup_samples %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+
+		if (prof)
+			prof->wakeup_cfg.nr_samples=val;
+	} else if (sscanf(kbuf, "wakeup_fill %i",&val)==1 && val>=0 && val<=100) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+
+		if (prof)
+			prof->wakeup_cfg.fill_percent=val;
+	} else if (sscanf(kbuf, "wakeup_latency %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+
+		if (prof)
+			prof->wakeup_cfg.latency=msecs_to_jiffies(val);
+	} else if (sscanf(kbuf,"buffer_overflow_t %15s",policy)==1) {
+		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+
+		if ((val=parse_overflow_policy(policy))<0)
+			ret=-EINVAL;
+		else if (prof)
+			prof->overflow_policy=val;
+	} else if (sscanf(kbuf,"buffer_overflow %15s",policy)==1) {
+		if ((val=parse_overflow_policy(policy))<0)
+			ret=-EINVAL;
+		else
+			pmcs_pmon_config.pmon_overflow_policy=val;
+	} else if (sscanf(kbuf,"mux_policy %15s",policy)==1) {
+		if ((val=parse_mux_policy(policy))<0)
+			ret=-EINVAL;
+		else
+			pmc_mux_policy=val;
 	} else if(sscanf(kbuf,"kernel_buffer_size_t %i",&val)==1 && val>0) {
 		pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
 
@@ -1172,6 +1604,12 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 			else
 				prof->kernel_buffer_size=new_size;
 		}
+	} else if (sscanf(kbuf,"syswide_cgroup %i",&val)==1) {
+		if ((val=syswide_monitoring_set_cgroup(val)))
+			ret=val;
+	} else if (strncmp(kbuf,"syswide_cpus ",13)==0) {
+		if ((val=syswide_monitoring_set_cpus(strim(kbuf+13))))
+			ret=val;
 	} else if ((val=mm_on_write_config(kbuf,len))!=0) {
 		ret=val;
 	} else
@@ -1207,6 +1645,13 @@ static ssize_t proc_pmc_config_read(struct file *filp, char __user *buf, size_t
 	dst+=sprintf(dst,"kernel_buffer_size = %u bytes (%zu samples)\n",
 	             pmcs_pmon_config.pmon_kernel_buffer_size,
 	             pmcs_pmon_config.pmon_kernel_buffer_size/sizeof(pmc_sample_t));
+	dst+=sprintf(dst,"buffer_overflow = %s\n",
+	             overflow_policy_names[pmcs_pmon_config.pmon_overflow_policy]);
+	dst+=sprintf(dst,"mux_policy = %s\n",mux_policy_names[pmc_mux_policy]);
+	dst+=sprintf(dst,"syswide_cpus = ");
+	dst+=syswide_monitoring_print_cpus(dst,PAGE_SIZE-(dst-kbuf)-1);
+	dst+=sprintf(dst,"\n");
+	dst+=syswide_monitoring_print_sessions(dst,PAGE_SIZE-(dst-kbuf)-1);
 
 	err=mm_on_read_config(dst,PAGE_SIZE-(dst-kbuf-1));
 
@@ -1237,6 +1682,8 @@ struct attach_arg {
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
 	core_experiment_set_t* exp_set[AMP_MAX_CORETYPES];
+	int profiling_mode;
+	pid_t pid_monitor;	/* Monitor whose session is closed (detach) */
 };
 
 
@@ -1253,7 +1700,17 @@ static int set_up_monitoring_task(void *data)
 	spin_lock_irqsave(&target->lock,flags);
 	cpu=smp_processor_id();
 
-	target->profiling_mode=monitor->profiling_mode;
+	/*
+	 * The exit callback may have run (or skipped the task, if it had
+	 * no pmon_prof_t yet) since the caller checked for PF_EXITING.
+	 * Taking references now would keep the monitor from seeing EOF.
+	 */
+	if (p->flags & PF_EXITING) {
+		spin_unlock_irqrestore(&target->lock,flags);
+		return -ESRCH;
+	}
+
+	target->profiling_mode=arg->profiling_mode;
 
 	/* Get reference to buffer */
 	if (monitor->pmc_samples_buffer) {
@@ -1270,18 +1727,16 @@ static int set_up_monitoring_task(void *data)
 
 	/* For now start with slow core events */
 	target->pmcs_config=get_cur_experiment_in_set(&target->pmcs_multiplex_cfg[0]);
+	init_core_experiment_state_t(&target->pmcs_state);
 
 	/* Inherit virtual counters */
 	target->virt_counter_mask=monitor->virt_counter_mask;
 
 	/* Inherit intervals from the monitor process  */
 	target->pmc_jiffies_interval=monitor->pmc_jiffies_interval;
+	target->pmc_sampling_period=monitor->pmc_sampling_period;
 	target->nticks_sampling_period=monitor->nticks_sampling_period;
-	target->pmc_jiffies_timeout=jiffies+target->pmc_jiffies_interval;
-#ifdef TBS_TIMER
-	if (target->profiling_mode==TBS_USER_MODE)
-		mod_timer( &target->timer, target->pmc_jiffies_timeout);
-#endif
+	target->pmc_sample_deadline=tbs_clock()+target->pmc_sampling_period;
 	smp_mb();
 	p->prof_enabled=1;
 	/* Set itself as the monitor */
@@ -1296,10 +1751,73 @@ static int set_up_monitoring_task(void *data)
 
 static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t monitor_pid);
 
-static int pmctrack_pid_attach(pid_t pid)
+/* Returns a non-zero value if the monitor with PID=pid has a session waiting for the thread's PMU */
+static int has_waiting_session(pmon_prof_t* prof, pid_t pid)
+{
+	int i;
+
+	for (i=0; i<prof->nr_waiting_sessions; i++)
+		if (prof->waiting_sessions[i]->pid_monitor==pid)
+			return 1;
+	return 0;
+}
+
+/*
+ * Attach a task that another process monitors in TBS mode, so that the
+ * calling process (monitor) gets its own session with the PMC
+ * configuration in "cfg". The session waits for its turn on the PMU
+ * of the task (see rotate_task_sessions()).
+ */
+static int pmctrack_task_add_session(struct task_struct* target, core_experiment_set_t cfg[])
+{
+	pmon_prof_t* monitor=(pmon_prof_t*)current->pmc;
+	pmon_prof_t* monitored=(pmon_prof_t*)target->pmc;
+	pmc_task_session_t* session;
+	unsigned long flags;
+	int retval=0;
+	int i;
+
+	if ((session=kzalloc(sizeof(pmc_task_session_t),GFP_KERNEL))==NULL)
+		return -ENOMEM;
+
+	session->pid_monitor=current->pid;
+	if (monitor->pmc_samples_buffer) {
+		get_pmc_samples_buffer(monitor->pmc_samples_buffer);
+		session->pmc_samples_buffer=monitor->pmc_samples_buffer;
+	}
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		clone_core_experiment_set_t(&session->pmcs_multiplex_cfg[i],&cfg[i]);
+	session->virt_counter_mask=monitor->virt_counter_mask;
+	session->pmc_jiffies_interval=monitor->pmc_jiffies_interval;
+	session->pmc_sampling_period=monitor->pmc_sampling_period;
+
+	spin_lock_irqsave(&monitored->lock,flags);
+
+	/* The exit callback frees up the sessions (see set_up_monitoring_task()) */
+	if (target->flags & PF_EXITING)
+		retval=-ESRCH;
+	else if (!target->prof_enabled || monitored->profiling_mode!=TBS_USER_MODE)
+		retval=-EINVAL;
+	else if (monitored->pid_monitor==current->pid || has_waiting_session(monitored,current->pid) ||
+	         monitored->nr_waiting_sessions==PMC_MAX_TASK_SESSIONS-1)
+		retval=-EBUSY;
+	else
+		monitored->waiting_sessions[monitored->nr_waiting_sessions++]=session;
+
+	spin_unlock_irqrestore(&monitored->lock,flags);
+
+	if (retval)
+		free_task_session(session);
+	return retval;
+}
+
+/*
+ * Attach a task to the calling process (monitor), so that the target
+ * is monitored with the PMC configuration in "cfg" (one experiment set
+ * per core type). The caller must hold a reference to the target.
+ */
+static int pmctrack_task_attach_set(struct task_struct* target, core_experiment_set_t cfg[], int profiling_mode)
 {
-	struct task_struct* cur=current;
-	struct task_struct* target=NULL;
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
 	struct attach_arg arg;
@@ -1314,21 +1832,17 @@ static int pmctrack_pid_attach(pid_t pid)
 	int nr_tries=0;
 	int ret=-EAGAIN;
 
-	if (pid<0 || !cur->pmc)
+	if (!current->pmc)
 		return -EINVAL;
 
-	rcu_read_lock();
-	target = find_process_by_pid(pid);
-	if(!target || !target->pmc) {
-		rcu_read_unlock();
+	if (target->flags & PF_EXITING)
 		return -ESRCH;
-	}
-	/* Prevent target from going away */
-	get_task_struct(target);
-	rcu_read_unlock();
 
 	monitor= (pmon_prof_t*)current->pmc;
-	monitored = (pmon_prof_t*)target->pmc;
+
+	/* The target may have never interacted with PMCTrack */
+	if ((monitored=get_pmon_prof(target))==NULL)
+		return -ENOMEM;
 
 	/* Phase one: set up monitor */
 	spin_lock_irqsave(&monitored->lock,flags);
@@ -1341,32 +1855,36 @@ static int pmctrack_pid_attach(pid_t pid)
 
 	/* Try to detach first */
 	if (try_force_detach) {
-		if ((retval=pmctrack_task_detach_force(target,monitored->pid_monitor)))
-			goto out_err;
+		retval=pmctrack_task_detach_force(target,monitored->pid_monitor);
+
+		/* The monitor is alive: time-share the PMU with its session */
+		if (retval==-EPERM && profiling_mode==TBS_USER_MODE)
+			return pmctrack_task_add_session(target,cfg);
+		else if (retval)
+			return retval;
 		else
 			attachable=1;
 	}
 
-	if (!attachable) {
-		retval=-EINVAL;
-		goto out_err;
-	}
+	if (!attachable)
+		return -EINVAL;
 
 	/* Phase 2 allocate experiments ..*/
 	for(i=0; i<AMP_MAX_CORETYPES; i++) {
 		init_core_experiment_set_t(&set[i]);
-		retval=clone_core_experiment_set_t(&set[i],&monitor->pmcs_multiplex_cfg[i]);
+		retval=clone_core_experiment_set_t(&set[i],&cfg[i]);
 
 		if (retval) {
 			for (j=0; j<i; j++)
 				free_experiment_set(&set[j]);
-			goto out_err;
+			return retval;
 		}
 	}
 
 	/* Phase 3: prepare xcall */
 	arg.monitor=monitor;
 	arg.monitored=monitored;
+	arg.profiling_mode=profiling_mode;
 	for(i=0; i<AMP_MAX_CORETYPES; i++)
 		arg.exp_set[i]=&set[i];
 
@@ -1377,7 +1895,7 @@ static int pmctrack_pid_attach(pid_t pid)
 	 * on the CPU where the task runs.
 	 */
 	if (cpu_task==-1 || target->state!=TASK_RUNNING) {
-		set_up_monitoring_task(&arg);
+		retval=set_up_monitoring_task(&arg);
 	} else {
 		/*
 		 * Note that the task may go to sleep or be migrated in the meantime. That is not a big deal
@@ -1396,11 +1914,45 @@ static int pmctrack_pid_attach(pid_t pid)
 	if (retval)
 		for(i=0; i<AMP_MAX_CORETYPES; i++)
 			free_experiment_set(&set[i]);
-out_err:
+	return retval;
+}
+
+/* Attach the process with PID=pid using the PMC configuration in "cfg" */
+static int pmctrack_pid_attach_set(pid_t pid, core_experiment_set_t cfg[], int profiling_mode)
+{
+	struct task_struct* target=NULL;
+	int retval;
+
+	if (pid<0)
+		return -EINVAL;
+
+	rcu_read_lock();
+	target = find_process_by_pid(pid);
+	if(!target || (target->flags & PF_EXITING)) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	/* Prevent target from going away */
+	get_task_struct(target);
+	rcu_read_unlock();
+
+	retval=pmctrack_task_attach_set(target,cfg,profiling_mode);
+
 	put_task_struct(target);
 	return retval;
 }
 
+/* Attach a process using the PMC configuration of the monitor */
+static int pmctrack_pid_attach(pid_t pid)
+{
+	pmon_prof_t* monitor=(pmon_prof_t*)current->pmc;
+
+	if (!monitor)
+		return -EINVAL;
+
+	return pmctrack_pid_attach_set(pid,monitor->pmcs_multiplex_cfg,monitor->profiling_mode);
+}
+
 
 static int disable_monitoring_task(void *data)
 {
@@ -1414,6 +1966,41 @@ static int disable_monitoring_task(void *data)
 	if (current==p)
 		mod_save_callback_gen(target,smp_processor_id(),0);
 
+	/* The save callback may have given the PMU to another session */
+	if (target->pid_monitor!=arg->pid_monitor) {
+		for (i=0; i<target->nr_waiting_sessions; i++) {
+			if (target->waiting_sessions[i]->pid_monitor==arg->pid_monitor) {
+				free_task_session(target->waiting_sessions[i]);
+				target->waiting_sessions[i]=target->waiting_sessions[--target->nr_waiting_sessions];
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&target->lock,flags);
+		return 0;
+	}
+
+	/* Hand the PMU over to the next session of the thread (if any) */
+	if (target->nr_waiting_sessions) {
+		rotate_task_sessions(target,target->time_enabled>target->session_wait?
+		                     target->time_enabled-target->session_wait:0);
+		/* The session being detached is now at the back of the queue */
+		free_task_session(target->waiting_sessions[--target->nr_waiting_sessions]);
+
+		/* Discard the counts of the session being detached */
+		for (i=0; i<MAX_LL_EXPS; i++)
+			target->pmc_values[i]=0;
+
+		target->pmcs_config=get_cur_experiment_in_set(&target->pmcs_multiplex_cfg[0]);
+		init_core_experiment_state_t(&target->pmcs_state);
+		target->pmc_sample_deadline=tbs_clock()+target->pmc_sampling_period;
+
+		if (current==p)
+			mod_restore_callback_gen(target,smp_processor_id(),0);
+
+		spin_unlock_irqrestore(&target->lock,flags);
+		return 0;
+	}
+
 	/* Remove reference to the buffer */
 	if (target->pmc_samples_buffer) {
 		put_pmc_samples_buffer(target->pmc_samples_buffer);
@@ -1438,53 +2025,64 @@ static int disable_monitoring_task(void *data)
 }
 
 
-static noinline int pmctrack_pid_detach(pid_t pid)
+/*
+ * Detach a task monitored by the calling process.
+ * The caller must hold a reference to the target.
+ */
+static noinline int pmctrack_task_detach(struct task_struct* target)
 {
 	struct task_struct* cur=current;
-	struct task_struct* target=NULL;
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
+	pmc_task_session_t* session=NULL;
 	struct attach_arg arg;
 	unsigned long flags;
 	int detachable;
+	int i;
 	int retval=0;
 	int cpu_task;
 	const int max_nr_tries=3;
 	int nr_tries=0;
 	int ret=-EAGAIN;
 
-	if (pid<0)
-		return -EINVAL;
-
-	rcu_read_lock();
-	target = find_process_by_pid(pid);
-	if(!target || !target->pmc) {
-		rcu_read_unlock();
+	if (!target->pmc)
 		return -ESRCH;
-	}
-	/* Prevent target from going away */
-	get_task_struct(target);
-	rcu_read_unlock();
 
 	monitor= (pmon_prof_t*)current->pmc;
 	monitored = (pmon_prof_t*)target->pmc;
 
 	/* Phase one: set up monitor */
 	spin_lock_irqsave(&monitored->lock,flags);
-	if (!target->pmc || !target->prof_enabled || monitored->pid_monitor!=cur->pid)
+	if (!target->pmc || !target->prof_enabled)
 		detachable=0;
-	else
+	else if (monitored->pid_monitor==cur->pid)
 		detachable=1;
+	else {
+		detachable=0;
+
+		/* The session waits for the PMU: just drop it */
+		for (i=0; i<monitored->nr_waiting_sessions; i++) {
+			if (monitored->waiting_sessions[i]->pid_monitor==cur->pid) {
+				session=monitored->waiting_sessions[i];
+				monitored->waiting_sessions[i]=monitored->waiting_sessions[--monitored->nr_waiting_sessions];
+				break;
+			}
+		}
+	}
 	spin_unlock_irqrestore(&monitored->lock,flags);
 
-	if (!detachable) {
-		retval=-EINVAL;
-		goto out_err;
+	if (session) {
+		free_task_session(session);
+		return 0;
 	}
 
+	if (!detachable)
+		return -EINVAL;
+
 	/* Phase 2: prepare xcall */
 	arg.monitor=monitor;
 	arg.monitored=monitored;
+	arg.pid_monitor=cur->pid;
 
 	cpu_task=task_cpu_safe(target);
 
@@ -1509,12 +2107,29 @@ static noinline int pmctrack_pid_detach(pid_t pid)
 		retval=ret;
 	}
 
-#ifdef TBS_TIMER
-	/* Disable timer if detach process was successful */
-	if (ret==0 && monitored->profiling_mode==TBS_USER_MODE)
-		del_timer_sync(&monitored->timer);
-#endif
-out_err:
+	return retval;
+}
+
+static noinline int pmctrack_pid_detach(pid_t pid)
+{
+	struct task_struct* target=NULL;
+	int retval;
+
+	if (pid<0)
+		return -EINVAL;
+
+	rcu_read_lock();
+	target = find_process_by_pid(pid);
+	if(!target || !target->pmc) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	/* Prevent target from going away */
+	get_task_struct(target);
+	rcu_read_unlock();
+
+	retval=pmctrack_task_detach(target);
+
 	put_task_struct(target);
 	return retval;
 }
@@ -1549,6 +2164,7 @@ static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t
 	/* Prepare xcall */
 	arg.monitor=NULL;
 	arg.monitored=monitored;
+	arg.pid_monitor=monitor_pid;
 
 	cpu_task=task_cpu_safe(target);
 
@@ -1578,6 +2194,153 @@ static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t
 
 
 
+/*
+ * Maximum number of times the thread list of a process is
+ * traversed when attaching/detaching a whole thread group
+ */
+#define PMCT_MAX_TGID_PASSES	4
+
+/* Does the current task monitor p (in any of its sessions)? */
+static inline int task_monitored_by_current(struct task_struct* p)
+{
+	pmon_prof_t* prof=(pmon_prof_t*)p->pmc;
+	unsigned long flags;
+	int monitored;
+
+	if (!prof || !p->prof_enabled)
+		return 0;
+
+	spin_lock_irqsave(&prof->lock,flags);
+	monitored=prof->pid_monitor==current->pid || has_waiting_session(prof,current->pid);
+	spin_unlock_irqrestore(&prof->lock,flags);
+	return monitored;
+}
+
+/*
+ * Take a reference to up to "max_tasks" threads in the thread
+ * group of "leader" such that task_monitored_by_current()==monitored.
+ * Returns the number of threads stored in "tasks".
+ */
+static int get_group_threads(struct task_struct* leader, int monitored,
+                             struct task_struct** tasks, int max_tasks)
+{
+	struct task_struct* t;
+	int nr_tasks=0;
+
+	rcu_read_lock();
+
+	if (!pid_alive(leader))
+		goto out_unlock;
+
+	t=leader;
+	do {
+		if (nr_tasks==max_tasks)
+			break;
+
+		if (!(t->flags & PF_EXITING) && task_monitored_by_current(t)==monitored) {
+			get_task_struct(t);
+			tasks[nr_tasks++]=t;
+		}
+	} while_each_thread(leader,t);
+
+out_unlock:
+	rcu_read_unlock();
+	return nr_tasks;
+}
+
+/*
+ * Attach (or detach) all the threads of the process that the thread with
+ * PID=pid belongs to, in a single operation.
+ *
+ * Threads created by an attached thread inherit the monitor (see
+ * mod_alloc_per_thread_data()), so once every thread in the group has been
+ * attached no thread can escape. Threads created in the meantime by threads
+ * not attached yet are caught by another pass over the thread list.
+ *
+ * The function returns the number of threads attached (detached),
+ * or a negative value upon failure.
+ */
+static int pmctrack_tgid_attach_detach(pid_t pid, int attach, core_experiment_set_t cfg[], int profiling_mode)
+{
+	struct task_struct* leader;
+	struct task_struct** tasks;
+	int max_tasks,nr_tasks;
+	int nr_done=0,nr_done_pass;
+	int pass,i;
+
+	if (pid<=0 || !current->pmc)
+		return -EINVAL;
+
+	rcu_read_lock();
+	leader = find_process_by_pid(pid);
+	if(!leader || (leader->flags & PF_EXITING)) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	leader=leader->group_leader;
+	/* Prevent leader from going away */
+	get_task_struct(leader);
+	rcu_read_unlock();
+
+	for (pass=0; pass<PMCT_MAX_TGID_PASSES; pass++) {
+		/* Leave room for threads created while traversing the list */
+		max_tasks=get_nr_threads(leader)+16;
+
+		if ((tasks=vmalloc(max_tasks*sizeof(struct task_struct*)))==NULL) {
+			nr_done=-ENOMEM;
+			break;
+		}
+
+		nr_tasks=get_group_threads(leader,!attach,tasks,max_tasks);
+		nr_done_pass=0;
+
+		for (i=0; i<nr_tasks; i++) {
+			if (attach && pmctrack_task_attach_set(tasks[i],cfg,profiling_mode)==0)
+				nr_done_pass++;
+			else if (!attach && pmctrack_task_detach(tasks[i])==0)
+				nr_done_pass++;
+			put_task_struct(tasks[i]);
+		}
+
+		vfree(tasks);
+		nr_done+=nr_done_pass;
+
+		/*
+		 * Stop when a pass finds nothing left to do
+		 * (or nothing else can be done)
+		 */
+		if (nr_done_pass==0)
+			break;
+	}
+
+	put_task_struct(leader);
+	return nr_done;
+}
+
+/* Attach the threads of the process with PID=pid using the PMC configuration in "cfg" */
+static int pmctrack_tgid_attach_set(pid_t pid, core_experiment_set_t cfg[], int profiling_mode)
+{
+	return pmctrack_tgid_attach_detach(pid,1,cfg,profiling_mode);
+}
+
+/* Attach the threads of a process using the PMC configuration of the monitor */
+static int pmctrack_tgid_attach(pid_t pid)
+{
+	pmon_prof_t* monitor=(pmon_prof_t*)current->pmc;
+
+	if (!monitor)
+		return -EINVAL;
+
+	return pmctrack_tgid_attach_set(pid,monitor->pmcs_multiplex_cfg,monitor->profiling_mode);
+}
+
+/* Detach all threads of a process monitored by the calling process */
+static int pmctrack_tgid_detach(pid_t pid)
+{
+	return pmctrack_tgid_attach_detach(pid,0,NULL,0);
+}
+
+
 /* Write callback for /proc/pmc/monitor */
 static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
 {
@@ -1599,6 +2362,10 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 
 	kbuf[len]='\0';
 
+	/* The monitor process gets its per-thread data on first use */
+	if (!get_pmon_prof(current))
+		return -ENOMEM;
+
 	if(sscanf(kbuf,"pid_monitor %i", &val)==1 && val>0) {
 		pid = (pid_t)val;
 		rcu_read_lock();
@@ -1629,6 +2396,14 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 		return pmctrack_pid_attach(val);
 	} else if (sscanf(kbuf,"pid_detach %i", &val)==1 && val>0) {
 		return pmctrack_pid_detach(val);
+	} else if (sscanf(kbuf,"tgid_attach %i", &val)==1 && val>0) {
+		if ((val=pmctrack_tgid_attach(val))<0)
+			return val;
+		else if (val==0)
+			return -ESRCH;
+	} else if (sscanf(kbuf,"tgid_detach %i", &val)==1 && val>0) {
+		if ((val=pmctrack_tgid_detach(val))<0)
+			return val;
 	} else if (strncmp(kbuf,"ON",2)==0) {
 		prof= (pmon_prof_t*)current->pmc;
 		if (!prof)
@@ -1636,7 +2411,7 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 
 		/* Allocate memory for the buffer sample */
 		if (!prof->pmc_samples_buffer) {
-			pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+			pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size,prof->overflow_policy);
 			if (pmc_buf == NULL) {
 				printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
 				return -1;
@@ -1650,16 +2425,12 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 
 		prof->flags|=PMC_READ_SELF_MONITORING;
 
-		/* Set up jiffies interval if it wasn't set previously */
+		/* Set up sampling period if it wasn't set previously */
 		if (prof->pmc_jiffies_interval<0)
-			prof->pmc_jiffies_interval=HZ; /* Default one second */
-
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
+			set_sampling_period_us(prof,USEC_PER_SEC); /* Default one second */
 
-#ifdef TBS_TIMER
-		if (prof->profiling_mode==TBS_USER_MODE)
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
-#endif
+		/* The sampling timer is armed by the restore callback below */
+		prof->pmc_sample_deadline=tbs_clock()+prof->pmc_sampling_period;
 		current->prof_enabled=1;
 
 		mod_restore_callback_gen(prof,smp_processor_id(),0);
@@ -1670,12 +2441,11 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 
 		if (!prof)
 			return -EINVAL;
+		spin_lock_irqsave(&prof->lock,flags);
 #ifdef TBS_TIMER
-		/* Cancel per-thread timer if in TBS mode */
-		if (prof->profiling_mode==TBS_USER_MODE && current->prof_enabled)
-			del_timer_sync(&prof->timer);
+		/* Stop sampling the thread */
+		tbs_sampler_stop(prof,smp_processor_id());
 #endif
-		spin_lock_irqsave(&prof->lock,flags);
 		/* Clear the prof_enabled flag prior to invoking
 		 * sample_counters_user_tbs() so that the
 		 * timer does not get reloaded()
@@ -1703,11 +2473,11 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 {
 	int lentotal;
 	pmon_prof_t *prof_mon;
-	unsigned long flags;
 	pmc_samples_buffer_t* pmcbuf;
 	pmc_sample_t* dst_buffer=NULL;
 	unsigned int dst_buffer_size=len;
-	int retval;
+	long retval;
+	int zero_copy;
 
 	lentotal=0;
 	prof_mon = (pmon_prof_t*)current->pmc;
@@ -1718,16 +2488,28 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	if ((pmcbuf=prof_mon->pmc_samples_buffer)==NULL)
 		return -ENOENT;
 
+	/* Apply the wakeup conditions requested by the monitor */
+	set_wakeup_cfg_pmc_samples_buffer(pmcbuf,&prof_mon->wakeup_cfg);
+
+	/*
+	 * If the monitor mapped the sample rings, it consumes samples
+	 * in place. In that case read() just waits for samples to
+	 * become available and reports how many bytes are ready.
+	 */
+	zero_copy=atomic_read(&pmcbuf->nr_user_mappings)>0;
+
 	/*
 	 * Use shared buffer between kernel and userspace if provided...
 	 * (The user must pass it as a parameter to the read call)
 	 */
-	if (prof_mon->pmc_kernel_samples) {
+	if (zero_copy) {
+		/* No intermediate buffer needed */
+	} else if (prof_mon->pmc_kernel_samples) {
 		dst_buffer=prof_mon->pmc_kernel_samples;
 		dst_buffer_size=PAGE_SIZE; /* This buffer is as big as a page */
 	}
 	/* Allocate memory the first time (if no dst_buffer available) */
-	if (!dst_buffer || !prof_mon->pmc_user_samples) {
+	if (!zero_copy && (!dst_buffer || !prof_mon->pmc_user_samples)) {
 		prof_mon->pmc_user_samples=kmalloc(len,GFP_KERNEL);
 		if (!prof_mon->pmc_user_samples)
 			return -ENOMEM;
@@ -1740,8 +2522,8 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	if (dst_buffer_size>len)
 		dst_buffer_size=len;
 
-	/* Prevent the perf interrupt to kick in when trying to do this */
-	spin_lock_irqsave(&pmcbuf->lock,flags);
+	/* Only one reader at a time (producers never take this lock) */
+	mutex_lock(&pmcbuf->consumer_lock);
 
 	if (prof_mon->flags & PMC_READ_SELF_MONITORING) {
 		prof_mon->flags&=~PMC_READ_SELF_MONITORING;
@@ -1749,36 +2531,45 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	}
 
 	/* EOF if all threads actually finished */
-	if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
-		spin_unlock_irqrestore(&pmcbuf->lock,flags);
+	if (get_pmc_samples_buffer_task_refs(pmcbuf)<=1 && is_empty_pmc_samples_buffer(pmcbuf)) {
+		mutex_unlock(&pmcbuf->consumer_lock);
 		return 0;
 	}
 
-	while (is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
-		pmcbuf->monitor_waiting=1;
+	/* Wait until the wakeup conditions are met */
+	while (!is_ready_pmc_samples_buffer(pmcbuf)) {
+		retval=wait_event_interruptible_timeout(pmcbuf->wq,
+		                                        is_ready_pmc_samples_buffer(pmcbuf) ||
+		                                        get_pmc_samples_buffer_task_refs(pmcbuf)<=1,
+		                                        pmcbuf->wakeup_latency?pmcbuf->wakeup_latency:MAX_SCHEDULE_TIMEOUT);
 
-		spin_unlock_irqrestore(&pmcbuf->lock,flags);
-
-		/* Wait until there are samples here */
-		if ((retval=down_interruptible(&pmcbuf->sem_queue))) {
-			pmcbuf->monitor_waiting=0;
+		if (retval<0) {
+			mutex_unlock(&pmcbuf->consumer_lock);
 			return -EINTR;
 		}
 
-		spin_lock_irqsave(&pmcbuf->lock,flags);
-
 		/* EOF if all threads actually finished */
-		if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
-			spin_unlock_irqrestore(&pmcbuf->lock,flags);
+		if (get_pmc_samples_buffer_task_refs(pmcbuf)<=1 && is_empty_pmc_samples_buffer(pmcbuf)) {
+			mutex_unlock(&pmcbuf->consumer_lock);
 			return 0;
 		}
+
+		/* Hand over what we have if threads finished or the latency bound expired */
+		if ((get_pmc_samples_buffer_task_refs(pmcbuf)<=1 || retval==0) && !is_empty_pmc_samples_buffer(pmcbuf))
+			break;
 	}
 
 read_buffer_now:
-	/* Bytes to be copied to the user buffer */
-	lentotal=remove_cbuffer_t_batch(pmcbuf->pmc_samples,dst_buffer,dst_buffer_size);
+	if (zero_copy) {
+		lentotal=nr_bytes_pmc_samples_buffer(pmcbuf);
+		mutex_unlock(&pmcbuf->consumer_lock);
+		return lentotal>len?len:lentotal;
+	}
+
+	/* Merge samples from the per-CPU rings into the destination buffer */
+	lentotal=drain_pmc_samples_buffer(pmcbuf,dst_buffer,dst_buffer_size);
 
-	spin_unlock_irqrestore(&pmcbuf->lock,flags);
+	mutex_unlock(&pmcbuf->consumer_lock);
 
 	/* Invoke copy to user if necessary */
 	if (!prof_mon->pmc_kernel_samples && copy_to_user(buf,dst_buffer,lentotal)) {
@@ -1799,6 +2590,35 @@ read_buffer_now:
 	return lentotal;
 }
 
+/*
+ * poll() operation for /proc/pmc/monitor
+ *
+ * The entry becomes readable when the wakeup conditions set up by the
+ * monitor are met. POLLHUP is reported when all monitored threads finished.
+ */
+static unsigned int proc_monitor_pmcs_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+	pmc_samples_buffer_t* pmcbuf;
+	unsigned int mask=0;
+
+	if (!prof || (pmcbuf=prof->pmc_samples_buffer)==NULL)
+		return POLLERR;
+
+	set_wakeup_cfg_pmc_samples_buffer(pmcbuf,&prof->wakeup_cfg);
+
+	poll_wait(filp,&pmcbuf->wq,wait);
+
+	if (get_pmc_samples_buffer_task_refs(pmcbuf)<=1) {
+		mask|=POLLHUP;
+		if (!is_empty_pmc_samples_buffer(pmcbuf))
+			mask|=POLLIN|POLLRDNORM;
+	} else if (is_ready_pmc_samples_buffer(pmcbuf))
+		mask|=POLLIN|POLLRDNORM;
+
+	return mask;
+}
+
 /*
  * Operations to allocate a shared page between
  * the monitor process (user-space program) and the
@@ -1844,12 +2664,88 @@ static struct vm_operations_struct mmap_vm_ops = {
 	.fault =   mmap_nopage,
 };
 
+/*
+ * Operations to map the per-CPU sample rings (and their control area)
+ * into the address space of the monitor process, which enables it to
+ * consume samples in place (see pmc_ring_control_t in pmc_user.h).
+ *
+ * Each mapping holds a reference to the buffer, so the rings
+ * stay around until the monitor unmaps them. These references are
+ * not taken into account to detect that all monitored threads
+ * finished (see get_pmc_samples_buffer_task_refs()).
+ */
+static void ring_mmap_open(struct vm_area_struct *vma)
+{
+	pmc_samples_buffer_t* sbuf=vma->vm_private_data;
+
+	get_pmc_samples_buffer(sbuf);
+	atomic_inc(&sbuf->nr_user_mappings);
+}
+
+static void ring_mmap_close(struct vm_area_struct *vma)
+{
+	pmc_samples_buffer_t* sbuf=vma->vm_private_data;
+
+	atomic_dec(&sbuf->nr_user_mappings);
+	put_pmc_samples_buffer(sbuf);
+}
+
+static int ring_mmap_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	pmc_samples_buffer_t* sbuf=vma->vm_private_data;
+	unsigned long offset=(vmf->pgoff-vma->vm_pgoff)<<PAGE_SHIFT;
+
+	if (offset>=sbuf->control->mmap_size)
+		return VM_FAULT_SIGBUS;
+
+	if ((vmf->page=get_page_pmc_samples_buffer(sbuf,offset))==NULL)
+		return VM_FAULT_SIGBUS;
+
+	/* Bring page to main memory */
+	get_page(vmf->page);
+
+	return 0;
+}
+
+static struct vm_operations_struct ring_mmap_vm_ops = {
+	.open =    ring_mmap_open,
+	.close =   ring_mmap_close,
+	.fault =   ring_mmap_nopage,
+};
+
+/* Map the rings of the current buffer (pgoff==PMC_RING_MMAP_PGOFF) */
+static int proc_monitor_pmcs_mmap_rings(pmon_prof_t* prof, struct vm_area_struct *vma)
+{
+	pmc_samples_buffer_t* sbuf=prof->pmc_samples_buffer;
+
+	/* The buffer is allocated when the monitoring session starts */
+	if (!sbuf)
+		return -ENOENT;
+
+	if (vma->vm_end-vma->vm_start > sbuf->control->mmap_size)
+		return -EINVAL;
+
+	vma->vm_ops = &ring_mmap_vm_ops;
+#ifdef CONFIG_PMC_PHI /* Older kernel */
+	vma->vm_flags |= VM_RESERVED|VM_DONTCOPY;
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+#endif
+	vma->vm_private_data = sbuf;
+
+	ring_mmap_open(vma);
+	return 0;
+}
+
 /* mmap() operation for /proc/pmc/monitor */
 static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	pmc_sample_t *handler;
 	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
 
+	if (prof && vma->vm_pgoff==PMC_RING_MMAP_PGOFF)
+		return proc_monitor_pmcs_mmap_rings(prof,vma);
+
 	if (!prof || prof->pmc_kernel_samples) /* NULL or shared page already reserved */
 		return -EINVAL;
 
@@ -1876,69 +2772,97 @@ static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
-/* Write callback for /proc/pmc/enable */
-static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+/*
+ * Allocate the buffer to store the samples
+ * of the calling thread if necessary
+ */
+static int alloc_self_samples_buffer(pmon_prof_t* prof)
 {
-	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
-	char kbuf[MAX_STR_CONFIG_LEN];
 	pmc_samples_buffer_t* pmc_buf=NULL;
 	unsigned long flags=0;
+
+	if (prof->pmc_samples_buffer)
+		return 0;
+
+	pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size,prof->overflow_policy);
+	if (pmc_buf == NULL) {
+		printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&prof->lock,flags);
+	/* Assign newly created data */
+	if (!prof->pmc_samples_buffer) {
+		prof->pmc_samples_buffer=pmc_buf;
+		pmc_buf=NULL;
+	}
+	spin_unlock_irqrestore(&prof->lock,flags);
+
+	/* Somebody else got there first */
+	if (pmc_buf)
+		put_pmc_samples_buffer(pmc_buf);
+	return 0;
+}
+
+/* Start a per-thread monitoring session for the calling thread */
+static int start_self_counting(pmon_prof_t* prof)
+{
+	unsigned long flags=0;
 	int error=0;
 
-	if (len>=MAX_STR_CONFIG_LEN || copy_from_user(kbuf,buff,len))
-		return -EFAULT;
+	if ((error=alloc_self_samples_buffer(prof)))
+		return error;
 
-	kbuf[len]='\0';
+	/* Prevent the perf interrupt to kick in when trying to do this */
+	spin_lock_irqsave(&prof->lock,flags);
 
-	if (strcmp(kbuf,"ON")==0 && prof!=NULL) {
+	/* Set up sampling period if it wasn't set previously */
+	if (prof->pmc_jiffies_interval<0)
+		set_sampling_period_us(prof,USEC_PER_SEC); /* One second (for now) */
 
-		/* Allocate memory for the buffer sample if necessary */
-		if (!prof->pmc_samples_buffer) {
-			pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
-			if (pmc_buf == NULL) {
-				printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
-				return -1;
-			}
-		}
+	/* The sampling timer is armed by the restore callback below */
+	prof->pmc_sample_deadline=tbs_clock()+prof->pmc_sampling_period;
+	current->prof_enabled=1;
 
-		/* Prevent the perf interrupt to kick in when trying to do this */
-		spin_lock_irqsave(&prof->lock,flags);
+	mod_restore_callback_gen(prof,smp_processor_id(),0);
 
-		/* Assign newly created data */
-		if (!prof->pmc_samples_buffer)
-			prof->pmc_samples_buffer=pmc_buf;
+	spin_unlock_irqrestore(&prof->lock,flags);
+	return 0;
+}
 
-		/* Set up jiffies interval if it wasn't set previously */
-		if (prof->pmc_jiffies_interval<0)
-			prof->pmc_jiffies_interval=HZ; /* One second (for now) */
+/* Stop the per-thread monitoring session of the calling thread */
+static void stop_self_counting(pmon_prof_t* prof)
+{
+	unsigned long flags=0;
 
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
-#ifdef TBS_TIMER
-		if (prof->profiling_mode==TBS_USER_MODE)
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
-#endif
-		current->prof_enabled=1;
+	/* Prevent the perf interrupt to kick in when trying to do this */
+	spin_lock_irqsave(&prof->lock,flags);
 
-		mod_restore_callback_gen(prof,smp_processor_id(),0);
+	if (current->prof_enabled)
+		current->prof_enabled=0;
 
-		spin_unlock_irqrestore(&prof->lock,flags);
-	} else if (strcmp(kbuf,"OFF")==0 && prof!=NULL) {
-		if (!prof)
-			return -EINVAL;
-#ifdef TBS_TIMER
-		/* Cancel per-thread timer if in TBS mode */
-		if (prof->profiling_mode==TBS_USER_MODE && current->prof_enabled)
-			del_timer_sync(&prof->timer);
-#endif
-		/* Prevent the perf interrupt to kick in when trying to do this */
-		spin_lock_irqsave(&prof->lock,flags);
+	mod_save_callback_gen(prof,smp_processor_id(),0);
 
-		if (current->prof_enabled)
-			current->prof_enabled=0;
+	spin_unlock_irqrestore(&prof->lock,flags);
+}
 
-		mod_save_callback_gen(prof,smp_processor_id(),0);
+/* Write callback for /proc/pmc/enable */
+static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+{
+	pmon_prof_t* prof=get_pmon_prof(current);
+	char kbuf[MAX_STR_CONFIG_LEN];
+	int error=0;
 
-		spin_unlock_irqrestore(&prof->lock,flags);
+	if (len>=MAX_STR_CONFIG_LEN || copy_from_user(kbuf,buff,len))
+		return -EFAULT;
+
+	kbuf[len]='\0';
+
+	if (strcmp(kbuf,"ON")==0 && prof!=NULL) {
+		if ((error=start_self_counting(prof)))
+			return error;
+	} else if (strcmp(kbuf,"OFF")==0 && prof!=NULL) {
+		stop_self_counting(prof);
 	} else if (strcmp(kbuf,"syswide on")==0) {
 		if ((error=syswide_monitoring_start()))
 			return error;
@@ -2083,7 +3007,7 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 		if (system_wide)
 			prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids; /* Number of possible CPUs */
 
-		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size,prof->overflow_policy);
 		if (pmc_buf == NULL) {
 			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
 			return -1;
@@ -2111,6 +3035,42 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 	return 0;
 }
 
+/*
+ * Extract the multiplexing weight of an event set ("weight=N" flag)
+ * from a raw PMC configuration string. The remaining flags are copied
+ * into "dst" (PMCTRACK_MAX_LEN_RAW_PMC_STRING bytes) for the
+ * platform-specific parser.
+ */
+static int parse_mux_weight(const char* buf, char* dst, unsigned int* weight)
+{
+	char cpbuf[PMCTRACK_MAX_LEN_RAW_PMC_STRING];
+	char* strconfig=cpbuf;
+	char* flag;
+	int val;
+	int nr_flags=0;
+
+	strncpy(strconfig,buf,PMCTRACK_MAX_LEN_RAW_PMC_STRING);
+	strconfig[PMCTRACK_MAX_LEN_RAW_PMC_STRING-1]='\0';
+	dst[0]='\0';
+	(*weight)=1;
+
+	while((flag = strsep(&strconfig, ","))!=NULL) {
+		if (sscanf(flag,"weight=%i",&val)==1) {
+			if (val<1 || val>PMC_MUX_MAX_WEIGHT) {
+				printk(KERN_INFO "The weight of an event set must be in [1,%d]\n",PMC_MUX_MAX_WEIGHT);
+				return -EINVAL;
+			}
+			(*weight)=val;
+		} else {
+			if (nr_flags++)
+				strcat(dst,",");
+			strcat(dst,flag);
+		}
+	}
+
+	return 0;
+}
+
 /*
  * This function accepts a user-provided virtual configuration string (buf) in the raw format,
  * and assigns the underlying configuration to a given process (p).
@@ -2118,6 +3078,8 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 static int configure_performance_counters_thread(const char *buf,struct task_struct* p, int system_wide)
 {
 	pmc_usrcfg_t pmc_cfg[MAX_LL_EXPS];
+	char strconfig[PMCTRACK_MAX_LEN_RAW_PMC_STRING];
+	unsigned int mux_weight=1;
 	unsigned int used_pmcs=0;
 	int error=0;
 	unsigned int nr_pmcs=0;
@@ -2144,7 +3106,10 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 	}
 
 	/* Check user-provided configuration */
-	error=parse_pmcs_strconfig(buf,1,pmc_cfg,&used_pmcs,&nr_pmcs,&ebs_index,&coretype);
+	if ((error=parse_mux_weight(buf,strconfig,&mux_weight)))
+		return error;
+
+	error=parse_pmcs_strconfig(strconfig,1,pmc_cfg,&used_pmcs,&nr_pmcs,&ebs_index,&coretype);
 
 	if (error)
 		return error;
@@ -2168,7 +3133,7 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 		if (system_wide)
 			prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids; /* Number of possible CPUs */
 
-		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size,prof->overflow_policy);
 		if (pmc_buf == NULL) {
 			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
 			return -1;
@@ -2177,7 +3142,7 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 
 	/* Allocate memory for PMCs/EVTSELs ...  */
 	if (coretype!=-1) {
-		exp[0]= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
+		exp[0]=alloc_core_experiment();
 		if(exp[0] == NULL) {
 			printk(KERN_INFO "Can't allocate memory to store all pmcs configuration\n");
 			put_pmc_samples_buffer(pmc_buf);
@@ -2186,17 +3151,18 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 
 		/*  Initialize structure for just one coretype */
 		do_setup_pmcs(pmc_cfg,used_pmcs,exp[0],cpu,0);
+		exp[0]->mux_weight=mux_weight;
 
 	} else {
 
 		for (i=0; i<AMP_MAX_CORETYPES; i++) {
-			exp[i]= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
+			exp[i]=alloc_core_experiment();
 
 			/* Free memory in case of failure */
 			if(exp[i] == NULL) {
 				printk(KERN_INFO "Can't allocate memory to store all pmcs configuration\n");
 				for (j=0; j<i; j++)
-					kfree(exp[j]);
+					put_core_experiment(exp[j]);
 				put_pmc_samples_buffer(pmc_buf);
 				return -1;
 			}
@@ -2204,6 +3170,7 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 
 		/*  Initialize structure for just one coretype */
 		do_setup_pmcs(pmc_cfg,used_pmcs,exp[0],cpu,0);
+		exp[0]->mux_weight=mux_weight;
 
 		/* Replicate for all */
 		for (i=1; i<AMP_MAX_CORETYPES; i++)
@@ -2229,17 +3196,30 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 
 	/* Add to set */
 	if (coretype==-1) {
-		for (i=0; i<AMP_MAX_CORETYPES; i++)
-			add_experiment_to_set(&prof->pmcs_multiplex_cfg[i],exp[i]);
+		for (i=0; i<AMP_MAX_CORETYPES && !error; i++)
+			if ((error=add_experiment_to_set(&prof->pmcs_multiplex_cfg[i],exp[i])))
+				for (j=i; j<AMP_MAX_CORETYPES; j++)
+					put_core_experiment(exp[j]);
 	} else {
-		add_experiment_to_set(&prof->pmcs_multiplex_cfg[coretype],exp[0]);
+		if ((error=add_experiment_to_set(&prof->pmcs_multiplex_cfg[coretype],exp[0])))
+			put_core_experiment(exp[0]);
+	}
+
+	if (error) {
+		spin_unlock_irqrestore(&prof->lock,flags);
+		printk(KERN_INFO "Can't add more event sets (max %d)\n",AMP_MAX_EXP_CORETYPE);
+		if (pmc_buf)
+			put_pmc_samples_buffer(pmc_buf);
+		return error;
 	}
 
 	/* Assign newly created data */
 	if (!prof->pmc_samples_buffer)
 		prof->pmc_samples_buffer=pmc_buf;
-	if (!prof->pmcs_config)
+	if (!prof->pmcs_config) {
 		prof->pmcs_config=exp[0];
+		init_core_experiment_state_t(&prof->pmcs_state);
+	}
 
 	spin_unlock_irqrestore(&prof->lock,flags);
 
@@ -2266,89 +3246,99 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 int configure_performance_counters_set(const char* strconfig[], core_experiment_set_t core_exp_set[], int nr_coretypes)
 {
 	int i=0,j=0,k=0;
-	int nr_experiments=0;
-	pmc_usrcfg_t pmc_cfg[AMP_MAX_EXP_CORETYPE][MAX_LL_EXPS];
+	pmc_usrcfg_t pmc_cfg[MAX_LL_EXPS];
+	char strcfg[PMCTRACK_MAX_LEN_RAW_PMC_STRING];
 	core_experiment_t* exp[AMP_MAX_CORETYPES];
-	struct {
-		unsigned int used_pmcs;
-		unsigned int nr_pmcs;
-		int ebs_index;
-		int coretype;
-	} aux_pmc_info[AMP_MAX_EXP_CORETYPE];
+	unsigned int used_pmcs;
+	unsigned int nr_pmcs;
+	unsigned int mux_weight;
+	int ebs_index;
+	int coretype;
 	int error=0;
 
 	/* Initialize everything just in case*/
 	for (i=0; i<nr_coretypes; i++)
 		init_core_experiment_set_t(&core_exp_set[i]);
 
-	i=0;
-	/* Make sure strconfig is Okay !! */
-	while (i<AMP_MAX_EXP_CORETYPE && strconfig[i]!=NULL) {
-		/* Check provided configuration */
-		error=parse_pmcs_strconfig(strconfig[i],1,pmc_cfg[i],&aux_pmc_info[i].used_pmcs,
-		                           &aux_pmc_info[i].nr_pmcs,&aux_pmc_info[i].ebs_index,
-		                           &aux_pmc_info[i].coretype);
-
-		if (error)
-			return error;
+	/* Event sets are validated and set up one at a time */
+	for (i=0; strconfig[i]!=NULL; i++) {
+		if (i==AMP_MAX_EXP_CORETYPE) {
+			error=-ENOSPC;
+			goto free_sets;
+		}
 
-		if (aux_pmc_info[i].ebs_index!=-1) /* Not supported here */
-			return -EINVAL;
+		/* Check provided configuration */
+		if ((error=parse_mux_weight(strconfig[i],strcfg,&mux_weight)))
+			goto free_sets;
 
-		i++;
-	}
+		error=parse_pmcs_strconfig(strcfg,1,pmc_cfg,&used_pmcs,&nr_pmcs,&ebs_index,&coretype);
 
-	printk(KERN_ALERT "The string-based PMC configuration seems to be OK\n" );
+		if (error)
+			goto free_sets;
 
-	nr_experiments=i;
+		if (ebs_index!=-1) { /* Not supported here */
+			error=-EINVAL;
+			goto free_sets;
+		}
 
-	for (i=0; i<nr_experiments; i++) {
-		if (aux_pmc_info[i].coretype!=-1) {
-			j=aux_pmc_info[i].coretype;
-			exp[j]= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
+		if (coretype!=-1) {
+			j=coretype;
+			exp[j]=alloc_core_experiment();
 
 			if(exp[j] == NULL) {
 				printk(KERN_INFO "Can't allocate memory to store all pmcs configuration\n");
-				for (k=0; k<nr_coretypes; k++)
-					free_experiment_set(&core_exp_set[k]);
-				return -ENOMEM;
+				error=-ENOMEM;
+				goto free_sets;
 			}
 
 			/*  Initialize structure for just one coretype */
-			do_setup_pmcs(pmc_cfg[i],aux_pmc_info[i].used_pmcs,exp[j],get_any_cpu_coretype(j),0);
+			do_setup_pmcs(pmc_cfg,used_pmcs,exp[j],get_any_cpu_coretype(j),0);
+			exp[j]->mux_weight=mux_weight;
 
 			/* Add to set */
-			add_experiment_to_set(&core_exp_set[j],exp[j]);
+			if ((error=add_experiment_to_set(&core_exp_set[j],exp[j]))) {
+				put_core_experiment(exp[j]);
+				goto free_sets;
+			}
 		} else {
 
 			for (j=0; j<nr_coretypes; j++) {
-				exp[j]= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
+				exp[j]=alloc_core_experiment();
 
 				/* Free memory in case of failure */
 				if(exp[j] == NULL) {
 					printk(KERN_INFO "Can't allocate memory to store all pmcs configuration\n");
 					for (k=0; k<j; k++)
-						kfree(exp[k]);
-					for (k=0; k<nr_coretypes; k++)
-						free_experiment_set(&core_exp_set[k]);
-					return -ENOMEM;
+						put_core_experiment(exp[k]);
+					error=-ENOMEM;
+					goto free_sets;
 				}
 			}
 
 			/*  Initialize structure for just one coretype */
-			do_setup_pmcs(pmc_cfg[i],aux_pmc_info[i].used_pmcs,exp[0],get_any_cpu_coretype(0),0);
+			do_setup_pmcs(pmc_cfg,used_pmcs,exp[0],get_any_cpu_coretype(0),0);
+			exp[0]->mux_weight=mux_weight;
 
 			/* Replicate for all */
 			for (j=1; j<nr_coretypes; j++)
 				memcpy(exp[j],exp[0],sizeof(core_experiment_t));
 
 			/* Add experiments to set */
-			for (j=0; j<nr_coretypes; j++)
-				add_experiment_to_set(&core_exp_set[j],exp[j]);
+			for (j=0; j<nr_coretypes; j++) {
+				if ((error=add_experiment_to_set(&core_exp_set[j],exp[j]))) {
+					for (k=j; k<nr_coretypes; k++)
+						put_core_experiment(exp[k]);
+					goto free_sets;
+				}
+			}
 		}
 	}
 
 	return 0;
+free_sets:
+	for (k=0; k<nr_coretypes; k++)
+		free_experiment_set(&core_exp_set[k]);
+	return error;
 }
 
 
@@ -2361,6 +3351,7 @@ void init_pmon_config_t(void)
 	pmcs_pmon_config.pmon_nticks = HZ; /* Set superhigh for testing purposes (one second) */
 #endif
 	pmcs_pmon_config.pmon_kernel_buffer_size=BUF_LEN_PMC_SAMPLES_EBS_KERNEL;
+	pmcs_pmon_config.pmon_overflow_policy=PMC_OVERFLOW_DROP;
 }
 
 
@@ -2594,13 +3585,435 @@ out_error:
 }
 
 
+/*** PMCTrack's binary control interface (/dev/pmctrack) **/
+
+#if PMCT_IOC_MAX_EVENT_SETS > AMP_MAX_EXP_CORETYPE
+#error "PMCT_IOC_MAX_EVENT_SETS cannot exceed AMP_MAX_EXP_CORETYPE"
+#endif
+
+/*
+ * PMC configuration validated and translated into its
+ * low-level representation by PMCT_IOC_COMPILE. Users refer
+ * to it by its index in the handle table (see below).
+ */
+typedef struct {
+	core_experiment_set_t sets[AMP_MAX_CORETYPES];
+	unsigned char in_use;
+} pmct_config_handle_t;
+
+/* Per-open-file state of /dev/pmctrack */
+typedef struct {
+	struct mutex lock;	/* Protects the handle table */
+	pmct_config_handle_t handles[PMCT_IOC_MAX_HANDLES];
+} pmct_ctl_file_t;
+
+static int pmct_ctl_open(struct inode *inode, struct file *filp)
+{
+	pmct_ctl_file_t* ctl;
+	int i,j;
+
+	if ((ctl=kmalloc(sizeof(pmct_ctl_file_t),GFP_KERNEL))==NULL)
+		return -ENOMEM;
+
+	mutex_init(&ctl->lock);
+
+	for (i=0; i<PMCT_IOC_MAX_HANDLES; i++) {
+		ctl->handles[i].in_use=0;
+		for (j=0; j<AMP_MAX_CORETYPES; j++)
+			init_core_experiment_set_t(&ctl->handles[i].sets[j]);
+	}
+
+	filp->private_data=ctl;
+	return 0;
+}
+
+/* Return a handle in use or NULL. The caller must hold ctl->lock */
+static pmct_config_handle_t* pmct_ctl_get_handle(pmct_ctl_file_t* ctl, int32_t handle)
+{
+	if (handle<0 || handle>=PMCT_IOC_MAX_HANDLES || !ctl->handles[handle].in_use)
+		return NULL;
+	return &ctl->handles[handle];
+}
+
+/* Release the experiments of a handle. The caller must hold ctl->lock */
+static void pmct_ctl_put_handle(pmct_config_handle_t* hcfg)
+{
+	int i;
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		free_experiment_set(&hcfg->sets[i]);
+		init_core_experiment_set_t(&hcfg->sets[i]);
+	}
+	hcfg->in_use=0;
+}
+
+static int pmct_ctl_release(struct inode *inode, struct file *filp)
+{
+	pmct_ctl_file_t* ctl=filp->private_data;
+	int i;
+
+	/* Threads still using the experiments keep their own references */
+	for (i=0; i<PMCT_IOC_MAX_HANDLES; i++)
+		if (ctl->handles[i].in_use)
+			pmct_ctl_put_handle(&ctl->handles[i]);
+
+	kfree(ctl);
+	return 0;
+}
+
+/* Take a reference to the experiments of a handle */
+static int pmct_ctl_clone_handle(pmct_ctl_file_t* ctl, int32_t handle, core_experiment_set_t sets[])
+{
+	pmct_config_handle_t* hcfg;
+	int i,j;
+	int retval=0;
+
+	mutex_lock(&ctl->lock);
+	if ((hcfg=pmct_ctl_get_handle(ctl,handle))==NULL) {
+		retval=-EINVAL;
+	} else {
+		for (i=0; i<AMP_MAX_CORETYPES; i++) {
+			init_core_experiment_set_t(&sets[i]);
+			if ((retval=clone_core_experiment_set_t(&sets[i],&hcfg->sets[i]))) {
+				for (j=0; j<i; j++)
+					free_experiment_set(&sets[j]);
+				break;
+			}
+		}
+	}
+	mutex_unlock(&ctl->lock);
+	return retval;
+}
+
+static long pmct_ctl_destroy(pmct_ctl_file_t* ctl, int32_t handle)
+{
+	pmct_config_handle_t* hcfg;
+	long retval=0;
+
+	mutex_lock(&ctl->lock);
+	if ((hcfg=pmct_ctl_get_handle(ctl,handle))==NULL)
+		retval=-EINVAL;
+	else
+		pmct_ctl_put_handle(hcfg);
+	mutex_unlock(&ctl->lock);
+	return retval;
+}
+
+/*
+ * PMCT_IOC_COMPILE: parse and validate the raw configuration strings
+ * once, so that attach and start requests just refer to the handle.
+ */
+static long pmct_ctl_compile(pmct_ctl_file_t* ctl, struct pmct_ioc_config __user *ucfg)
+{
+	struct pmct_ioc_config* cfg;
+	const char* strconfig[PMCT_IOC_MAX_EVENT_SETS+1];
+	core_experiment_set_t sets[AMP_MAX_CORETYPES];
+	monitoring_module_counter_usage_t usage;
+	int32_t handle=-1;
+	long retval=0;
+	int i;
+
+	/* The current monitoring module may be using the PMCs */
+	mm_module_counter_usage(&usage);
+	if (usage.hwpmc_mask)
+		return -EBUSY;
+
+	if ((cfg=vmalloc(sizeof(struct pmct_ioc_config)))==NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(cfg,ucfg,sizeof(struct pmct_ioc_config))) {
+		retval=-EFAULT;
+		goto out_free;
+	}
+
+	if (cfg->nr_sets==0 || cfg->nr_sets>PMCT_IOC_MAX_EVENT_SETS) {
+		retval=-EINVAL;
+		goto out_free;
+	}
+
+	for (i=0; i<cfg->nr_sets; i++) {
+		cfg->strcfg[i][PMCT_IOC_MAX_CFG_LEN-1]='\0';
+		strconfig[i]=cfg->strcfg[i];
+	}
+	strconfig[i]=NULL;
+
+	if ((retval=configure_performance_counters_set(strconfig,sets,AMP_MAX_CORETYPES)))
+		goto out_free;
+
+	mutex_lock(&ctl->lock);
+	for (i=0; i<PMCT_IOC_MAX_HANDLES && handle==-1; i++)
+		if (!ctl->handles[i].in_use)
+			handle=i;
+
+	if (handle!=-1) {
+		/* The handle takes over the references */
+		for (i=0; i<AMP_MAX_CORETYPES; i++)
+			clone_core_experiment_set_t_noalloc(&ctl->handles[handle].sets[i],&sets[i]);
+		ctl->handles[handle].in_use=1;
+	}
+	mutex_unlock(&ctl->lock);
+
+	if (handle==-1) {
+		for (i=0; i<AMP_MAX_CORETYPES; i++)
+			free_experiment_set(&sets[i]);
+		retval=-ENOSPC;
+		goto out_free;
+	}
+
+	if (put_user(handle,&ucfg->handle)) {
+		pmct_ctl_destroy(ctl,handle);
+		retval=-EFAULT;
+	}
+out_free:
+	vfree(cfg);
+	return retval;
+}
+
+/*
+ * PMCT_IOC_ATTACH and PMCT_IOC_ATTACH_TGID: the caller becomes the
+ * monitor of the target process (or of all the threads in its group)
+ */
+static long pmct_ctl_attach(pmct_ctl_file_t* ctl, struct pmct_ioc_attach __user *uarg, int whole_group)
+{
+	struct pmct_ioc_attach arg;
+	core_experiment_set_t sets[AMP_MAX_CORETYPES];
+	pmon_prof_t* monitor;
+	unsigned long flags=0;
+	long retval=0;
+	int i;
+
+	if (copy_from_user(&arg,uarg,sizeof(struct pmct_ioc_attach)))
+		return -EFAULT;
+
+	if ((monitor=get_pmon_prof(current))==NULL)
+		return -ENOMEM;
+
+	/* Samples from the target go to the buffer of the monitor */
+	if ((retval=alloc_self_samples_buffer(monitor)))
+		return retval;
+
+	/* The target inherits the sampling period of the monitor */
+	spin_lock_irqsave(&monitor->lock,flags);
+	if (monitor->pmc_jiffies_interval<0)
+		set_sampling_period_us(monitor,USEC_PER_SEC);
+	spin_unlock_irqrestore(&monitor->lock,flags);
+
+	if ((retval=pmct_ctl_clone_handle(ctl,arg.handle,sets)))
+		return retval;
+
+	/* Precompiled configurations are always TBS */
+	if (whole_group)
+		retval=pmctrack_tgid_attach_set(arg.pid,sets,TBS_USER_MODE);
+	else
+		retval=pmctrack_pid_attach_set(arg.pid,sets,TBS_USER_MODE);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		free_experiment_set(&sets[i]);
+
+	return retval;
+}
+
+/*
+ * PMCT_IOC_ATTACH_LIST: attach a list of processes in one go.
+ * Returns the number of processes attached.
+ */
+static long pmct_ctl_attach_list(pmct_ctl_file_t* ctl, struct pmct_ioc_attach_list __user *uarg)
+{
+	struct pmct_ioc_attach_list arg;
+	core_experiment_set_t sets[AMP_MAX_CORETYPES];
+	pmon_prof_t* monitor;
+	int32_t* pids;
+	unsigned long flags=0;
+	long retval=0;
+	int nr_attached=0;
+	int i;
+
+	if (copy_from_user(&arg,uarg,sizeof(struct pmct_ioc_attach_list)))
+		return -EFAULT;
+
+	if (arg.nr_pids==0 || arg.nr_pids>PMCT_IOC_MAX_PIDS)
+		return -EINVAL;
+
+	if ((monitor=get_pmon_prof(current))==NULL)
+		return -ENOMEM;
+
+	if ((pids=vmalloc(arg.nr_pids*sizeof(int32_t)))==NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(pids,(void __user *)(unsigned long)arg.pids,arg.nr_pids*sizeof(int32_t))) {
+		retval=-EFAULT;
+		goto out_free;
+	}
+
+	if ((retval=alloc_self_samples_buffer(monitor)))
+		goto out_free;
+
+	spin_lock_irqsave(&monitor->lock,flags);
+	if (monitor->pmc_jiffies_interval<0)
+		set_sampling_period_us(monitor,USEC_PER_SEC);
+	spin_unlock_irqrestore(&monitor->lock,flags);
+
+	if ((retval=pmct_ctl_clone_handle(ctl,arg.handle,sets)))
+		goto out_free;
+
+	for (i=0; i<arg.nr_pids; i++)
+		if (pmctrack_pid_attach_set(pids[i],sets,TBS_USER_MODE)==0)
+			nr_attached++;
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++)
+		free_experiment_set(&sets[i]);
+
+	retval=nr_attached;
+out_free:
+	vfree(pids);
+	return retval;
+}
+
+/*
+ * PMCT_IOC_START: install a precompiled configuration on the calling
+ * thread and start a per-thread or system-wide monitoring session
+ */
+static long pmct_ctl_start(pmct_ctl_file_t* ctl, struct pmct_ioc_start __user *uarg)
+{
+	struct pmct_ioc_start arg;
+	core_experiment_set_t sets[AMP_MAX_CORETYPES];
+	pmon_prof_t* prof;
+	unsigned long flags=0;
+	int system_wide;
+	long retval=0;
+	int i;
+
+	if (copy_from_user(&arg,uarg,sizeof(struct pmct_ioc_start)))
+		return -EFAULT;
+
+	system_wide=(arg.flags & PMCT_IOC_SYSWIDE);
+
+	if ((prof=get_pmon_prof(current))==NULL)
+		return -ENOMEM;
+
+	if (current->prof_enabled)
+		return -EBUSY;
+
+	/* Same buffer capacity as with /proc/pmc/config */
+	if (system_wide && !prof->pmc_samples_buffer)
+		prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids;
+
+	if ((retval=alloc_self_samples_buffer(prof)))
+		return retval;
+
+	if ((retval=pmct_ctl_clone_handle(ctl,arg.handle,sets)))
+		return retval;
+
+	/* Prevent the perf interrupt to kick in when trying to do this */
+	spin_lock_irqsave(&prof->lock,flags);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		free_experiment_set(&prof->pmcs_multiplex_cfg[i]);
+		clone_core_experiment_set_t_noalloc(&prof->pmcs_multiplex_cfg[i],&sets[i]);
+	}
+
+	prof->profiling_mode=TBS_USER_MODE;
+	prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
+	init_core_experiment_state_t(&prof->pmcs_state);
+
+	spin_unlock_irqrestore(&prof->lock,flags);
+
+	if (system_wide)
+		return syswide_monitoring_start();
+	else
+		return start_self_counting(prof);
+}
+
+/* PMCT_IOC_STOP */
+static long pmct_ctl_stop(uint32_t __user *uflags)
+{
+	pmon_prof_t* prof=(pmon_prof_t*)current->pmc;
+	uint32_t flags;
+
+	if (get_user(flags,uflags))
+		return -EFAULT;
+
+	if (flags & PMCT_IOC_SYSWIDE)
+		return syswide_monitoring_stop();
+
+	if (!prof)
+		return -EINVAL;
+
+	stop_self_counting(prof);
+	return 0;
+}
+
+static long pmct_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	pmct_ctl_file_t* ctl=filp->private_data;
+	void __user *uarg=(void __user *)arg;
+	struct pmct_ioc_version version;
+	int32_t val;
+
+	switch (cmd) {
+	case PMCT_IOC_GET_VERSION:
+		version.abi_version=PMCT_IOC_ABI_VERSION;
+		version.max_handles=PMCT_IOC_MAX_HANDLES;
+		version.max_event_sets=PMCT_IOC_MAX_EVENT_SETS;
+		version.max_cfg_len=PMCT_IOC_MAX_CFG_LEN;
+		if (copy_to_user(uarg,&version,sizeof(struct pmct_ioc_version)))
+			return -EFAULT;
+		return 0;
+	case PMCT_IOC_COMPILE:
+		return pmct_ctl_compile(ctl,uarg);
+	case PMCT_IOC_DESTROY:
+		if (get_user(val,(int32_t __user *)uarg))
+			return -EFAULT;
+		return pmct_ctl_destroy(ctl,val);
+	case PMCT_IOC_ATTACH:
+		return pmct_ctl_attach(ctl,uarg,0);
+	case PMCT_IOC_ATTACH_TGID:
+		return pmct_ctl_attach(ctl,uarg,1);
+	case PMCT_IOC_ATTACH_LIST:
+		return pmct_ctl_attach_list(ctl,uarg);
+	case PMCT_IOC_DETACH:
+		if (get_user(val,(int32_t __user *)uarg))
+			return -EFAULT;
+		return pmctrack_pid_detach(val);
+	case PMCT_IOC_DETACH_TGID:
+		if (get_user(val,(int32_t __user *)uarg))
+			return -EFAULT;
+		return pmctrack_tgid_detach(val);
+	case PMCT_IOC_START:
+		return pmct_ctl_start(ctl,uarg);
+	case PMCT_IOC_STOP:
+		return pmct_ctl_stop(uarg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* All the structures in pmc_ioctl.h have the same layout on 32-bit user space */
+static const struct file_operations pmct_ctl_fops = {
+	.owner = THIS_MODULE,
+	.open = pmct_ctl_open,
+	.release = pmct_ctl_release,
+	.unlocked_ioctl = pmct_ctl_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = pmct_ctl_ioctl,
+#endif
+};
+
+static struct miscdevice pmct_ctl_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = PMCT_IOC_DEVICE_NAME,
+	.fops = &pmct_ctl_fops,
+	.mode = 0666,
+};
+
+
 /*********** Platform-independent code that takes care of PMC overflow *****************/
 
 /*
  * This function detects which PMC different from the EBS counter actually overflowed.
  * The function returns a non-zero value if the EBS counter is among those which overflowed.
  */
-static unsigned int update_overflow_status_non_ebs_pmcs(core_experiment_t* exp,unsigned int overflow_mask)
+static unsigned int update_overflow_status_non_ebs_pmcs(core_experiment_t* exp,core_experiment_state_t* state,unsigned int overflow_mask)
 {
 	/* On AMD overflow masks are unreliable
 		since no overflow status exists as such
@@ -2628,7 +4041,7 @@ static unsigned int update_overflow_status_non_ebs_pmcs(core_experiment_t* exp,u
 		if ((filtered_mask & (0x1 << i)) &&
 		    (log_pmc_index=exp->phys_to_log[i])!=-1) {
 			trace_printk("Increment overflow counter of log event %d\n",log_pmc_index);
-			exp->nr_overflows[log_pmc_index]++;
+			state->nr_overflows[log_pmc_index]++;
 		}
 
 		filtered_mask&=~(0x1 << i);
@@ -2650,7 +4063,11 @@ static unsigned int update_overflow_status_non_ebs_pmcs(core_experiment_t* exp,u
 void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 {
 	int read_ok=0;
-	pmc_sample_t sample;
+	pmc_sample_v2_t sample;
+	pmc_samples_buffer_t* sbuf;
+	pmc_sample_record_t* rec;
+	uint64_t* counts;
+	uint32_t next_head=0;
 	unsigned int ebs_idx=0;
 	unsigned int this_cpu=smp_processor_id();
 	pmu_props_t* props=get_pmu_props_cpu(this_cpu);
@@ -2671,11 +4088,48 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 	} else {
 		core_exp = prof->pmcs_config?prof->pmcs_config:&per_cpu(cpu_exp, this_cpu);
 
-		filtered_mask=update_overflow_status_non_ebs_pmcs(core_exp,overflow_mask);
+		filtered_mask=update_overflow_status_non_ebs_pmcs(core_exp,&prof->pmcs_state,overflow_mask);
 
 		if (!filtered_mask)
 			goto exit_unlock;
 
+		/*
+		 * Unless the monitoring module gets the sample, read the
+		 * counters straight into a record of the local ring
+		 * (NMI context: it has no other producer in EBS mode)
+		 */
+		sbuf=prof->pmc_samples_buffer;
+
+		if (sbuf && !(prof->virt_counter_mask && mm_handles_samples(prof))) {
+			rec=__reserve_sample_cbuffer(sbuf,p,PMC_EBS_SAMPLE,0,0,core_exp->used_pmcs,core_exp->size,
+			                             &next_head);
+
+			/* The counters must be read even if the sample is dropped */
+			if (rec) {
+				take_sample_times(prof,&rec->timestamp,&rec->time_enabled,&rec->time_running);
+				counts=rec->counts;
+			} else {
+				fill_sample_times(prof,&sample);
+				counts=sample.pmc_counts;
+			}
+
+			read_ok=!do_count_mc_experiment_buffer(core_exp,&prof->pmcs_state,props,counts);
+
+			if (read_ok) {
+				ebs_idx=core_exp->ebs_idx;
+
+				if (ebs_idx!=-1) {
+					uint64_t reset_value=__get_reset_value(&(core_exp->array[ebs_idx]));
+					counts[ebs_idx]+=( (-reset_value) & props->pmc_width_mask);
+				}
+			}
+
+			/* Discard the record if the counters were just set up */
+			if (read_ok || !rec)
+				__commit_sample_cbuffer(sbuf,rec,next_head,1);
+			goto exit_unlock;
+		}
+
 		/* Initialize sample*/
 		sample.type=PMC_EBS_SAMPLE;
 		sample.coretype=0;
@@ -2685,9 +4139,12 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
 		sample.pid=p->pid;
+		sample.tgid=p->tgid;
+		fill_sample_times(prof,&sample);
 
 		/* Read counters !! */
 		read_ok=!do_count_mc_experiment_buffer(core_exp,
+		                                       &prof->pmcs_state,
 		                                       props,
 		                                       sample.pmc_counts);
 
@@ -2704,26 +4161,66 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 			if (prof && prof->virt_counter_mask)
 				mm_on_new_sample(prof,this_cpu,&sample,MM_TICK,NULL);
 
-			spin_lock(&prof->pmc_samples_buffer->lock);
-			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-			spin_unlock(&prof->pmc_samples_buffer->lock);
+			/* NMI context: the local ring has no other producer in EBS mode */
+			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample,p);
 		}
 	}
 exit_unlock:
 	spin_unlock_irqrestore(&prof->lock,flags);
 }
 
+/*
+ * Build-time checks on the layout of the structures
+ * used on the context-switch and tick paths (no code is generated)
+ */
+static inline void check_pmon_prof_layout(void)
+{
+	/* Hot fields fit in the space reserved for them (unless spinlocks carry debug info) */
+#if !defined(CONFIG_DEBUG_SPINLOCK) && !defined(CONFIG_DEBUG_LOCK_ALLOC)
+	BUILD_BUG_ON(offsetof(pmon_prof_t,lock)+sizeof(spinlock_t)>PMON_PROF_HOT_BYTES);
+#endif
+	/* Counter values start on a new cacheline and are followed by their state */
+	BUILD_BUG_ON(offsetof(pmon_prof_t,pmc_values)%SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(pmon_prof_t,pmcs_state)!=offsetof(pmon_prof_t,pmc_values)+sizeof(uint64_t)*MAX_LL_EXPS);
+	/* Cold fields do not share cachelines with hot ones */
+	BUILD_BUG_ON(offsetof(pmon_prof_t,pmcs_multiplex_cfg)%SMP_CACHE_BYTES);
+	/* Scalar fields of an experiment precede the events ... */
+	BUILD_BUG_ON(offsetof(core_experiment_t,array)!=4*sizeof(int));
+	/* ... and low-level events do not embed their names */
+	BUILD_BUG_ON(sizeof(low_level_exp)>sizeof(struct hw_event)+2*sizeof(long));
+}
+
 static void init_percpu_structures(void)
 {
 	int cpu;
 	core_experiment_t* exp;
+#ifdef TBS_TIMER
+	tbs_sampler_t* sampler;
+#endif
 
 	for_each_possible_cpu(cpu) {
 		exp=&per_cpu(cpu_exp, cpu);
 		init_core_experiment_t(exp,0);
+#ifdef TBS_TIMER
+		sampler=&per_cpu(tbs_sampler, cpu);
+		hrtimer_init(&sampler->timer,CLOCK_MONOTONIC,HRTIMER_MODE_ABS);
+		sampler->timer.function=tbs_sampler_fire;
+		sampler->prof=NULL;
+#endif
 	}
 }
 
+/* Make sure that per-CPU timers do not fire anymore */
+static void destroy_percpu_structures(void)
+{
+#ifdef TBS_TIMER
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu(tbs_sampler, cpu).timer);
+#endif
+}
+
 /* Module initialization function */
 static int __init pmctrack_module_init(void)
 {
@@ -2736,12 +4233,26 @@ static int __init pmctrack_module_init(void)
 		return ret;
 	}
 
+	check_pmon_prof_layout();
 	init_pmon_config_t();
 	init_percpu_structures();
 
+	/* Slab caches for per-thread data and PMC experiments */
+	if ((ret=init_core_experiment_cache())!=0) {
+		printk("Can't create slab caches");
+		return ret;
+	}
+
+	pmon_prof_cache=kmem_cache_create("pmctrack_prof",sizeof(pmon_prof_t),0,SLAB_HWCACHE_ALIGN,NULL);
+	if (!pmon_prof_cache) {
+		printk("Can't create slab caches");
+		destroy_core_experiment_cache();
+		return -ENOMEM;
+	}
+
 	if((ret = register_pmc_module(&pmc_mc_prog,THIS_MODULE)) != 0) {
 		printk("Can't load pmc module");
-		return ret;
+		goto out_destroy_caches;
 	}
 
 	/* Create /proc/pmc directory */
@@ -2772,6 +4283,14 @@ static int __init pmctrack_module_init(void)
 		goto out_error;
 	}
 
+	/* Binary control interface */
+	if ( (ret=misc_register(&pmct_ctl_dev))!=0) {
+		printk("Can't register /dev/%s",PMCT_IOC_DEVICE_NAME);
+		syswide_monitoring_cleanup();
+		error_proc_entries=ret;
+		goto out_error;
+	}
+
 	printk(KERN_INFO "PMCTrack module loaded\n");
 	return 0;
 out_error:
@@ -2784,6 +4303,9 @@ out_error:
 		remove_proc_entry("pmc", NULL);
 	}
 	unregister_pmc_module(&pmc_mc_prog,THIS_MODULE);
+out_destroy_caches:
+	kmem_cache_destroy(pmon_prof_cache);
+	destroy_core_experiment_cache();
 	return ret;
 }
 
@@ -2791,14 +4313,20 @@ out_error:
 static void __exit pmctrack_module_exit(void)
 {
 	if(!unregister_pmc_module(&pmc_mc_prog,THIS_MODULE)) {
+		destroy_percpu_structures();
 		/* Restore the APIC and stuff */
 		pmu_shutdown();
 		/* Unload monitoring module manager */
 		destroy_mm_manager(pmc_dir);
+		misc_deregister(&pmct_ctl_dev);
 		destroy_proc_entries();
 		syswide_monitoring_cleanup();
+		/* Wait for deferred releases of sample buffers */
+		flush_scheduled_work();
 		if (pmc_dir)
 			remove_proc_entry("pmc", NULL);
+		kmem_cache_destroy(pmon_prof_cache);
+		destroy_core_experiment_cache();
 		printk(KERN_INFO "Module PMCs unloaded.\n");
 	} else {
 		printk(KERN_INFO "Module PMCs not unloaded.\n");
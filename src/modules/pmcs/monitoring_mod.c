@@ -17,7 +17,7 @@
 #include <pmc/smart_power.h>
 
 #ifdef DEBUG
-static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration"};
+static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration","self","online","offline"};
 #endif
 
 
@@ -42,10 +42,6 @@ static int dummy_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 	return 0;
 }
 static void dummy_on_exec(pmon_prof_t* prof) {}
-static int dummy_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
-{
-	return 0;
-}
 static void dummy_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu) {}
 static void dummy_module_counter_usage(monitoring_module_counter_usage_t* usage)
 {
@@ -157,10 +153,9 @@ static int dummy_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 
 static void dummy_on_exec(pmon_prof_t* prof) { }
 
-static int dummy_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
-{
-
 #ifdef DEBUG
+static int dummy_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
+{
 	int remaining_pmcmask=0x1f;
 	int j=0;
 	/* Max supported counters 10 */
@@ -192,12 +187,12 @@ static int dummy_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,in
 			/* Clear all counters in the platform */
 			mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
 			prof->pmcs_config=next;
-			mc_restart_all_counters(prof->pmcs_config);
+			mc_restart_all_counters(prof->pmcs_config,&prof->pmcs_state);
 		}
 	}
-#endif
 	return 0;
 }
+#endif
 
 static void dummy_on_migrate(pmon_prof_t* prof, int prev_cpu, int new_cpu)
 {
@@ -216,7 +211,10 @@ static monitoring_module_t dummy_mm= {
 	.on_write_config=dummy_on_write_config,
 	.on_fork=dummy_on_fork,
 	.on_exec=dummy_on_exec,
+#if defined(DEBUG) && !defined(CONFIG_PMC_PHI)
+	/* Samples only go through the module in debug builds */
 	.on_new_sample=dummy_on_new_sample,
+#endif
 	.on_migrate=dummy_on_migrate,
 	.module_counter_usage=dummy_module_counter_usage
 };
@@ -668,7 +666,12 @@ void mm_on_exec(pmon_prof_t* prof)
 		mm_manager.cur_module->on_exec(prof);
 }
 
-int mm_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+int mm_handles_samples(pmon_prof_t* prof)
+{
+	return mod_task_is_curr(prof) && mm_manager.cur_module->on_new_sample;
+}
+
+int mm_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
 {
 	if ( mod_task_is_curr(prof) && mm_manager.cur_module->on_new_sample)
 		return mm_manager.cur_module->on_new_sample(prof,cpu,sample,flags,data);
@@ -752,7 +755,7 @@ void mm_on_syswide_refresh_monitor(int cpu, unsigned int virtual_mask)
 		mm_manager.cur_module->on_syswide_refresh_monitor(cpu,virtual_mask);
 }
 
-void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample)
+void mm_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_v2_t* sample)
 {
 	if (mm_manager.cur_module && mm_manager.cur_module->on_syswide_dump_virtual_counters)
 		mm_manager.cur_module->on_syswide_dump_virtual_counters(cpu,virtual_mask,sample);
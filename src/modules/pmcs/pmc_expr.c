@@ -0,0 +1,579 @@
+/*
+ *  pmc_expr.c
+ *
+ *  Compiler and fixed-point evaluator for metric expressions
+ *  (see include/pmc/pmc_expr.h)
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+#include <pmc/pmc_expr.h>
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#define expr_mem_alloc(bytes) kmalloc(bytes,GFP_KERNEL)
+#define expr_mem_free(ptr) kfree(ptr)
+#define nr_bits(x) fls64(x)
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#define expr_mem_alloc(bytes) malloc(bytes)
+#define expr_mem_free(ptr) free(ptr)
+#define div64_u64(a,b) ((a)/(b))
+#define nr_bits(x) ((x)?64-__builtin_clzll(x):0)
+#endif
+
+#define FRAC_MASK	(PMC_EXPR_ONE-1)
+#define MAX_NAME_LEN	64
+#define MAX_NESTING	16	/* Bounds the recursion of the parser */
+
+/* Parser state */
+typedef struct {
+	const char* cur;	/* Next character to parse */
+	pmc_expr_t* prog;
+	unsigned int depth;	/* Current stack depth */
+	unsigned int nesting;	/* Current nesting level of expressions */
+	pmc_expr_lookup_t lookup;
+	void* data;
+} expr_parser_t;
+
+static int parse_expr(expr_parser_t* ps);
+
+static inline int is_name_char(char c, int first)
+{
+	return (c>='a' && c<='z') || (c>='A' && c<='Z') || c=='_' || (!first && c>='0' && c<='9');
+}
+
+static inline void skip_blanks(expr_parser_t* ps)
+{
+	while (*ps->cur==' ' || *ps->cur=='\t')
+		ps->cur++;
+}
+
+/* Number of pops and pushes of an instruction */
+static inline void insn_stack_effect(pmc_expr_insn_t* insn, int* nr_pops)
+{
+	switch (insn->opcode) {
+	case PMC_EXPR_PUSH_CONST:
+	case PMC_EXPR_PUSH_EVENT:
+	case PMC_EXPR_PUSH_METRIC:
+		*nr_pops=0;
+		break;
+	case PMC_EXPR_NEG:
+		*nr_pops=1;
+		break;
+	case PMC_EXPR_SUB:
+	case PMC_EXPR_MUL:
+	case PMC_EXPR_DIV:
+		*nr_pops=2;
+		break;
+	default:
+		/* n-ary */
+		*nr_pops=insn->operand;
+		break;
+	}
+}
+
+static int emit(expr_parser_t* ps, pmc_expr_opcode_t opcode, unsigned int operand)
+{
+	pmc_expr_t* prog=ps->prog;
+	pmc_expr_insn_t* insn;
+	int nr_pops;
+
+	if (prog->nr_insns==PMC_EXPR_MAX_INSNS)
+		return -E2BIG;
+
+	insn=&prog->code[prog->nr_insns++];
+	insn->opcode=opcode;
+	insn->reserved=0;
+	insn->operand=operand;
+
+	insn_stack_effect(insn,&nr_pops);
+	ps->depth=ps->depth-nr_pops+1;
+
+	if (ps->depth>PMC_EXPR_MAX_STACK)
+		return -E2BIG;
+	if (ps->depth>prog->max_depth)
+		prog->max_depth=ps->depth;
+
+	if (opcode==PMC_EXPR_PUSH_EVENT && operand+1>prog->nr_events)
+		prog->nr_events=operand+1;
+	return 0;
+}
+
+static int emit_const(expr_parser_t* ps, int64_t value)
+{
+	pmc_expr_t* prog=ps->prog;
+	unsigned int i;
+
+	/* Reuse constants */
+	for (i=0; i<prog->nr_consts; i++)
+		if (prog->consts[i]==value)
+			return emit(ps,PMC_EXPR_PUSH_CONST,i);
+
+	if (prog->nr_consts==PMC_EXPR_MAX_CONSTS)
+		return -E2BIG;
+
+	prog->consts[prog->nr_consts]=value;
+	return emit(ps,PMC_EXPR_PUSH_CONST,prog->nr_consts++);
+}
+
+static int64_t apply_op(pmc_expr_opcode_t opcode, int64_t* args, unsigned int nr_args);
+
+/*
+ * Emit an operator. If all its arguments are constants,
+ * the result is computed now (constant folding).
+ */
+static int emit_op(expr_parser_t* ps, pmc_expr_opcode_t opcode, unsigned int nr_args)
+{
+	pmc_expr_t* prog=ps->prog;
+	int64_t args[PMC_EXPR_MAX_STACK];
+	unsigned int i,first;
+
+	if (prog->nr_insns>=nr_args) {
+		first=prog->nr_insns-nr_args;
+
+		for (i=0; i<nr_args; i++)
+			if (prog->code[first+i].opcode!=PMC_EXPR_PUSH_CONST)
+				break;
+
+		if (i==nr_args) {
+			for (i=0; i<nr_args; i++)
+				args[i]=prog->consts[prog->code[first+i].operand];
+
+			prog->nr_insns=first;
+			ps->depth-=nr_args;
+			return emit_const(ps,apply_op(opcode,args,nr_args));
+		}
+	}
+
+	return emit(ps,opcode,(opcode==PMC_EXPR_NEG)?0:nr_args);
+}
+
+/* Parse a (decimal or hex) number into a fixed-point value */
+static int parse_number(expr_parser_t* ps, int64_t* value)
+{
+	const char* p=ps->cur;
+	uint64_t ipart=0,fpart=0,fscale=1;
+	int digit;
+
+	if (p[0]=='0' && (p[1]=='x' || p[1]=='X')) {
+		p+=2;
+		if (!((*p>='0' && *p<='9') || (*p>='a' && *p<='f') || (*p>='A' && *p<='F')))
+			return -EINVAL;
+
+		for (;; p++) {
+			if (*p>='0' && *p<='9')
+				digit=*p-'0';
+			else if (*p>='a' && *p<='f')
+				digit=*p-'a'+10;
+			else if (*p>='A' && *p<='F')
+				digit=*p-'A'+10;
+			else
+				break;
+
+			ipart=ipart*16+digit;
+			if (ipart>=(1ULL<<(62-PMC_EXPR_FRAC_BITS)))
+				return -EINVAL;
+		}
+	} else {
+		for (; *p>='0' && *p<='9'; p++) {
+			ipart=ipart*10+(*p-'0');
+			if (ipart>=(1ULL<<(62-PMC_EXPR_FRAC_BITS)))
+				return -EINVAL;
+		}
+
+		if (*p=='.') {
+			/* Digits beyond the 9th decimal place are ignored */
+			for (p++; *p>='0' && *p<='9'; p++)
+				if (fscale<1000000000ULL) {
+					fpart=fpart*10+(*p-'0');
+					fscale*=10;
+				}
+		}
+	}
+
+	if (is_name_char(*p,0))
+		return -EINVAL;
+
+	/* Round the fractional part to the nearest */
+	*value=(int64_t)((ipart<<PMC_EXPR_FRAC_BITS)+div64_u64((fpart<<PMC_EXPR_FRAC_BITS)+fscale/2,fscale));
+	ps->cur=p;
+	return 0;
+}
+
+/* Parse a comma-separated list of arguments followed by ')' */
+static int parse_args(expr_parser_t* ps, unsigned int* nr_args)
+{
+	int ret;
+
+	*nr_args=0;
+
+	for (;;) {
+		if ((ret=parse_expr(ps)))
+			return ret;
+
+		(*nr_args)++;
+		skip_blanks(ps);
+
+		if (*ps->cur==')')
+			break;
+		else if (*ps->cur!=',')
+			return -EINVAL;
+
+		ps->cur++;
+	}
+
+	ps->cur++;
+	return 0;
+}
+
+static int parse_primary(expr_parser_t* ps)
+{
+	char name[MAX_NAME_LEN];
+	unsigned int len=0,nr_args;
+	pmc_expr_opcode_t opcode;
+	int64_t value;
+	int ret,idx;
+
+	skip_blanks(ps);
+
+	if (*ps->cur=='(') {
+		ps->cur++;
+		if ((ret=parse_expr(ps)))
+			return ret;
+		skip_blanks(ps);
+		if (*ps->cur!=')')
+			return -EINVAL;
+		ps->cur++;
+		return 0;
+	}
+
+	if (*ps->cur>='0' && *ps->cur<='9') {
+		if ((ret=parse_number(ps,&value)))
+			return ret;
+		return emit_const(ps,value);
+	}
+
+	if (!is_name_char(*ps->cur,1))
+		return -EINVAL;
+
+	while (is_name_char(*ps->cur,0)) {
+		if (len==MAX_NAME_LEN-1)
+			return -EINVAL;
+		name[len++]=*ps->cur++;
+	}
+	name[len]='\0';
+
+	skip_blanks(ps);
+
+	/* Function call */
+	if (*ps->cur=='(') {
+		if (strcmp(name,"min")==0)
+			opcode=PMC_EXPR_MIN_N;
+		else if (strcmp(name,"max")==0)
+			opcode=PMC_EXPR_MAX_N;
+		else if (strcmp(name,"sum")==0)
+			opcode=PMC_EXPR_ADD;
+		else
+			return -EINVAL;
+
+		ps->cur++;
+		if ((ret=parse_args(ps,&nr_args)))
+			return ret;
+
+		return nr_args==1?0:emit_op(ps,opcode,nr_args);
+	}
+
+	/* Raw event ("evN") */
+	if (name[0]=='e' && name[1]=='v' && name[2]>='0' && name[2]<='9') {
+		idx=0;
+		for (len=2; name[len]>='0' && name[len]<='9'; len++) {
+			idx=idx*10+(name[len]-'0');
+			if (idx>0xffff)
+				return -EINVAL;
+		}
+		if (name[len]=='\0')
+			return emit(ps,PMC_EXPR_PUSH_EVENT,idx);
+	}
+
+	/* Metric (or event) name */
+	opcode=PMC_EXPR_PUSH_METRIC;
+
+	if (!ps->lookup || (idx=ps->lookup(name,ps->data,&opcode))<0 || idx>0xffff)
+		return -EINVAL;
+
+	return emit(ps,opcode,idx);
+}
+
+static int parse_factor(expr_parser_t* ps)
+{
+	int ret;
+
+	skip_blanks(ps);
+
+	if (*ps->cur=='-') {
+		ps->cur++;
+		if (++ps->nesting>MAX_NESTING)
+			return -E2BIG;
+		ret=parse_factor(ps);
+		ps->nesting--;
+		if (ret)
+			return ret;
+		return emit_op(ps,PMC_EXPR_NEG,1);
+	}
+
+	return parse_primary(ps);
+}
+
+static int parse_term(expr_parser_t* ps)
+{
+	pmc_expr_opcode_t opcode;
+	int ret;
+
+	if ((ret=parse_factor(ps)))
+		return ret;
+
+	for (;;) {
+		skip_blanks(ps);
+
+		if (*ps->cur=='*')
+			opcode=PMC_EXPR_MUL;
+		else if (*ps->cur=='/')
+			opcode=PMC_EXPR_DIV;
+		else
+			return 0;
+
+		ps->cur++;
+		if ((ret=parse_factor(ps)) || (ret=emit_op(ps,opcode,2)))
+			return ret;
+	}
+}
+
+static int parse_expr(expr_parser_t* ps)
+{
+	pmc_expr_opcode_t opcode;
+	int ret;
+
+	if (++ps->nesting>MAX_NESTING)
+		return -E2BIG;
+
+	if ((ret=parse_term(ps)))
+		return ret;
+
+	for (;;) {
+		skip_blanks(ps);
+
+		if (*ps->cur=='+')
+			opcode=PMC_EXPR_ADD;
+		else if (*ps->cur=='-')
+			opcode=PMC_EXPR_SUB;
+		else
+			break;
+
+		ps->cur++;
+		if ((ret=parse_term(ps)) || (ret=emit_op(ps,opcode,2)))
+			return ret;
+	}
+
+	ps->nesting--;
+	return 0;
+}
+
+int pmc_expr_compile(const char* str, pmc_expr_lookup_t lookup, void* data, pmc_expr_t** prog)
+{
+	expr_parser_t ps;
+	int ret;
+
+	if (strlen(str)>=PMC_EXPR_MAX_LENGTH)
+		return -E2BIG;
+
+	ps.cur=str;
+	ps.depth=0;
+	ps.nesting=0;
+	ps.lookup=lookup;
+	ps.data=data;
+	ps.prog=expr_mem_alloc(sizeof(pmc_expr_t));
+
+	if (!ps.prog)
+		return -ENOMEM;
+
+	memset(ps.prog,0,sizeof(pmc_expr_t));
+
+	ret=parse_expr(&ps);
+	skip_blanks(&ps);
+
+	/* Trailing garbage */
+	if (!ret && (*ps.cur!='\0' && *ps.cur!='\n'))
+		ret=-EINVAL;
+
+	if (ret) {
+		expr_mem_free(ps.prog);
+		return ret;
+	}
+
+	*prog=ps.prog;
+	return 0;
+}
+
+void pmc_expr_free(pmc_expr_t* prog)
+{
+	expr_mem_free(prog);
+}
+
+int pmc_expr_check_events(const pmc_expr_t* prog, unsigned int nr_hw_events)
+{
+	return prog->nr_events>nr_hw_events?-EINVAL:0;
+}
+
+/*** Fixed-point arithmetic (saturating) ***/
+
+static inline uint64_t abs_value(int64_t x)
+{
+	return x<0?-(uint64_t)x:(uint64_t)x;
+}
+
+static inline int64_t apply_sign(uint64_t x, int negative)
+{
+	if (x>(uint64_t)PMC_EXPR_MAX)
+		return negative?PMC_EXPR_MIN:PMC_EXPR_MAX;
+	return negative?-(int64_t)x:(int64_t)x;
+}
+
+static inline int64_t fixed_add(int64_t a, int64_t b)
+{
+	int64_t r=(int64_t)((uint64_t)a+(uint64_t)b);
+
+	/* Overflow if both operands have the same sign and the result does not */
+	if ((a<0)==(b<0) && (r<0)!=(a<0))
+		return a<0?PMC_EXPR_MIN:PMC_EXPR_MAX;
+	return r;
+}
+
+static inline int64_t fixed_mul(int64_t a, int64_t b)
+{
+	uint64_t ua=abs_value(a),ub=abs_value(b);
+	uint64_t a_hi=ua>>PMC_EXPR_FRAC_BITS,a_lo=ua&FRAC_MASK;
+	uint64_t b_hi=ub>>PMC_EXPR_FRAC_BITS,b_lo=ub&FRAC_MASK;
+	int negative=(a<0)!=(b<0);
+
+	/* (a_hi+a_lo)*ub=a_hi*ub+a_lo*b_hi+a_lo*b_lo (scaled) */
+	if (nr_bits(a_hi)+nr_bits(ub)>62)
+		return negative?PMC_EXPR_MIN:PMC_EXPR_MAX;
+
+	return apply_sign(a_hi*ub+a_lo*b_hi+((a_lo*b_lo)>>PMC_EXPR_FRAC_BITS),negative);
+}
+
+static inline int64_t fixed_div(int64_t a, int64_t b)
+{
+	uint64_t ua=abs_value(a),ub=abs_value(b);
+	uint64_t q,r,frac;
+	int negative=(a<0)!=(b<0);
+
+	if (ub==0)
+		return 0;
+
+	q=div64_u64(ua,ub);
+	r=ua-q*ub;
+
+	if (q>=(1ULL<<(63-PMC_EXPR_FRAC_BITS)))
+		return negative?PMC_EXPR_MIN:PMC_EXPR_MAX;
+
+	/* r<ub, so r<<FRAC_BITS may only overflow for huge divisors */
+	if (r<(1ULL<<(63-PMC_EXPR_FRAC_BITS)))
+		frac=div64_u64(r<<PMC_EXPR_FRAC_BITS,ub);
+	else
+		frac=div64_u64(r,ub>>PMC_EXPR_FRAC_BITS);
+
+	return apply_sign((q<<PMC_EXPR_FRAC_BITS)+frac,negative);
+}
+
+static int64_t apply_op(pmc_expr_opcode_t opcode, int64_t* args, unsigned int nr_args)
+{
+	int64_t r=args[0];
+	unsigned int i;
+
+	switch (opcode) {
+	case PMC_EXPR_ADD:
+		for (i=1; i<nr_args; i++)
+			r=fixed_add(r,args[i]);
+		return r;
+	case PMC_EXPR_SUB:
+		return fixed_add(r,args[1]==PMC_EXPR_MIN?PMC_EXPR_MAX:-args[1]);
+	case PMC_EXPR_MUL:
+		return fixed_mul(r,args[1]);
+	case PMC_EXPR_DIV:
+		return fixed_div(r,args[1]);
+	case PMC_EXPR_NEG:
+		return r==PMC_EXPR_MIN?PMC_EXPR_MAX:-r;
+	case PMC_EXPR_MIN_N:
+		for (i=1; i<nr_args; i++)
+			if (args[i]<r)
+				r=args[i];
+		return r;
+	case PMC_EXPR_MAX_N:
+		for (i=1; i<nr_args; i++)
+			if (args[i]>r)
+				r=args[i];
+		return r;
+	default:
+		return 0;
+	}
+}
+
+int64_t pmc_expr_eval(const pmc_expr_t* prog,
+                      const uint64_t* hw_events,
+                      const int64_t* metric_values,
+                      unsigned int stride)
+{
+	int64_t stack[PMC_EXPR_MAX_STACK];
+	const pmc_expr_insn_t* insn=prog->code;
+	const pmc_expr_insn_t* end=prog->code+prog->nr_insns;
+	unsigned int sp=0;
+	uint64_t count;
+
+	for (; insn<end; insn++) {
+		switch (insn->opcode) {
+		case PMC_EXPR_PUSH_CONST:
+			stack[sp++]=prog->consts[insn->operand];
+			break;
+		case PMC_EXPR_PUSH_EVENT:
+			count=hw_events[insn->operand];
+			stack[sp++]=count>=(1ULL<<(63-PMC_EXPR_FRAC_BITS))?
+			            PMC_EXPR_MAX:pmc_expr_from_int(count);
+			break;
+		case PMC_EXPR_PUSH_METRIC:
+			stack[sp++]=*(const int64_t*)((const char*)metric_values+insn->operand*stride);
+			break;
+		case PMC_EXPR_ADD:
+			if (insn->operand==2) {
+				/* Fast path */
+				sp--;
+				stack[sp-1]=fixed_add(stack[sp-1],stack[sp]);
+				break;
+			}
+			/* Fall through */
+		case PMC_EXPR_MIN_N:
+		case PMC_EXPR_MAX_N:
+			sp-=insn->operand;
+			stack[sp]=apply_op(insn->opcode,&stack[sp],insn->operand);
+			sp++;
+			break;
+		case PMC_EXPR_NEG:
+			stack[sp-1]=apply_op(PMC_EXPR_NEG,&stack[sp-1],1);
+			break;
+		default:
+			/* Binary operators */
+			sp--;
+			stack[sp-1]=apply_op(insn->opcode,&stack[sp-1],2);
+			break;
+		}
+	}
+
+	return sp?stack[sp-1]:0;
+}
@@ -637,6 +637,9 @@ void mc_clear_all_platform_counters(pmu_props_t* props_cpu)
 {
 	int i;
 
+	/* The PMCs no longer hold the values of any thread */
+	invalidate_pmu_owner();
+
 	for (i=0; i<props_cpu->nr_gp_pmcs; i++) {
 		armv8pmu_write_counter(i+1,0);
 		armv8pmu_write_evtype(i+1,EVTSEL_RESET_VALUE);
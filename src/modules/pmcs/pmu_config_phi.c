@@ -383,6 +383,9 @@ void mc_clear_all_platform_counters(pmu_props_t* props_cpu)
 	int cnt=0;
 	_pmc_t pmc;
 
+	/* The PMCs no longer hold the values of any thread */
+	invalidate_pmu_owner();
+
 	for (i=0; i<props_cpu->nr_gp_pmcs; i++,cnt++) {
 		msr.address=EVTSEL_MSR_INITIAL_ADDRESS+i;
 		msr.reset_value=0;
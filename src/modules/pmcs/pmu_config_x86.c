@@ -520,6 +520,8 @@ void mc_clear_all_platform_counters(pmu_props_t* props_cpu)
 #endif
 	_pmc_t pmc;
 
+	/* The PMCs no longer hold the values of any thread */
+	invalidate_pmu_owner();
 
 	for (i=0; i<props_cpu->nr_gp_pmcs; i++,cnt++) {
 		msr.address=EVTSEL_MSR_INITIAL_ADDRESS+i;
@@ -114,7 +114,7 @@ static int spower_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
  * Update cumulative energy counters in the thread structure and
  * set the associated virtual counts in the PMC sample structure
  */
-static int spower_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+static int spower_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
 {
 	spower_thread_data_t* tdata=prof->monitoring_mod_priv_data;
 	int i=0;
@@ -217,7 +217,7 @@ static void spower_on_syswide_refresh_monitor(int cpu, unsigned int virtual_mask
 }
 
 /* 	Dump virtual-counter values for this CPU */
-static void spower_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample)
+static void spower_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_v2_t* sample)
 {
 	spower_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
 	int i=0;
@@ -8,9 +8,17 @@
 
 #include <pmc/syswide.h>
 #include <pmc/mc_experiments.h>
-#include <linux/timer.h>
+#include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/smp.h>
 #include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/cgroup.h>
+#include <linux/mutex.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#include <linux/cpuhotplug.h>
+#endif
 #include <pmc/pmu_config.h>
 #include <linux/mm.h>  /* mmap related stuff */
 #include <asm/uaccess.h>
@@ -21,36 +29,95 @@
 #define SYSWIDE_MONITORING_STOPPING -2
 #define SYSWIDE_MONITORING_STARTING -1
 
+/*
+ * Maximum number of system-wide sessions running at once.
+ * Sessions that monitor the same CPU time-share its PMU.
+ */
+#define SYSWIDE_MAX_SESSIONS	4
+
 
 /*
- * Per-CPU structure to hold the necessary
- * information to implement the system-wide
- * monitoring mode
+ * Per-CPU state of a system-wide session
  */
 typedef struct {
 	core_experiment_set_t pmc_config_set;
 	core_experiment_t* cur_config;
-	uint_t virt_counter_mask;
+	core_experiment_state_t cur_state;	/* Counter state associated with cur_config */
 	uint64_t pmc_values[MAX_LL_EXPS];
-	pmc_sample_t last_sample;
+	pmc_sample_v2_t last_sample;
+	uint64_t last_sample_time;	/* pmc_sample_clock() value when the previous sample was collected */
+	uint64_t time_counting;		/* Time the session's events were counted since the previous sample */
+	/* Accounting: sum of time_enabled/time_running of the samples generated so far */
+	uint64_t total_enabled;
+	uint64_t total_running;
+	uint64_t nr_samples;
+	unsigned char active;		/* The CPU belongs to the CPU set of the session */
+} cpu_session_t;
+
+/*
+ * Per-CPU structure to hold the necessary
+ * information to implement the system-wide
+ * monitoring mode
+ */
+typedef struct {
+	cpu_session_t sessions[SYSWIDE_MAX_SESSIONS];
+	int cur_session;		/* Session whose events are on the PMU (-1 if none) */
+	core_experiment_t* pmu_config;	/* Event set programmed on the PMU (NULL if cleared) */
+	uint64_t count_start;		/* pmc_sample_clock() value when the counters were last started */
+	struct hrtimer timer;		/* Pinned timer that samples this CPU */
+	ktime_t next_sample;		/* Timer expiry saved while the CPU is idle */
+	unsigned char active;		/* The CPU belongs to the CPU set of some session */
+	unsigned char counting;		/* The counters are running */
+	unsigned char paused;		/* Counters and timer stopped (all sessions on this CPU are paused) */
+	unsigned char idle;		/* Timer cancelled because the idle task is running */
+#ifdef DEBUG
+	uint64_t nr_timer_fires;	/* Statistics on the latency of the timer callback */
+	uint64_t timer_latency_sum;
+	uint64_t timer_latency_max;
+#endif
 	spinlock_t lock;
 } cpu_syswide_t;
 
-/* Global structure for the system-wide monitoring mode */
+/* A system-wide monitoring session */
 typedef struct {
-	/* PID of the monitor (-1 means syswide disabled) */
-	volatile pid_t syswide_monitor;
-	/* Buffer shared between monitor and kernel timer.
-		It must be big enough to store a sample per-CPU */
+	/* PID of the monitor (SYSWIDE_MONITORING_DISABLED if the slot is free) */
+	volatile pid_t monitor;
+	/* Buffer shared between monitor and the per-CPU timers.
+		Each CPU pushes its samples into its own ring */
 	pmc_samples_buffer_t* pmc_samples_buffer;
-	/* kernel timer to engage collection of PMC events */
-	struct timer_list syswide_timer;
+	uint64_t period;		/* Sampling period in ns (inherited from monitor thread) */
+	unsigned int paused;
+	uint_t virt_counter_mask;
+	struct cpumask cpus;		/* CPUs to monitor */
+	/* If set, count only while tasks of this cgroup (perf_event hierarchy) run */
+	struct cgroup_subsys_state* cgroup_css;
+} syswide_session_t;
+
+/* Global structure for the system-wide monitoring mode */
+typedef struct {
+	syswide_session_t sessions[SYSWIDE_MAX_SESSIONS];
+	volatile int nr_sessions;	/* Sessions up and running */
+	/*
+	 * Period of the per-CPU timers in ns: the shortest sampling period
+	 * among sessions. This is also the time slice of a session on the
+	 * PMU when several sessions share a CPU.
+	 */
+	uint64_t syswide_timer_period;
+	/* The estimation module serves virtual counters to one session only */
+	int virt_session;
+	/*
+	 * Settings ("syswide_cpus", "syswide_cgroup") for the next session
+	 * started by process "next_owner"
+	 */
+	pid_t next_owner;
+	struct cpumask next_cpus;
+	struct cgroup_subsys_state* next_cgroup_css;
 	/* To serialize accesses the various fields.
-		Note that pmc_samples_buffer has its own spinlock
+		Note that pmc_samples_buffer is made up of lock-free per-CPU rings
 	*/
-	unsigned long syswide_timer_period; /* Inherit from monitor thread */
-	unsigned int pause_syswide_monitor; /* Global pause flag */
 	spinlock_t lock;
+	/* Serializes start/stop/pause/resume requests, which send IPIs */
+	struct mutex session_mutex;
 } syswide_ctl_t;
 
 
@@ -58,40 +125,132 @@ typedef struct {
 /* Global data
   Essential initialization to avoid races ...
 */
-syswide_ctl_t syswide_ctl= {.syswide_monitor=SYSWIDE_MONITORING_DISABLED};
+syswide_ctl_t syswide_ctl= {.nr_sessions=0};
 static DEFINE_PER_CPU(cpu_syswide_t, cpu_syswide);
 
+/* Defined in the kernel patch */
+extern struct task_struct* find_process_by_pid(pid_t pid);
 
 /*
- * Read performance counters and update statistics
- * on the current CPU
+ * The cgroup mode relies on the perf_event controller,
+ * just like the cgroup mode of perf.
+ */
+#ifdef CONFIG_CGROUP_PERF
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,12,0)
+#define task_perf_css(p) task_subsys_state((p),perf_subsys_id)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#define task_perf_css(p) task_css((p),perf_subsys_id)
+#else
+#define task_perf_css(p) task_css((p),perf_event_cgrp_id)
+#endif
+#endif
+
+/*
+ * Returns true if the events of task "p" must be counted for session
+ * "idx": either all tasks are monitored or "p" belongs to the cgroup
+ * selected for the session. Child cgroups are not included.
+ */
+static inline int syswide_task_tracked(struct task_struct* p, int idx)
+{
+#ifdef CONFIG_CGROUP_PERF
+	struct cgroup_subsys_state* css=syswide_ctl.sessions[idx].cgroup_css;
+	int tracked;
+
+	if (!css)
+		return 1;
+
+	rcu_read_lock();
+	tracked=(task_perf_css(p)==css);
+	rcu_read_unlock();
+	return tracked;
+#else
+	return 1;
+#endif
+}
+
+/* CPU hotplug support */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+static enum cpuhp_state syswide_hp_state;
+static int syswide_cpu_online(unsigned int cpu);
+static int syswide_cpu_offline(unsigned int cpu);
+#else
+static int syswide_cpu_notifier(struct notifier_block *b, unsigned long action, void *data);
+
+static struct notifier_block syswide_cpu_nb = {
+	.notifier_call = syswide_cpu_notifier,
+};
+#endif
+
+/* Returns true if session "idx" may use the PMU of this CPU */
+static inline int session_runnable(cpu_syswide_t* cpudata, int idx)
+{
+	return cpudata->sessions[idx].active && !syswide_ctl.sessions[idx].paused;
+}
+
+/*
+ * Returns the session that gets the PMU after session "idx"
+ * (round robin) or -1 if no session can use it.
+ * "idx" is returned if it is the only runnable session.
+ */
+static int next_runnable_session(cpu_syswide_t* cpudata, int idx)
+{
+	int i,next;
+
+	for (i=1; i<=SYSWIDE_MAX_SESSIONS; i++) {
+		next=(idx+i)%SYSWIDE_MAX_SESSIONS;
+		if (session_runnable(cpudata,next))
+			return next;
+	}
+	return -1;
+}
+
+/* Returns true if the estimation module serves session "idx" */
+static inline int session_uses_virt_counters(int idx)
+{
+	return syswide_ctl.virt_session==idx && syswide_ctl.sessions[idx].virt_counter_mask;
+}
+
+
+/*
+ * Read performance counters and update the statistics of
+ * the session on the PMU of the current CPU. If "stop" is non-zero,
+ * the counters are left stopped.
  */
-static int __refresh_counts_cpu(cpu_syswide_t* cpudata)
+static int __refresh_counts_cpu(cpu_syswide_t* cpudata, int stop)
 {
-	core_experiment_t* core_experiment=cpudata->cur_config;
+	cpu_session_t* cs;
+	core_experiment_t* core_experiment;
 	int i=0;
 	uint64_t last_value;
+	int vidx=syswide_ctl.virt_session;
+
+	if (vidx>=0 && cpudata->sessions[vidx].active && session_uses_virt_counters(vidx))
+		mm_on_syswide_refresh_monitor(smp_processor_id(),syswide_ctl.sessions[vidx].virt_counter_mask);
+
+	if (cpudata->cur_session<0)
+		return 1;
+
+	cs=&cpudata->sessions[cpudata->cur_session];
+	core_experiment=cs->cur_config;
+
+	/* Nothing to do if no counters have been configured (or they are stopped) */
+	if (core_experiment && cpudata->counting) {
+		invalidate_pmu_owner();
 
-	/* Nothing to do if no counters have been configured */
-	if (core_experiment) {
 		for(i=0; i<core_experiment->size; i++) {
 			low_level_exp* lle = &core_experiment->array[i];
 			/* Gather PMC values (stop,read and reset) */
 			__stop_count(lle);
-			__read_count(lle);
-			__restart_count(lle);
+			last_value = __read_value(lle);
+			if (!stop)
+				__restart_count(lle);
 
-			/* get Last value */
-			last_value = __get_last_value(lle);
-			cpudata->pmc_values[i]+=last_value;
+			cs->pmc_values[i]+=last_value;
 		}
 
 		reset_overflow_status();
 	}
 
-	if (cpudata->virt_counter_mask)
-		mm_on_syswide_refresh_monitor(smp_processor_id(),cpudata->virt_counter_mask);
-
 	return !core_experiment;
 }
 
@@ -107,159 +266,319 @@ static int refresh_counts_cpu(cpu_syswide_t* cpudata)
 
 	/* Grab the spinlock to avoid races when updating "pmc_values" */
 	spin_lock_irqsave(&cpudata->lock,flags);
-	retval=__refresh_counts_cpu(cpudata);
+	retval=__refresh_counts_cpu(cpudata,0);
 	spin_unlock_irqrestore(&cpudata->lock,flags);
 	return retval;
 }
 
+/*
+ * Start/stop counting the events of the session on the PMU
+ * of the current CPU (must be invoked with cpudata->lock held)
+ */
+static void __start_counting_cpu(cpu_syswide_t* cpudata)
+{
+	cpu_session_t* cs=&cpudata->sessions[cpudata->cur_session];
+
+	if (cs->cur_config)
+		mc_restart_all_counters(cs->cur_config,&cs->cur_state);
+	cpudata->pmu_config=cs->cur_config;
+	cpudata->count_start=pmc_sample_clock();
+	cpudata->counting=1;
+}
+
+static void __stop_counting_cpu(cpu_syswide_t* cpudata)
+{
+	/* Gather the counts first */
+	__refresh_counts_cpu(cpudata,1);
+	cpudata->sessions[cpudata->cur_session].time_counting+=pmc_sample_clock()-cpudata->count_start;
+	cpudata->counting=0;
+}
 
 /*
- * Gather PMC and virtual-counter samples
- * on the current CPU
+ * Hand the PMU of the current CPU over to session "next"
+ * (-1 leaves the PMU unused). Must be invoked with cpudata->lock held.
  */
-static void syswide_monitoring_sample_cpu(void* dummy)
+static void __switch_session_cpu(cpu_syswide_t* cpudata, int next, int cpu)
 {
+	if (cpudata->counting)
+		__stop_counting_cpu(cpudata);
+
+	/*
+	 * Clear all counters in the platform, unless the same event set
+	 * stays on the PMU (same session and no multiplexing switch).
+	 * In that case the counters just have to be restarted.
+	 */
+	if (next<0 || next!=cpudata->cur_session ||
+	    cpudata->sessions[next].cur_config!=cpudata->pmu_config) {
+		mc_clear_all_platform_counters(get_pmu_props_coretype(get_coretype_cpu(cpu)));
+		cpudata->pmu_config=NULL;
+	}
+	cpudata->cur_session=next;
 
-	int cpu=smp_processor_id();
-	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
-	core_experiment_t* core_exp=cur->cur_config;
+	if (next>=0 && !cpudata->paused && syswide_task_tracked(current,next))
+		__start_counting_cpu(cpudata);
+}
+
+/*
+ * Build a sample with the counts gathered for session "idx" on the
+ * current CPU and select the next event set of the session
+ * (multiplexation). The counters of the session must be stopped.
+ * Must be invoked with cpudata->lock held.
+ */
+static pmc_sample_v2_t* __sample_session_cpu(cpu_syswide_t* cpudata, int idx, int cpu, uint64_t now)
+{
+	cpu_session_t* cs=&cpudata->sessions[idx];
+	core_experiment_t* core_exp=cs->cur_config;
 	core_experiment_t* next=NULL;
-	int cur_coretype=get_coretype_cpu(cpu);
-	pmc_sample_t* sample=&cur->last_sample;
-	unsigned long flags=0;
+	pmc_sample_v2_t* sample=&cs->last_sample;
 	int i=0;
 
-	/* Grab the spinlock to avoid races when updating "pmc_values" */
-	spin_lock_irqsave(&cur->lock,flags);
-
-	__refresh_counts_cpu(cur);
-
 	if (core_exp) {
 		/* Copy and clear samples in prof */
 		for(i=0; i<MAX_LL_EXPS; i++) {
-			cur->last_sample.pmc_counts[i]=cur->pmc_values[i];
-			cur->pmc_values[i]=0;
+			sample->pmc_counts[i]=cs->pmc_values[i];
+			cs->pmc_values[i]=0;
 		}
 	}
 
 	/* Generate sample ... */
-	sample->coretype=cur_coretype;
+	sample->coretype=get_coretype_cpu(cpu);
 	sample->exp_idx=core_exp?core_exp->exp_idx:0;
 	sample->pmc_mask=core_exp?core_exp->used_pmcs:0;
 	sample->nr_counts=core_exp?core_exp->size:0;
 	sample->virt_mask=0;
 	sample->nr_virt_counts=0;
 	sample->pid=cpu; /* In syswide mode -> this field is reused to store the CPU */
-
+	sample->tgid=-1;
+	sample->timestamp=now;
+	sample->time_enabled=now-cs->last_sample_time;
+	/*
+	 * The session only counts while its events are on the PMU, which
+	 * excludes the time slices of other sessions, pauses and the time
+	 * the cgroup was not running.
+	 */
+	sample->time_running=cs->time_counting;
+	cs->last_sample_time=now;
+	cs->time_counting=0;
+
+	/* Keep track of the share of the PMU each session gets */
+	cs->total_enabled+=sample->time_enabled;
+	cs->total_running+=sample->time_running;
+	cs->nr_samples++;
 
 	/* Call the estimation module if the user requested virtual counters */
-	if (cur->virt_counter_mask)
-		mm_on_syswide_dump_virtual_counters(cpu,cur->virt_counter_mask,sample);
-
-	/* Engage multiplexation */
-	next=get_next_experiment_in_set(&cur->pmc_config_set);
-
-	if (next && cur->cur_config!=next) {
-		/* Clear all counters in the platform */
-		mc_clear_all_platform_counters(get_pmu_props_coretype(cur_coretype));
-		/* Update experiment set */
-		cur->cur_config=next;
+	if (session_uses_virt_counters(idx))
+		mm_on_syswide_dump_virtual_counters(cpu,syswide_ctl.sessions[idx].virt_counter_mask,sample);
 
-		/* Reconfigure counters as if it were the first time*/
-		mc_restart_all_counters(cur->cur_config);
-	}
+	/* Engage multiplexation (takes effect when the session gets the PMU again) */
+	mux_account_sample(&cs->pmc_config_set,sample->pmc_counts,sample->nr_counts,sample->time_running);
+	next=get_next_experiment_in_set(&cs->pmc_config_set);
 
+	if (next)
+		cs->cur_config=next;
 
-	spin_unlock_irqrestore(&cur->lock,flags);
+	return sample;
 }
 
-/* Main timer function for the syswide-monitoring mode */
-static void fire_syswide_timer(unsigned long data)
+
+/*
+ * Gather PMC and virtual-counter samples on the current CPU.
+ * The session whose events were on the PMU gets a sample if its
+ * sampling period is over. Then the PMU is handed over to the next
+ * session on this CPU (time sharing).
+ */
+static void syswide_monitoring_sample_cpu(cpu_syswide_t* cur, int cpu)
 {
-	cpu_syswide_t* cur=NULL;
-	unsigned long flags;
-	int cpu=0;
+	int idx;
+	int next;
+	cpu_session_t* cs;
+	syswide_session_t* session;
+	pmc_samples_buffer_t* sbuf;
+	pmc_sample_v2_t* sample;
+	unsigned long flags=0;
+	uint64_t now;
 
-	if (!syswide_monitoring_enabled())
-		return;
+	/* Grab the spinlock to avoid races when updating "pmc_values" */
+	spin_lock_irqsave(&cur->lock,flags);
 
-	/* Generate per-cpu samples in a distributed way */
-	on_each_cpu(syswide_monitoring_sample_cpu, NULL, 1);
+	if ((idx=cur->cur_session)<0)
+		goto out_unlock;
 
-	/* Grab the global lock */
-	spin_lock_irqsave(&syswide_ctl.lock,flags);
+	cs=&cur->sessions[idx];
+	session=&syswide_ctl.sessions[idx];
 
-	if (!syswide_ctl.pause_syswide_monitor && syswide_monitoring_enabled() &&  syswide_ctl.pmc_samples_buffer) {
-		spin_lock(&syswide_ctl.pmc_samples_buffer->lock);
+	if (cur->counting)
+		__stop_counting_cpu(cur);
 
-		/* Dump the various samples */
-		for_each_online_cpu(cpu) {
-			cur=&per_cpu(cpu_syswide, cpu);
-			__push_sample_cbuffer_nowakeup(syswide_ctl.pmc_samples_buffer,&cur->last_sample);
-		}
-		/* Wake up monitor ... */
-		__wake_up_monitor_program(syswide_ctl.pmc_samples_buffer);
-		spin_unlock(&syswide_ctl.pmc_samples_buffer->lock);
-	}
+	now=pmc_sample_clock();
+	next=next_runnable_session(cur,idx);
 
-	if (syswide_monitoring_enabled())
-		mod_timer( &syswide_ctl.syswide_timer, jiffies + syswide_ctl.syswide_timer_period);
+	/*
+	 * Sample the session if its period is (almost) over. With a single
+	 * session on the CPU, a sample is collected every time the timer fires.
+	 */
+	if (next==idx || next<0 ||
+	    now-cs->last_sample_time+syswide_ctl.syswide_timer_period/2>=session->period) {
+		sample=__sample_session_cpu(cur,idx,cpu,now);
+		sbuf=ACCESS_ONCE(session->pmc_samples_buffer);
 
-	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
-}
+		/* Dump the sample into the ring of this CPU (interrupts are disabled here) */
+		if (sbuf)
+			__push_sample_cbuffer(sbuf,sample,NULL);
+	}
 
+	/* Reconfigure counters (new event set or new session) */
+	__switch_session_cpu(cur,next,cpu);
+out_unlock:
+	spin_unlock_irqrestore(&cur->lock,flags);
+}
 
-/* Free up the structure that stores PMC configurations for a CPU */
-static inline void free_cpu_syswide_data(cpu_syswide_t* data)
+/*
+ * Per-CPU timer function for the syswide-monitoring mode.
+ * Each CPU samples itself and pushes the samples into the rings
+ * of the sessions' buffers, so no IPIs or global locks are needed.
+ * Each monitor merges the samples of the various CPUs by timestamp.
+ */
+static enum hrtimer_restart fire_syswide_timer(struct hrtimer* timer)
 {
-	free_experiment_set(&data->pmc_config_set);
+	cpu_syswide_t* cur=container_of(timer,cpu_syswide_t,timer);
+	int cpu=smp_processor_id();
+#ifdef DEBUG
+	uint64_t latency=ktime_to_ns(ktime_sub(hrtimer_cb_get_time(timer),hrtimer_get_expires(timer)));
+
+	cur->nr_timer_fires++;
+	cur->timer_latency_sum+=latency;
+	if (latency>cur->timer_latency_max)
+		cur->timer_latency_max=latency;
+#endif
+
+	/* Being stopped */
+	if (!cur->active)
+		return HRTIMER_NORESTART;
+
+	syswide_monitoring_sample_cpu(cur,cpu);
+
+	hrtimer_forward_now(timer,ns_to_ktime(syswide_ctl.syswide_timer_period));
+	return HRTIMER_RESTART;
 }
 
-/* Reset per-CPU structure for system-wide monitoring */
-static inline void reset_cpu_syswide_data(cpu_syswide_t* data, int init)
+
+/* Reset the per-CPU state of a session */
+static inline void reset_cpu_session_data(cpu_session_t* cs, int init)
 {
 	int i=0;
 
 	/* Empty experiment set ... */
 	if (init)
-		init_core_experiment_set_t(&data->pmc_config_set);
+		init_core_experiment_set_t(&cs->pmc_config_set);
 	else
-		free_experiment_set(&data->pmc_config_set);
-
-	if (init)
-		spin_lock_init(&data->lock);
+		free_experiment_set(&cs->pmc_config_set);
 
 	for(i=0; i<MAX_LL_EXPS; i++)
-		data->pmc_values[i]=0;
+		cs->pmc_values[i]=0;
 
 	/* Set NULL (no perf counters) */
-	data->cur_config=NULL;
+	cs->cur_config=NULL;
+	init_core_experiment_state_t(&cs->cur_state);
 
-	data->virt_counter_mask=0;	// No virtual counters selected so far
+	cs->active=0;
+	cs->time_counting=0;
+	cs->total_enabled=0;
+	cs->total_running=0;
+	cs->nr_samples=0;
 
 	/* Clear sample */
-	memset(&data->last_sample,0,sizeof(pmc_sample_t));
+	memset(&cs->last_sample,0,sizeof(pmc_sample_v2_t));
+}
+
+/* Free up the structures that store PMC configurations for a CPU */
+static inline void free_cpu_syswide_data(cpu_syswide_t* data)
+{
+	int i;
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++)
+		free_experiment_set(&data->sessions[i].pmc_config_set);
+}
+
+/* Reset per-CPU structure for system-wide monitoring */
+static inline void reset_cpu_syswide_data(cpu_syswide_t* data, int init)
+{
+	int i=0;
+
+	if (init)
+		spin_lock_init(&data->lock);
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++)
+		reset_cpu_session_data(&data->sessions[i],init);
+
+	data->cur_session=-1;
+	data->pmu_config=NULL;
+	data->active=0;
+	data->counting=0;
+	data->paused=0;
+	data->idle=0;
 }
 
-/* Setup PMC and virtual-counter configuration for a CPU */
-static int setup_cpu_syswide_data(cpu_syswide_t* data,
-                                  core_experiment_set_t* pmc_config_set,
-                                  uint_t virt_counter_mask)
+/*
+ * Setup the PMC configuration of a session for a CPU.
+ * The CPU shares the monitor's PMC experiments (no copies are made).
+ */
+static int setup_cpu_session_data(cpu_session_t* cs,
+                                  core_experiment_set_t* pmc_config_set)
 {
-	reset_cpu_syswide_data(data,0);
+	reset_cpu_session_data(cs,0);
 
-	if (clone_core_experiment_set_t(&data->pmc_config_set,pmc_config_set))
+	if (clone_core_experiment_set_t(&cs->pmc_config_set,pmc_config_set))
 		return -ENOMEM;
 
 	/* Set up cur experiment */
-	data->cur_config=get_cur_experiment_in_set(&data->pmc_config_set);
-
-	/* Inherit virtual counter mask as well */
-	data->virt_counter_mask=virt_counter_mask;
+	cs->cur_config=get_cur_experiment_in_set(&cs->pmc_config_set);
 
 	return 0;
 }
 
+/* Reset the settings for the next session to the defaults */
+static inline void reset_next_session_settings(void)
+{
+	syswide_ctl.next_owner=-1;
+	cpumask_copy(&syswide_ctl.next_cpus,cpu_possible_mask);
+	syswide_ctl.next_cgroup_css=NULL;
+}
+
+/*
+ * Recompute the period of the per-CPU timers
+ * (must be invoked with syswide_ctl.lock held)
+ */
+static void __update_timer_period(void)
+{
+	uint64_t period=0;
+	int i;
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++) {
+		syswide_session_t* session=&syswide_ctl.sessions[i];
+
+		if (session->monitor!=SYSWIDE_MONITORING_DISABLED &&
+		    (!period || session->period<period))
+			period=session->period;
+	}
+
+	syswide_ctl.syswide_timer_period=period?period:NSEC_PER_SEC;
+}
+
+/*
+ * Return the session of monitor "pid" or -1 if there is none
+ * (must be invoked with syswide_ctl.lock held)
+ */
+static int __find_session(pid_t pid)
+{
+	int i;
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++)
+		if (syswide_ctl.sessions[i].monitor==pid)
+			return i;
+	return -1;
+}
+
 
 /*
  * Global initialization function for system-wide mode
@@ -269,25 +588,49 @@ int syswide_monitoring_init(void)
 {
 
 	int cpu;
+	int i;
 	cpu_syswide_t* cur;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	int ret;
+#endif
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++) {
+		syswide_session_t* session=&syswide_ctl.sessions[i];
+
+		session->monitor=SYSWIDE_MONITORING_DISABLED;
+		session->pmc_samples_buffer=NULL;
+		session->period=NSEC_PER_SEC;
+		session->paused=0;
+		session->virt_counter_mask=0;
+		cpumask_clear(&session->cpus);
+		session->cgroup_css=NULL;
+	}
 
-	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_DISABLED;
-	syswide_ctl.pmc_samples_buffer=NULL;
+	syswide_ctl.nr_sessions=0;
+	syswide_ctl.syswide_timer_period=NSEC_PER_SEC;
+	syswide_ctl.virt_session=-1;
+	reset_next_session_settings();
 	spin_lock_init(&syswide_ctl.lock);
-
-	/* Initialize timer fields but do not activate it yet */
-	init_timer(&syswide_ctl.syswide_timer);
-	syswide_ctl.syswide_timer.expires=0; /* Any default value will do here */
-	syswide_ctl.syswide_timer.data=0;
-	syswide_ctl.syswide_timer.function=fire_syswide_timer;
-	syswide_ctl.syswide_timer_period=HZ;
-	syswide_ctl.pause_syswide_monitor=0; /* Enabled by default */
+	mutex_init(&syswide_ctl.session_mutex);
 
 	for_each_possible_cpu(cpu) {
 		cur=&per_cpu(cpu_syswide, cpu);
 		reset_cpu_syswide_data(cur,1);
+		/* Initialize per-CPU timers but do not activate them yet */
+		hrtimer_init(&cur->timer,CLOCK_MONOTONIC,HRTIMER_MODE_ABS);
+		cur->timer.function=fire_syswide_timer;
 	}
 
+	/* Follow CPUs going offline/online during a session */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	ret=cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN,"pmctrack/syswide:online",
+	                              syswide_cpu_online,syswide_cpu_offline);
+	if (ret<0)
+		return ret;
+	syswide_hp_state=ret;
+#else
+	register_cpu_notifier(&syswide_cpu_nb);
+#endif
 	return 0;
 }
 
@@ -300,25 +643,62 @@ void syswide_monitoring_cleanup(void)
 	int cpu;
 	cpu_syswide_t* cur;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	cpuhp_remove_state_nocalls(syswide_hp_state);
+#else
+	unregister_cpu_notifier(&syswide_cpu_nb);
+#endif
+
 	for_each_possible_cpu(cpu) {
 		cur=&per_cpu(cpu_syswide, cpu);
+		hrtimer_cancel(&cur->timer);
 		free_cpu_syswide_data(cur);
 	}
+
+	/* Drop the cgroup selected for a session that was never started */
+	syswide_monitoring_set_cgroup(0);
 }
 
 /* Return nozero if syswide_monitoring was actually disabled */
 int syswide_monitoring_enabled(void)
 {
-	return syswide_ctl.syswide_monitor>SYSWIDE_MONITORING_STARTING;
+	return syswide_ctl.nr_sessions>0;
 }
 
 /*
  *  This function gets invoked on every context switch
  *  in when syswide monitoring is enabled.
+ *
+ *  When the CPU goes idle its sampling timer is cancelled,
+ *  so that idle CPUs are not woken up just to collect
+ *  a sample. The counters keep running, so nothing is lost.
  */
 int syswide_monitoring_switch_in(int cpu)
 {
-	/* Do nothing on switch in for now */
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+
+	/* Leave the PMCs to the per-thread modes on CPUs not monitored */
+	if (!cur->active)
+		return 1;
+
+	if (cur->paused)
+		return 0;
+
+	/* cgroup mode: count while the tasks of the cgroup run */
+	if (!cur->counting && cur->cur_session>=0 &&
+	    syswide_task_tracked(current,cur->cur_session)) {
+		spin_lock(&cur->lock);
+		__start_counting_cpu(cur);
+		spin_unlock(&cur->lock);
+	}
+
+	if (is_idle_task(current) && !cur->idle) {
+		cur->next_sample=hrtimer_get_expires(&cur->timer);
+		/* The timer is pinned, so its callback cannot be running now */
+		hrtimer_try_to_cancel(&cur->timer);
+		cur->idle=1;
+	}
+
 	return 0;
 }
 
@@ -334,91 +714,281 @@ int syswide_monitoring_switch_in(int cpu)
 int syswide_monitoring_switch_out(int cpu)
 {
 	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	int retval;
 
-	if (!syswide_monitoring_enabled())
+	if (!syswide_monitoring_enabled() || !cur->active)
 		return 1;
 
-	return refresh_counts_cpu(cur);
+	/* Counters are stopped */
+	if (cur->paused)
+		return 0;
+
+	if (cur->counting && syswide_ctl.sessions[cur->cur_session].cgroup_css) {
+		/* cgroup mode: the next task may not belong to the cgroup */
+		spin_lock(&cur->lock);
+		__stop_counting_cpu(cur);
+		retval=!cur->sessions[cur->cur_session].cur_config;
+		spin_unlock(&cur->lock);
+	} else
+		retval=refresh_counts_cpu(cur);
+
+	/*
+	 * The CPU leaves the idle state: rearm the timer. If the
+	 * sampling period expired while idle, the timer fires right away
+	 * and a single sample covers the whole idle period.
+	 */
+	if (cur->idle) {
+		cur->idle=0;
+		pmct_hrtimer_start_pinned(&cur->timer,cur->next_sample);
+	}
+
+	return retval;
 }
 
-/* Returns true if "p" is current syswide monitor process */
+/* Returns true if "p" is the monitor process of a syswide session */
 int is_syswide_monitor(struct task_struct* p)
 {
-	return syswide_ctl.syswide_monitor==p->pid;
+	int i;
+
+	if (!syswide_monitoring_enabled())
+		return 0;
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++)
+		if (syswide_ctl.sessions[i].monitor==p->pid)
+			return 1;
+	return 0;
 }
 
-/* Start syswide monitoring on this cpu */
-static void syswide_monitoring_start_cpu(void* dummy)
+/*
+ * Stop the counters and the timer of the current CPU if none of
+ * its sessions can use the PMU (they are all paused), and restart
+ * them otherwise. If the session on the PMU was paused or stopped,
+ * the PMU is handed over to the next session.
+ * Must be invoked with cpudata->lock held.
+ */
+static void __update_cpu_state(cpu_syswide_t* cur, int cpu)
 {
+	int next;
+
+	if (!cur->active)
+		return;
+
+	if (cur->cur_session>=0 && session_runnable(cur,cur->cur_session))
+		next=cur->cur_session;
+	else
+		next=next_runnable_session(cur,cur->cur_session);
+
+	if (next<0) {
+		if (!cur->paused) {
+			/* Counts collected so far are kept for the next sample */
+			if (cur->counting)
+				__stop_counting_cpu(cur);
+			cur->paused=1;
+			/* The timer is pinned, so its callback cannot be running now */
+			hrtimer_try_to_cancel(&cur->timer);
+			cur->idle=0;
+		}
+		return;
+	}
+
+	if (cur->paused) {
+		cur->paused=0;
+		__switch_session_cpu(cur,next,cpu);
+		cur->next_sample=ktime_add_ns(ktime_get(),syswide_ctl.syswide_timer_period);
+
+		/* The IPI may have interrupted the idle task: do not wake up the CPU again */
+		if (is_idle_task(current))
+			cur->idle=1;
+		else
+			hrtimer_start(&cur->timer,cur->next_sample,HRTIMER_MODE_ABS_PINNED);
+	} else if (next!=cur->cur_session)
+		__switch_session_cpu(cur,next,cpu);
+}
 
+/* Start session "arg" on this cpu */
+static void syswide_monitoring_start_cpu(void* arg)
+{
+	int idx=(long)arg;
 	int cpu=smp_processor_id();
 	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	cpu_session_t* cs=&cur->sessions[idx];
+	unsigned long flags=0;
 
-	/* Reprogram all PMCs safely from here */
-	if (cur->cur_config) {
-		mc_clear_all_counters(cur->cur_config);
-		mc_restart_all_counters(cur->cur_config);
+	spin_lock_irqsave(&cur->lock,flags);
+
+	cs->last_sample_time=pmc_sample_clock();
+	cs->time_counting=0;
+	cs->total_enabled=0;
+	cs->total_running=0;
+	cs->nr_samples=0;
+	cs->active=1;
+
+	if (!cur->active) {
+		/* First session on this CPU: the timer is armed below */
+		cur->cur_session=-1;
+		cur->pmu_config=NULL;
+		cur->counting=0;
+		cur->idle=0;
+		cur->paused=1;
+#ifdef DEBUG
+		cur->nr_timer_fires=cur->timer_latency_sum=cur->timer_latency_max=0;
+#endif
+		/* This CPU samples itself from now on */
+		cur->active=1;
 	}
 
+	/* Reprogram all PMCs safely from here */
+	__update_cpu_state(cur,cpu);
+
+	spin_unlock_irqrestore(&cur->lock,flags);
+
 	/* Tell the monitoring module to start syswide monitoring */
-	if (cur->virt_counter_mask)
-		mm_on_syswide_start_monitor(cpu, cur->virt_counter_mask);
+	if (session_uses_virt_counters(idx))
+		mm_on_syswide_start_monitor(cpu, syswide_ctl.sessions[idx].virt_counter_mask);
 }
 
-/* Stop syswide monitoring on this cpu */
-static void syswide_monitoring_stop_cpu(void* dummy)
+/* Stop session "arg" on this cpu */
+static void syswide_monitoring_stop_cpu(void* arg)
 {
-
+	int idx=(long)arg;
 	int cpu=smp_processor_id();
-	cpu_syswide_t* cur=&per_cpu(cpu_syswide, smp_processor_id());
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	cpu_session_t* cs=&cur->sessions[idx];
+	unsigned long flags=0;
+	int i;
+
+	spin_lock_irqsave(&cur->lock,flags);
+
+	if (!cs->active) {
+		spin_unlock_irqrestore(&cur->lock,flags);
+		return;
+	}
+
+	if (cur->cur_session==idx) {
+		if (cur->counting)
+			__stop_counting_cpu(cur);
+		/* Clear PMCs */
+		mc_clear_all_platform_counters(get_pmu_props_coretype(get_coretype_cpu(cpu)));
+		cur->pmu_config=NULL;
+		cur->cur_session=-1;
+	}
 
-	/* Clear PMCs */
-	if (cur->cur_config)
-		mc_clear_all_counters(cur->cur_config);
+	cs->active=0;
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS && !cur->sessions[i].active; i++)
+		;
+
+	if (i==SYSWIDE_MAX_SESSIONS) {
+		/* Make sure the timer is not rearmed when leaving the idle state */
+		cur->active=0;
+		cur->counting=0;
+		cur->idle=0;
+		cur->paused=0;
+		hrtimer_try_to_cancel(&cur->timer);
+
+#ifdef DEBUG
+		if (cur->nr_timer_fires)
+			printk(KERN_INFO "CPU %d: %llu syswide timer callbacks, latency avg=%lluns max=%lluns\n",
+			       cpu,cur->nr_timer_fires,div64_u64(cur->timer_latency_sum,cur->nr_timer_fires),
+			       cur->timer_latency_max);
+#endif
+	} else {
+		/* Other sessions keep using the PMU */
+		__update_cpu_state(cur,cpu);
+	}
+
+	spin_unlock_irqrestore(&cur->lock,flags);
 
 	/* Tell the monitoring module to stop */
-	if (cur->virt_counter_mask)
-		mm_on_syswide_stop_monitor(cpu, cur->virt_counter_mask);
+	if (session_uses_virt_counters(idx))
+		mm_on_syswide_stop_monitor(cpu, syswide_ctl.sessions[idx].virt_counter_mask);
+}
+
+/* Stop and restart counters on this CPU after a session was paused or resumed */
+static void syswide_monitoring_update_cpu(void* dummy)
+{
+	int cpu=smp_processor_id();
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	unsigned long flags=0;
+
+	spin_lock_irqsave(&cur->lock,flags);
+	__update_cpu_state(cur,cpu);
+	spin_unlock_irqrestore(&cur->lock,flags);
 }
 
-/* Start syswide_monitoring */
+/*
+ * Start a syswide_monitoring session for the current process.
+ * Several sessions (with their own buffer, events, sampling period,
+ * CPU set and cgroup) may be active at once. Sessions monitoring the
+ * same CPU time-share its PMU.
+ */
 int syswide_monitoring_start(void)
 {
 	int retval=0;
 	unsigned long flags=0;
 	int coretype=0;
 	int cpu;
+	int idx;
 	struct task_struct* p=current;
 	pmon_prof_t* prof=(pmon_prof_t*)p->pmc;
 	cpu_syswide_t* cur;
 	core_experiment_t* experiment=NULL;
+	syswide_session_t* session=NULL;
 
 	if (!prof)
 		return -EPERM;
 
+	mutex_lock(&syswide_ctl.session_mutex);
+	/* Keep the set of online CPUs stable */
+	get_online_cpus();
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 
-	/* Make sure system wide is not already in use */
-	if (syswide_ctl.syswide_monitor!=SYSWIDE_MONITORING_DISABLED) {
+	/* A monitor may only run a session at a time */
+	if (__find_session(p->pid)>=0) {
 		retval=-EBUSY;
 		printk(KERN_INFO "Attempting to enable system-wide mode while active\n");
 		goto exit_unlock;
 	}
 
-	/* Inherit fields from monitor process */
-	syswide_ctl.syswide_timer_period=prof->pmc_jiffies_interval;
-	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_STARTING;
-	smp_mb();
+	/* Grab a free slot */
+	if ((idx=__find_session(SYSWIDE_MONITORING_DISABLED))<0) {
+		retval=-EBUSY;
+		printk(KERN_INFO "Too many system-wide sessions\n");
+		goto exit_unlock;
+	}
+
+	session=&syswide_ctl.sessions[idx];
+
+	/* Apply the settings selected by this process for its session */
+	if (syswide_ctl.next_owner==p->pid)
+		cpumask_copy(&session->cpus,&syswide_ctl.next_cpus);
+	else
+		cpumask_copy(&session->cpus,cpu_possible_mask);
+
+	/* At least one of the selected CPUs must be online */
+	if (!cpumask_intersects(&session->cpus,cpu_online_mask)) {
+		retval=-EINVAL;
+		printk(KERN_INFO "None of the CPUs selected for system-wide mode is online\n");
+		goto exit_unlock;
+	}
 
 	/* Check for the availability of system-wide virtual counters
 	   on the current CPU */
-	if (prof->virt_counter_mask &&
-	    (retval=mm_on_syswide_start_monitor(-1, prof->virt_counter_mask))) {
-		printk(KERN_INFO "Virtual counters not available in system-wide mode\n");
-		goto exit_unlock;
+	if (prof->virt_counter_mask) {
+		if (syswide_ctl.virt_session>=0) {
+			retval=-EBUSY;
+			printk(KERN_INFO "Virtual counters already in use by another system-wide session\n");
+			goto exit_unlock;
+		}
+
+		if ((retval=mm_on_syswide_start_monitor(-1, prof->virt_counter_mask))) {
+			printk(KERN_INFO "Virtual counters not available in system-wide mode\n");
+			goto exit_unlock;
+		}
 	}
+
 	/* Propagate values on each CPU ... */
-	for_each_possible_cpu(cpu) {
+	for_each_cpu(cpu,&session->cpus) {
 
 		coretype=get_coretype_cpu(cpu);
 		cur=&per_cpu(cpu_syswide, cpu);
@@ -427,7 +997,7 @@ int syswide_monitoring_start(void)
 		if (!&prof->pmcs_multiplex_cfg[coretype]) {
 			printk(KERN_INFO "No experiments were defined for this core type\n");
 			retval=-ENOENT;
-			goto exit_unlock;
+			goto exit_free;
 		}
 
 		experiment=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[coretype]);
@@ -435,108 +1005,488 @@ int syswide_monitoring_start(void)
 		if (experiment && experiment->ebs_idx!=-1) {
 			retval=-EINVAL;
 			printk(KERN_INFO "EBS can't be used in system-wide mode\n");
-			goto exit_unlock;
+			goto exit_free;
 		}
 
-		if ((retval=setup_cpu_syswide_data(cur,
-		                                   &prof->pmcs_multiplex_cfg[coretype],
-		                                   prof->virt_counter_mask))!=0) {
+		/* The slot is not active on any CPU, so no timer is using it */
+		if ((retval=setup_cpu_session_data(&cur->sessions[idx],
+		                                   &prof->pmcs_multiplex_cfg[coretype]))!=0) {
 			printk(KERN_INFO "Can't setup per-CPU syswide data\n");
-			goto exit_unlock;
+			goto exit_free;
 		}
 	}
 
+	/* Inherit fields from monitor process */
+	session->monitor=SYSWIDE_MONITORING_STARTING;
+	session->period=prof->pmc_sampling_period?prof->pmc_sampling_period:NSEC_PER_SEC;
+	session->paused=0;
+	session->virt_counter_mask=prof->virt_counter_mask;
+	if (session->virt_counter_mask)
+		syswide_ctl.virt_session=idx;
+
+	if (syswide_ctl.next_owner==p->pid) {
+		/* The reference to the cgroup is handed over to the session */
+		session->cgroup_css=syswide_ctl.next_cgroup_css;
+		reset_next_session_settings();
+	} else
+		session->cgroup_css=NULL;
+
 	/* Share buffer ... */
-	syswide_ctl.pmc_samples_buffer=prof->pmc_samples_buffer;
+	session->pmc_samples_buffer=prof->pmc_samples_buffer;
 	/* Increase ref count */
-	get_pmc_samples_buffer(syswide_ctl.pmc_samples_buffer);
+	get_pmc_samples_buffer(session->pmc_samples_buffer);
+
+	/* The timers of the CPUs pick up the new time slice when they fire */
+	__update_timer_period();
+	smp_mb();
 
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
-	/* Initialize counters on each CPU with interrupts enabled */
-	on_each_cpu(syswide_monitoring_start_cpu, NULL, 1);
+	/*
+	 * Initialize counters and start up the timer on each selected CPU.
+	 * CPUs coming online later on are handled by the hotplug callbacks.
+	 */
+	on_each_cpu_mask(&session->cpus, syswide_monitoring_start_cpu, (void*)(long)idx, 1);
 
-	/* Enable system-wide monitoring and start up timer */
+	/* Enable system-wide monitoring */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
-	syswide_ctl.syswide_monitor=p->pid;
-	syswide_ctl.syswide_timer.expires=jiffies+syswide_ctl.syswide_timer_period;
-	syswide_ctl.pause_syswide_monitor=0; /* Enabled by default */
-	add_timer(&syswide_ctl.syswide_timer);
+	session->monitor=p->pid;
+	syswide_ctl.nr_sessions++;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	put_online_cpus();
+	mutex_unlock(&syswide_ctl.session_mutex);
 
 	return 0;
+exit_free:
+	for_each_cpu(cpu,&session->cpus)
+		reset_cpu_session_data(&per_cpu(cpu_syswide, cpu).sessions[idx],0);
+	cpumask_clear(&session->cpus);
 exit_unlock:
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	put_online_cpus();
+	mutex_unlock(&syswide_ctl.session_mutex);
 	return retval; /* TODO */
 }
 
-/* Stop syswide_monitoring */
+/* Stop the syswide_monitoring session of the current process */
 int syswide_monitoring_stop(void)
 {
 	int retval=0;
 	unsigned long flags=0;
 	struct task_struct* p=current;
+	syswide_session_t* session;
+	struct cgroup_subsys_state* css;
+	pmc_samples_buffer_t* sbuf;
+	int idx;
+	int cpu;
 
+	mutex_lock(&syswide_ctl.session_mutex);
+	/* Keep the set of online CPUs stable */
+	get_online_cpus();
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 
 	/* Make sure the monitor is the only one invoking this function */
-	if (syswide_ctl.syswide_monitor!=p->pid) {
+	if ((idx=__find_session(p->pid))<0) {
 		retval=-EPERM;
 		goto exit_unlock_stop;
 	}
 
+	session=&syswide_ctl.sessions[idx];
 	/* Clean up the various fields */
-	syswide_ctl.syswide_timer_period=HZ;
-	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_STOPPING;
+	session->monitor=SYSWIDE_MONITORING_STOPPING;
+	syswide_ctl.nr_sessions--;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
-	/* Cancel timer (Blocking function)*/
-	del_timer_sync(&syswide_ctl.syswide_timer);
-	/* Stop counters across CPUs */
-	on_each_cpu(syswide_monitoring_stop_cpu, NULL, 1);
+	/*
+	 * Stop counters across CPUs. The PMU of each CPU is handed over
+	 * to the remaining sessions and the timers of CPUs left without
+	 * sessions are cancelled.
+	 */
+	on_each_cpu_mask(&session->cpus, syswide_monitoring_stop_cpu, (void*)(long)idx, 1);
+
+	/* Wait for timer callbacks still running on CPUs no longer monitored */
+	for_each_possible_cpu(cpu) {
+		cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+
+		if (!cur->active)
+			hrtimer_cancel(&cur->timer);
+	}
+
+	/* Now the timers do not use the session, drop its PMC configuration */
+	for_each_cpu(cpu,&session->cpus)
+		reset_cpu_session_data(&per_cpu(cpu_syswide, cpu).sessions[idx],0);
 
 	/* Update global status */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
-	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_DISABLED;
-	/* Now the timer is not around it's safe to release the buffer */
-	/* Decrease ref count for the shared buffer and forget it ever existed */
-	put_pmc_samples_buffer(syswide_ctl.pmc_samples_buffer);
-	syswide_ctl.pmc_samples_buffer=NULL;
+	if (syswide_ctl.virt_session==idx)
+		syswide_ctl.virt_session=-1;
+	session->monitor=SYSWIDE_MONITORING_DISABLED;
+	session->paused=0;
+	session->virt_counter_mask=0;
+	cpumask_clear(&session->cpus);
+	css=session->cgroup_css;
+	session->cgroup_css=NULL;
+	/* Forget the buffer ever existed */
+	sbuf=session->pmc_samples_buffer;
+	session->pmc_samples_buffer=NULL;
+	__update_timer_period();
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	put_online_cpus();
+	mutex_unlock(&syswide_ctl.session_mutex);
+
+	/* Now the timer is not around it's safe to release the buffer */
+	put_pmc_samples_buffer(sbuf);
 
+	if (css)
+		css_put(css);
 	return 0;
 exit_unlock_stop:
-	spin_lock_irqsave(&syswide_ctl.lock,flags);
+	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	put_online_cpus();
+	mutex_unlock(&syswide_ctl.session_mutex);
 	return retval;
 }
 
+/*
+ * Bring up system-wide monitoring on a CPU that has just come online
+ * (invoked on that CPU with interrupts disabled)
+ */
+static void syswide_monitoring_cpu_up(void* dummy)
+{
+	int cpu=smp_processor_id();
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	syswide_session_t* session;
+	pmc_samples_buffer_t* sbuf;
+	long idx;
+
+	for (idx=0; idx<SYSWIDE_MAX_SESSIONS; idx++) {
+		session=&syswide_ctl.sessions[idx];
 
-/* Pause syswide_monitoring */
-int syswide_monitoring_pause(void)
+		if (session->monitor<=SYSWIDE_MONITORING_STOPPING ||
+		    !cpumask_test_cpu(cpu,&session->cpus) || cur->sessions[idx].active)
+			continue;
+
+		syswide_monitoring_start_cpu((void*)idx);
+
+		if ((sbuf=ACCESS_ONCE(session->pmc_samples_buffer)))
+			__push_cpu_state_cbuffer(sbuf,cpu,1,cur->sessions[idx].last_sample_time);
+	}
+}
+
+/*
+ * Tear down system-wide monitoring on a CPU about to go offline
+ * (invoked on that CPU with interrupts disabled). The counts
+ * gathered so far are flushed in a last sample for each session.
+ */
+static void syswide_monitoring_cpu_down(void* dummy)
+{
+	int cpu=smp_processor_id();
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
+	pmc_samples_buffer_t* sbuf;
+	pmc_sample_v2_t* sample;
+	uint64_t now;
+	long idx;
+
+	if (!cur->active)
+		return;
+
+	spin_lock(&cur->lock);
+
+	if (cur->counting)
+		__stop_counting_cpu(cur);
+
+	now=pmc_sample_clock();
+
+	for (idx=0; idx<SYSWIDE_MAX_SESSIONS; idx++) {
+		if (!cur->sessions[idx].active)
+			continue;
+
+		sample=__sample_session_cpu(cur,idx,cpu,now);
+
+		if ((sbuf=ACCESS_ONCE(syswide_ctl.sessions[idx].pmc_samples_buffer))) {
+			__push_sample_cbuffer(sbuf,sample,NULL);
+			__push_cpu_state_cbuffer(sbuf,cpu,0,now);
+		}
+	}
+
+	spin_unlock(&cur->lock);
+
+	/* Pinned timers would otherwise be migrated to another CPU */
+	for (idx=0; idx<SYSWIDE_MAX_SESSIONS; idx++)
+		syswide_monitoring_stop_cpu((void*)idx);
+}
+
+/* Returns true if a CPU that changes state must be brought up/down */
+static inline int syswide_monitoring_cpu_tracked(unsigned int cpu)
+{
+	int i;
+
+	if (!syswide_monitoring_enabled())
+		return 0;
+
+	for (i=0; i<SYSWIDE_MAX_SESSIONS; i++)
+		if (syswide_ctl.sessions[i].monitor>SYSWIDE_MONITORING_STARTING &&
+		    cpumask_test_cpu(cpu,&syswide_ctl.sessions[i].cpus))
+			return 1;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+/* Hotplug callbacks (invoked on the CPU that changes state) */
+static int syswide_cpu_online(unsigned int cpu)
+{
+	unsigned long flags;
+
+	if (syswide_monitoring_cpu_tracked(cpu)) {
+		local_irq_save(flags);
+		syswide_monitoring_cpu_up(NULL);
+		local_irq_restore(flags);
+	}
+	return 0;
+}
+
+static int syswide_cpu_offline(unsigned int cpu)
+{
+	unsigned long flags;
+
+	if (syswide_monitoring_cpu_tracked(cpu)) {
+		local_irq_save(flags);
+		syswide_monitoring_cpu_down(NULL);
+		local_irq_restore(flags);
+	}
+	return 0;
+}
+#else
+static int syswide_cpu_notifier(struct notifier_block *b, unsigned long action,
+                                void *data)
+{
+	int cpu = (unsigned long)data;
+
+	if (!syswide_monitoring_cpu_tracked(cpu))
+		return NOTIFY_OK;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_DOWN_FAILED:
+	case CPU_ONLINE:
+		smp_call_function_single(cpu, syswide_monitoring_cpu_up, NULL, 1);
+		break;
+	case CPU_DOWN_PREPARE:
+		smp_call_function_single(cpu, syswide_monitoring_cpu_down, NULL, 1);
+		break;
+	}
+	return NOTIFY_OK;
+}
+#endif
+
+/*
+ * Set the pause flag of the session of the current process
+ * and stop/restart counting on its CPUs. Sessions sharing
+ * those CPUs get the whole PMU while the session is paused.
+ */
+static int syswide_monitoring_set_paused(unsigned int pause)
 {
 	unsigned long flags=0;
 	int ret=0;
+	int idx;
+
+	mutex_lock(&syswide_ctl.session_mutex);
+	get_online_cpus();
 
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
-	if (!syswide_monitoring_enabled())
+	if ((idx=__find_session(current->pid))<0)
 		ret=-EINVAL;
+	else if (syswide_ctl.sessions[idx].paused==pause)
+		ret=1; /* Nothing to do */
 	else
-		syswide_ctl.pause_syswide_monitor=1;
+		syswide_ctl.sessions[idx].paused=pause;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
-	return ret;
+
+	if (ret==0)
+		on_each_cpu_mask(&syswide_ctl.sessions[idx].cpus,
+		                 syswide_monitoring_update_cpu, NULL, 1);
+
+	put_online_cpus();
+	mutex_unlock(&syswide_ctl.session_mutex);
+	return ret<0?ret:0;
+}
+
+/* Pause syswide_monitoring */
+int syswide_monitoring_pause(void)
+{
+	return syswide_monitoring_set_paused(1);
 }
 
 /* Resume syswide_monitoring */
 int syswide_monitoring_resume(void)
 {
+	return syswide_monitoring_set_paused(0);
+}
+
+/*
+ * Make the current process the owner of the settings for the next session.
+ * Settings left by another process are discarded. Returns the cgroup that
+ * must be released (must be invoked with syswide_ctl.lock held).
+ */
+static struct cgroup_subsys_state* __claim_next_session_settings(void)
+{
+	struct cgroup_subsys_state* old=NULL;
+
+	if (syswide_ctl.next_owner!=current->pid) {
+		old=syswide_ctl.next_cgroup_css;
+		reset_next_session_settings();
+		syswide_ctl.next_owner=current->pid;
+	}
+	return old;
+}
+
+/*
+ * Select the CPUs to monitor in the next system-wide session
+ * of the current process (list format: "0-3,8")
+ */
+int syswide_monitoring_set_cpus(const char* cpulist)
+{
+	cpumask_var_t cpus;
 	unsigned long flags=0;
-	int ret=0;
+	struct cgroup_subsys_state* old;
+	int retval=0;
+
+	if (!alloc_cpumask_var(&cpus,GFP_KERNEL))
+		return -ENOMEM;
+
+	if ((retval=cpulist_parse(cpulist,cpus)))
+		goto out_free;
+
+	cpumask_and(cpus,cpus,cpu_possible_mask);
+
+	if (cpumask_empty(cpus)) {
+		retval=-EINVAL;
+		goto out_free;
+	}
 
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
-	if (!syswide_monitoring_enabled())
-		ret=-EINVAL;
-	else
-		syswide_ctl.pause_syswide_monitor=0;
+	old=__claim_next_session_settings();
+	cpumask_copy(&syswide_ctl.next_cpus,cpus);
+	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+
+#ifdef CONFIG_CGROUP_PERF
+	if (old)
+		css_put(old);
+#endif
+out_free:
+	free_cpumask_var(cpus);
+	return retval;
+}
+
+/*
+ * Restrict the next system-wide session of the current process to the
+ * tasks in the cgroup of process "pid" within the perf_event hierarchy
+ * (pid<=0 monitors all tasks again)
+ */
+int syswide_monitoring_set_cgroup(pid_t pid)
+{
+#ifdef CONFIG_CGROUP_PERF
+	struct task_struct* p;
+	struct cgroup_subsys_state* css=NULL;
+	struct cgroup_subsys_state* old;
+	struct cgroup_subsys_state* prev;
+	unsigned long flags=0;
+
+	if (pid>0) {
+		rcu_read_lock();
+		p=find_process_by_pid(pid);
+		if (!p) {
+			rcu_read_unlock();
+			return -ESRCH;
+		}
+		css=task_perf_css(p);
+		css_get(css);
+		rcu_read_unlock();
+	}
+
+	spin_lock_irqsave(&syswide_ctl.lock,flags);
+	prev=__claim_next_session_settings();
+	old=syswide_ctl.next_cgroup_css;
+	syswide_ctl.next_cgroup_css=css;
+	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+
+	if (prev)
+		css_put(prev);
+	if (old)
+		css_put(old);
+	return 0;
+#else
+	return pid>0?-ENOSYS:0;
+#endif
+}
+
+/* Print a CPU list */
+static int print_cpulist(char* buf, int len, const struct cpumask* mask)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+	return cpulist_scnprintf(buf,len,mask);
+#else
+	return scnprintf(buf,len,"%*pbl",cpumask_pr_args(mask));
+#endif
+}
+
+/*
+ * Print the list of CPUs to monitor in system-wide mode: those of the
+ * session of the current process if it has one, those selected for its
+ * next session otherwise.
+ */
+int syswide_monitoring_print_cpus(char* buf, int len)
+{
+	const struct cpumask* mask=cpu_possible_mask;
+	unsigned long flags=0;
+	int idx;
+	int ret;
+
+	spin_lock_irqsave(&syswide_ctl.lock,flags);
+	if ((idx=__find_session(current->pid))>=0)
+		mask=&syswide_ctl.sessions[idx].cpus;
+	else if (syswide_ctl.next_owner==current->pid)
+		mask=&syswide_ctl.next_cpus;
+	ret=print_cpulist(buf,len,mask);
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 	return ret;
 }
+
+/*
+ * Print one line per active system-wide session with the share
+ * of the PMU it got so far: the ratio between the time its events
+ * were counted and the time it was enabled, across its CPUs.
+ */
+int syswide_monitoring_print_sessions(char* buf, int len)
+{
+	char* dst=buf;
+	int idx;
+	int cpu;
+
+	mutex_lock(&syswide_ctl.session_mutex);
+
+	for (idx=0; idx<SYSWIDE_MAX_SESSIONS; idx++) {
+		syswide_session_t* session=&syswide_ctl.sessions[idx];
+		uint64_t enabled=0,running=0,nr_samples=0;
+
+		if (session->monitor<=SYSWIDE_MONITORING_STARTING)
+			continue;
+
+		for_each_cpu(cpu,&session->cpus) {
+			cpu_session_t* cs=&per_cpu(cpu_syswide, cpu).sessions[idx];
+
+			enabled+=cs->total_enabled;
+			running+=cs->total_running;
+			nr_samples+=cs->nr_samples;
+		}
+
+		dst+=scnprintf(dst,len-(dst-buf),"syswide_session = pid=%d period=%llums%s cpus=",
+		               session->monitor,div64_u64(session->period,NSEC_PER_MSEC),
+		               session->paused?" (paused)":"");
+		dst+=print_cpulist(dst,len-(dst-buf),&session->cpus);
+		dst+=scnprintf(dst,len-(dst-buf)," samples=%llu pmu_share=%llu%%\n",
+		               nr_samples,enabled?div64_u64(running*100,enabled):100ULL);
+	}
+
+	mutex_unlock(&syswide_ctl.session_mutex);
+	return dst-buf;
+}
@@ -175,7 +175,7 @@ static inline void do_read_sensors(vexpress_sensors_thread_data_t* tdata, int ac
  * Update cumulative energy counters in the thread structure and
  * set the associated virtual counts in the PMC sample structure
  */
-static int vexpress_sensors_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,int flags,void* data)
+static int vexpress_sensors_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_v2_t* sample,int flags,void* data)
 {
 	vexpress_sensors_thread_data_t* tdata=prof->monitoring_mod_priv_data;
 	int i=0;
@@ -311,7 +311,7 @@ static void vexpress_sensors_on_syswide_refresh_monitor(int cpu, unsigned int vi
 }
 
 /* 	Dump virtual-counter values for this CPU */
-static void vexpress_sensors_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_t* sample)
+static void vexpress_sensors_on_syswide_dump_virtual_counters(int cpu, unsigned int virtual_mask,pmc_sample_v2_t* sample)
 {
 	vexpress_sensors_thread_data_t* data=&per_cpu(cpu_syswide, cpu);
 	int i=0;
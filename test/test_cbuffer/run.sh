@@ -0,0 +1,2 @@
+#!/bin/bash
+LD_LIBRARY_PATH=../../src/lib/libpmctrack ./test-cbuffer "$@"
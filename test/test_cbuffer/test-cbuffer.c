@@ -0,0 +1,416 @@
+/*
+ * test-cbuffer.c
+ *
+ * Unit tests and microbenchmark for the ring buffers used by PMCTrack's
+ * kernel module: the byte ring (cbuffer_t) and the per-CPU sample rings.
+ * cbuffer.c and the producer side of the sample rings are built in
+ * userspace as is. Samples are retrieved from the rings with libpmctrack,
+ * as pmctrack does. The benchmark compares the two ways the module can
+ * store a sample: assembling a pmc_sample_v2_t and copying it into the
+ * ring, or filling a record reserved in the ring in place.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pmc/data_str/cbuffer.h>
+#include <pmc/data_str/sample_ring.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define BUFFER_SIZE		(64*1024)
+#define CONTROL_SIZE		4096
+#define BATCH_SIZE		64
+#define BENCH_NR_COUNTS		4
+#define NR_PMC_VALUES		11	/* Size of prof->pmc_values (MAX_LL_EXPS on Intel Core i7) */
+#define DEFAULT_ITERATIONS	100000
+
+static int nr_failures=0;
+
+#define check(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+			nr_failures++; \
+		} \
+	} while (0)
+
+/* Tests for the original byte ring */
+static void test_cbuffer_v1(void)
+{
+	cbuffer_t* cbuf=create_cbuffer_t(10);
+	char out[10];
+	int i;
+
+	check(cbuf!=NULL);
+	check(is_empty_cbuffer_t(cbuf));
+
+	insert_items_cbuffer_t(cbuf,"abcdefgh",8);
+	check(size_cbuffer_t(cbuf)==8);
+	remove_items_cbuffer_t(cbuf,out,6);
+	check(memcmp(out,"abcdef",6)==0);
+
+	/* Wrap around the end of the buffer */
+	insert_items_cbuffer_t(cbuf,"ijklmn",6);
+	check(size_cbuffer_t(cbuf)==8);
+	check(remove_cbuffer_t_batch(cbuf,out,10)==8);
+	check(memcmp(out,"ghijklmn",8)==0);
+	check(is_empty_cbuffer_t(cbuf));
+
+	/* v1 overwrites the oldest bytes when full */
+	for (i=0; i<12; i++)
+		insert_cbuffer_t(cbuf,'a'+i);
+	check(is_full_cbuffer_t(cbuf));
+	check(remove_cbuffer_t(cbuf)=='c');
+
+	destroy_cbuffer_t(cbuf);
+}
+
+/*
+ * Single ring laid out as in the mapping exported by the kernel module
+ * (control area followed by the data area), along with the producer
+ * state used by the module and the consumer state used by libpmctrack.
+ */
+typedef struct {
+	char* mem;
+	pmc_ring_control_t* control;
+	pmc_samples_ring_t ring;
+	pmct_sample_rings_t rings;
+	pmc_overflow_policy_t policy;
+} test_ring_t;
+
+static void init_test_ring(test_ring_t* tr, unsigned int data_size, pmc_overflow_policy_t policy)
+{
+	pmc_ring_control_t* control;
+
+	if (posix_memalign((void**)&tr->mem,CONTROL_SIZE,CONTROL_SIZE+data_size))
+		exit(1);
+	memset(tr->mem,0,CONTROL_SIZE+data_size);
+
+	control=tr->control=(pmc_ring_control_t*)tr->mem;
+	control->version=PMC_RING_VERSION;
+	control->nr_rings=1;
+	control->data_size=data_size;
+	control->max_record_size=PMC_MAX_RECORD_SIZE;
+	control->data_offset=CONTROL_SIZE;
+	control->ring_stride=data_size;
+	control->overflow_policy=policy;
+	control->mmap_size=CONTROL_SIZE+data_size;
+
+	memset(&tr->ring,0,sizeof(pmc_samples_ring_t));
+	tr->ring.idx=&control->index[0];
+	tr->ring.data=tr->mem+CONTROL_SIZE;
+	tr->policy=policy;
+
+	memset(&tr->rings,0,sizeof(pmct_sample_rings_t));
+	tr->rings.control=control;
+	tr->rings.mmap_size=control->mmap_size;
+	tr->rings.schemas=calloc(1,sizeof(pmc_schema_table_t));
+}
+
+static void free_test_ring(test_ring_t* tr)
+{
+	free(tr->rings.schemas);
+	free(tr->mem);
+}
+
+static int push_sample(test_ring_t* tr, pmc_sample_v2_t* sample)
+{
+	return __store_sample_ring(&tr->ring,tr->control->data_size,tr->policy,sample,
+	                           sample->pid,sample->pid,0);
+}
+
+static uint32_t ring_bytes(test_ring_t* tr)
+{
+	return tr->ring.idx->head-tr->ring.idx->tail;
+}
+
+static void fill_test_sample(pmc_sample_v2_t* sample, int exp_idx, int i)
+{
+	memset(sample,0,sizeof(pmc_sample_v2_t));
+	sample->type=PMC_TICK_SAMPLE;
+	sample->exp_idx=exp_idx;
+	sample->pid=100+i;
+	sample->pmc_mask=0x3;
+	sample->nr_counts=2;
+	sample->pmc_counts[0]=i;
+	sample->pmc_counts[1]=2*i;
+	sample->timestamp=i;
+}
+
+/* Tests for the per-CPU sample rings of the kernel module */
+static void test_sample_ring(void)
+{
+	unsigned int rec_size=pmc_sample_record_size(2,0);
+	pmc_sample_v2_t sample,out[16];
+	test_ring_t tr;
+	int i,nr_samples;
+
+	init_test_ring(&tr,256,PMC_OVERFLOW_DROP);
+
+	/* The schema of the event set is emitted once, before its first sample */
+	for (i=0; i<3; i++) {
+		fill_test_sample(&sample,0,i);
+		check(push_sample(&tr,&sample));
+	}
+	check(ring_bytes(&tr)==sizeof(pmc_schema_record_t)+3*rec_size);
+
+	nr_samples=pmct_ring_read_samples(-1,&tr.rings,out,16);
+	check(nr_samples==3);
+	for (i=0; i<nr_samples; i++) {
+		check(out[i].pid==100+i && out[i].tgid==100+i);
+		check(out[i].pmc_mask==0x3 && out[i].nr_counts==2);
+		check(out[i].pmc_counts[0]==i && out[i].pmc_counts[1]==2*i);
+	}
+	check(ring_bytes(&tr)==0);
+
+	/* Fill the ring up: the samples that do not fit are dropped */
+	for (i=0; i<4; i++) {
+		fill_test_sample(&sample,0,i);
+		push_sample(&tr,&sample);
+	}
+	check(tr.ring.idx->nr_lost==1);
+
+	/* The loss is reported in the stream, and the next sample wraps around */
+	check(pmct_ring_read_samples(-1,&tr.rings,out,16)==3);
+	fill_test_sample(&sample,1,7);
+	check(push_sample(&tr,&sample));
+	check(tr.ring.idx->head % 256 < tr.ring.idx->tail % 256);
+	check(pmct_ring_read_samples(-1,&tr.rings,out,16)==1);
+	check(out[0].exp_idx==1 && out[0].pmc_counts[1]==14);
+	check(tr.rings.nr_lost_reported==1);
+	free_test_ring(&tr);
+
+	/* The oldest records are discarded if the ring overwrites them */
+	init_test_ring(&tr,256,PMC_OVERFLOW_OVERWRITE);
+	for (i=0; i<10; i++) {
+		fill_test_sample(&sample,0,i);
+		check(push_sample(&tr,&sample));
+	}
+	check(tr.ring.idx->nr_lost>0);
+	nr_samples=pmct_ring_read_samples(-1,&tr.rings,out,16);
+	check(nr_samples>0 && nr_samples==10-tr.ring.idx->nr_lost);
+	check(out[nr_samples-1].pmc_counts[0]==9);
+	check(tr.rings.nr_discarded==0);
+	free_test_ring(&tr);
+}
+
+/* Tests for sample records filled in place */
+static void test_sample_ring_in_place(void)
+{
+	pmc_sample_record_t* rec;
+	pmc_sample_v2_t out[16];
+	uint32_t next_head,head;
+	test_ring_t tr;
+	int i;
+
+	init_test_ring(&tr,256,PMC_OVERFLOW_DROP);
+
+	rec=__reserve_sample_ring(&tr.ring,256,tr.policy,0,2,0x5,2,0x1,1,&next_head);
+	check(rec!=NULL);
+	check(rec->nr_counts==2 && rec->nr_virt_counts==1);
+	check(rec->header.size==pmc_sample_record_size(2,1));
+
+	/* Only the schema is visible until the record is committed */
+	check(ring_bytes(&tr)==sizeof(pmc_schema_record_t));
+
+	rec->type=PMC_EXIT_SAMPLE;
+	rec->tid=7;
+	rec->tgid=5;
+	rec->cpu=0;
+	rec->timestamp=1000;
+	rec->time_enabled=20;
+	rec->time_running=10;
+	for (i=0; i<3; i++)
+		rec->counts[i]=i+1;
+	__commit_sample_ring(&tr.ring,rec,next_head);
+	check(tr.ring.last_record_size==pmc_sample_record_size(2,1));
+
+	check(pmct_ring_read_samples(-1,&tr.rings,out,16)==1);
+	check(out[0].type==PMC_EXIT_SAMPLE && out[0].exp_idx==2);
+	check(out[0].pid==7 && out[0].tgid==5);
+	check(out[0].pmc_mask==0x5 && out[0].pmc_counts[0]==1 && out[0].pmc_counts[1]==2);
+	check(out[0].virt_mask==0x1 && out[0].virtual_counts[0]==3);
+	check(out[0].time_enabled==20 && out[0].time_running==10);
+
+	/* A reservation that is not committed leaves no trace in the stream */
+	head=tr.ring.idx->head;
+	rec=__reserve_sample_ring(&tr.ring,256,tr.policy,0,2,0x5,2,0x1,1,&next_head);
+	check(rec!=NULL && tr.ring.idx->head==head);
+	check(ring_bytes(&tr)==0);
+
+	/* Counts beyond the record format are not stored */
+	rec=__reserve_sample_ring(&tr.ring,256,tr.policy,0,2,0x5,MAX_PERFORMANCE_COUNTERS+1,0x1,1,&next_head);
+	check(rec!=NULL && rec->nr_counts==MAX_PERFORMANCE_COUNTERS);
+	free_test_ring(&tr);
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+/*
+ * Counts gathered for a thread between two samples
+ * (prof->pmc_values in the kernel module)
+ */
+static void gather_counts(uint64_t* values, int i)
+{
+	int k;
+
+	for (k=0; k<BENCH_NR_COUNTS; k++)
+		values[k]=(k+1)*i;
+}
+
+/*
+ * Store a sample as the module did before records could be filled in
+ * place: assemble it on the stack and copy it into the ring.
+ */
+static int store_sample_copy(test_ring_t* tr, uint64_t* values, int i)
+{
+	pmc_sample_v2_t sample;
+	int k;
+
+	sample.type=PMC_TICK_SAMPLE;
+	sample.coretype=0;
+	sample.exp_idx=0;
+	sample.pmc_mask=(1U<<BENCH_NR_COUNTS)-1;
+	sample.nr_counts=BENCH_NR_COUNTS;
+	sample.virt_mask=0;
+	sample.nr_virt_counts=0;
+	sample.pid=i;
+	sample.tgid=i;
+	sample.timestamp=i;
+	sample.time_enabled=i;
+	sample.time_running=i;
+
+	for (k=0; k<NR_PMC_VALUES; k++) {
+		sample.pmc_counts[k]=values[k];
+		values[k]=0;
+	}
+
+	return __store_sample_ring(&tr->ring,tr->control->data_size,tr->policy,&sample,
+	                           sample.pid,sample.tgid,0);
+}
+
+/* Store a sample as the module does now: fill a record reserved in the ring */
+static int store_sample_in_place(test_ring_t* tr, uint64_t* values, int i)
+{
+	pmc_sample_record_t* rec;
+	uint32_t next_head;
+	int k;
+
+	rec=__reserve_sample_ring(&tr->ring,tr->control->data_size,tr->policy,0,0,
+	                          (1U<<BENCH_NR_COUNTS)-1,BENCH_NR_COUNTS,0,0,&next_head);
+
+	if (rec) {
+		rec->type=PMC_TICK_SAMPLE;
+		rec->tid=i;
+		rec->tgid=i;
+		rec->cpu=0;
+		rec->timestamp=i;
+		rec->time_enabled=i;
+		rec->time_running=i;
+		for (k=0; k<rec->nr_counts; k++)
+			rec->counts[k]=values[k];
+		__commit_sample_ring(&tr->ring,rec,next_head);
+	}
+
+	for (k=0; k<NR_PMC_VALUES; k++)
+		values[k]=0;
+
+	return rec!=NULL;
+}
+
+/*
+ * Producer throughput of one of the ways to store a sample: batches of
+ * samples are stored and then decoded by libpmctrack (as in pmctrack).
+ * Only the time spent storing samples is measured.
+ * Returns the checksum of the samples consumed (to keep the compiler honest).
+ */
+static unsigned long bench_store(int (*store)(test_ring_t*,uint64_t*,int), int iterations, double* ns_per_sample)
+{
+	pmc_sample_v2_t samples[BATCH_SIZE];
+	uint64_t values[NR_PMC_VALUES]= {0};
+	struct timespec start,end;
+	unsigned long checksum=0;
+	double elapsed=0;
+	test_ring_t tr;
+	int i,j,nr_samples;
+
+	init_test_ring(&tr,BUFFER_SIZE,PMC_OVERFLOW_DROP);
+
+	for (i=0; i<iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for (j=0; j<BATCH_SIZE; j++) {
+			gather_counts(values,j);
+			store(&tr,values,j);
+		}
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		elapsed+=elapsed_ns(&start,&end);
+
+		nr_samples=pmct_ring_read_samples(-1,&tr.rings,samples,BATCH_SIZE);
+		for (j=0; j<nr_samples; j++)
+			checksum+=samples[j].pmc_counts[BENCH_NR_COUNTS-1]+samples[j].pid;
+	}
+
+	(*ns_per_sample)=elapsed/((double)iterations*BATCH_SIZE);
+	free_test_ring(&tr);
+	return checksum;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations=argc>1?atoi(argv[1]):DEFAULT_ITERATIONS;
+	unsigned long checksum_copy,checksum_in_place;
+	double ns_copy,ns_in_place;
+
+	test_cbuffer_v1();
+	test_sample_ring();
+	test_sample_ring_in_place();
+
+	if (nr_failures) {
+		fprintf(stderr,"%d check(s) failed\n",nr_failures);
+		exit(1);
+	}
+
+	printf("Unit tests passed\n");
+
+	if (iterations<=0)
+		return 0;
+
+	checksum_copy=bench_store(store_sample_copy,iterations,&ns_copy);
+	checksum_in_place=bench_store(store_sample_in_place,iterations,&ns_in_place);
+
+	if (checksum_copy!=checksum_in_place) {
+		fprintf(stderr,"Checksum mismatch: %lu (copy) vs. %lu (in place)\n",checksum_copy,checksum_in_place);
+		exit(1);
+	}
+
+	printf("%d samples with %d counts (batches of %d), time spent storing them:\n",
+	       iterations*BATCH_SIZE,BENCH_NR_COUNTS,BATCH_SIZE);
+	printf("stack sample + copy: %.2f ns/sample\n",ns_copy);
+	printf("filled in place:     %.2f ns/sample\n",ns_in_place);
+
+	return 0;
+}
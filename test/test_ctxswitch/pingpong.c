@@ -0,0 +1,111 @@
+/*
+ * pingpong.c
+ *
+ * Context-switch microbenchmark. Two processes bounce a byte
+ * back and forth through a pair of pipes; when both are bound to
+ * the same CPU, each round trip involves two context switches.
+ * Running it with and without PMCTrack reveals the overhead of
+ * the save/restore callbacks of the kernel module.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ROUND_TRIPS	100000
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+/* Read and write exactly one byte */
+static void bounce(int in, int out, char* byte)
+{
+	if (read(in,byte,1)!=1) {
+		perror("read");
+		exit(1);
+	}
+	if (write(out,byte,1)!=1) {
+		perror("write");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_round_trips=argc>1?atoi(argv[1]):DEFAULT_ROUND_TRIPS;
+	int ping[2],pong[2];
+	struct timespec start,end;
+	char byte='x';
+	double ns;
+	pid_t pid;
+	int i;
+
+	if (nr_round_trips<=0) {
+		fprintf(stderr,"Usage: %s [nr_round_trips]\n",argv[0]);
+		exit(1);
+	}
+
+	if (pipe(ping)==-1 || pipe(pong)==-1) {
+		perror("pipe");
+		exit(1);
+	}
+
+	pid=fork();
+
+	if (pid==-1) {
+		perror("fork");
+		exit(1);
+	} else if (pid==0) {
+		/* Child: echo every byte back to the parent */
+		close(ping[1]);
+		close(pong[0]);
+		for (i=0; i<nr_round_trips; i++)
+			bounce(ping[0],pong[1],&byte);
+		exit(0);
+	}
+
+	close(ping[0]);
+	close(pong[1]);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	for (i=0; i<nr_round_trips; i++) {
+		if (write(ping[1],&byte,1)!=1 || read(pong[0],&byte,1)!=1) {
+			perror("pipe round trip");
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	waitpid(pid,NULL,0);
+
+	ns=elapsed_ns(&start,&end);
+	printf("%d round trips in %.3f s\n",nr_round_trips,ns/1e9);
+	printf("%.1f ns/round trip (%.1f ns/context switch)\n",ns/nr_round_trips,ns/(2.0*nr_round_trips));
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# Context-switch microbenchmark: compare the cost of a pipe round trip
+# with and without PMCTrack monitoring both processes.
+#
+# Usage: ./run.sh [nr_round_trips] [pmctrack event configuration]
+#
+NR_ROUND_TRIPS=${1:-100000}
+EVENTS=${2:-instr,cycles}
+PMCTRACK=../../bin/pmctrack
+
+# Keep both processes on the same CPU so that every round trip
+# involves two context switches
+TASKSET=
+if which taskset > /dev/null 2>&1; then
+	TASKSET="taskset -c 0"
+fi
+
+echo "== Unmonitored"
+$TASKSET ./pingpong $NR_ROUND_TRIPS
+
+if [ -x $PMCTRACK ] && [ -d /proc/pmc ]; then
+	echo "== Monitored by PMCTrack (TBS, -c $EVENTS)"
+	$TASKSET $PMCTRACK -c $EVENTS ./pingpong $NR_ROUND_TRIPS
+else
+	echo "PMCTrack kernel module not loaded: skipping monitored run"
+fi
@@ -0,0 +1,282 @@
+/*
+ * evloop-bench.c
+ *
+ * Maximum sustained sample rate of the two ways pmctrack has used to
+ * retrieve and print samples:
+ *
+ *  - alarm: setitimer() + pause() to wait for each sampling period,
+ *    a single read() of the sample buffer (one page) and an unbuffered
+ *    output stream (one write() per line).
+ *  - poll: an event loop on the sample source, a timerfd and a signalfd,
+ *    which drains all the samples available in batches and writes the
+ *    output in large blocks (flushed once every period).
+ *
+ * A producer thread stands in for the kernel module: it pushes samples
+ * into a pipe (sized like the kernel buffer) as fast as it can, and
+ * drops them when the pipe is full, as the kernel does with the "drop"
+ * overflow policy. Samples are printed with libpmctrack.
+ *
+ * Usage: ./evloop-bench [period_us] [secs] [output-file]
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_PERIOD_US	1000
+#define DEFAULT_SECS		2
+#define DEFAULT_OUTPUT		"bench-output.txt"
+#define PIPE_SIZE		(1<<20)		/* Same as a 1MB kernel buffer */
+#define READ_BUFFER_SIZE	4096		/* Shared page used by pmctrack */
+#define BATCH_SIZE		16		/* Samples per write() (atomic) */
+#define OUTPUT_BUFFER_SIZE	(1<<20)
+
+static int pipe_fds[2];
+static volatile int producer_stop=0;
+static unsigned long nr_produced=0,nr_dropped=0;
+
+/* Generate samples until told to stop, then close the pipe (EOF) */
+static void* producer(void* arg)
+{
+	pmc_sample_v2_t batch[BATCH_SIZE];
+	int i;
+
+	memset(batch,0,sizeof(batch));
+	for (i=0; i<BATCH_SIZE; i++) {
+		batch[i].type=PMC_TICK_SAMPLE;
+		batch[i].pid=1000+i;
+		batch[i].pmc_mask=0x3;
+		batch[i].nr_counts=2;
+		batch[i].pmc_counts[0]=123456789+i;
+		batch[i].pmc_counts[1]=987654321+i;
+	}
+
+	while (!producer_stop) {
+		if (write(pipe_fds[1],batch,sizeof(batch))==sizeof(batch))
+			nr_produced+=BATCH_SIZE;
+		else
+			nr_dropped+=BATCH_SIZE;
+	}
+
+	close(pipe_fds[1]);
+	return NULL;
+}
+
+static void start_producer(pthread_t* thread)
+{
+	if (pipe(pipe_fds))
+		err(1,"pipe");
+	fcntl(pipe_fds[0],F_SETPIPE_SZ,PIPE_SIZE);
+	fcntl(pipe_fds[1],F_SETFL,O_NONBLOCK);
+	producer_stop=0;
+	nr_produced=nr_dropped=0;
+	if (pthread_create(thread,NULL,producer,NULL))
+		errx(1,"Can't create the producer thread");
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+static int expired(struct timespec* start, int secs)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return elapsed_ns(start,&now)>=secs*1e9;
+}
+
+static void print_samples(FILE* fout, pmc_sample_v2_t* samples, int nr_samples, int* cont)
+{
+	int i;
+
+	for (i=0; i<nr_samples; i++)
+		pmct_print_sample(fout,1,0x3,0,0,(*cont)++,&samples[i]);
+}
+
+static void sigalarm_handler(int signo) { }
+
+/* Former loop of pmctrack */
+static int run_alarm(FILE* fout, int period_us, int secs)
+{
+	pmc_sample_v2_t samples[READ_BUFFER_SIZE/sizeof(pmc_sample_v2_t)];
+	struct sigaction sact;
+	struct itimerval timer;
+	struct timespec start;
+	int nr_samples,cont=1;
+
+	memset(&sact,0,sizeof(sact));
+	sact.sa_handler=sigalarm_handler;
+	sigaction(SIGALRM,&sact,NULL);
+	setbuf(fout,NULL);
+
+	/*
+	 * pmctrack armed a one-shot timer before each pause(). The timer is
+	 * periodic here so that a SIGALRM delivered before pause() (which
+	 * pmctrack did not guard against) costs a period rather than a hang.
+	 */
+	timer.it_value.tv_sec=period_us/1000000;
+	timer.it_value.tv_usec=period_us%1000000;
+	timer.it_interval=timer.it_value;
+	setitimer(ITIMER_REAL,&timer,NULL);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	while (1) {
+		if (!producer_stop) {
+			pause();
+			producer_stop=expired(&start,secs);
+		}
+
+		if ((nr_samples=read(pipe_fds[0],samples,sizeof(samples)))<=0)
+			break;
+		print_samples(fout,samples,nr_samples/sizeof(pmc_sample_v2_t),&cont);
+	}
+
+	memset(&timer,0,sizeof(timer));
+	setitimer(ITIMER_REAL,&timer,NULL);
+	return cont-1;
+}
+
+/* Event loop of pmctrack */
+static int run_poll(FILE* fout, int period_us, int secs)
+{
+	pmc_sample_v2_t samples[READ_BUFFER_SIZE/sizeof(pmc_sample_v2_t)];
+	static char output_buffer[OUTPUT_BUFFER_SIZE];
+	struct pollfd fds[3];
+	struct itimerspec period;
+	struct timespec start;
+	sigset_t sigmask;
+	uint64_t expirations;
+	int nr_samples,cont=1;
+
+	setvbuf(fout,output_buffer,_IOFBF,OUTPUT_BUFFER_SIZE);
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask,SIGINT);
+	sigaddset(&sigmask,SIGTERM);
+	sigprocmask(SIG_BLOCK,&sigmask,NULL);
+
+	fds[0].fd=pipe_fds[0];
+	fds[1].fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK);
+	fds[2].fd=signalfd(-1,&sigmask,SFD_NONBLOCK);
+	fds[0].events=fds[1].events=fds[2].events=POLLIN;
+
+	period.it_value.tv_sec=period_us/1000000;
+	period.it_value.tv_nsec=(period_us%1000000)*1000;
+	period.it_interval=period.it_value;
+	timerfd_settime(fds[1].fd,0,&period,NULL);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	while (1) {
+		if (poll(fds,3,-1)<0)
+			err(1,"poll");
+
+		if (fds[2].revents & POLLIN)
+			break;
+
+		if (fds[1].revents & POLLIN) {
+			if (read(fds[1].fd,&expirations,sizeof(expirations))<0) {}
+			fflush(fout);
+			if (!producer_stop)
+				producer_stop=expired(&start,secs);
+		}
+
+		if (!(fds[0].revents & (POLLIN|POLLHUP)))
+			continue;
+
+		/* Drain what is available */
+		do {
+			if ((nr_samples=read(pipe_fds[0],samples,sizeof(samples)))<=0)
+				break;
+			print_samples(fout,samples,nr_samples/sizeof(pmc_sample_v2_t),&cont);
+		} while (poll(fds,1,0)>0 && (fds[0].revents & POLLIN));
+
+		if (nr_samples==0)
+			break;
+	}
+
+	fflush(fout);
+	close(fds[1].fd);
+	close(fds[2].fd);
+	return cont-1;
+}
+
+static void run(const char* name, int (*reader)(FILE*,int,int),
+                int period_us, int secs, const char* output)
+{
+	pthread_t thread;
+	struct timespec start,end;
+	FILE* fout;
+	double ns;
+	int nr_samples;
+
+	if ((fout=fopen(output,"w"))==NULL)
+		err(1,"Can't open %s",output);
+
+	start_producer(&thread);
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	nr_samples=reader(fout,period_us,secs);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	producer_stop=1;
+	pthread_join(thread,NULL);
+	close(pipe_fds[0]);
+	fclose(fout);
+
+	ns=elapsed_ns(&start,&end);
+	printf("%-6s %10.0f samples/s sustained (%d samples in %.2f s, %.1f%% dropped)\n",
+	       name,nr_samples*1e9/ns,nr_samples,ns/1e9,
+	       100.0*nr_dropped/(nr_produced+nr_dropped));
+}
+
+int main(int argc, char *argv[])
+{
+	int period_us=argc>1?atoi(argv[1]):DEFAULT_PERIOD_US;
+	int secs=argc>2?atoi(argv[2]):DEFAULT_SECS;
+	const char* output=argc>3?argv[3]:DEFAULT_OUTPUT;
+
+	if (period_us<=0 || secs<=0) {
+		fprintf(stderr,"Usage: %s [period_us] [secs] [output-file]\n",argv[0]);
+		exit(1);
+	}
+
+	printf("Sampling period %d us, %d s per run, output to %s\n",period_us,secs,output);
+	run("alarm",run_alarm,period_us,secs,output);
+	run("poll",run_poll,period_us,secs,output);
+	return 0;
+}
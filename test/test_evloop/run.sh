@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# Maximum sustained sample rate of pmctrack's former alarm()/pause()
+# loop vs. its timerfd/signalfd/poll event loop (see evloop-bench.c).
+# With the kernel module loaded, pmctrack is also run with a short
+# sampling period on a CPU-bound program.
+#
+# Usage: ./run.sh [period_us] [secs] [pmctrack event configuration]
+#
+PERIOD_US=${1:-1000}
+SECS=${2:-2}
+EVENTS=${3:-instr,cycles}
+PMCTRACK=../../bin/pmctrack
+export LD_LIBRARY_PATH=../../src/lib/libpmctrack
+
+./evloop-bench $PERIOD_US $SECS || exit 1
+rm -f bench-output.txt
+
+if [ -x $PMCTRACK ] && [ -d /proc/pmc ]; then
+	PERIOD=$(echo "$PERIOD_US" | awk '{print $1/1000000}')
+	echo "== pmctrack -T $PERIOD -c $EVENTS (${SECS}s)"
+	START=$(date +%s.%N)
+	NR_SAMPLES=$($PMCTRACK -T $PERIOD -c $EVENTS timeout $SECS sh -c 'while :; do :; done' | wc -l)
+	END=$(date +%s.%N)
+	echo "$NR_SAMPLES $START $END" | awk '{printf("%.0f samples/s\n",$1/($3-$2))}'
+else
+	echo "PMCTrack kernel module not loaded: skipping monitored run"
+fi
@@ -0,0 +1,370 @@
+/*
+ * test-expr.c
+ *
+ * Unit tests and microbenchmark for the compiler and the fixed-point
+ * evaluator of metric expressions used by PMCTrack's kernel module.
+ * pmc_expr.c is built in userspace as is.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pmc/pmc_expr.h>
+
+#define NR_EVENTS		4
+#define NR_RANDOM_TESTS		10000
+#define DEFAULT_ITERATIONS	1000000
+
+static int nr_failures=0;
+
+#define check(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+			nr_failures++; \
+		} \
+	} while (0)
+
+/* Mimics pmc_metric_t: the value is not the first field */
+typedef struct {
+	const char* name;
+	int64_t value;
+} test_metric_t;
+
+static test_metric_t metrics[]= {
+	{"IPC",0},
+	{"MPKI",0},
+};
+
+/* Resolves the metrics above, and "cycles"/"instr" as events */
+static int lookup_name(const char* name, void* data, pmc_expr_opcode_t* opcode)
+{
+	int i;
+
+	if (strcmp(name,"instr")==0) {
+		*opcode=PMC_EXPR_PUSH_EVENT;
+		return 0;
+	} else if (strcmp(name,"cycles")==0) {
+		*opcode=PMC_EXPR_PUSH_EVENT;
+		return 1;
+	}
+
+	for (i=0; i<sizeof(metrics)/sizeof(test_metric_t); i++)
+		if (strcmp(name,metrics[i].name)==0)
+			return i;
+
+	return -1;
+}
+
+/* Compiles and evaluates an expression; returns the compiler's error code */
+static int eval_str(const char* str, const uint64_t* hw_events, int64_t* result)
+{
+	pmc_expr_t* prog;
+	int ret;
+
+	if ((ret=pmc_expr_compile(str,lookup_name,NULL,&prog)))
+		return ret;
+
+	*result=pmc_expr_eval(prog,hw_events,&metrics[0].value,sizeof(test_metric_t));
+	pmc_expr_free(prog);
+	return 0;
+}
+
+static int eval_equals(const char* str, const uint64_t* hw_events, int64_t expected)
+{
+	int64_t result;
+
+	if (eval_str(str,hw_events,&result)) {
+		fprintf(stderr,"can't compile \"%s\"\n",str);
+		return 0;
+	}
+
+	if (result!=expected) {
+		fprintf(stderr,"\"%s\": got %lld (expected %lld)\n",str,(long long)result,(long long)expected);
+		return 0;
+	}
+	return 1;
+}
+
+static void test_arithmetic(void)
+{
+	uint64_t ev[NR_EVENTS]= {1000,2000,30,7};
+
+	/* Precedence and associativity */
+	check(eval_equals("1+2*3",ev,pmc_expr_from_int(7)));
+	check(eval_equals("(1+2)*3",ev,pmc_expr_from_int(9)));
+	check(eval_equals("10-4-3",ev,pmc_expr_from_int(3)));
+	check(eval_equals("64/4/2",ev,pmc_expr_from_int(8)));
+	check(eval_equals("-ev3+10",ev,pmc_expr_from_int(3)));
+	check(eval_equals("ev0-ev1",ev,pmc_expr_from_int(-1000)));
+	check(eval_equals(" ( ev2 * 64 ) / ( ev1 / 2000 ) ",ev,pmc_expr_from_int(1920)));
+
+	/* Fractions and hex */
+	check(eval_equals("ev0/ev1",ev,PMC_EXPR_ONE/2));
+	check(eval_equals("2.5*ev3",ev,pmc_expr_from_int(35)/2));
+	check(eval_equals("0x40*ev2",ev,pmc_expr_from_int(64*30)));
+	check(eval_equals("0.25",ev,PMC_EXPR_ONE/4));
+
+	/* Functions with arbitrary arity */
+	check(eval_equals("sum(ev0,ev1,ev2,ev3)",ev,pmc_expr_from_int(3037)));
+	check(eval_equals("min(ev0,ev3,ev2)",ev,pmc_expr_from_int(7)));
+	check(eval_equals("max(ev0,ev1*2,ev2)",ev,pmc_expr_from_int(4000)));
+	check(eval_equals("max(ev3)",ev,pmc_expr_from_int(7)));
+	check(eval_equals("1000*ev0/sum(ev1,ev2-ev2)",ev,pmc_expr_from_int(500)));
+
+	/* Division by zero yields zero */
+	check(eval_equals("ev0/(ev2-30)",ev,0));
+	check(eval_equals("ev0/0",ev,0));
+}
+
+static void test_names(void)
+{
+	uint64_t ev[NR_EVENTS]= {3000,1500,0,0};
+
+	metrics[0].value=pmc_expr_from_int(2);
+	metrics[1].value=pmc_expr_from_int(5)/2;
+
+	check(eval_equals("instr/cycles",ev,pmc_expr_from_int(2)));
+	check(eval_equals("IPC*MPKI",ev,pmc_expr_from_int(5)));
+	check(eval_equals("max(IPC,MPKI)-min(IPC,MPKI)",ev,PMC_EXPR_ONE/2));
+}
+
+static void test_compiler(void)
+{
+	pmc_expr_t* prog;
+	int64_t result;
+	char str[PMC_EXPR_MAX_LENGTH+16];
+	uint64_t ev[NR_EVENTS]= {0,0,0,0};
+	int i;
+
+	/* Constant subexpressions are folded into a single constant */
+	check(pmc_expr_compile("(2+3)*4-max(1,8,2)/2",NULL,NULL,&prog)==0);
+	check(prog->nr_insns==1 && prog->code[0].opcode==PMC_EXPR_PUSH_CONST);
+	check(pmc_expr_eval(prog,ev,NULL,0)==pmc_expr_from_int(16));
+	pmc_expr_free(prog);
+
+	check(pmc_expr_compile("1000*ev0/(ev1*2)",NULL,NULL,&prog)==0);
+	check(prog->nr_insns==7 && prog->max_depth==3 && prog->nr_events==2);
+	pmc_expr_free(prog);
+
+	/* Events beyond the end of the hw_events array are rejected */
+	check(pmc_expr_compile("ev0+ev3",NULL,NULL,&prog)==0);
+	check(pmc_expr_check_events(prog,NR_EVENTS)==0);
+	check(pmc_expr_check_events(prog,NR_EVENTS-1)==-EINVAL);
+	pmc_expr_free(prog);
+
+	/* Repeated constants share a slot in the pool */
+	check(pmc_expr_compile("ev0*3+ev1*3+ev2*3",NULL,NULL,&prog)==0);
+	check(prog->nr_consts==1);
+	pmc_expr_free(prog);
+
+	/* Syntax errors and unknown names */
+	check(eval_str("",ev,&result)==-EINVAL);
+	check(eval_str("1+",ev,&result)==-EINVAL);
+	check(eval_str("(ev0",ev,&result)==-EINVAL);
+	check(eval_str("ev0)",ev,&result)==-EINVAL);
+	check(eval_str("ev0 ev1",ev,&result)==-EINVAL);
+	check(eval_str("min()",ev,&result)==-EINVAL);
+	check(eval_str("min(ev0,)",ev,&result)==-EINVAL);
+	check(eval_str("foo(ev0)",ev,&result)==-EINVAL);
+	check(eval_str("unknown+1",ev,&result)==-EINVAL);
+	check(eval_str("12ab",ev,&result)==-EINVAL);
+	check(eval_str("0x",ev,&result)==-EINVAL);
+	check(pmc_expr_compile("IPC",NULL,NULL,&prog)==-EINVAL);
+
+	/* Too long or too complex */
+	memset(str,'1',sizeof(str)-1);
+	str[sizeof(str)-1]='\0';
+	check(eval_str(str,ev,&result)==-E2BIG);
+
+	str[0]='\0';
+	for (i=0; i<PMC_EXPR_MAX_STACK+1; i++)
+		strcat(str,"(ev0+");
+	strcat(str,"ev1");
+	for (i=0; i<PMC_EXPR_MAX_STACK+1; i++)
+		strcat(str,")");
+	check(eval_str(str,ev,&result)==-E2BIG);
+}
+
+static void test_saturation(void)
+{
+	uint64_t ev[NR_EVENTS]= {~0ULL,1ULL<<40,3,0};
+
+	/* Huge counts are clamped, and so are results */
+	check(eval_equals("ev0",ev,PMC_EXPR_MAX));
+	check(eval_equals("ev1*ev1",ev,PMC_EXPR_MAX));
+	check(eval_equals("-ev1*ev1",ev,PMC_EXPR_MIN));
+	check(eval_equals("ev0+ev0",ev,PMC_EXPR_MAX));
+	check(eval_equals("-ev0-ev0",ev,PMC_EXPR_MIN));
+	check(eval_equals("ev1/0.00001",ev,PMC_EXPR_MAX));
+	check(eval_equals("ev0-ev0",ev,0));
+	check(eval_equals("ev1*ev2/ev2",ev,pmc_expr_from_int(1ULL<<40)));
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+	/* xorshift64 */
+	*state^=*state<<13;
+	*state^=*state>>7;
+	*state^=*state<<17;
+	return *state;
+}
+
+/*
+ * Compare random metric formulas against double precision arithmetic.
+ * Values are kept in a range where the fixed-point format is accurate.
+ */
+static void test_random(void)
+{
+	static const char* formulas[]= {
+		"1000*ev0/ev1",
+		"(ev2*64)/(ev1/2400)",
+		"ev0/sum(ev0,ev1,ev2,ev3)",
+		"max(ev0,ev1)-min(ev2,ev3)*0.5",
+		"(ev0-ev1)/(ev2+1)",
+		NULL
+	};
+	uint64_t state=0x2545f4914f6cdd1dULL;
+	uint64_t ev[NR_EVENTS];
+	double d[NR_EVENTS],expected,got;
+	int64_t result;
+	int i,j,k,errors=0;
+
+	for (i=0; formulas[i]; i++) {
+		for (j=0; j<NR_RANDOM_TESTS; j++) {
+			for (k=0; k<NR_EVENTS; k++) {
+				ev[k]=1+next_random(&state)%(1ULL<<32);
+				d[k]=ev[k];
+			}
+
+			switch (i) {
+			case 0:
+				expected=1000*d[0]/d[1];
+				break;
+			case 1:
+				expected=(d[2]*64)/(d[1]/2400);
+				break;
+			case 2:
+				expected=d[0]/(d[0]+d[1]+d[2]+d[3]);
+				break;
+			case 3:
+				expected=(d[0]>d[1]?d[0]:d[1])-(d[2]<d[3]?d[2]:d[3])*0.5;
+				break;
+			default:
+				expected=(d[0]-d[1])/(d[2]+1);
+				break;
+			}
+
+			if (eval_str(formulas[i],ev,&result)) {
+				errors++;
+				break;
+			}
+
+			got=(double)result/PMC_EXPR_ONE;
+
+			/* Each operation may be off by one ulp (2^-16), relative errors pile up */
+			if (fabs(got-expected)>1e-3+fabs(expected)*1e-6) {
+				if (errors<5)
+					fprintf(stderr,"\"%s\": got %f (expected %f)\n",formulas[i],got,expected);
+				errors++;
+			}
+		}
+	}
+
+	check(errors==0);
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+/*
+ * Evaluation cost of a typical metric.
+ * Returns the sum of the results (to keep the compiler honest).
+ */
+static int64_t bench_eval(const char* str, int iterations, double* ns_per_eval)
+{
+	struct timespec start,end;
+	uint64_t ev[NR_EVENTS]= {123456789,234567891,3456789,456789};
+	pmc_expr_t* prog;
+	int64_t sum=0;
+	int i;
+
+	(*ns_per_eval)=0;
+
+	if (pmc_expr_compile(str,lookup_name,NULL,&prog))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	for (i=0; i<iterations; i++) {
+		ev[0]+=i;
+		sum+=pmc_expr_eval(prog,ev,&metrics[0].value,sizeof(test_metric_t));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	(*ns_per_eval)=elapsed_ns(&start,&end)/iterations;
+	pmc_expr_free(prog);
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations=argc>1?atoi(argv[1]):DEFAULT_ITERATIONS;
+	static const char* bench[]= {
+		"1000*ev0/ev1",
+		"(ev2*64)/(ev1/2400)",
+		"max(ev0,ev1,ev2,ev3)/sum(ev0,ev1,ev2,ev3)+IPC",
+		NULL
+	};
+	int64_t checksum=0;
+	double ns;
+	int i;
+
+	test_arithmetic();
+	test_names();
+	test_compiler();
+	test_saturation();
+	test_random();
+
+	if (nr_failures) {
+		fprintf(stderr,"%d check(s) failed\n",nr_failures);
+		exit(1);
+	}
+
+	printf("Unit tests passed\n");
+
+	if (iterations<=0)
+		return 0;
+
+	for (i=0; bench[i]; i++) {
+		checksum+=bench_eval(bench[i],iterations,&ns);
+		printf("%-48s %.2f ns/eval\n",bench[i],ns);
+	}
+
+	printf("checksum: %lld\n",(long long)checksum);
+	return 0;
+}
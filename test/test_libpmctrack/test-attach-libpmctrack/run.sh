@@ -0,0 +1,12 @@
+#!/bin/bash
+#
+# Scalability of attaching to a multithreaded process:
+# one request per thread vs. whole thread group at once
+#
+# Usage: ./run.sh [nr_threads] [nr_late_threads]
+#
+if [ ! -d /proc/pmc ]; then
+	echo "PMCTrack kernel module not loaded: skipping test"
+	exit 0
+fi
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-attach $1 $2
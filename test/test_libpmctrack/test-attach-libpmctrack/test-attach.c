@@ -0,0 +1,299 @@
+/*
+ * test-attach.c
+ *
+ * Scalability test for attaching to a multithreaded process.
+ * A child process creates thousands of threads. The test measures the
+ * time it takes to attach to (and detach from) all of them, either
+ * one thread at a time or the whole thread group at once. It also checks
+ * that threads created after the group attach are monitored as well.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_NR_THREADS	2000
+#define DEFAULT_NR_LATE_THREADS	16
+#define THREAD_STACK_SIZE	(64*1024)
+#define MAX_SAMPLES		8192
+
+static double elapsed_ms(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e3+(end->tv_nsec-start->tv_nsec)/1e6;
+}
+
+static void fail(const char* what)
+{
+	fprintf(stderr,"%s failed\n",what);
+	exit(1);
+}
+
+/*** Target process ***/
+
+static void* idle_thread(void* arg)
+{
+	for (;;)
+		pause();
+	return NULL;
+}
+
+static void* busy_thread(void* arg)
+{
+	volatile unsigned long i,acum=0;
+
+	for (i=0; i<50000000UL; i++)
+		acum+=i;
+	return NULL;
+}
+
+static pthread_t create_thread(void* (*routine)(void*))
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr,THREAD_STACK_SIZE);
+	if (pthread_create(&thread,&attr,routine,NULL))
+		fail("pthread_create");
+	pthread_attr_destroy(&attr);
+	return thread;
+}
+
+/*
+ * Create nr_threads idle threads and wait for commands:
+ * 's' spawns nr_late_threads short-lived busy threads.
+ */
+static void run_target(int nr_threads, int nr_late_threads, int cmd_fd, int ack_fd)
+{
+	pthread_t* late=malloc(sizeof(pthread_t)*nr_late_threads);
+	char cmd='r';
+	int i;
+
+	for (i=0; i<nr_threads; i++)
+		pthread_detach(create_thread(idle_thread));
+
+	/* Ready */
+	if (write(ack_fd,&cmd,1)!=1)
+		exit(1);
+
+	while (read(cmd_fd,&cmd,1)==1) {
+		if (cmd!='s')
+			break;
+
+		for (i=0; i<nr_late_threads; i++)
+			late[i]=create_thread(busy_thread);
+		for (i=0; i<nr_late_threads; i++)
+			pthread_join(late[i],NULL);
+
+		if (write(ack_fd,&cmd,1)!=1)
+			break;
+	}
+	exit(0);
+}
+
+/*** Monitor process ***/
+
+/* Retrieve the TIDs of the threads of a process */
+static int get_tids(pid_t pid, pid_t** tids)
+{
+	struct dirent **list=NULL;
+	char path[64];
+	int nr_items,nr_tids=0;
+	int i;
+
+	sprintf(path,"/proc/%d/task",pid);
+
+	if ((nr_items=scandir(path,&list,NULL,NULL))<=0)
+		return -1;
+
+	*tids=malloc(sizeof(pid_t)*nr_items);
+
+	for (i=0; i<nr_items; i++) {
+		if (list[i]->d_name[0]!='.')
+			(*tids)[nr_tids++]=atoi(list[i]->d_name);
+		free(list[i]);
+	}
+	free(list);
+	return nr_tids;
+}
+
+static int tid_in_set(pid_t tid, pid_t* tids, int nr_tids)
+{
+	int i;
+
+	for (i=0; i<nr_tids; i++)
+		if (tids[i]==tid)
+			return 1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_threads=argc>1?atoi(argv[1]):DEFAULT_NR_THREADS;
+	int nr_late_threads=argc>2?atoi(argv[2]):DEFAULT_NR_LATE_THREADS;
+	const char* strcfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x11,pmc2=0x08"
+#elif defined(AMD)
+		"pmc0=0xc0,pmc1=0x76"
+#else
+		"pmc0,pmc1"
+#endif
+		,NULL
+	};
+	struct timespec start,end;
+	int cmd[2],ack[2];
+	pid_t child;
+	pid_t* tids;
+	pid_t late_tids[MAX_SAMPLES];
+	pmc_sample_t* samples;
+	int nr_tids,nr_attached,nr_late_seen=0,nr_samples;
+	int fd,handle;
+	int i,exit_val=0;
+	char c;
+
+	if (nr_threads<=0 || nr_late_threads<0)
+		fail("argument parsing");
+
+	if (pipe(cmd) || pipe(ack))
+		fail("pipe");
+
+	if ((child=fork())==0) {
+		close(cmd[1]);
+		close(ack[0]);
+		run_target(nr_threads,nr_late_threads,cmd[0],ack[1]);
+	} else if (child==-1) {
+		fail("fork");
+	}
+
+	close(cmd[0]);
+	close(ack[1]);
+
+	if (read(ack[0],&c,1)!=1)
+		fail("target start-up");
+
+	if ((nr_tids=get_tids(child,&tids))<=0)
+		fail("get_tids");
+
+	printf("Threads in target process: %d\n",nr_tids);
+
+	if (pmct_config_counters(strcfg,0) || pmct_config_timeout(50,0))
+		fail("configuration");
+
+	/* One request per thread */
+	nr_attached=0;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_tids; i++)
+		if (pmct_attach_process(tids[i],1)==0)
+			nr_attached++;
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("%-28s %10.2f ms (%d/%d threads)\n","attach (per thread):",elapsed_ms(&start,&end),nr_attached,nr_tids);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_tids; i++)
+		pmct_detach_process(tids[i]);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("%-28s %10.2f ms\n","detach (per thread):",elapsed_ms(&start,&end));
+
+	/* Whole thread group (text interface) */
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	if (pmct_attach_thread_group(child))
+		fail("pmct_attach_thread_group");
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("%-28s %10.2f ms\n","attach (thread group):",elapsed_ms(&start,&end));
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	if (pmct_detach_thread_group(child))
+		fail("pmct_detach_thread_group");
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("%-28s %10.2f ms\n","detach (thread group):",elapsed_ms(&start,&end));
+
+	/* Binary interface */
+	if ((fd=pmct_ioctl_open())<0 || (handle=pmct_ioctl_compile_config(fd,strcfg))<0)
+		fail("binary interface set-up");
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	nr_attached=pmct_ioctl_attach_tgid(fd,handle,child);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("%-28s %10.2f ms (%d/%d threads)\n","attach (ioctl, group):",elapsed_ms(&start,&end),nr_attached,nr_tids);
+	if (nr_attached!=nr_tids)
+		exit_val=1;
+	pmct_ioctl_detach_tgid(fd,child);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	nr_attached=pmct_ioctl_attach_list(fd,handle,tids,nr_tids);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("%-28s %10.2f ms (%d/%d threads)\n","attach (ioctl, list):",elapsed_ms(&start,&end),nr_attached,nr_tids);
+	if (nr_attached!=nr_tids)
+		exit_val=1;
+	pmct_ioctl_detach_tgid(fd,child);
+
+	pmct_ioctl_destroy_config(fd,handle);
+	close(fd);
+
+	/* Threads created after attaching must be monitored too */
+	if (nr_late_threads>0) {
+		if (pmct_attach_thread_group(child))
+			fail("pmct_attach_thread_group");
+
+		c='s';
+		if (write(cmd[1],&c,1)!=1 || read(ack[0],&c,1)!=1)
+			fail("late threads");
+
+		if ((fd=pmct_open_monitor_entry())<0)
+			fail("pmct_open_monitor_entry");
+
+		samples=malloc(sizeof(pmc_sample_t)*MAX_SAMPLES);
+		nr_samples=pmct_read_samples(fd,samples,MAX_SAMPLES);
+
+		for (i=0; i<nr_samples; i++) {
+			pid_t tid=samples[i].pid;
+
+			if (!tid_in_set(tid,tids,nr_tids) && !tid_in_set(tid,late_tids,nr_late_seen))
+				late_tids[nr_late_seen++]=tid;
+		}
+
+		printf("Late threads sampled: %d/%d\n",nr_late_seen,nr_late_threads);
+		if (nr_late_seen!=nr_late_threads)
+			exit_val=1;
+
+		pmct_detach_thread_group(child);
+		close(fd);
+		free(samples);
+	}
+
+	kill(child,SIGKILL);
+	waitpid(child,NULL,0);
+	free(tids);
+
+	printf("%s\n",exit_val?"FAILED":"OK");
+	return exit_val;
+}
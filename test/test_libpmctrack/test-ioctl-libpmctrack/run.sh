@@ -0,0 +1,12 @@
+#!/bin/bash
+#
+# Per-operation latency of PMCTrack's control plane:
+# text interface (/proc/pmc) vs binary interface (/dev/pmctrack)
+#
+# Usage: ./run.sh [nr_iterations]
+#
+if [ ! -c /dev/pmctrack ]; then
+	echo "PMCTrack kernel module not loaded: skipping benchmark"
+	exit 0
+fi
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-ioctl $1
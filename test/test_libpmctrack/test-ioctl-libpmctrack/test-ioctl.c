@@ -0,0 +1,163 @@
+/*
+ * test-ioctl.c
+ *
+ * Control-plane microbenchmark. Measures the per-operation latency
+ * of attaching/detaching a process and starting/stopping a per-thread
+ * monitoring session, both via the text interface (/proc/pmc) and via
+ * the binary interface (/dev/pmctrack) with a precompiled configuration.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_ITERATIONS	1000
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+static void report(const char* op, const char* path, double ns, int nr_ops)
+{
+	printf("%-16s %-8s %10.2f us/op\n",op,path,ns/nr_ops/1000.0);
+}
+
+/* Stop counting through the text interface (libpmctrack has no function for it) */
+static int text_stop_counting(void)
+{
+	int fd=open("/proc/pmc/enable",O_WRONLY);
+	int ret=0;
+
+	if (fd==-1)
+		return -1;
+	if (write(fd,"OFF",3)<0)
+		ret=-1;
+	close(fd);
+	return ret;
+}
+
+static void fail(const char* what)
+{
+	fprintf(stderr,"%s failed\n",what);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_iterations=argc>1?atoi(argv[1]):DEFAULT_ITERATIONS;
+	const char* strcfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x11,pmc2=0x08"
+#elif defined(AMD)
+		"pmc0=0xc0,pmc1=0x76"
+#else
+		"pmc0,pmc1"
+#endif
+		,NULL
+	};
+	struct timespec start,end;
+	pid_t child;
+	int fd,handle;
+	int i;
+
+	if (nr_iterations<=0)
+		nr_iterations=DEFAULT_ITERATIONS;
+
+	/* Process to be attached (does nothing) */
+	if ((child=fork())==0) {
+		pause();
+		exit(0);
+	} else if (child==-1) {
+		perror("fork");
+		exit(1);
+	}
+
+	printf("%-16s %-8s %13s\n","operation","path","latency");
+
+	/* Text interface: the configuration is parsed once for the monitor */
+	if (pmct_config_counters(strcfg,0))
+		fail("pmct_config_counters");
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		if (pmct_attach_process(child,1) || pmct_detach_process(child))
+			fail("text attach/detach");
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	report("attach+detach","text",elapsed_ns(&start,&end),nr_iterations);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		if (pmct_start_counting() || text_stop_counting())
+			fail("text start/stop");
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	report("start+stop","text",elapsed_ns(&start,&end),nr_iterations);
+
+	/* Binary interface */
+	if ((fd=pmct_ioctl_open())<0)
+		fail("pmct_ioctl_open");
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		if ((handle=pmct_ioctl_compile_config(fd,strcfg))<0 ||
+		    pmct_ioctl_destroy_config(fd,handle))
+			fail("ioctl compile/destroy");
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	report("compile+destroy","ioctl",elapsed_ns(&start,&end),nr_iterations);
+
+	if ((handle=pmct_ioctl_compile_config(fd,strcfg))<0)
+		fail("pmct_ioctl_compile_config");
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		if (pmct_ioctl_attach(fd,handle,child) || pmct_ioctl_detach(fd,child))
+			fail("ioctl attach/detach");
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	report("attach+detach","ioctl",elapsed_ns(&start,&end),nr_iterations);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		if (pmct_ioctl_start_counting(fd,handle,0) || pmct_ioctl_stop_counting(fd,0))
+			fail("ioctl start/stop");
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	report("start+stop","ioctl",elapsed_ns(&start,&end),nr_iterations);
+
+	pmct_ioctl_destroy_config(fd,handle);
+	close(fd);
+
+	kill(child,SIGKILL);
+	waitpid(child,NULL,0);
+	return 0;
+}
@@ -0,0 +1,79 @@
+# -*- coding: utf-8 -*-
+
+#
+# bench-metrics.py
+# Times the post-processing path used by PMCTrack-GUI (pmc_extract.py) to
+# compute metrics from the output of pmctrack: every line is split into
+# fields and each metric is evaluated with eval(). The metrics are the
+# same as BENCH_METRICS in test-metrics.c.
+#
+# Usage: python bench-metrics.py <pmctrack-output-file>
+#
+##############################################################################
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+# MA 02110-1301, USA.
+#
+##############################################################################
+
+import re
+import sys
+import time
+
+metrics = [("IPC", "pmc0/pmc1"), ("MPKI", "1000*pmc2/pmc0"), ("HIT", "1-pmc2/pmc3")]
+
+# Same rewrite as Metric in user_config.py
+def compile_metric(str_metric):
+	str_metric_mod = re.sub(r"pmc(\d+)", r"float(field[pos['pmc\1']])", str_metric)
+	str_metric_mod = re.sub(r"virt(\d+)", r"float(field[pos['virt\1']])", str_metric_mod)
+	return compile(str_metric_mod, "<metric>", "eval")
+
+def main():
+	if len(sys.argv) != 2:
+		sys.stderr.write("Usage: %s <pmctrack-output-file>\n" % sys.argv[0])
+		sys.exit(1)
+
+	fin = open(sys.argv[1])
+	fout = open("/dev/null", "w")
+	progs = [compile_metric(m[1]) for m in metrics]
+	nr_samples = 0
+
+	start = time.time()
+
+	pos = {}
+	for ind, header in enumerate(fin.readline().split()):
+		pos[header] = ind
+
+	for line in fin:
+		field = line.split()
+		fout.write(field[pos["nsample"]].rjust(7) + " ")
+		fout.write(field[pos["pid"]].rjust(6) + " ")
+		for prog in progs:
+			try:
+				metric_eval = eval(prog)
+			except ZeroDivisionError:
+				metric_eval = 0.0
+			fout.write("{0:13.3f} ".format(metric_eval))
+		fout.write("\n")
+		nr_samples += 1
+
+	elapsed = time.time() - start
+
+	print("python: %d samples, %.0f samples/s (%.1f ns/sample)" % (nr_samples, nr_samples / elapsed, elapsed * 1e9 / nr_samples))
+	fin.close()
+	fout.close()
+
+if __name__ == "__main__":
+	main()
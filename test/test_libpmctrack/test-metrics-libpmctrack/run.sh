@@ -0,0 +1,11 @@
+#!/bin/bash
+NR_SAMPLES=${1:-200000}
+SAMPLES_FILE=samples.txt
+
+PMCTRACK_ROOT=../../.. LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-metrics $NR_SAMPLES $SAMPLES_FILE || exit 1
+
+# Python post-processing of the same samples (as done by PMCTrack-GUI)
+if [ -f $SAMPLES_FILE ] && which python3 > /dev/null 2>&1 ; then
+	python3 bench-metrics.py $SAMPLES_FILE
+fi
+rm -f $SAMPLES_FILE
@@ -0,0 +1,400 @@
+/*
+ * test-metrics.c
+ *
+ * Checks the derived metrics of libpmctrack (no kernel module needed)
+ * with synthetic samples, and measures how many samples per second can
+ * be turned into metric rows. The same samples are also written in
+ * pmctrack's output format, so that the Python post-processing path
+ * (bench-metrics.py) can be timed on identical data.
+ *
+ * The PMU of the given processor model (4 general-purpose counters) is used.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_MODEL		"x86_intel-core.haswell"
+#define DEFAULT_NR_SAMPLES	200000
+#define PERIOD_NS		1000000000ULL
+
+/* Same definitions as in bench-metrics.py */
+#define BENCH_METRICS	"IPC=pmc0/pmc1;MPKI=1000*pmc2/pmc0;HIT=1-pmc2/pmc3"
+
+static int nr_failures=0;
+
+#define check(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+			nr_failures++; \
+		} \
+	} while (0)
+
+/* Fill a sample of experiment exp_idx with counts[pmc] for the PMCs of that experiment */
+static void fill_sample(pmc_sample_v2_t* sample, counter_mapping_t* mapping, int exp_idx,
+                        const uint64_t* counts, uint64_t enabled, uint64_t running)
+{
+	int i;
+
+	memset(sample,0,sizeof(pmc_sample_v2_t));
+	sample->type=PMC_TICK_SAMPLE;
+	sample->exp_idx=exp_idx;
+	sample->pid=1234;
+	sample->time_enabled=enabled;
+	sample->time_running=running;
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS; i++) {
+		if (mapping && !(mapping[i].experiment_mask & (1U<<exp_idx)))
+			continue;
+		if (!mapping && !counts[i])
+			continue;
+		sample->pmc_mask|=1<<i;
+		sample->pmc_counts[sample->nr_counts++]=counts[i];
+	}
+}
+
+/* Counts of each PMC such that the event called "name" gets "value" */
+static void set_event_count(counter_mapping_t* mapping, int exp_idx,
+                            const char* name, uint64_t value, uint64_t* counts)
+{
+	int i;
+
+	for (i=0; i<MAX_PERFORMANCE_COUNTERS; i++)
+		if ((mapping[i].experiment_mask & (1U<<exp_idx)) && strcmp(mapping[i].events[exp_idx],name)==0)
+			counts[i]=value;
+}
+
+static double metric_value(pmct_metric_set_t* set, int idx)
+{
+	if (!(set->valid & (1U<<(idx+1))))
+		return NAN;
+	return (double)set->values[idx+1]/PMC_EXPR_ONE;
+}
+
+static int close_to(double value, double expected)
+{
+	return fabs(value-expected)<=1e-3+fabs(expected)*1e-4;
+}
+
+static int parse_config(const char* model, const char* strcfg,
+                        counter_mapping_t* mapping, unsigned int* nr_exps)
+{
+	char* raw_cfgs[MAX_COUNTER_CONFIGS];
+	unsigned int pmcmask;
+	int i;
+
+	memset(mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
+
+	if (pmct_parse_counter_string(strcfg,0,model,raw_cfgs,nr_exps,&pmcmask,mapping))
+		return 1;
+
+	for (i=0; i<*nr_exps; i++)
+		free(raw_cfgs[i]);
+	return 0;
+}
+
+static void test_single_set(const char* model)
+{
+	counter_mapping_t mapping[MAX_PERFORMANCE_COUNTERS];
+	pmct_metric_set_t set;
+	pmc_sample_v2_t sample;
+	uint64_t counts[MAX_PERFORMANCE_COUNTERS]= {0};
+	unsigned int nr_exps;
+
+	check(parse_config(model,"instr_retired,unhalted_core_cycles,llc_misses,llc_references",mapping,&nr_exps)==0);
+	check(nr_exps==1);
+
+	pmct_metrics_init(&set);
+	check(pmct_metrics_add(&set,"IPC=instr_retired/unhalted_core_cycles; "
+	                       "MPKI = 1000*llc_misses/instr_retired")==0);
+	check(pmct_metrics_add(&set,"HIT=1-llc_misses/llc_references;BW=64*llc_misses/secs/1000000;IPC2=2*IPC")==0);
+	check(pmct_metrics_compile(&set,mapping)==0);
+
+	set_event_count(mapping,0,"instr_retired",3000000,counts);
+	set_event_count(mapping,0,"unhalted_core_cycles",2000000,counts);
+	set_event_count(mapping,0,"llc_misses",15000,counts);
+	set_event_count(mapping,0,"llc_references",60000,counts);
+
+	fill_sample(&sample,mapping,0,counts,PERIOD_NS/2,PERIOD_NS/2);
+	pmct_metrics_eval(&set,&sample,1,0);
+	check(close_to(metric_value(&set,0),1.5));
+	check(close_to(metric_value(&set,1),5.0));
+	check(close_to(metric_value(&set,2),0.75));
+	check(close_to(metric_value(&set,3),1.92));
+	check(close_to(metric_value(&set,4),3.0));
+
+	/* Multiplexed set: counts are extrapolated (ratios stay the same) */
+	fill_sample(&sample,mapping,0,counts,PERIOD_NS,PERIOD_NS/4);
+	pmct_metrics_eval(&set,&sample,1,0);
+	check(close_to(metric_value(&set,0),1.5));
+	check(close_to(metric_value(&set,3),3.84));
+
+	/* No timing information */
+	fill_sample(&sample,mapping,0,counts,0,0);
+	pmct_metrics_eval(&set,&sample,1,0);
+	check(close_to(metric_value(&set,0),1.5));
+	check(isnan(metric_value(&set,3)));
+
+	pmct_metrics_free(&set);
+}
+
+static void test_multiple_sets(const char* model)
+{
+	counter_mapping_t mapping[MAX_PERFORMANCE_COUNTERS];
+	pmct_metric_set_t set;
+	pmc_sample_v2_t samples[2];
+	uint64_t counts[2][MAX_PERFORMANCE_COUNTERS]= {{0}};
+	unsigned int nr_exps;
+	int e;
+
+	/* instr_retired and unhalted_core_cycles are split across event sets */
+	check(parse_config(model,"instr_retired:pmc=0,llc_misses:pmc=0,unhalted_core_cycles,"
+	                   "llc_references,0xd1:umask=0x1,0xd1:umask=0x2",mapping,&nr_exps)==0);
+	check(nr_exps==2);
+
+	pmct_metrics_init(&set);
+	check(pmct_metrics_add(&set,"IPC=instr_retired/unhalted_core_cycles;MPKI=1000*llc_misses/instr_retired")==0);
+	check(pmct_metrics_compile(&set,mapping)==0);
+
+	for (e=0; e<2; e++) {
+		set_event_count(mapping,e,"instr_retired",4000000,counts[e]);
+		set_event_count(mapping,e,"unhalted_core_cycles",2000000,counts[e]);
+		set_event_count(mapping,e,"llc_misses",8000,counts[e]);
+		set_event_count(mapping,e,"llc_references",10000,counts[e]);
+		fill_sample(&samples[e],mapping,e,counts[e],PERIOD_NS,PERIOD_NS);
+	}
+
+	/* Per-sample mode: the events of a metric must be in the same set */
+	for (e=0; e<2; e++) {
+		pmct_metrics_eval(&set,&samples[e],1,0);
+		check(isnan(metric_value(&set,1)));
+	}
+
+	/* Aggregate mode: counts of all the sets are combined */
+	pmct_metrics_eval(&set,samples,2,1);
+	check(close_to(metric_value(&set,0),2.0));
+	check(close_to(metric_value(&set,1),2.0));
+
+	pmct_metrics_free(&set);
+}
+
+static void test_errors(const char* model)
+{
+	counter_mapping_t mapping[MAX_PERFORMANCE_COUNTERS];
+	pmct_metric_set_t set;
+	unsigned int nr_exps;
+	const char* bad_compile[]= {
+		"X=foo/instr_retired",		/* Unknown event */
+		"X=pmc11",			/* No such counter */
+		"X=Y+1;Y=2",			/* Forward reference */
+		"X=ev63",			/* Raw slot not in use */
+		"X=instr_retired/",		/* Syntax error */
+		NULL
+	};
+	const char* bad_add[]= {
+		"X",
+		"1X=2",
+		"secs=2",
+		"X=",
+		"X=1;X=2",
+		NULL
+	};
+	char path[]="/tmp/test-metrics-XXXXXX";
+	FILE* fout;
+	int i,fd;
+
+	check(parse_config(model,"instr_retired,unhalted_core_cycles",mapping,&nr_exps)==0);
+
+	for (i=0; bad_add[i]; i++) {
+		pmct_metrics_init(&set);
+		check(pmct_metrics_add(&set,bad_add[i])!=0);
+		pmct_metrics_free(&set);
+	}
+
+	for (i=0; bad_compile[i]; i++) {
+		pmct_metrics_init(&set);
+		check(pmct_metrics_add(&set,bad_compile[i])==0);
+		check(pmct_metrics_compile(&set,mapping)!=0);
+		pmct_metrics_free(&set);
+	}
+
+	/* Definitions in a file */
+	fd=mkstemp(path);
+	check(fd>=0 && (fout=fdopen(fd,"w"))!=NULL);
+	fprintf(fout,"# Basic metrics\n\nIPC = instr_retired/unhalted_core_cycles\n  CPI=1/IPC\n");
+	fclose(fout);
+
+	pmct_metrics_init(&set);
+	check(pmct_metrics_load_file(&set,path)==0);
+	check(set.nr_metrics==2 && strcmp(set.metrics[1].name,"CPI")==0);
+	check(pmct_metrics_compile(&set,mapping)==0);
+	pmct_metrics_free(&set);
+	unlink(path);
+
+	pmct_metrics_init(&set);
+	check(pmct_metrics_load_file(&set,"/nonexistent/metrics")!=0);
+	pmct_metrics_free(&set);
+}
+
+static void test_output(void)
+{
+	counter_mapping_t mapping[MAX_PERFORMANCE_COUNTERS];
+	pmct_metric_set_t set;
+	pmc_sample_v2_t sample;
+	uint64_t counts[MAX_PERFORMANCE_COUNTERS]= {300,200,0,0};
+	char* buf;
+	size_t size;
+	FILE* fout;
+
+	/* Raw configuration: no event names */
+	memset(mapping,0,sizeof(mapping));
+	pmct_metrics_init(&set);
+	check(pmct_metrics_add(&set,"IPC=pmc0/pmc1;MISS=pmc2/pmc0")==0);
+	check(pmct_metrics_compile(&set,mapping)==0);
+
+	fill_sample(&sample,NULL,0,counts,PERIOD_NS,PERIOD_NS);
+	pmct_metrics_eval(&set,&sample,1,0);
+
+	fout=open_memstream(&buf,&size);
+	pmct_print_header_with_metrics(fout,1,0x3,0,0,0,&set);
+	pmct_print_sample_with_metrics(fout,1,0x3,0,0,1,&sample,&set);
+	pmct_print_header_with_metrics(fout,1,0x3,0,PMCT_OUTPUT_METRICS_ONLY,0,&set);
+	pmct_print_sample_with_metrics(fout,1,0x3,0,PMCT_OUTPUT_METRICS_ONLY,1,&sample,&set);
+	fclose(fout);
+
+	check(strcmp(buf,
+	             "nsample    pid      event          pmc0          pmc1           IPC          MISS\n"
+	             "      1   1234       tick           300           200         1.500             - \n"
+	             "nsample    pid      event           IPC          MISS\n"
+	             "      1   1234       tick         1.500             - \n")==0);
+	free(buf);
+	pmct_metrics_free(&set);
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+/* Fill a synthetic sample (4 counters, two event sets) */
+static void bench_sample(pmc_sample_v2_t* sample, int i)
+{
+	uint64_t counts[MAX_PERFORMANCE_COUNTERS]= {0};
+
+	counts[0]=1000000+(i*7919)%100000;
+	counts[1]=800000+(i*104729)%300000;
+	counts[2]=1+(i*31)%5000;
+	counts[3]=5000+(i*17)%20000;
+	fill_sample(sample,NULL,i%2,counts,PERIOD_NS/1000,PERIOD_NS/1000);
+}
+
+/*
+ * Time how long it takes to evaluate the metrics of every sample
+ * and print the resulting rows (to /dev/null). If text_file is not NULL,
+ * the samples are also written there in pmctrack's output format.
+ */
+static int bench_metrics(int nr_samples, const char* text_file)
+{
+	counter_mapping_t mapping[MAX_PERFORMANCE_COUNTERS];
+	pmct_metric_set_t set;
+	pmc_sample_v2_t* samples=malloc(nr_samples*sizeof(pmc_sample_v2_t));
+	struct timespec start,end;
+	FILE* fout;
+	double ns;
+	int i;
+
+	if (!samples)
+		return 1;
+
+	for (i=0; i<nr_samples; i++)
+		bench_sample(&samples[i],i);
+
+	if (text_file) {
+		if ((fout=fopen(text_file,"w"))==NULL) {
+			free(samples);
+			return 1;
+		}
+		pmct_print_header(fout,2,0xf,0,PMCT_OUTPUT_EXTENDED,0);
+		for (i=0; i<nr_samples; i++)
+			pmct_print_sample(fout,2,0xf,0,PMCT_OUTPUT_EXTENDED,i+1,&samples[i]);
+		fclose(fout);
+	}
+
+	memset(mapping,0,sizeof(mapping));
+	pmct_metrics_init(&set);
+
+	if (pmct_metrics_add(&set,BENCH_METRICS) || pmct_metrics_compile(&set,mapping) ||
+	    (fout=fopen("/dev/null","w"))==NULL) {
+		free(samples);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	pmct_print_header_with_metrics(fout,2,0xf,0,PMCT_OUTPUT_EXTENDED|PMCT_OUTPUT_METRICS_ONLY,0,&set);
+	for (i=0; i<nr_samples; i++) {
+		pmct_metrics_eval(&set,&samples[i],1,0);
+		pmct_print_sample_with_metrics(fout,2,0xf,0,PMCT_OUTPUT_EXTENDED|PMCT_OUTPUT_METRICS_ONLY,
+		                               i+1,&samples[i],&set);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	ns=elapsed_ns(&start,&end);
+
+	printf("libpmctrack: %d samples, %.0f samples/s (%.1f ns/sample)\n",
+	       nr_samples,nr_samples*1e9/ns,ns/nr_samples);
+
+	fclose(fout);
+	pmct_metrics_free(&set);
+	free(samples);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_samples=argc>1?atoi(argv[1]):DEFAULT_NR_SAMPLES;
+	const char* text_file=argc>2?argv[2]:NULL;
+	const char* model=DEFAULT_MODEL;
+
+	test_single_set(model);
+	test_multiple_sets(model);
+	test_errors(model);
+	test_output();
+
+	if (nr_failures) {
+		fprintf(stderr,"%d check(s) failed\n",nr_failures);
+		exit(1);
+	}
+
+	printf("Unit tests passed\n");
+
+	if (nr_samples<=0)
+		return 0;
+
+	return bench_metrics(nr_samples,text_file);
+}
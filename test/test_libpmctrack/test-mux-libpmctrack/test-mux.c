@@ -0,0 +1,297 @@
+/*
+ * test-mux.c
+ *
+ * Event-set multiplexing test. The same event (retired instructions)
+ * is configured in many event sets, and half of them are given
+ * a higher weight. For each multiplexing policy the test reports
+ * how many intervals each set got, and how much the extrapolated
+ * counts of the different sets diverge from each other (ideally
+ * they would all be the same). It also checks that the time each set
+ * is running matches the policy: the same for all the sets with "rr",
+ * and HEAVY_WEIGHT times more for the heavy sets with "weighted".
+ *
+ * The time each set was running is only reported in the record stream,
+ * so a child process does the work and the test retrieves its samples
+ * from the sample rings.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_NR_SETS		12
+#define HEAVY_WEIGHT		3
+#define PERIOD_MS		10
+#define MAX_SAMPLES		8192
+#define N			40000
+#define SHARE_TOLERANCE		0.2	/* Relative error allowed in the running shares */
+
+#if defined(__arm__) || defined(__aarch64__)
+#define INSTR_CFG	"pmc1=0x08"
+#define INSTR_PMC	1
+#elif defined(AMD)
+#define INSTR_CFG	"pmc0=0xc0"
+#define INSTR_PMC	0
+#else
+#define INSTR_CFG	"pmc0"
+#define INSTR_PMC	0
+#endif
+
+typedef struct {
+	unsigned int nr_samples;
+	uint64_t counts;
+	uint64_t time_running;
+} set_stats_t;
+
+static int A[N],B[N],C[N];
+
+static void do_work(void)
+{
+	int i,j;
+
+	for (i=0; i<N; i++)
+		for (j=i; j>=0; j--)
+			C[j]=A[i]+B[j];
+}
+
+/* Monitored process: configure the counters and do the work */
+static void run_target(const char* strcfg[], int ready_fd)
+{
+	char c='r';
+
+	if (pmct_config_counters(strcfg,0) || pmct_config_timeout(PERIOD_MS,0) || pmct_start_counting())
+		_exit(1);
+
+	if (write(ready_fd,&c,1)!=1)
+		_exit(1);
+
+	do_work();
+	_exit(0);
+}
+
+/* Retrieve the samples of the monitored process until it finishes */
+static int collect_samples(pid_t child, int ready_fd, set_stats_t* stats, int nr_sets,
+                           uint64_t* total_running)
+{
+	pmc_sample_v2_t* samples;
+	pmct_sample_rings_t* rings;
+	int fd,nr_samples,total_samples=0;
+	int i;
+	char c;
+
+	if (pmct_attach_process(child,0) || read(ready_fd,&c,1)!=1)
+		return -1;
+
+	if ((samples=malloc(sizeof(pmc_sample_v2_t)*MAX_SAMPLES))==NULL)
+		return -1;
+
+	if ((fd=pmct_open_monitor_entry())<0 || (rings=pmct_map_sample_rings(fd))==NULL) {
+		if (fd>=0)
+			close(fd);
+		free(samples);
+		return -1;
+	}
+
+	while ((nr_samples=pmct_ring_read_samples(fd,rings,samples,MAX_SAMPLES))>0) {
+		for (i=0; i<nr_samples; i++) {
+			pmc_sample_v2_t* sample=&samples[i];
+
+			if (sample->exp_idx<0 || sample->exp_idx>=nr_sets)
+				continue;
+
+			stats[sample->exp_idx].nr_samples++;
+			stats[sample->exp_idx].counts+=sample->pmc_counts[INSTR_PMC];
+			stats[sample->exp_idx].time_running+=sample->time_running;
+			(*total_running)+=sample->time_running;
+		}
+		total_samples+=nr_samples;
+	}
+
+	pmct_unmap_sample_rings(rings);
+	close(fd);
+	free(samples);
+
+	return nr_samples<0?-1:total_samples;
+}
+
+/*
+ * Check that the time the heavy sets (second half) were running
+ * is "expected" times that of the light sets, on average
+ */
+static int check_shares(const char* policy, set_stats_t* stats, int nr_sets, double expected)
+{
+	uint64_t light=0,heavy=0;
+	int nr_light=nr_sets/2;
+	double ratio;
+	int i;
+
+	if (nr_light==0)
+		return 0;
+
+	for (i=0; i<nr_sets; i++) {
+		if (i<nr_light)
+			light+=stats[i].time_running;
+		else
+			heavy+=stats[i].time_running;
+	}
+
+	if (light==0)
+		return 1;
+
+	ratio=((double)heavy/(nr_sets-nr_light))/((double)light/nr_light);
+	printf("running time heavy/light sets: %.2f (expected %.2f)\n",ratio,expected);
+
+	if (ratio<expected*(1-SHARE_TOLERANCE) || ratio>expected*(1+SHARE_TOLERANCE)) {
+		printf("Unexpected running shares for policy %s\n",policy);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int run_policy(const char* policy, const char* strcfg[], int nr_sets)
+{
+	set_stats_t* stats=calloc(nr_sets,sizeof(set_stats_t));
+	uint64_t total_running=0;
+	double estimate,min=0,max=0,mean=0;
+	int nr_samples,i,ret=0;
+	int ready[2];
+	int status;
+	pid_t child;
+
+	if (!stats || pmct_config_mux_policy(policy) || pipe(ready))
+		return 1;
+
+	if ((child=fork())==0) {
+		close(ready[0]);
+		run_target(strcfg,ready[1]);
+	} else if (child==-1) {
+		return 1;
+	}
+
+	close(ready[1]);
+	nr_samples=collect_samples(child,ready[0],stats,nr_sets,&total_running);
+	close(ready[0]);
+
+	if (nr_samples<0)
+		kill(child,SIGKILL);
+
+	if (waitpid(child,&status,0)!=child || !WIFEXITED(status) || WEXITSTATUS(status) || nr_samples<0) {
+		free(stats);
+		return 1;
+	}
+
+	printf("policy=%s (%d samples)\n",policy,nr_samples);
+	printf("%5s %6s %8s %10s %16s\n","set","weight","samples","running","estimate");
+
+	for (i=0; i<nr_sets; i++) {
+		if (stats[i].time_running==0) {
+			printf("%5d %6d %8u %9.1f%% %16s\n",i,i<nr_sets/2?1:HEAVY_WEIGHT,
+			       stats[i].nr_samples,0.0,"-");
+			ret=1;
+			continue;
+		}
+
+		/* Extrapolate to the whole time the thread was monitored */
+		estimate=(double)stats[i].counts*total_running/stats[i].time_running;
+		printf("%5d %6d %8u %9.1f%% %16.0f\n",i,i<nr_sets/2?1:HEAVY_WEIGHT,
+		       stats[i].nr_samples,100.0*stats[i].time_running/total_running,estimate);
+
+		if (i==0 || estimate<min)
+			min=estimate;
+		if (i==0 || estimate>max)
+			max=estimate;
+		mean+=estimate/nr_sets;
+	}
+
+	if (mean>0)
+		printf("spread of the estimates: %.2f%% of the mean\n",100.0*(max-min)/mean);
+
+	if (strcmp(policy,"rr")==0) {
+		/* Every set on its own must get its share too */
+		for (i=0; i<nr_sets; i++) {
+			double share=(double)stats[i].time_running*nr_sets/total_running;
+
+			if (share<1-SHARE_TOLERANCE || share>1+SHARE_TOLERANCE) {
+				printf("Set %d got %.1f%% of the time under policy rr\n",i,100.0*share/nr_sets);
+				ret=1;
+			}
+		}
+		if (check_shares(policy,stats,nr_sets,1.0))
+			ret=1;
+	} else if (strcmp(policy,"weighted")==0) {
+		if (check_shares(policy,stats,nr_sets,HEAVY_WEIGHT))
+			ret=1;
+	}
+
+	printf("\n");
+
+	free(stats);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_sets=argc>1?atoi(argv[1]):DEFAULT_NR_SETS;
+	const char* policies[]= {"rr","weighted","adaptive",NULL};
+	const char** strcfg;
+	char* buf;
+	int i,exit_val=0;
+
+	if (nr_sets<=0 || nr_sets>MAX_COUNTER_CONFIGS) {
+		fprintf(stderr,"The number of event sets must be in [1,%d]\n",MAX_COUNTER_CONFIGS);
+		exit(1);
+	}
+
+	strcfg=malloc(sizeof(char*)*(nr_sets+1));
+	buf=malloc(nr_sets*MAX_CONFIG_STRING_SIZE);
+
+	/* The second half of the sets gets a higher weight */
+	for (i=0; i<nr_sets; i++) {
+		char* cfg=&buf[i*MAX_CONFIG_STRING_SIZE];
+
+		if (i<nr_sets/2)
+			snprintf(cfg,MAX_CONFIG_STRING_SIZE,"%s",INSTR_CFG);
+		else
+			snprintf(cfg,MAX_CONFIG_STRING_SIZE,"%s,weight=%d",INSTR_CFG,HEAVY_WEIGHT);
+		strcfg[i]=cfg;
+	}
+	strcfg[nr_sets]=NULL;
+
+	for (i=0; policies[i]; i++)
+		if (run_policy(policies[i],strcfg,nr_sets))
+			exit_val=1;
+
+	/* Restore the default */
+	pmct_config_mux_policy("weighted");
+
+	printf("%s\n",exit_val?"FAILED":"OK");
+	free(strcfg);
+	free(buf);
+	return exit_val;
+}
@@ -0,0 +1,3 @@
+#!/bin/bash
+PMCTRACK_ROOT=../../.. LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-packing &&
+PMCTRACK_ROOT=../../.. LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-packing x86_intel-core.core2
@@ -0,0 +1,130 @@
+/*
+ * test-packing.c
+ *
+ * Checks the event-to-counter assignment of pmct_parse_counter_string()
+ * (no kernel module needed): flat event lists must be packed into the
+ * minimum number of experiments, counter constraints must be honored and
+ * reference events must show up in every experiment.
+ *
+ * The PMU of the given processor model (4 general-purpose counters) is used.
+ * Tests that rely on the events of a specific model only run for that model.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_MODEL	"x86_intel-core.haswell"
+
+typedef struct {
+	const char* strcfg;
+	unsigned int nr_exps;	/* Expected number of experiments */
+	const char* ref;	/* Code of the reference event (if any) */
+	const char* model;	/* Model whose CSV defines the events (NULL if any) */
+} packing_test_t;
+
+static packing_test_t tests[]= {
+	/* Fits in the counters available */
+	{"0xc0,0xc4,0xc5,0x3c",1,NULL},
+	/* ceil(9/4) */
+	{"0xc0,0xc4,0xc5,0x3c,0x2e:umask=0x41,0x2e:umask=0x4f,0xd1:umask=0x1,0xd1:umask=0x2,0xd1:umask=0x4",3,NULL},
+	/* First-fit would need two experiments */
+	{"0xc4,0xc5,0x3c,0x2e:pmc=0:umask=0x41",1,NULL},
+	/* Two events pinned to the same counter */
+	{"0x2e:pmc=1:umask=0x41,0x2e:pmc=1:umask=0x4f,0xc4",2,NULL},
+	/* The reference event takes a counter in every experiment: ceil(7/3) */
+	{"0xc0:ref,0xc4,0xc5,0x3c,0x2e:umask=0x41,0x2e:umask=0x4f,0xd1:umask=0x1,0xd1:umask=0x2",3,"0xc0"},
+	/* Reference event pinned to a counter */
+	{"0x3c:pmc=3:ref,0x2e:pmc=3:umask=0x41",0,NULL},	/* Unfeasible */
+	{"0x3c:pmc=2:ref,0x2e:pmc=1:umask=0x41,0x2e:pmc=1:umask=0x4f",2,"0x3c"},
+	/* Parse errors after some events were built */
+	{"0xc0,0xc4,weight=0",0,NULL},
+	{"0xc0,no_such_event",0,NULL},
+	{"0xc0,0xc4:pmc=9",0,NULL},
+	/* Flags are not events */
+	{"weight=2,0xc0,0xc4,0xc5,0x3c",1,NULL},
+	/* Counter constraints given by the "pmcs" flag in the CSV file */
+	{"fp_comp_ops_exe,mul,instr_retired,unhalted_core_cycles",1,NULL,"x86_intel-core.core2"},
+	{"fp_comp_ops_exe,cycles_div_busy,mul",2,NULL,"x86_intel-core.core2"},
+	{"mul,div,fp_assist,mem_load_retired.l2_miss",3,NULL,"x86_intel-core.core2"},
+	{NULL,0,NULL}
+};
+
+/* Count the experiments that include the event with the given code */
+static int count_ref(char* raw_cfgs[], unsigned int nr_exps, const char* code)
+{
+	char needle[32];
+	int i,count=0;
+
+	snprintf(needle,sizeof(needle),"=%s",code);
+
+	for (i=0; i<nr_exps; i++)
+		if (strstr(raw_cfgs[i],needle))
+			count++;
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	const char* model=argc>1?argv[1]:DEFAULT_MODEL;
+	counter_mapping_t mapping[MAX_PERFORMANCE_COUNTERS];
+	char* raw_cfgs[MAX_COUNTER_CONFIGS];
+	unsigned int nr_exps,pmcmask;
+	int i,j,ret,failed,exit_val=0;
+
+	for (i=0; tests[i].strcfg; i++) {
+		/* The PMU information is loaded once per process */
+		if (tests[i].model && strcmp(tests[i].model,model))
+			continue;
+
+		nr_exps=0;
+		failed=0;
+		ret=pmct_parse_counter_string(tests[i].strcfg,0,model,raw_cfgs,&nr_exps,&pmcmask,mapping);
+
+		if (tests[i].nr_exps==0) {
+			/* Must be rejected */
+			failed=(ret==0);
+			nr_exps=ret?0:nr_exps;
+		} else if (ret || nr_exps!=tests[i].nr_exps) {
+			failed=1;
+			nr_exps=ret?0:nr_exps;
+		} else if (tests[i].ref && count_ref(raw_cfgs,nr_exps,tests[i].ref)!=nr_exps) {
+			failed=1;
+		}
+
+		printf("%-6s %s (expected %u experiments, got %u)\n",failed?"FAILED":"OK",
+		       tests[i].strcfg,tests[i].nr_exps,nr_exps);
+
+		for (j=0; j<nr_exps; j++) {
+			printf("\t%s\n",raw_cfgs[j]);
+			free(raw_cfgs[j]);
+		}
+
+		if (failed)
+			exit_val=1;
+	}
+
+	printf("%s\n",exit_val?"FAILED":"OK");
+	return exit_val;
+}
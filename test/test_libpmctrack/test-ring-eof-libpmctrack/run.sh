@@ -0,0 +1,10 @@
+#!/bin/bash
+#
+# Check that a monitor that consumes samples straight from the mapped
+# sample rings gets EOF (and POLLHUP) when the monitored process exits
+#
+if [ ! -d /proc/pmc ]; then
+	echo "PMCTrack kernel module not loaded: skipping test"
+	exit 0
+fi
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./test-ring-eof
@@ -0,0 +1,162 @@
+/*
+ * test-ring-eof.c
+ *
+ * Checks that a monitor process that maps the per-CPU sample rings
+ * (as pmctrack does) detects that the monitored process finished:
+ * poll() must report POLLHUP and pmct_ring_read_samples() must return
+ * EOF once all samples were retrieved, rather than blocking forever.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define MAX_SAMPLES		4096
+#define RUNTIME_MS		300	/* Time the monitored process runs for */
+#define EOF_TIMEOUT_SECS	10	/* Time allowed to get EOF after it exits */
+
+static void fail(const char* what)
+{
+	fprintf(stderr,"%s failed\n",what);
+	exit(1);
+}
+
+static void timeout_handler(int signo)
+{
+	static const char msg[]="Timed out waiting for EOF\nFAILED\n";
+
+	if (write(2,msg,sizeof(msg)-1)<0) {}
+	_exit(1);
+}
+
+/* Monitored process: configure the counters and keep the CPU busy */
+static void run_target(int ready_fd)
+{
+	const char* strcfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x11,pmc2=0x08"
+#elif defined(AMD)
+		"pmc0=0xc0,pmc1=0x76"
+#else
+		"pmc0,pmc1"
+#endif
+		,NULL
+	};
+	struct timespec start,now;
+	volatile unsigned long acum=0;
+	char c='r';
+
+	if (pmct_config_counters(strcfg,0) || pmct_config_timeout(10,0) || pmct_start_counting())
+		_exit(1);
+
+	if (write(ready_fd,&c,1)!=1)
+		_exit(1);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	do {
+		acum++;
+		clock_gettime(CLOCK_MONOTONIC,&now);
+	} while ((now.tv_sec-start.tv_sec)*1000+(now.tv_nsec-start.tv_nsec)/1000000<RUNTIME_MS);
+
+	_exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	pmc_sample_v2_t* samples;
+	pmct_sample_rings_t* rings;
+	struct pollfd pfd;
+	int ready[2];
+	pid_t child;
+	int fd,nr_samples,total_samples=0;
+	int exit_val=0;
+	char c;
+
+	if (pipe(ready))
+		fail("pipe");
+
+	if ((child=fork())==0) {
+		close(ready[0]);
+		run_target(ready[1]);
+	} else if (child==-1) {
+		fail("fork");
+	}
+
+	close(ready[1]);
+
+	if (pmct_attach_process(child,0))
+		fail("pmct_attach_process");
+
+	if (read(ready[0],&c,1)!=1)
+		fail("target start-up");
+
+	if ((fd=pmct_open_monitor_entry())<0)
+		fail("pmct_open_monitor_entry");
+
+	if ((rings=pmct_map_sample_rings(fd))==NULL)
+		fail("pmct_map_sample_rings");
+
+	if ((samples=malloc(sizeof(pmc_sample_v2_t)*MAX_SAMPLES))==NULL)
+		fail("malloc");
+
+	/* Wait for the target to finish (the rings remain mapped) */
+	waitpid(child,NULL,0);
+
+	signal(SIGALRM,timeout_handler);
+	alarm(EOF_TIMEOUT_SECS);
+
+	/* No monitored thread left: POLLHUP, even if there are samples to read */
+	pfd.fd=fd;
+	pfd.events=POLLIN;
+	if (poll(&pfd,1,EOF_TIMEOUT_SECS*1000)!=1 || !(pfd.revents & POLLHUP)) {
+		fprintf(stderr,"POLLHUP not reported (revents=0x%x)\n",pfd.revents);
+		exit_val=1;
+	}
+
+	/* Retrieve what is left until EOF */
+	while ((nr_samples=pmct_ring_read_samples(fd,rings,samples,MAX_SAMPLES))>0)
+		total_samples+=nr_samples;
+
+	alarm(0);
+
+	if (nr_samples<0)
+		fail("pmct_ring_read_samples");
+
+	printf("Samples retrieved: %d\n",total_samples);
+	if (total_samples==0)
+		exit_val=1;
+
+	pmct_unmap_sample_rings(rings);
+	close(fd);
+	free(samples);
+
+	printf("%s\n",exit_val?"FAILED":"OK");
+	return exit_val;
+}
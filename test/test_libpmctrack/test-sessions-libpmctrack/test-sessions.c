@@ -0,0 +1,295 @@
+/*
+ * test-sessions.c
+ *
+ * Two concurrent system-wide sessions: a low-rate "collector" and an
+ * "ad-hoc" session with a shorter sampling period and different events.
+ * Both sessions must start (no -EBUSY) and each one gets its own samples.
+ * The share of the PMU each session got is reported by /proc/pmc/config.
+ *
+ * The same is then done in per-thread mode: two monitors attach to the
+ * same busy process. Each monitor must get samples of its own, and the
+ * share of the PMU it got is derived from the time_enabled/time_running
+ * fields of the samples.
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define COLLECTOR_PERIOD_MS	1000
+#define ADHOC_PERIOD_MS		100
+#define DEFAULT_DURATION	3
+#define MAX_SAMPLES		1024
+
+/* Print the session lines of /proc/pmc/config */
+static void print_sessions(const char* who)
+{
+	FILE* fin=fopen("/proc/pmc/config","r");
+	char line[256];
+
+	if (!fin)
+		return;
+
+	while (fgets(line,sizeof(line),fin))
+		if (strncmp(line,"syswide_session",15)==0)
+			printf("[%s] %s",who,line);
+	fclose(fin);
+}
+
+/*
+ * Run a system-wide session. The session starts once "start_fd"
+ * is readable and lasts for "duration" seconds.
+ */
+static int run_session(const char* who, const char* strcfg[], int period_ms,
+                       int duration, int ready_fd, int start_fd)
+{
+	pmctrack_desc_t* desc;
+	char c='r';
+
+	if ((desc=pmctrack_init(0))==NULL)
+		return 1;
+
+	if (pmctrack_config_counters(desc,strcfg,NULL,period_ms)) {
+		fprintf(stderr,"[%s] configuration failed\n",who);
+		return 1;
+	}
+
+	if (pmctrack_start_counters_syswide(desc)) {
+		fprintf(stderr,"[%s] can't start system-wide session\n",who);
+		c='e';
+	}
+
+	if (write(ready_fd,&c,1)!=1 || c=='e')
+		return 1;
+
+	/* Wait until both sessions are up */
+	if (read(start_fd,&c,1)!=1)
+		return 1;
+
+	sleep(duration);
+	print_sessions(who);
+
+	if (pmctrack_stop_counters_syswide(desc))
+		return 1;
+
+	printf("[%s] period=%dms\n",who,period_ms);
+	pmctrack_print_counts(desc,stdout,0);
+	pmctrack_destroy(desc);
+	return 0;
+}
+
+/* Target of the per-thread sessions */
+static void run_busy_target(void)
+{
+	volatile unsigned long acum=0;
+
+	for (;;)
+		acum++;
+}
+
+/*
+ * Attach to "target" with a per-thread session and read its samples
+ * for "duration" seconds. The session is attached once "start_fd"
+ * is readable.
+ */
+static int run_thread_session(const char* who, const char* strcfg[], int period_ms,
+                              pid_t target, int duration, int ready_fd, int start_fd)
+{
+	pmct_sample_rings_t* rings;
+	pmc_sample_v2_t* samples;
+	struct timespec now,end;
+	unsigned long nr_samples=0;
+	uint64_t time_enabled=0,time_running=0;
+	int fd,nr,i;
+	char c='r';
+
+	if (pmct_config_counters(strcfg,0) || pmct_config_timeout(period_ms,0)) {
+		fprintf(stderr,"[%s] configuration failed\n",who);
+		c='e';
+	}
+
+	if (write(ready_fd,&c,1)!=1 || c=='e')
+		return 1;
+
+	/* Attach at the same time as the other monitor */
+	if (read(start_fd,&c,1)!=1)
+		return 1;
+
+	if (pmct_attach_process(target,1)) {
+		fprintf(stderr,"[%s] can't attach to %d\n",who,target);
+		return 1;
+	}
+
+	if ((fd=pmct_open_monitor_entry())<0 || (rings=pmct_map_sample_rings(fd))==NULL)
+		return 1;
+
+	samples=malloc(sizeof(pmc_sample_v2_t)*MAX_SAMPLES);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	end.tv_sec+=duration;
+
+	do {
+		if ((nr=pmct_ring_read_samples(fd,rings,samples,MAX_SAMPLES))<=0)
+			break;
+
+		for (i=0; i<nr; i++) {
+			if (samples[i].pid!=target)
+				continue;
+			nr_samples++;
+			time_enabled+=samples[i].time_enabled;
+			time_running+=samples[i].time_running;
+		}
+		clock_gettime(CLOCK_MONOTONIC,&now);
+	} while (now.tv_sec<end.tv_sec || (now.tv_sec==end.tv_sec && now.tv_nsec<end.tv_nsec));
+
+	pmct_detach_process(target);
+	pmct_unmap_sample_rings(rings);
+	close(fd);
+	free(samples);
+
+	printf("[%s] period=%dms samples=%lu pmu_share=%.1f%%\n",who,period_ms,nr_samples,
+	       time_enabled?(100.0*time_running)/time_enabled:0.0);
+	return nr_samples==0;
+}
+
+/*
+ * Fork one child per session and make them start at once. If "target"
+ * is not zero, the sessions are per-thread sessions on that process.
+ */
+static int run_sessions(const char* collector_cfg[], const char* adhoc_cfg[],
+                        pid_t target, int duration)
+{
+	int ready[2],start[2];
+	pid_t pids[2];
+	int i,status,exit_val=0;
+	char c;
+
+	if (pipe(ready) || pipe(start)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	/* Do not duplicate buffered output in the children */
+	fflush(stdout);
+
+	for (i=0; i<2; i++) {
+		if ((pids[i]=fork())==0) {
+			close(ready[0]);
+			close(start[1]);
+			if (target && i==0)
+				exit(run_thread_session("collector",collector_cfg,COLLECTOR_PERIOD_MS,target,duration+1,ready[1],start[0]));
+			else if (target)
+				exit(run_thread_session("ad-hoc",adhoc_cfg,ADHOC_PERIOD_MS,target,duration,ready[1],start[0]));
+			else if (i==0)
+				exit(run_session("collector",collector_cfg,COLLECTOR_PERIOD_MS,duration+1,ready[1],start[0]));
+			else
+				exit(run_session("ad-hoc",adhoc_cfg,ADHOC_PERIOD_MS,duration,ready[1],start[0]));
+		} else if (pids[i]==-1) {
+			perror("fork");
+			exit(1);
+		}
+	}
+
+	close(ready[1]);
+	close(start[0]);
+
+	/* Both sessions must be up at once */
+	for (i=0; i<2; i++) {
+		if (read(ready[0],&c,1)!=1 || c!='r')
+			exit_val=1;
+	}
+
+	if (!exit_val) {
+		c='s';
+		for (i=0; i<2; i++)
+			if (write(start[1],&c,1)!=1)
+				exit_val=1;
+	}
+	close(start[1]);
+	close(ready[0]);
+
+	for (i=0; i<2; i++) {
+		waitpid(pids[i],&status,0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			exit_val=1;
+	}
+
+	return exit_val;
+}
+
+int main(int argc, char *argv[])
+{
+	int duration=argc>1?atoi(argv[1]):DEFAULT_DURATION;
+	const char* collector_cfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x11,pmc2=0x08"
+#elif defined(AMD)
+		"pmc0=0xc0,pmc1=0x76"
+#else
+		"pmc0,pmc1"
+#endif
+		,NULL
+	};
+	const char* adhoc_cfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x03,pmc2=0x04"
+#elif defined(AMD)
+		"pmc0=0xc2,pmc1=0xc3"
+#else
+		"pmc3=0x2e,umask3=0x4f,pmc4=0x2e,umask4=0x41"
+#endif
+		,NULL
+	};
+	pid_t target;
+	int exit_val=0;
+
+	if (duration<=0)
+		duration=DEFAULT_DURATION;
+
+	printf("System-wide sessions\n");
+	if (run_sessions(collector_cfg,adhoc_cfg,0,duration))
+		exit_val=1;
+
+	printf("Per-thread sessions\n");
+	fflush(stdout);
+	if ((target=fork())==0)
+		run_busy_target();
+	else if (target==-1) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (run_sessions(collector_cfg,adhoc_cfg,target,duration))
+		exit_val=1;
+
+	kill(target,SIGKILL);
+	waitpid(target,NULL,0);
+
+	printf("%s\n",exit_val?"FAILED":"OK");
+	return exit_val;
+}
@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# Aggregate count mode (-A) with many short-lived threads
+#
+# Usage: ./run.sh [nr_threads] [pmctrack event configuration]
+#
+NR_THREADS=${1:-10000}
+EVENTS=${2:-instr,cycles}
+PMCTRACK=../../../bin/pmctrack
+export LD_LIBRARY_PATH=../../../src/lib/libpmctrack
+
+./test-threads $NR_THREADS || exit 1
+
+if [ ! -x $PMCTRACK ] || [ ! -d /proc/pmc ]; then
+	echo "PMCTrack kernel module not loaded: skipping monitored run"
+	exit 0
+fi
+
+echo "== pmctrack -A ($NR_THREADS threads)"
+NR_PIDS=$($PMCTRACK -L -A -c $EVENTS ./test-threads spawn $NR_THREADS | awk 'NR>1 {print $2}' | sort -u | wc -l)
+echo "$NR_PIDS threads with accumulated counts"
+[ $NR_PIDS -gt 256 ] || exit 1
+
+echo "== pmctrack -A -U tgid"
+$PMCTRACK -L -A -U tgid -c $EVENTS ./test-threads spawn $NR_THREADS || exit 1
+
+echo "== pmctrack -A -U comm"
+$PMCTRACK -L -A -U comm -c $EVENTS ./test-threads spawn $NR_THREADS || exit 1
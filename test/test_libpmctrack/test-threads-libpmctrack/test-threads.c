@@ -0,0 +1,469 @@
+/*
+ * test-threads.c
+ *
+ * Checks the table used by pmctrack to accumulate the samples of each
+ * thread in the aggregate count mode (-A), along with the per-process
+ * and per-name rollups (-U), with synthetic samples (no kernel module
+ * needed). The stress test spawns many short-lived threads, so that the
+ * table is fed with real thread IDs that show up only once, and compares
+ * the cost of accumulating the samples with that of the linear search
+ * formerly used by pmctrack.
+ *
+ * Usage: ./test-threads [nr_threads]
+ *        ./test-threads spawn [nr_threads]
+ *           (Only spawn the threads: the workload for pmctrack in run.sh)
+ *
+ ******************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <pmctrack.h>
+#include <pmctrack_internal.h>
+
+#define DEFAULT_NR_THREADS	10000
+#define MAX_LIVE_THREADS	64	/* Threads running at the same time */
+#define NR_THREAD_NAMES		4
+#define NR_EXPERIMENTS		2
+#define SAMPLES_PER_THREAD	4	/* Per event set */
+#define PMCMASK			0x3
+
+static int nr_failures=0;
+
+#define check(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+			nr_failures++; \
+		} \
+	} while (0)
+
+static void fill_sample(pmc_sample_v2_t* sample, pid_t tid, pid_t tgid, int exp_idx,
+                        uint64_t count, uint64_t enabled, uint64_t running)
+{
+	memset(sample,0,sizeof(pmc_sample_v2_t));
+	sample->type=PMC_TICK_SAMPLE;
+	sample->exp_idx=exp_idx;
+	sample->pid=tid;
+	sample->tgid=tgid;
+	sample->pmc_mask=PMCMASK;
+	sample->nr_counts=2;
+	sample->pmc_counts[0]=count;
+	sample->pmc_counts[1]=2*count;
+	sample->time_enabled=enabled;
+	sample->time_running=running;
+}
+
+/* Lookups, growth and accumulation */
+static void test_table(void)
+{
+	pmct_thread_table_t table;
+	pmct_thread_acum_t* entry;
+	pmc_sample_v2_t sample;
+	int i,nr_threads=1000;
+
+	check(pmct_thread_table_init(&table,NR_EXPERIMENTS,PMCT_ROLLUP_NONE)==0);
+
+	/* Thread IDs that are far apart, or one apart, and a few samples each */
+	for (i=0; i<3*nr_threads; i++) {
+		int t=i%nr_threads;
+		pid_t tid=(t&1)?t+1:t*4096+1;
+
+		fill_sample(&sample,tid,tid/2,(i/nr_threads)%NR_EXPERIMENTS,i,100,100);
+		check(pmct_thread_table_accumulate(&table,PMCMASK,0,&sample)!=NULL);
+	}
+
+	check(table.nr_entries==nr_threads);
+
+	for (i=0; i<table.nr_entries; i++) {
+		entry=&table.entries[i];
+		check(pmct_thread_table_get(&table,entry->pid)==entry);
+		check(entry->tgid==entry->pid/2);
+		check(entry->nr_threads==1);
+	}
+
+	check(table.nr_entries<=table.max_entries);
+	check(table.index_size>=2*table.nr_entries);
+
+	/* All samples of thread 1 go to the same entry (arrival order is kept) */
+	entry=&table.entries[0];
+	check(entry->pid==1);
+	check(entry->exp_mask==0x3);
+	check(entry->nr_samples_accum[0]==2 && entry->nr_samples_accum[1]==1);
+	check(entry->samples[0].pmc_counts[0]==2000);
+	check(entry->samples[0].pmc_counts[1]==4000);
+
+	/* Samples with a bogus event set are rejected */
+	fill_sample(&sample,1,1,NR_EXPERIMENTS,1,1,1);
+	check(pmct_thread_table_accumulate(&table,PMCMASK,0,&sample)==NULL);
+
+	pmct_thread_table_free(&table);
+
+	/* A single thread with both event sets multiplexed */
+	check(pmct_thread_table_init(&table,NR_EXPERIMENTS,PMCT_ROLLUP_NONE)==0);
+	fill_sample(&sample,7,7,0,100,100,50);
+	pmct_thread_table_accumulate(&table,PMCMASK,0,&sample);
+	fill_sample(&sample,7,7,1,300,100,50);
+	pmct_thread_table_accumulate(&table,PMCMASK,0,&sample);
+	fill_sample(&sample,7,7,1,100,100,50);
+	entry=pmct_thread_table_accumulate(&table,PMCMASK,0,&sample);
+	check(entry && entry->nr_samples_accum[0]==1 && entry->nr_samples_accum[1]==2);
+
+	pmct_thread_table_scale(&table);
+	entry=&table.entries[0];
+	/* The thread was monitored for 300ns */
+	check(entry->samples[0].pmc_counts[0]==600);   /* 100 * 300/50 */
+	check(entry->samples[1].pmc_counts[0]==1200);  /* 400 * 300/100 */
+	check(entry->samples[0].time_enabled==300);
+	pmct_thread_table_free(&table);
+}
+
+/* Per-process and per-name groups */
+static void test_rollup(void)
+{
+	pmct_thread_table_t threads,groups;
+	pmct_thread_acum_t* entry;
+	pmc_sample_v2_t sample;
+	static const char* names[]= {"main","worker","worker","io"};
+	int i;
+
+	check(pmct_thread_table_init(&threads,NR_EXPERIMENTS,PMCT_ROLLUP_NONE)==0);
+
+	/* Threads 10..13 belong to process 10, and 20..23 to process 20 */
+	for (i=0; i<8; i++) {
+		pid_t tid=(i<4?10:20)+i%4;
+
+		fill_sample(&sample,tid,(i<4?10:20),0,10,100,100);
+		entry=pmct_thread_table_accumulate(&threads,PMCMASK,0,&sample);
+		strcpy(entry->comm,names[i%4]);
+		/* Only the threads of process 20 ran the second event set */
+		fill_sample(&sample,tid,(i<4?10:20),1,5,100,i<4?0:100);
+		pmct_thread_table_accumulate(&threads,PMCMASK,0,&sample);
+	}
+
+	pmct_thread_table_scale(&threads);
+
+	check(pmct_thread_table_init(&groups,NR_EXPERIMENTS,PMCT_ROLLUP_TGID)==0);
+	check(pmct_thread_table_rollup(&threads,&groups,PMCMASK,0)==0);
+	check(groups.nr_entries==2);
+	entry=&groups.entries[0];
+	check(entry->pid==10 && entry->tgid==10 && entry->nr_threads==4);
+	check(entry->exp_mask==0x1);
+	/* 10 counts in 100ns of a 200ns interval: 20 per thread */
+	check(entry->samples[0].pmc_counts[0]==80);
+	check(entry->samples[0].pid==10);
+	check(entry->samples[0].time_running==entry->samples[0].time_enabled);
+	check(entry->nr_samples_accum[0]==4);
+	entry=&groups.entries[1];
+	check(entry->pid==20 && entry->exp_mask==0x3);
+	check(entry->samples[0].pmc_counts[0]==80);
+	check(entry->samples[1].pmc_counts[0]==40);
+	check(entry->samples[1].pmc_counts[1]==80);
+	pmct_thread_table_free(&groups);
+
+	check(pmct_thread_table_init(&groups,NR_EXPERIMENTS,PMCT_ROLLUP_COMM)==0);
+	check(pmct_thread_table_rollup(&threads,&groups,PMCMASK,0)==0);
+	check(groups.nr_entries==3);
+	entry=&groups.entries[0];
+	check(entry->pid==1 && !strcmp(entry->comm,"main") && entry->nr_threads==2);
+	entry=pmct_thread_table_get_comm(&groups,"worker");
+	check(entry->pid==2 && entry->nr_threads==4);
+	check(entry->samples[0].pmc_counts[0]==80);
+	check(entry->samples[0].pid==2);
+	check(pmct_thread_table_get_comm(&groups,"io")->pid==3);
+	check(groups.nr_entries==3);
+	pmct_thread_table_free(&groups);
+
+	pmct_thread_table_free(&threads);
+
+	/* Samples obtained with read() carry no tgid: each thread is a group */
+	check(pmct_thread_table_init(&threads,NR_EXPERIMENTS,PMCT_ROLLUP_NONE)==0);
+	for (i=0; i<2; i++) {
+		fill_sample(&sample,30+i,-1,0,10,100,100);
+		pmct_thread_table_accumulate(&threads,PMCMASK,0,&sample);
+	}
+	pmct_thread_table_scale(&threads);
+
+	check(pmct_thread_table_init(&groups,NR_EXPERIMENTS,PMCT_ROLLUP_TGID)==0);
+	check(pmct_thread_table_rollup(&threads,&groups,PMCMASK,0)==0);
+	check(groups.nr_entries==2);
+	check(groups.entries[0].pid==30 && groups.entries[0].nr_threads==1);
+	check(groups.entries[1].pid==31 && groups.entries[1].samples[0].pmc_counts[0]==10);
+	pmct_thread_table_free(&groups);
+	pmct_thread_table_free(&threads);
+}
+
+/* Names retrieved from /proc */
+static void test_thread_comm(void)
+{
+	char comm[PMCT_COMM_LEN];
+	char name[PMCT_COMM_LEN];
+
+	pthread_getname_np(pthread_self(),name,sizeof(name));
+
+	check(pmct_get_thread_comm(getpid(),getpid(),comm)==0);
+	check(!strcmp(comm,name));
+
+	/* Unknown thread (already exited): the name of its process is used */
+	check(pmct_get_thread_comm(0x7ffffff0,getpid(),comm)==0);
+	check(!strcmp(comm,name));
+
+	check(pmct_get_thread_comm(0x7ffffff0,0x7ffffff0,comm)==-1);
+	check(!strcmp(comm,"?"));
+}
+
+/* Stress test: samples of many short-lived threads */
+
+typedef struct {
+	pid_t tid;
+	char comm[PMCT_COMM_LEN];
+} thread_info_t;
+
+static pthread_mutex_t spawn_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spawn_cond=PTHREAD_COND_INITIALIZER;
+static int nr_live_threads=0;
+
+static void* short_lived_thread(void* arg)
+{
+	thread_info_t* info=(thread_info_t*)arg;
+
+	if (info) {
+		info->tid=syscall(SYS_gettid);
+		/* Retrieved while the thread is alive, as pmctrack does */
+		pmct_get_thread_comm(info->tid,getpid(),info->comm);
+	}
+
+	pthread_mutex_lock(&spawn_lock);
+	nr_live_threads--;
+	pthread_cond_signal(&spawn_cond);
+	pthread_mutex_unlock(&spawn_lock);
+	return NULL;
+}
+
+/*
+ * Create nr_threads detached threads (MAX_LIVE_THREADS at a time),
+ * named after NR_THREAD_NAMES different names
+ */
+static int spawn_threads(int nr_threads, thread_info_t* info)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	char name[PMCT_COMM_LEN];
+	char main_name[PMCT_COMM_LEN];
+	int i;
+
+	pthread_getname_np(pthread_self(),main_name,sizeof(main_name));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+
+	for (i=0; i<nr_threads; i++) {
+		pthread_mutex_lock(&spawn_lock);
+		while (nr_live_threads>=MAX_LIVE_THREADS)
+			pthread_cond_wait(&spawn_cond,&spawn_lock);
+		nr_live_threads++;
+		pthread_mutex_unlock(&spawn_lock);
+
+		/* The name is inherited from the creator */
+		sprintf(name,"worker-%d",i%NR_THREAD_NAMES);
+		pthread_setname_np(pthread_self(),name);
+
+		if (pthread_create(&thread,&attr,short_lived_thread,info?&info[i]:NULL)) {
+			warnx("Couldn't create thread %d",i);
+			return -1;
+		}
+	}
+
+	/* Wait for the last ones */
+	pthread_mutex_lock(&spawn_lock);
+	while (nr_live_threads>0)
+		pthread_cond_wait(&spawn_cond,&spawn_lock);
+	pthread_mutex_unlock(&spawn_lock);
+
+	pthread_setname_np(pthread_self(),main_name);
+	pthread_attr_destroy(&attr);
+	return 0;
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1e9+(end->tv_nsec-start->tv_nsec);
+}
+
+/* Accumulation with a linear search of the threads (as pmctrack did) */
+static int accumulate_linear(pmc_sample_v2_t* samples, int nr_samples,
+                             pid_t* pids, pmc_sample_v2_t* acum)
+{
+	int i,j,nr_pids=0;
+
+	for (i=0; i<nr_samples; i++) {
+		pmc_sample_v2_t* cur=&samples[i];
+
+		for (j=0; j<nr_pids && pids[j]!=cur->pid; j++)
+			;
+		if (j==nr_pids)
+			pids[nr_pids++]=cur->pid;
+
+		pmct_accumulate_sample(NR_EXPERIMENTS,PMCMASK,0,0,cur,&acum[j*NR_EXPERIMENTS+cur->exp_idx]);
+	}
+
+	return nr_pids;
+}
+
+static void stress_test(int nr_threads)
+{
+	thread_info_t* info=calloc(nr_threads,sizeof(thread_info_t));
+	int nr_samples=nr_threads*NR_EXPERIMENTS*SAMPLES_PER_THREAD;
+	pmc_sample_v2_t* samples=malloc(nr_samples*sizeof(pmc_sample_v2_t));
+	pmct_thread_table_t threads,groups;
+	pmct_thread_acum_t* entry;
+	struct timespec start,end;
+	double ns_table,ns_linear=0;
+	pid_t* pids;
+	pmc_sample_v2_t* acum;
+	int i,j,k,cnt=0,nr_pids;
+	uint64_t total=0,group_total=0;
+
+	if (!info || !samples) {
+		warnx("Couldn't allocate memory for the stress test");
+		nr_failures++;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	check(spawn_threads(nr_threads,info)==0);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	printf("Spawned %d short-lived threads in %.1f ms\n",nr_threads,elapsed_ns(&start,&end)/1e6);
+
+	/*
+	 * Samples of each thread are interleaved with those of the
+	 * threads that ran around the same time
+	 */
+	for (k=0; k<SAMPLES_PER_THREAD; k++)
+		for (i=0; i<nr_threads; i++)
+			for (j=0; j<NR_EXPERIMENTS; j++) {
+				fill_sample(&samples[cnt++],info[i].tid,getpid(),j,i+1,100,100);
+				total+=i+1;
+			}
+
+	check(pmct_thread_table_init(&threads,NR_EXPERIMENTS,PMCT_ROLLUP_NONE)==0);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_samples; i++) {
+		entry=pmct_thread_table_accumulate(&threads,PMCMASK,0,&samples[i]);
+		if (!entry->comm[0])
+			strcpy(entry->comm,info[(i/NR_EXPERIMENTS)%nr_threads].comm);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	ns_table=elapsed_ns(&start,&end);
+
+	/* The kernel may recycle thread IDs, but hardly that many */
+	check(threads.nr_entries>MAX_LIVE_THREADS);
+	check(threads.nr_entries<=nr_threads);
+
+	for (i=0; i<threads.nr_entries; i++) {
+		entry=&threads.entries[i];
+		check(entry->exp_mask==0x3);
+		check(entry->nr_samples_accum[0]%SAMPLES_PER_THREAD==0);
+		check(!strncmp(entry->comm,"worker-",7));
+	}
+
+	printf("Accumulated %d samples of %u threads: %.1f ns/sample (hash table)\n",
+	       nr_samples,threads.nr_entries,ns_table/nr_samples);
+
+	pids=malloc(nr_threads*sizeof(pid_t));
+	acum=calloc(nr_threads*NR_EXPERIMENTS,sizeof(pmc_sample_v2_t));
+	if (pids && acum) {
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		nr_pids=accumulate_linear(samples,nr_samples,pids,acum);
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		ns_linear=elapsed_ns(&start,&end);
+		check(nr_pids==threads.nr_entries);
+		printf("Accumulated %d samples of %d threads: %.1f ns/sample (linear search)\n",
+		       nr_samples,nr_pids,ns_linear/nr_samples);
+	}
+	free(pids);
+	free(acum);
+
+	pmct_thread_table_scale(&threads);
+
+	/* A single process */
+	check(pmct_thread_table_init(&groups,NR_EXPERIMENTS,PMCT_ROLLUP_TGID)==0);
+	check(pmct_thread_table_rollup(&threads,&groups,PMCMASK,0)==0);
+	check(groups.nr_entries==1);
+	check(groups.entries[0].pid==getpid());
+	check(groups.entries[0].nr_threads==threads.nr_entries);
+	check(groups.entries[0].nr_samples_accum[1]==nr_threads*SAMPLES_PER_THREAD);
+	/* Both sets ran all the time: the scaled counts double */
+	check(groups.entries[0].samples[0].pmc_counts[0]==2*total/NR_EXPERIMENTS);
+	pmct_thread_table_free(&groups);
+
+	/* One group per name */
+	check(pmct_thread_table_init(&groups,NR_EXPERIMENTS,PMCT_ROLLUP_COMM)==0);
+	check(pmct_thread_table_rollup(&threads,&groups,PMCMASK,0)==0);
+	check(groups.nr_entries==NR_THREAD_NAMES);
+	for (i=0; i<groups.nr_entries; i++) {
+		entry=&groups.entries[i];
+		/* Unless a thread ID was recycled */
+		if (threads.nr_entries==nr_threads)
+			check(entry->nr_threads==nr_threads/NR_THREAD_NAMES);
+		group_total+=entry->samples[0].pmc_counts[0];
+	}
+	check(group_total==2*total/NR_EXPERIMENTS);
+	pmct_thread_table_free(&groups);
+
+	pmct_thread_table_free(&threads);
+	free(samples);
+	free(info);
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_threads;
+
+	/* Workload for pmctrack */
+	if (argc>1 && !strcmp(argv[1],"spawn")) {
+		nr_threads=argc>2?atoi(argv[2]):DEFAULT_NR_THREADS;
+		return spawn_threads(nr_threads,NULL)?1:0;
+	}
+
+	nr_threads=argc>1?atoi(argv[1]):DEFAULT_NR_THREADS;
+
+	test_table();
+	test_rollup();
+	test_thread_comm();
+
+	if (nr_threads>0)
+		stress_test(nr_threads);
+
+	if (nr_failures) {
+		fprintf(stderr,"%d checks failed\n",nr_failures);
+		return 1;
+	}
+
+	printf("Unit tests passed\n");
+	return 0;
+}